@@ -0,0 +1,71 @@
+#!/bin/bash
+
+# Batched socket I/O (-b N, recvmmsg/sendmmsg) versus one syscall per
+# datagram (-b 1):
+#   1. socket syscalls per MB for one large download at several window
+#      sizes (epoll mode, counters read with SIGUSR1)
+#   2. requests/sec accepted for a flood of tiny RRQs from many clients
+#
+# Run from hw1 after `make`: ./tests/bench_batch.sh
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-21100}
+FILE_MB=${FILE_MB:-16}
+BATCH=${BATCH:-32}
+
+cd "$(dirname "$0")/.." || exit 1
+ulimit -n 8192
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+head -c $((FILE_MB * 1024 * 1024)) /dev/urandom > "$WORKDIR/image.bin"
+head -c 100 /dev/urandom > "$WORKDIR/tiny.bin"
+
+start_server() {
+    ./tftp.out "$@" $PORT $END_PORT > "$WORKDIR/server.log" 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+}
+
+stop_server() {
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+}
+
+# Socket syscalls made by the server so far
+syscalls() {
+    kill -USR1 $SERVER_PID
+    sleep 0.2
+    sed -n 's/^Stats: \([0-9]*\) socket syscalls.*/\1/p' "$WORKDIR/server.log" | tail -1
+}
+
+echo "Syscalls per MB, one ${FILE_MB} MB download x 5, blksize 1428:"
+printf "%-8s %8s %14s %10s\n" batch window syscalls/MB "MB/s"
+for W in 1 16 64; do
+    for B in 1 $BATCH; do
+        start_server -m epoll -b $B
+        S0=$(syscalls)
+        OUT=$(./tests/tftp_bench 127.0.0.1 $PORT "$WORKDIR/image.bin" 1 5 1428 $W)
+        S1=$(syscalls)
+        stop_server
+        RATE=$(echo "$OUT" | sed -n 's/.*MB\/s=\([0-9.]*\).*/\1/p')
+        printf "%-8d %8d %14d %10s\n" $B $W $(((S1 - S0) / (FILE_MB * 5))) "${RATE:-FAILED}"
+    done
+done
+
+echo
+echo "Requests/sec, 100-byte file, 500 concurrent clients:"
+printf "%-6s %-8s %14s\n" mode batch requests/sec
+for MODE in epoll fork; do
+    for B in 1 $BATCH; do
+        start_server -m $MODE -b $B
+        OUT=$(./tests/tftp_bench 127.0.0.1 $PORT "$WORKDIR/tiny.bin" 500 10000)
+        stop_server
+        pkill -P $SERVER_PID 2>/dev/null
+        RATE=$(echo "$OUT" | sed -n 's/.*transfers\/sec=\([0-9.]*\).*/\1/p')
+        printf "%-6s %-8d %14s\n" $MODE $B "${RATE:-FAILED}"
+    done
+done
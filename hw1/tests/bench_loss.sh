@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Goodput of a single download through tests/lossy_proxy.c as the packet
+# loss rate rises, for stop-and-wait (windowsize 1) and a sliding window
+# of 8. Loss is applied independently in both directions, and 1% of the
+# surviving datagrams are reordered.
+#
+# Run from hw1 after `make`: ./tests/bench_loss.sh
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-20100}
+PROXY_PORT=${PROXY_PORT:-20500}
+FILE_MB=${FILE_MB:-4}
+BLKSIZE=${BLKSIZE:-1428}
+
+cd "$(dirname "$0")/.." || exit 1
+
+echo "Compiling benchmark client and proxy..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+gcc -O2 -Wall -o tests/lossy_proxy tests/lossy_proxy.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID $PROXY_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+head -c $((FILE_MB * 1024 * 1024)) /dev/urandom > "$WORKDIR/image.bin"
+
+./tftp.out -m epoll $PORT $END_PORT > /dev/null 2>&1 &
+SERVER_PID=$!
+sleep 0.5
+
+printf "%-6s %14s %14s\n" "loss%" "w=1 MB/s" "w=8 MB/s"
+for LOSS in 0 0.1 0.5 1 2 5; do
+    ./tests/lossy_proxy $PROXY_PORT 127.0.0.1 $PORT $LOSS 1 &
+    PROXY_PID=$!
+    sleep 0.2
+    printf "%-6s" $LOSS
+    for W in 1 8; do
+        OUT=$(./tests/tftp_bench 127.0.0.1 $PROXY_PORT "$WORKDIR/image.bin" 1 3 $BLKSIZE $W)
+        RATE=$(echo "$OUT" | sed -n 's/.*MB\/s=\([0-9.]*\).*/\1/p')
+        printf " %14s" "${RATE:-FAILED}"
+    done
+    echo
+    kill $PROXY_PID
+    wait $PROXY_PID 2>/dev/null
+done
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Compare the fork-per-request server with the epoll engine:
+# transfers/sec and peak resident memory (server plus all children)
+# at 10, 100 and 1000 concurrent downloads.
+#
+# Run from hw1 after `make`: ./tests/bench_modes.sh
+
+START_PORT=${START_PORT:-20000}
+END_PORT=${END_PORT:-21200}
+FILE_KB=${FILE_KB:-64}
+
+cd "$(dirname "$0")/.." || exit 1
+ulimit -n 8192
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+head -c $((FILE_KB * 1024)) /dev/urandom > "$WORKDIR/image.bin"
+
+# Sum VmRSS (kB) of a process and its direct children
+total_rss() {
+    local sum=0
+    for pid in $1 $(pgrep -P "$1"); do
+        local kb
+        kb=$(awk '/^VmRSS/ {print $2}' /proc/$pid/status 2>/dev/null)
+        sum=$((sum + ${kb:-0}))
+    done
+    echo $sum
+}
+
+printf "%-6s %8s %10s %14s %14s\n" mode clients transfers transfers/sec peak_rss_kB
+for MODE in fork epoll; do
+    for N in 10 100 1000; do
+        TRANSFERS=$((N * 5))
+        [ $TRANSFERS -lt 200 ] && TRANSFERS=200
+
+        ./tftp.out -m $MODE $START_PORT $END_PORT > /dev/null 2>&1 &
+        SERVER_PID=$!
+        sleep 0.5
+
+        ./tests/tftp_bench 127.0.0.1 $START_PORT "$WORKDIR/image.bin" $N $TRANSFERS > "$WORKDIR/result" &
+        BENCH_PID=$!
+
+        PEAK=0
+        while kill -0 $BENCH_PID 2>/dev/null; do
+            RSS=$(total_rss $SERVER_PID)
+            [ "$RSS" -gt "$PEAK" ] && PEAK=$RSS
+            sleep 0.05
+        done
+        wait $BENCH_PID
+
+        RATE=$(sed -n 's/.*transfers\/sec=\([0-9.]*\).*/\1/p' "$WORKDIR/result")
+        printf "%-6s %8d %10d %14s %14d\n" $MODE $N $TRANSFERS "${RATE:-FAILED}" $PEAK
+
+        kill $SERVER_PID
+        wait $SERVER_PID 2>/dev/null
+        pkill -P $SERVER_PID 2>/dev/null
+    done
+done
@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# Loopback throughput of a single download as blksize (RFC 2348) and
+# windowsize (RFC 7440) vary. blksize 512 / windowsize 1 is plain
+# RFC 1350 stop-and-wait.
+#
+# Run from hw1 after `make`: ./tests/bench_options.sh
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-20100}
+FILE_MB=${FILE_MB:-16}
+MODE=${MODE:-epoll}
+
+cd "$(dirname "$0")/.." || exit 1
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+head -c $((FILE_MB * 1024 * 1024)) /dev/urandom > "$WORKDIR/image.bin"
+
+./tftp.out -m $MODE $PORT $END_PORT > /dev/null 2>&1 &
+SERVER_PID=$!
+sleep 0.5
+
+printf "%-8s" "blksize"
+for W in 1 4 16 64; do printf "%12s" "w=$W MB/s"; done
+echo
+for B in 512 1428 8192 65464; do
+    printf "%-8d" $B
+    for W in 1 4 16 64; do
+        OUT=$(./tests/tftp_bench 127.0.0.1 $PORT "$WORKDIR/image.bin" 1 3 $B $W)
+        RATE=$(echo "$OUT" | sed -n 's/.*MB\/s=\([0-9.]*\).*/\1/p')
+        printf "%12s" "${RATE:-FAILED}"
+    done
+    echo
+done
@@ -0,0 +1,78 @@
+#!/bin/bash
+
+# Release regression run: a fixed matrix of downloads, uploads and mixed
+# loads with tftp_bench, every transfer checksummed (-c). Prints one line
+# per case: transfers/sec, MB/s, p50/p99 completion time and client
+# retransmissions.
+#
+# Save a run with SAVE=file and compare a later one with BASELINE=file:
+# a case whose MB/s drops or whose p99 grows by more than TOLERANCE
+# percent (default 15) is flagged and the script exits non-zero.
+#
+# Run from hw1 after `make`: ./tests/bench_regress.sh
+# SERVER_ARGS picks the server mode (default "-m epoll").
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-24100}
+SERVER_ARGS=${SERVER_ARGS:--m epoll}
+TOLERANCE=${TOLERANCE:-15}
+
+cd "$(dirname "$0")/.." || exit 1
+ulimit -n 8192
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+head -c 100 /dev/urandom > "$WORKDIR/tiny.bin"
+head -c $((100 * 1024)) /dev/urandom > "$WORKDIR/small.bin"
+head -c $((1024 * 1024)) /dev/urandom > "$WORKDIR/image.bin"
+head -c $((16 * 1024 * 1024)) /dev/urandom > "$WORKDIR/large.bin"
+
+./tftp.out $SERVER_ARGS -d 0 $PORT $END_PORT > /dev/null 2>&1 &
+SERVER_PID=$!
+sleep 0.5
+
+FAILED=0
+: > "$WORKDIR/results"
+
+# run <case> <tftp_bench arguments...>
+run() {
+    local name=$1
+    shift
+    OUT=$(./tests/tftp_bench -c "$@")
+    [ $? -eq 0 ] || FAILED=1
+    rm -f "$WORKDIR"/*.up.*
+    echo "$OUT" | sed -n "s/.*retransmits=\([0-9]*\).*transfers\/sec=\([0-9.]*\) MB\/s=\([0-9.]*\).* p50_ms=\([0-9.]*\) p99_ms=\([0-9.]*\).*/$name \2 \3 \4 \5 \1/p" |
+        grep . >> "$WORKDIR/results" || { echo "$name FAILED"; FAILED=1; }
+}
+
+run rrq-tiny-500c        -- 127.0.0.1 $PORT "$WORKDIR/tiny.bin" 500 10000
+run rrq-1m-default       -- 127.0.0.1 $PORT "$WORKDIR/image.bin" 20 200
+run rrq-1m-1428-w8       -- 127.0.0.1 $PORT "$WORKDIR/image.bin" 20 200 1428 8
+run rrq-16m-8192-w16     -- 127.0.0.1 $PORT "$WORKDIR/large.bin" 1 5 8192 16
+run wrq-1m-1428-w8       -u 127.0.0.1 $PORT "$WORKDIR/image.bin" 20 200 1428 8
+run mixed-1m-1428-w8     -m 50 127.0.0.1 $PORT "$WORKDIR/image.bin" 50 400 1428 8
+run mixed-100k-2000c     -m 20 127.0.0.1 $PORT "$WORKDIR/small.bin" 2000 4000 1428 8
+
+printf "%-20s %12s %9s %9s %9s %8s\n" case transfers/sec "MB/s" p50_ms p99_ms retrans
+awk '{ printf "%-20s %12s %9s %9s %9s %8s\n", $1, $2, $3, $4, $5, $6 }' "$WORKDIR/results"
+
+if [ -n "$SAVE" ]; then
+    cp "$WORKDIR/results" "$SAVE"
+fi
+if [ -n "$BASELINE" ]; then
+    echo
+    echo "Against $BASELINE (tolerance $TOLERANCE%):"
+    awk -v tol=$TOLERANCE 'NR == FNR { mbs[$1] = $3; p99[$1] = $5; next }
+        ($1 in mbs) {
+            bad = ""
+            if ($3 < mbs[$1] * (1 - tol / 100)) bad = bad sprintf(" MB/s %s -> %s", mbs[$1], $3)
+            if ($5 > p99[$1] * (1 + tol / 100)) bad = bad sprintf(" p99 %s -> %s ms", p99[$1], $5)
+            printf "  %-4s %s%s\n", bad == "" ? "ok" : "SLOW", $1, bad
+            if (bad != "") failed = 1
+        }
+        END { exit failed }' "$BASELINE" "$WORKDIR/results" || FAILED=1
+fi
+exit $FAILED
@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Scaling of the single-port SO_REUSEPORT mode with worker threads. The
+# server runs with T threads pinned to T cores for T = 1, 2, 4, ... up
+# to the number of online CPUs (or MAX_CORES), and we measure requests/sec
+# for a flood of tiny downloads and MB/s for concurrent 1 MB downloads.
+# The load comes from CLIENT_PROCS benchmark clients run in parallel,
+# whose results are added up. The epoll engine on one core is the
+# baseline.
+#
+# Run from hw1 after `make`: ./tests/bench_reuseport.sh
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-21100}
+MAX_CORES=${MAX_CORES:-$(nproc)}
+CLIENT_PROCS=${CLIENT_PROCS:-4}
+BATCH=${BATCH:-32}
+
+cd "$(dirname "$0")/.." || exit 1
+ulimit -n 8192
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+head -c 100 /dev/urandom > "$WORKDIR/tiny.bin"
+head -c $((1024 * 1024)) /dev/urandom > "$WORKDIR/image.bin"
+
+# Run CLIENT_PROCS clients with the given arguments at once and print
+# "requests/sec MB/s" over the wall-clock time of the whole run
+load() {
+    local t0 t1
+    t0=$(date +%s.%N)
+    for i in $(seq $CLIENT_PROCS); do
+        ./tests/tftp_bench 127.0.0.1 $PORT "$@" > "$WORKDIR/client.$i" &
+    done
+    wait # Only the clients: load runs in a subshell
+    t1=$(date +%s.%N)
+    cat "$WORKDIR"/client.* | sed -n 's/.*transfers=\([0-9]*\).*seconds=\([0-9.]*\).*MB\/s=\([0-9.]*\).*/\1 \2 \3/p' |
+        awk -v t0=$t0 -v t1=$t1 '{ n += $1; mb += $2 * $3 } END { printf "%.0f %.1f", n / (t1 - t0), mb / (t1 - t0) }'
+}
+
+run() {
+    local label=$1 cores=$2
+    shift 2
+    taskset -c 0-$((cores - 1)) ./tftp.out -b $BATCH "$@" > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+    RPS=$(load "$WORKDIR/tiny.bin" 100 5000 | cut -d' ' -f1)
+    MBS=$(load "$WORKDIR/image.bin" 50 200 1428 8 | cut -d' ' -f2)
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+    printf "%-16s %6d %14s %10s\n" "$label" $cores $RPS $MBS
+}
+
+printf "%-16s %6s %14s %10s\n" mode cores requests/sec "MB/s"
+run epoll 1 -m epoll $PORT $END_PORT
+T=1
+while [ $T -le $MAX_CORES ]; do
+    run "reuseport -t $T" $T -m reuseport -t $T $PORT
+    T=$((T * 2))
+done
+# More workers than cores: what the extra threads cost
+run "reuseport -t 4" 1 -m reuseport -t 4 $PORT
@@ -0,0 +1,74 @@
+#!/bin/bash
+
+# Server CPU use with SESSIONS idle-but-open transfers (tests/idle_clients.c:
+# every client sends an RRQ and then never answers), timer wheel (-T
+# wheel) versus checking every session's deadline on each wakeup (-T
+# scan), in epoll and reuseport mode. CPU is measured over WINDOW
+# seconds while the server keeps retransmitting DATA 1 with backoff,
+# before the sessions start giving up after TFTP_MAX_RETRIES.
+#
+# Run from hw1 after `make`: ./tests/bench_timers.sh
+
+PORT=${PORT:-20000}
+SESSIONS=${SESSIONS:-10000}
+END_PORT=${END_PORT:-$((PORT + SESSIONS + 100))}
+METRICS_PORT=${METRICS_PORT:-$((END_PORT + 1))}
+SETTLE=${SETTLE:-3}
+WINDOW=${WINDOW:-20}
+
+cd "$(dirname "$0")/.." || exit 1
+ulimit -n $((SESSIONS + 1000)) || exit 1
+
+echo "Compiling idle client..."
+gcc -O2 -Wall -o tests/idle_clients tests/idle_clients.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID $CLIENT_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+head -c 100 /dev/urandom > "$WORKDIR/tiny.bin"
+
+HZ=$(getconf CLK_TCK)
+
+metric() {
+    curl -s http://127.0.0.1:$METRICS_PORT/metrics | awk -v name=$1 '$1 == name { print $2 }'
+}
+
+cpu_ticks() {
+    awk '{print $14 + $15}' /proc/$1/stat
+}
+
+run() {
+    local mode=$1 timers=$2
+    if [ $mode = reuseport ]; then
+        ./tftp.out -m reuseport -t 1 -T $timers -d 0 -M $METRICS_PORT $PORT > /dev/null 2>&1 &
+    else
+        ./tftp.out -m epoll -T $timers -d 0 -M $METRICS_PORT $PORT $END_PORT > /dev/null 2>&1 &
+    fi
+    SERVER_PID=$!
+    sleep 0.5
+
+    ./tests/idle_clients 127.0.0.1 $PORT "$WORKDIR/tiny.bin" $SESSIONS $((SETTLE + WINDOW + 5)) > /dev/null &
+    CLIENT_PID=$!
+    sleep $SETTLE
+
+    local active timeouts0 timeouts1 t0 t1
+    active=$(metric tftp_sessions_active)
+    timeouts0=$(metric tftp_timeouts_total)
+    t0=$(cpu_ticks $SERVER_PID)
+    sleep $WINDOW
+    t1=$(cpu_ticks $SERVER_PID)
+    timeouts1=$(metric tftp_timeouts_total)
+
+    kill $CLIENT_PID $SERVER_PID
+    wait $CLIENT_PID $SERVER_PID 2>/dev/null
+    awk -v mode=$mode -v timers=$timers -v active=$active -v fired=$((timeouts1 - timeouts0)) \
+        -v ticks=$((t1 - t0)) -v hz=$HZ -v window=$WINDOW 'BEGIN {
+        printf "%-10s %-6s %9d %12.0f %8.2f\n", mode, timers, active, fired / window, ticks * 100 / hz / window
+    }'
+}
+
+printf "%-10s %-6s %9s %12s %8s\n" mode timers sessions timeouts/sec "cpu%"
+for MODE in epoll reuseport; do
+    for TIMERS in scan wheel; do
+        run $MODE $TIMERS
+    done
+done
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+# Upload (WRQ) throughput for each way of writing the file (-W sync,
+# behind, direct) and each fsync policy (-f none, close, chunk), into a
+# tmpfs directory and into a directory on a real disk. Every transfer
+# uploads a FILE_MB file with blksize 8192 and windowsize 16, with
+# CLIENTS uploads in flight at once (epoll mode).
+#
+# Run from hw1 after `make`: ./tests/bench_upload.sh
+# DISK_DIR picks the on-disk directory (default /var/tmp).
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-21100}
+FILE_MB=${FILE_MB:-32}
+CLIENTS=${CLIENTS:-4}
+TRANSFERS=${TRANSFERS:-8}
+TMPFS_DIR=${TMPFS_DIR:-/dev/shm}
+DISK_DIR=${DISK_DIR:-/var/tmp}
+
+cd "$(dirname "$0")/.." || exit 1
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+TMPFS_WORK=$(mktemp -d -p "$TMPFS_DIR")
+DISK_WORK=$(mktemp -d -p "$DISK_DIR")
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$TMPFS_WORK" "$DISK_WORK"' EXIT
+
+# The uploads land next to the source file, so each directory gets a copy
+head -c $((FILE_MB * 1024 * 1024)) /dev/urandom > "$TMPFS_WORK/image.bin"
+cp "$TMPFS_WORK/image.bin" "$DISK_WORK/image.bin"
+
+run() {
+    local dir=$1 label=$2 mode=$3 policy=$4
+    ./tftp.out -m epoll -W $mode -f $policy $PORT $END_PORT > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+    sync
+    OUT=$(./tests/tftp_bench -u 127.0.0.1 $PORT "$dir/image.bin" $CLIENTS $TRANSFERS 8192 16)
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+    # Check one upload made it intact, then make room for the next run
+    cmp -s "$dir/image.bin" "$dir/image.bin.up.0" || OUT="corrupt upload"
+    rm -f "$dir"/image.bin.up.*
+    RATE=$(echo "$OUT" | sed -n 's/.*MB\/s=\([0-9.]*\).*/\1/p')
+    printf "%-6s %-8s %-7s %10s\n" $label $mode $policy "${RATE:-FAILED}"
+}
+
+printf "%-6s %-8s %-7s %10s\n" fs write fsync "MB/s"
+for TARGET in "tmpfs $TMPFS_WORK" "disk $DISK_WORK"; do
+    set -- $TARGET
+    for POLICY in none close chunk; do
+        for MODE in sync behind direct; do
+            run "$2" $1 $MODE $POLICY
+        done
+    done
+done
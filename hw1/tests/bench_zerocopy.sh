@@ -0,0 +1,55 @@
+#!/bin/bash
+
+# Server CPU cost of serving a hot (page-cached) file with fread() into
+# the packet buffer versus sendmsg() straight from an mmap of the file.
+# Reports CPU time and CPU cycles per MB served, from the server's
+# utime + stime in /proc and the nominal clock rate in /proc/cpuinfo.
+#
+# Run from hw1 after `make`: ./tests/bench_zerocopy.sh
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-20100}
+FILE_MB=${FILE_MB:-16}
+TRANSFERS=${TRANSFERS:-20}
+WINDOW=${WINDOW:-16}
+
+cd "$(dirname "$0")/.." || exit 1
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+head -c $((FILE_MB * 1024 * 1024)) /dev/urandom > "$WORKDIR/image.bin"
+cat "$WORKDIR/image.bin" > /dev/null
+
+HZ=$(getconf CLK_TCK)
+MHZ=$(awk -F: '/^cpu MHz/ {print $2; exit}' /proc/cpuinfo)
+
+# utime + stime of a process, in clock ticks
+cpu_ticks() {
+    awk '{print $14 + $15}' /proc/$1/stat
+}
+
+printf "%-6s %8s %10s %12s %14s\n" path blksize "MB/s" "cpu_ms/MB" "cycles/MB"
+for BLKSIZE in 512 1428 8192 65464; do
+    for MODE in fread mmap; do
+        ./tftp.out -m epoll -r $MODE $PORT $END_PORT > /dev/null 2>&1 &
+        SERVER_PID=$!
+        sleep 0.5
+
+        T0=$(cpu_ticks $SERVER_PID)
+        OUT=$(./tests/tftp_bench 127.0.0.1 $PORT "$WORKDIR/image.bin" 1 $TRANSFERS $BLKSIZE $WINDOW)
+        T1=$(cpu_ticks $SERVER_PID)
+
+        RATE=$(echo "$OUT" | sed -n 's/.*MB\/s=\([0-9.]*\).*/\1/p')
+        awk -v mode=$MODE -v b=$BLKSIZE -v rate="${RATE:-FAILED}" -v ticks=$((T1 - T0)) \
+            -v hz=$HZ -v mhz="$MHZ" -v mb=$((FILE_MB * TRANSFERS)) 'BEGIN {
+            ms = ticks * 1000 / hz / mb
+            printf "%-6s %8d %10s %12.2f %14.0f\n", mode, b, rate, ms, ms * mhz * 1000
+        }'
+
+        kill $SERVER_PID
+        wait $SERVER_PID 2>/dev/null
+    done
+done
@@ -0,0 +1,75 @@
+/*
+ * Opens <count> transfers against the TFTP server and then leaves them
+ * idle: each socket sends one RRQ and never reads or ACKs anything, so
+ * the server holds <count> sessions that do nothing but wait for their
+ * retransmission timers. The sockets stay open for <seconds> so the
+ * server never gets an ICMP error that would end the session early.
+ *
+ * Build: gcc -O2 -Wall -o idle_clients idle_clients.c
+ * Usage: ./idle_clients <host> <port> <file> <count> <seconds>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TFTP_RRQ 1
+#define BURST 100           // Requests sent before pausing
+#define BURST_GAP_US 10000  // Keeps the server's request queue from overflowing
+
+int main(int argc, char **argv) {
+    if (argc != 6) {
+        fprintf(stderr, "Usage: %s <host> <port> <file> <count> <seconds>\n", argv[0]);
+        exit(1);
+    }
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(argv[2]));
+    if (inet_pton(AF_INET, argv[1], &server.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address %s\n", argv[1]);
+        exit(1);
+    }
+    int count = atoi(argv[4]);
+    int seconds = atoi(argv[5]);
+
+    char req[512];
+    unsigned short op = htons(TFTP_RRQ);
+    memcpy(req, &op, 2);
+    size_t len = 2;
+    len += snprintf(req + len, sizeof(req) - len - 8, "%s", argv[3]) + 1;
+    len += sprintf(req + len, "octet") + 1;
+
+    struct pollfd *pfds = calloc(count, sizeof(*pfds));
+    for (int i = 0; i < count; i++) {
+        pfds[i].fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (pfds[i].fd < 0) {
+            perror("socket");
+            exit(1);
+        }
+        pfds[i].events = POLLIN;
+        sendto(pfds[i].fd, req, len, 0, (struct sockaddr *)&server, sizeof(server));
+        if ((i + 1) % BURST == 0) {
+            usleep(BURST_GAP_US);
+        }
+    }
+
+    // Count the transfers the server started, then hold them open
+    usleep(500000);
+    int answered = 0;
+    poll(pfds, count, 0);
+    for (int i = 0; i < count; i++) {
+        answered += (pfds[i].revents & POLLIN) != 0;
+    }
+    printf("opened=%d answered=%d\n", count, answered);
+    fflush(stdout);
+
+    sleep(seconds);
+    return 0;
+}
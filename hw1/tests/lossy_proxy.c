@@ -0,0 +1,223 @@
+/*
+ * Loss-injecting UDP proxy for TFTP.
+ *
+ * Clients send their requests to <listen_port>. For every client TID the
+ * proxy opens an upstream socket, forwards the request to the server and
+ * then relays the transfer in both directions, learning the server's TID
+ * from its first reply. Clients see the proxy's listen port as the
+ * server TID.
+ *
+ * Each relayed datagram is dropped with probability loss_pct/100. With
+ * reorder_pct, a surviving datagram may instead be held back and sent
+ * right after the next one going the same way (or after 5 ms if no other
+ * datagram shows up).
+ *
+ * Build: gcc -O2 -Wall -o lossy_proxy lossy_proxy.c
+ * Usage: ./lossy_proxy <listen_port> <server_ip> <server_port> <loss_pct> [reorder_pct [seed]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_FLOWS 1024
+#define MAX_PACKET (65464 + 4)
+#define HOLD_MS 5
+
+typedef struct Held {
+    int active;
+    int fd;
+    struct sockaddr_in to;
+    char *buf;                      // Allocated on first use
+    ssize_t len;
+    long since;
+} Held;
+
+typedef struct Flow {
+    int fd;                         // Upstream socket, -1 if unused
+    struct sockaddr_in client;      // Client TID
+    struct sockaddr_in server_tid;  // Server TID once known
+    int have_tid;
+    Held held_up, held_down;        // Datagram held back for reordering
+} Flow;
+
+static int listen_fd;
+static struct sockaddr_in server;
+static double loss, reorder;
+static Flow flows[MAX_FLOWS];
+static long forwarded, dropped, reordered;
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void release(Held *h) {
+    if (h->active) {
+        sendto(h->fd, h->buf, h->len, 0, (struct sockaddr *)&h->to, sizeof(h->to));
+        h->active = 0;
+    }
+}
+
+// Send buf via fd to `to`, subject to loss and reordering.
+static void relay(Held *h, int fd, const struct sockaddr_in *to, const char *buf, ssize_t len) {
+    if (drand48() < loss) {
+        dropped++;
+        return;
+    }
+    forwarded++;
+    if (!h->active && drand48() < reorder) {
+        if (h->buf == NULL && (h->buf = malloc(MAX_PACKET)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        h->active = 1;
+        h->fd = fd;
+        h->to = *to;
+        memcpy(h->buf, buf, len);
+        h->len = len;
+        h->since = now_ms();
+        reordered++;
+        return;
+    }
+    sendto(fd, buf, len, 0, (const struct sockaddr *)to, sizeof(*to));
+    release(h);
+}
+
+static Flow *flow_for_client(const struct sockaddr_in *cli) {
+    Flow *free_slot = NULL;
+    for (int i = 0; i < MAX_FLOWS; i++) {
+        Flow *f = &flows[i];
+        if (f->fd < 0) {
+            if (free_slot == NULL) {
+                free_slot = f;
+            }
+            continue;
+        }
+        if (f->client.sin_addr.s_addr == cli->sin_addr.s_addr && f->client.sin_port == cli->sin_port) {
+            return f;
+        }
+    }
+    if (free_slot == NULL) {
+        // Recycle the oldest slot: flows are never torn down explicitly
+        static int victim;
+        free_slot = &flows[victim];
+        victim = (victim + 1) % MAX_FLOWS;
+        close(free_slot->fd);
+        free(free_slot->held_up.buf);
+        free(free_slot->held_down.buf);
+    }
+
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (free_slot->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    free_slot->client = *cli;
+    return free_slot;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 5 || argc > 7) {
+        fprintf(stderr, "Usage: %s <listen_port> <server_ip> <server_port> <loss_pct> [reorder_pct [seed]]\n", argv[0]);
+        exit(1);
+    }
+
+    loss = atof(argv[4]) / 100.0;
+    reorder = argc > 5 ? atof(argv[5]) / 100.0 : 0.0;
+    srand48(argc > 6 ? atol(argv[6]) : 1);
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(argv[3]));
+    if (inet_pton(AF_INET, argv[2], &server.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address %s\n", argv[2]);
+        exit(1);
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(atoi(argv[1]));
+    listen_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    for (int i = 0; i < MAX_FLOWS; i++) {
+        flows[i].fd = -1;
+    }
+
+    static struct pollfd pfds[MAX_FLOWS + 1];
+    static Flow *owner[MAX_FLOWS + 1];
+    static char buf[MAX_PACKET];
+
+    for (;;) {
+        int n = 0;
+        pfds[n].fd = listen_fd;
+        pfds[n].events = POLLIN;
+        owner[n++] = NULL;
+        for (int i = 0; i < MAX_FLOWS; i++) {
+            if (flows[i].fd >= 0) {
+                pfds[n].fd = flows[i].fd;
+                pfds[n].events = POLLIN;
+                owner[n++] = &flows[i];
+            }
+        }
+
+        if (poll(pfds, n, HOLD_MS) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            ssize_t len = recvfrom(pfds[i].fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+            if (len < 0) {
+                continue;
+            }
+
+            if (owner[i] == NULL) {
+                // Client -> server
+                Flow *f = flow_for_client(&from);
+                relay(&f->held_up, f->fd, f->have_tid ? &f->server_tid : &server, buf, len);
+            } else {
+                // Server -> client
+                Flow *f = owner[i];
+                if (!f->have_tid) {
+                    f->server_tid = from;
+                    f->have_tid = 1;
+                }
+                relay(&f->held_down, listen_fd, &f->client, buf, len);
+            }
+        }
+
+        // Don't hold a reordered datagram forever
+        long now = now_ms();
+        for (int i = 0; i < MAX_FLOWS; i++) {
+            if (flows[i].fd < 0) {
+                continue;
+            }
+            if (flows[i].held_up.active && now - flows[i].held_up.since >= HOLD_MS) {
+                release(&flows[i].held_up);
+            }
+            if (flows[i].held_down.active && now - flows[i].held_down.since >= HOLD_MS) {
+                release(&flows[i].held_down);
+            }
+        }
+    }
+}
@@ -0,0 +1,146 @@
+#!/bin/bash
+
+# Admission control and rate limiting:
+#   1. duplicate requests: every request is sent twice (tftp_bench -D)
+#      and each must start exactly one transfer, in every server mode
+#   2. a boot storm of CLIENTS clients that also retransmit their
+#      requests, with and without -S: the peak number of fork-mode
+#      children, or of live sessions on the metrics endpoint for epoll
+#      and reuseport, must stay within the limit and every transfer
+#      must still complete
+#   3. a full admission queue (-Q) refuses the overflow with "Server busy."
+#   4. per-client (-R) and per-/24 (-N) bandwidth limits, with the clients
+#      on one loopback address or spread over four (tftp_bench -A)
+#
+# Run from hw1 after `make`: ./tests/test_admission.sh
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-21100}
+METRICS_PORT=${METRICS_PORT:-21200}
+CLIENTS=${CLIENTS:-64}
+LIMIT=${LIMIT:-8}
+
+cd "$(dirname "$0")/.." || exit 1
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID $SAMPLER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+head -c $((1024 * 1024)) /dev/urandom > "$WORKDIR/image.bin"
+
+FAILED=0
+
+start_server() {
+    if [ "$1" = reuseport ]; then
+        ./tftp.out -m reuseport -t 4 -M $METRICS_PORT "${@:2}" $PORT > /dev/null 2>&1 &
+    else
+        ./tftp.out -m "$@" -M $METRICS_PORT $PORT $END_PORT > /dev/null 2>&1 &
+    fi
+    SERVER_PID=$!
+    sleep 0.5
+}
+
+stop_server() {
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+}
+
+check() {
+    if eval "$2"; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1"
+        FAILED=1
+    fi
+}
+
+metric() {
+    curl -s http://127.0.0.1:$METRICS_PORT/metrics | awk -v name=$1 '$1 == name { print $2 }'
+}
+
+field() {
+    echo "$1" | sed -n "s|.* $2=\([0-9.]*\).*|\1|p"
+}
+
+# Record the server's concurrent transfers every 10 ms until it exits:
+# children in fork mode, live sessions otherwise
+start_sampler() {
+    (
+        while kill -0 $SERVER_PID 2>/dev/null; do
+            if [ "$1" = fork ]; then
+                pgrep -c -P $SERVER_PID
+            else
+                metric tftp_sessions_active
+            fi
+            sleep 0.01
+        done
+    ) > "$WORKDIR/samples" &
+    SAMPLER_PID=$!
+}
+
+stop_sampler() {
+    wait $SAMPLER_PID
+    PEAK=$(sort -n "$WORKDIR/samples" | tail -1)
+}
+
+for MODE in fork epoll reuseport; do
+    start_server $MODE
+    ./tests/tftp_bench -D -c 127.0.0.1 $PORT "$WORKDIR/image.bin" 16 64 1428 8 > /dev/null
+    RC=$?
+    check "$MODE: duplicated requests, transfers intact" "[ $RC -eq 0 ]"
+    check "$MODE: one transfer per request" "[ '$(metric tftp_sessions_total)' = 64 ]"
+    check "$MODE: every copy dropped" "[ '$(metric tftp_requests_duplicate_total)' = 64 ]"
+    stop_server
+done
+
+echo
+echo "Boot storm: $CLIENTS clients, $((CLIENTS * 4)) downloads of 1 MB, requests sent twice"
+printf "%-10s %6s %6s %9s %8s %8s\n" mode limit peak queued seconds "MB/s"
+for MODE in fork epoll reuseport; do
+    for S in 0 $LIMIT; do
+        start_server $MODE -S $S
+        start_sampler $MODE
+        OUT=$(./tests/tftp_bench -D 127.0.0.1 $PORT "$WORKDIR/image.bin" $CLIENTS $((CLIENTS * 4)) 1428 8)
+        RC=$?
+        QUEUED=$(metric tftp_requests_queued_total)
+        stop_server
+        stop_sampler
+        printf "%-10s %6s %6s %9s %8s %8s\n" $MODE $([ $S = 0 ] && echo none || echo $S) "$PEAK" "$QUEUED" \
+            "$(field "$OUT" seconds)" "$(field "$OUT" MB/s)"
+        check "$MODE -S $S: all transfers completed" "[ $RC -eq 0 ]"
+        if [ $S != 0 ]; then
+            check "$MODE -S $S: at most $S transfers at once" "[ ${PEAK:-999} -le $S ]"
+        fi
+    done
+done
+
+echo
+start_server fork -S 4 -Q 8
+./tests/tftp_bench 127.0.0.1 $PORT "$WORKDIR/image.bin" 32 32 1428 8 > /dev/null 2>&1
+STARTED=$(metric tftp_sessions_total)
+REFUSED=$(metric tftp_requests_refused_total)
+stop_server
+echo "32 requests, -S 4 -Q 8: $STARTED served, $REFUSED refused"
+check "full queue refuses requests" "[ ${REFUSED:-0} -gt 0 ]"
+check "every request served or refused" "[ $((STARTED + REFUSED)) -eq 32 ]"
+
+echo
+echo "Bandwidth limits, 4 clients, 8 downloads of 1 MB:"
+printf "%-10s %-20s %-10s %8s %8s\n" mode limits addresses "MB/s" expected
+for MODE in fork epoll reuseport; do
+    for CASE in "-R 2048:1:2048" "-R 2048:4:8192" "-R 2048 -N 4096:4:4096"; do
+        IFS=: read -r LIMITS ADDRS KBPS <<< "$CASE"
+        start_server $MODE $LIMITS
+        OUT=$(./tests/tftp_bench -A $ADDRS -c 127.0.0.1 $PORT "$WORKDIR/image.bin" 4 8 8192 16)
+        RC=$?
+        stop_server
+        RATE=$(field "$OUT" MB/s)
+        WANT=$(awk -v k=$KBPS 'BEGIN { printf "%.2f", k * 1024 / 1e6 }')
+        printf "%-10s %-20s %-10s %8s %8s\n" $MODE "$LIMITS" $ADDRS "${RATE:-FAILED}" $WANT
+        check "$MODE $LIMITS, $ADDRS addresses: intact, within 25% of the limit" \
+            "[ $RC -eq 0 ] && awk -v r=${RATE:-0} -v w=$WANT 'BEGIN { exit !(r > w * 0.75 && r < w * 1.25) }'"
+    done
+done
+
+exit $FAILED
@@ -0,0 +1,96 @@
+#!/bin/bash
+
+# Many clients fetch the same file at once. Counts the bytes the server
+# reads from files (rchar in /proc/<pid>/io, which includes reaped fork
+# children) with the file cache on and with the old uncached fread()
+# path, checks that the cached server read the file only once, then
+# checks that a small budget evicts.
+#
+# Run from hw1 after `make`: ./tests/test_cache.sh
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-21100}
+CLIENTS=${CLIENTS:-200}
+TRANSFERS=${TRANSFERS:-500}
+
+cd "$(dirname "$0")/.." || exit 1
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+head -c $((1024 * 1024)) /dev/urandom > "$WORKDIR/image.bin"
+SIZE=$(stat -c %s "$WORKDIR/image.bin")
+
+FAILED=0
+
+start_server() {
+    ./tftp.out "$@" $PORT $END_PORT > "$WORKDIR/server.log" 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+}
+
+stop_server() {
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+}
+
+read_bytes() {
+    awk '/^rchar/ {print $2}' /proc/$SERVER_PID/io
+}
+
+check() {
+    if eval "$2"; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1"
+        FAILED=1
+    fi
+}
+
+printf "%-6s %-6s %12s %14s %8s %8s\n" mode cache transfers file_reads_MB hits misses
+for MODE in epoll fork; do
+    for CACHE in 64 0; do
+        if [ $CACHE -gt 0 ]; then
+            start_server -m $MODE -c $CACHE
+        else
+            start_server -m $MODE -c 0 -r fread
+        fi
+        R0=$(read_bytes)
+        ./tests/tftp_bench 127.0.0.1 $PORT "$WORKDIR/image.bin" $CLIENTS $TRANSFERS 1428 8 > "$WORKDIR/result"
+        BENCH_RC=$?
+        R1=$(read_bytes)
+        stop_server
+
+        # Largest counters logged (fork children log from their own copy)
+        HITS=$(sed -n 's/^Cache .* (hits \([0-9]*\), misses \([0-9]*\).*/\1/p' "$WORKDIR/server.log" | sort -n | tail -1)
+        MISSES=$(sed -n 's/^Cache .* misses \([0-9]*\),.*/\1/p' "$WORKDIR/server.log" | sort -n | tail -1)
+        READ=$((R1 - R0))
+        printf "%-6s %-6s %12d %14s %8s %8s\n" $MODE $CACHE $TRANSFERS \
+            $(awk -v r=$READ 'BEGIN { printf "%.1f", r / 1048576 }') "${HITS:--}" "${MISSES:--}"
+
+        check "$MODE, cache $CACHE MB: all transfers complete" "[ $BENCH_RC -eq 0 ]"
+        if [ $CACHE -gt 0 ]; then
+            check "$MODE: file read from disk once" "[ $READ -lt $((SIZE * 2)) ] && [ \"$MISSES\" = 1 ]"
+        else
+            check "$MODE: uncached server reads the file per transfer" "[ $READ -ge $((SIZE * TRANSFERS / 2)) ]"
+        fi
+    done
+done
+
+# A 2 MB budget holds two of these files; fetching a third evicts the
+# least recently used one, and fetching that again is a miss.
+for F in a b c; do
+    head -c $((1024 * 1024)) /dev/urandom > "$WORKDIR/$F.bin"
+done
+start_server -m epoll -c 2
+for F in a b a c b; do
+    ./tests/tftp_bench 127.0.0.1 $PORT "$WORKDIR/$F.bin" 1 1 > /dev/null
+done
+stop_server
+LAST=$(grep '^Cache ' "$WORKDIR/server.log" | tail -1)
+echo "$LAST"
+check "budget: LRU eviction" "echo \"$LAST\" | grep -q 'hits 1, misses 4, evictions 2'"
+
+exit $FAILED
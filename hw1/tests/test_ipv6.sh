@@ -0,0 +1,102 @@
+#!/bin/bash
+
+# IPv6 and dual-stack listening: in every server mode, with the default
+# single dual-stack socket and with separate IPv4 and IPv6 sockets
+# (-l 0.0.0.0 -l ::), mixed downloads and uploads over 127.0.0.1 and
+# ::1 must all complete intact. Then a server on -l ::1 alone must not
+# listen on IPv4, and the per-client rate limit (-R) must hold for an
+# IPv6 client as well.
+#
+# Run from hw1 after `make`: ./tests/test_ipv6.sh
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-21100}
+
+cd "$(dirname "$0")/.." || exit 1
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+head -c $((1024 * 1024)) /dev/urandom > "$WORKDIR/image.bin"
+
+FAILED=0
+
+start_server() {
+    if [ "$1" = reuseport ]; then
+        ./tftp.out -m reuseport -t 4 "${@:2}" $PORT > /dev/null 2>&1 &
+    else
+        ./tftp.out -m "$@" $PORT $END_PORT > /dev/null 2>&1 &
+    fi
+    SERVER_PID=$!
+    sleep 0.5
+}
+
+stop_server() {
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+}
+
+check() {
+    if eval "$2"; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1"
+        FAILED=1
+    fi
+}
+
+field() {
+    echo "$1" | sed -n "s|.* $2=\([0-9.]*\).*|\1|p"
+}
+
+# The local addresses of the server's UDP sockets on PORT
+listening() {
+    ss -Hlun "sport = :$PORT" | awk '{ print $4 }' | sort -u | tr '\n' ' '
+}
+
+echo "8 clients, 64 transfers of 1 MB, half of them uploads, blksize 1428, windowsize 8"
+printf "%-10s %-22s %-10s %8s %8s\n" mode listen client "MB/s" corrupt
+for MODE in fork epoll reuseport; do
+    for LISTEN in "" "-l 0.0.0.0 -l ::"; do
+        start_server $MODE $LISTEN
+        for HOST in 127.0.0.1 ::1; do
+            rm -f "$WORKDIR"/image.bin.up.*
+            OUT=$(./tests/tftp_bench -c -m 50 $HOST $PORT "$WORKDIR/image.bin" 8 64 1428 8)
+            RC=$?
+            printf "%-10s %-22s %-10s %8s %8s\n" $MODE "${LISTEN:-dual-stack}" $HOST \
+                "$(field "$OUT" MB/s)" "$(field "$OUT" corrupt)"
+            check "$MODE ${LISTEN:-dual-stack}, $HOST: all transfers intact" "[ $RC -eq 0 ]"
+        done
+        stop_server
+    done
+done
+
+echo
+start_server epoll
+check "no -l: one dual-stack socket" "[ '$(listening)' = '*:$PORT ' ]"
+stop_server
+start_server epoll -l 0.0.0.0 -l ::
+check "-l 0.0.0.0 -l ::: separate IPv4 and IPv6 sockets" "[ '$(listening)' = '0.0.0.0:$PORT [::]:$PORT ' ]"
+stop_server
+start_server epoll -l ::1
+check "-l ::1: IPv6 loopback only" "[ '$(listening)' = '[::1]:$PORT ' ]"
+./tests/tftp_bench -c ::1 $PORT "$WORKDIR/image.bin" 1 1 > /dev/null
+check "-l ::1: ::1 served" "[ $? -eq 0 ]"
+stop_server
+
+echo
+echo "-R 2048 over IPv6, 4 clients, 8 downloads of 1 MB:"
+for MODE in fork epoll reuseport; do
+    start_server $MODE -R 2048
+    OUT=$(./tests/tftp_bench -c ::1 $PORT "$WORKDIR/image.bin" 4 8 8192 16)
+    RC=$?
+    stop_server
+    RATE=$(field "$OUT" MB/s)
+    echo "$MODE: ${RATE:-FAILED} MB/s, expected 2.10"
+    check "$MODE -R 2048 over ::1: intact, within 25% of the limit" \
+        "[ $RC -eq 0 ] && awk -v r=${RATE:-0} 'BEGIN { exit !(r > 2.10 * 0.75 && r < 2.10 * 1.25) }'"
+done
+
+exit $FAILED
@@ -0,0 +1,111 @@
+#!/bin/bash
+
+# Metrics endpoint and debug levels:
+#   1. runs downloads and uploads against the epoll engine and fork mode
+#      and checks the counters served on -M match what the clients did
+#   2. checks SIGUSR2 turns per-block logging on for a running server
+#   3. measures server CPU per MB and log volume at -d 2 (every block,
+#      the old behaviour), -d 1 (default) and -d 0, with stdout line
+#      buffered as it is on a terminal
+#
+# Run from hw1 after `make`: ./tests/test_metrics.sh
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-20100}
+METRICS_PORT=${METRICS_PORT:-20200}
+DOWNLOADS=${DOWNLOADS:-50}
+UPLOADS=${UPLOADS:-10}
+
+cd "$(dirname "$0")/.." || exit 1
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+head -c $((100 * 1024)) /dev/urandom > "$WORKDIR/small.bin"
+head -c $((4 * 1024 * 1024)) /dev/urandom > "$WORKDIR/image.bin"
+
+HZ=$(getconf CLK_TCK)
+FAILED=0
+
+start_server() {
+    $WRAP ./tftp.out "$@" $PORT $END_PORT > "$WORKDIR/server.log" 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+}
+
+stop_server() {
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+}
+
+metric() {
+    curl -s http://127.0.0.1:$METRICS_PORT/metrics | awk -v name=$1 '$1 == name { print $2 }'
+}
+
+expect() {
+    local name=$1 want=$2
+    local got
+    got=$(metric $name)
+    if [ "$got" = "$want" ]; then
+        echo "  ok   $name = $got"
+    else
+        echo "  FAIL $name = $got, expected $want"
+        FAILED=1
+    fi
+}
+
+for MODE in epoll fork; do
+    echo "Counters, $MODE mode, $DOWNLOADS downloads and $UPLOADS uploads:"
+    start_server -m $MODE -M $METRICS_PORT
+    ./tests/tftp_bench 127.0.0.1 $PORT "$WORKDIR/small.bin" 10 $DOWNLOADS 1428 8 > /dev/null
+    ./tests/tftp_bench -u 127.0.0.1 $PORT "$WORKDIR/small.bin" 2 $UPLOADS 1428 8 > /dev/null
+    sleep 0.2 # Fork mode: let the last children close their sessions
+    expect tftp_rrq_total $DOWNLOADS
+    expect tftp_wrq_total $UPLOADS
+    expect tftp_transfers_completed_total $((DOWNLOADS + UPLOADS))
+    expect tftp_transfers_failed_total 0
+    expect tftp_sessions_active 0
+    expect tftp_bytes_in_total $((UPLOADS * 100 * 1024))
+    expect tftp_transfer_duration_seconds_count $((DOWNLOADS + UPLOADS))
+    stop_server
+    rm -f "$WORKDIR"/small.bin.up.*
+done
+
+echo "SIGUSR2 toggles per-block logging:"
+start_server -m epoll
+./tests/tftp_bench 127.0.0.1 $PORT "$WORKDIR/small.bin" 1 1 > /dev/null
+kill -USR2 $SERVER_PID
+./tests/tftp_bench 127.0.0.1 $PORT "$WORKDIR/small.bin" 1 1 > /dev/null
+kill -USR1 $SERVER_PID # Flushes the log
+sleep 0.2
+stop_server
+ACKS=$(grep -c "^Received ACK" "$WORKDIR/server.log")
+if [ "$ACKS" -eq 201 ]; then
+    echo "  ok   $ACKS ACKs logged, all from the second download"
+else
+    echo "  FAIL $ACKS ACKs logged, expected 201"
+    FAILED=1
+fi
+
+echo
+echo "Server cost of logging, 20 downloads of 4 MB, blksize 512, windowsize 1:"
+printf "%-6s %10s %12s %12s\n" level "MB/s" "cpu_ms/MB" "log KB/MB"
+WRAP="stdbuf -oL"
+for LEVEL in 2 1 0; do
+    start_server -m epoll -d $LEVEL
+    T0=$(awk '{print $14 + $15}' /proc/$SERVER_PID/stat)
+    OUT=$(./tests/tftp_bench 127.0.0.1 $PORT "$WORKDIR/image.bin" 1 20 512 1)
+    T1=$(awk '{print $14 + $15}' /proc/$SERVER_PID/stat)
+    kill -USR1 $SERVER_PID
+    sleep 0.2
+    stop_server
+    RATE=$(echo "$OUT" | sed -n 's/.*MB\/s=\([0-9.]*\).*/\1/p')
+    awk -v level=$LEVEL -v rate="${RATE:-FAILED}" -v ticks=$((T1 - T0)) -v hz=$HZ \
+        -v bytes=$(stat -c %s "$WORKDIR/server.log") 'BEGIN {
+        printf "%-6d %10s %12.2f %12.1f\n", level, rate, ticks * 1000 / hz / 80, bytes / 1024 / 80
+    }'
+done
+
+exit $FAILED
@@ -0,0 +1,87 @@
+#!/bin/bash
+
+# Netascii transfers. A file made mostly of '\r', '\n' and NUL is
+# downloaded and uploaded with block sizes from the 8-byte minimum up,
+# so CR LF and CR NUL pairs get split across block boundaries at every
+# offset, in each server mode and both RRQ read paths. tftp_bench -a -c
+# translates on its own side and checks every transfer against the
+# file's CRC-32. Then compares netascii with octet throughput on a text
+# file with ordinary line lengths.
+#
+# Run from hw1 after `make`: ./tests/test_netascii.sh
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-21100}
+TEXT_MB=${TEXT_MB:-16}
+
+cd "$(dirname "$0")/.." || exit 1
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+
+# 20000 random bytes mapped onto 'a', 'b', 'x', CR, LF and NUL, half
+# of them CR or LF
+MAP=$(printf 'ab\\r\\n\\r\\n\\000x%.0s' {1..32})
+head -c 20000 /dev/urandom | tr '\000-\377' "$MAP" > "$WORKDIR/dense.txt"
+# Lines of 20 to 100 characters
+awk -v mb=$TEXT_MB 'BEGIN { srand(2); while (n < mb * 1048576) { l = int(rand() * 80) + 20;
+                    s = sprintf("%" l "s", ""); gsub(/ /, "x", s); print s; n += l + 1 } }' > "$WORKDIR/text.txt"
+
+FAILED=0
+
+start_server() {
+    if [ "$1" = reuseport ]; then
+        ./tftp.out -m reuseport "${@:2}" $PORT > /dev/null 2>&1 &
+    else
+        ./tftp.out -m "$@" $PORT $END_PORT > /dev/null 2>&1 &
+    fi
+    SERVER_PID=$!
+    sleep 0.5
+}
+
+stop_server() {
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+}
+
+check() {
+    if eval "$2"; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1"
+        FAILED=1
+    fi
+}
+
+for SERVER in "epoll" "epoll -r fread -c 0" "fork" "reuseport"; do
+    start_server $SERVER
+    for BLKSIZE in 8 9 10 11 13 512; do
+        for WINDOW in 1 4; do
+            ./tests/tftp_bench -a -c 127.0.0.1 $PORT "$WORKDIR/dense.txt" 2 4 $BLKSIZE $WINDOW > /dev/null
+            check "$SERVER: download, blksize $BLKSIZE, windowsize $WINDOW" "[ $? -eq 0 ]"
+            ./tests/tftp_bench -a -c -u 127.0.0.1 $PORT "$WORKDIR/dense.txt" 2 2 $BLKSIZE $WINDOW > /dev/null
+            check "$SERVER: upload, blksize $BLKSIZE, windowsize $WINDOW" "[ $? -eq 0 ]"
+            rm -f "$WORKDIR"/dense.txt.up.*
+        done
+    done
+    stop_server
+done
+
+echo
+printf "%-9s %-8s %10s\n" mode transfer "MB/s"
+start_server epoll
+for MODE in octet netascii; do
+    FLAG=$([ $MODE = netascii ] && echo -a)
+    for DIR in download upload; do
+        OUT=$(./tests/tftp_bench $FLAG $([ $DIR = upload ] && echo -u) 127.0.0.1 $PORT "$WORKDIR/text.txt" 2 8 8192 16)
+        rm -f "$WORKDIR"/text.txt.up.*
+        RATE=$(echo "$OUT" | sed -n 's/.*MB\/s=\([0-9.]*\).*/\1/p')
+        printf "%-9s %-8s %10s\n" $MODE $DIR "${RATE:-FAILED}"
+    done
+done
+stop_server
+
+exit $FAILED
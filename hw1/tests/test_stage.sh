@@ -0,0 +1,97 @@
+#!/bin/bash
+
+# Staged variants (-z). The server directory only has image.bin.gz. The
+# first round of downloads of image.bin makes the server decompress it
+# into the staging directory; a second round finds it already staged.
+# Every transfer asks for tsize and is checked against it and against
+# the CRC-32 of the original, which the clients have in their own
+# directory. Checks that the first DATA arrives well before gzip alone
+# could have finished, that the file is staged once, and that a corrupt
+# archive fails the transfer instead of hanging it.
+#
+# Run from hw1 after `make`: ./tests/test_stage.sh
+
+PORT=${PORT:-20000}
+END_PORT=${END_PORT:-21100}
+FILE_MB=${FILE_MB:-64}
+CLIENTS=${CLIENTS:-4}
+
+cd "$(dirname "$0")/.." || exit 1
+HW1=$(pwd)
+
+echo "Compiling benchmark client..."
+gcc -O2 -Wall -o tests/tftp_bench tests/tftp_bench.c || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+mkdir "$WORKDIR/srv" "$WORKDIR/cli" "$WORKDIR/stage"
+
+# Base64 text compresses about as well as a typical firmware image
+base64 -w 76 /dev/urandom | head -c $((FILE_MB * 1024 * 1024)) > "$WORKDIR/cli/image.bin"
+gzip -1 -c "$WORKDIR/cli/image.bin" > "$WORKDIR/srv/image.bin.gz"
+cp "$WORKDIR/cli/image.bin" "$WORKDIR/srv/plain.bin"
+cp "$WORKDIR/cli/image.bin" "$WORKDIR/cli/plain.bin"
+# Right trailer, truncated deflate stream
+head -c $((FILE_MB * 1024 * 256)) "$WORKDIR/srv/image.bin.gz" > "$WORKDIR/srv/bad.bin.gz"
+tail -c 8 "$WORKDIR/srv/image.bin.gz" >> "$WORKDIR/srv/bad.bin.gz"
+cp "$WORKDIR/cli/image.bin" "$WORKDIR/cli/bad.bin"
+
+TIMEFORMAT=%R
+GUNZIP_MS=$( { time gzip -dc "$WORKDIR/srv/image.bin.gz" > /dev/null; } 2>&1 | awk '{ printf "%d", $1 * 1000 }')
+echo "gzip -dc alone: $GUNZIP_MS ms"
+
+FAILED=0
+
+start_server() {
+    (cd "$WORKDIR/srv" && exec "$HW1/tftp.out" -m $1 -z "$WORKDIR/stage" $PORT $END_PORT > /dev/null 2>&1) &
+    SERVER_PID=$!
+    sleep 0.5
+}
+
+stop_server() {
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+}
+
+check() {
+    if eval "$2"; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1"
+        FAILED=1
+    fi
+}
+
+# Prints the result line; the exit status is the client's
+bench() {
+    (cd "$WORKDIR/cli" && "$HW1/tests/tftp_bench" -s -c 127.0.0.1 $PORT "$@")
+}
+
+field() {
+    echo "$1" | sed -n "s|.* $2=\([0-9.]*\).*|\1|p"
+}
+
+printf "%-6s %-7s %10s %10s %8s\n" mode run first_ms seconds "MB/s"
+for MODE in epoll fork; do
+    rm -f "$WORKDIR"/stage/*
+    start_server $MODE
+    for RUN in cold warm plain; do
+        FILE=$([ $RUN = plain ] && echo plain.bin || echo image.bin)
+        OUT=$(bench $FILE $CLIENTS $((CLIENTS * 2)) 8192 16)
+        RC=$?
+        printf "%-6s %-7s %10s %10s %8s\n" $MODE $RUN "$(field "$OUT" first_p50_ms)" \
+            "$(field "$OUT" seconds)" "$(field "$OUT" MB/s)"
+        check "$MODE $RUN: transfers intact with the right tsize" "[ $RC -eq 0 ]"
+        if [ $RUN = cold ]; then
+            FIRST=$(field "$OUT" first_p50_ms)
+            check "$MODE: first DATA before decompression could finish" "[ ${FIRST%.*} -lt $((GUNZIP_MS / 2)) ]"
+        fi
+    done
+    check "$MODE: staged once" "[ $(ls "$WORKDIR/stage" | wc -l) -eq 1 ]"
+
+    timeout 30 bash -c "cd '$WORKDIR/cli' && '$HW1/tests/tftp_bench' 127.0.0.1 $PORT bad.bin 1 1 8192 16" > /dev/null 2>&1
+    check "$MODE: corrupt archive fails the transfer" "[ $? -eq 1 ]"
+    stop_server
+done
+
+exit $FAILED
@@ -0,0 +1,669 @@
+/*
+ * Concurrent RRQ/WRQ load generator and benchmark client for the TFTP
+ * server.
+ *
+ * Keeps <clients> transfers of <file> in flight at once from a single
+ * process (one UDP socket per transfer, multiplexed with poll()) until
+ * <transfers> of them have completed, then reports transfers/sec, MB/s,
+ * retransmissions, the median and 99th percentile completion time, and
+ * the median time to the first DATA (or, uploading, the first ACK).
+ *
+ * Transfers are downloads unless -u (all uploads) or -m pct (that
+ * percentage of uploads, spread evenly) is given. An upload sends the
+ * local <file> and names it "<file>.up.<n>" on the server, so the server
+ * must be able to create files at that path.
+ *
+ * With -c every transfer is checked against the CRC-32 of the local
+ * <file>: downloads as they arrive, uploads by reading back the file the
+ * server wrote, which needs the client on the server's filesystem. A
+ * mismatch counts as corrupt and makes the exit status non-zero.
+ *
+ * With -a transfers use netascii mode: uploads send <file> with its line
+ * ends expanded to CR LF / CR NUL, and with -c downloads are collapsed
+ * back before they are checked. This is a plain byte-at-a-time
+ * translation, independent of the server's.
+ *
+ * With -s every request carries the tsize option, and a download whose
+ * size differs from the tsize in the OACK counts as corrupt.
+ *
+ * With -D every request is sent twice, as by a client that retransmits
+ * before the server's first answer reaches it. Each transfer should
+ * still be served once; the copy from a second server TID is ignored.
+ *
+ * With -A n transfers take turns binding to n loopback addresses from
+ * 127.0.0.1 up, so they look like n client hosts in one /24. Linux
+ * routes all of 127/8 to lo without further setup. IPv4 servers only.
+ *
+ * <host> is an IPv4 or IPv6 address or a name, e.g. ::1 to test the
+ * server's IPv6 path over loopback.
+ *
+ * If blksize and/or windowsize are given they are requested with RFC
+ * 2348/7440 options and the values from the server's OACK are used.
+ *
+ * Build: gcc -O2 -Wall -o tftp_bench tftp_bench.c
+ * Usage: ./tftp_bench [-u | -m pct] [-c] [-a] [-s] [-D] [-A n] <host> <port> <file> <clients> <transfers> [blksize [windowsize]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define TFTP_RRQ   1
+#define TFTP_WRQ   2
+#define TFTP_DATA  3
+#define TFTP_ACK   4
+#define TFTP_ERROR 5
+#define TFTP_OACK  6
+#define DATA_SIZE 512
+#define MAX_PACKET (65464 + 4)
+#define TIMEOUT_MS 1000
+#define MAX_RETRIES 10
+
+typedef struct Client {
+    int fd;
+    struct sockaddr_storage tid;  // Server TID, learned from the first DATA
+    int have_tid;
+    unsigned short expected;    // Next DATA block we want
+    int blksize, windowsize;    // In effect for this transfer
+    int since_ack;              // Blocks received since our last ACK
+    char last[DATA_SIZE + 4];   // Last packet sent (RRQ or ACK)
+    size_t last_len;
+    long deadline;
+    int retries;
+    long bytes;
+    uint64_t acked;             // Upload: highest block ACKed by the server
+    uint64_t next;              // Upload: next block to send
+    uint64_t nblocks;           // Upload: blocks in the file, the last one short
+    int upload;                 // This transfer is a WRQ
+    long index;                 // Number of the transfer, names the upload
+    long t_start;               // now_us() when the request went out
+    uint32_t crc;               // Download: CRC-32 of the data so far
+    int net_cr;                 // Download: netascii block ended in a CR
+    long t_first;               // now_us() when the first DATA or ACK arrived, or 0
+    long tsize;                 // From the OACK, -1 if none
+} Client;
+
+static struct sockaddr_storage server;
+static socklen_t server_len;
+static const char *filename;
+static int req_blksize, req_windowsize;  // 0 = don't ask
+static long completed, failed, started, total_bytes, retransmits;
+static int upload_pct;          // Share of transfers that are uploads
+static int verify;              // -c: check every transfer's CRC-32
+static char *file_data;         // Contents of <file> when uploading or verifying
+static long file_len;
+static uint32_t file_crc;
+static long corrupt;
+static long *latency_us;        // Completion time of each good transfer
+static int netascii;            // -a: transfer in netascii mode
+static char *send_data;         // What uploads put on the wire
+static long send_len;
+static int want_tsize;          // -s: ask for tsize and check downloads against it
+static long *first_us;          // Time to first DATA/ACK of each good transfer
+static int dup_requests;        // -D: send every request twice
+static int src_addrs;           // -A: loopback source addresses to spread transfers over
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+// CRC-32 (IEEE 802.3), continued from crc over len more bytes
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len) {
+    static uint32_t table[256];
+    const unsigned char *p = buf;
+
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (len-- > 0) {
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Read a whole file into memory. Returns NULL on failure.
+static char *read_file(const char *path, long *len) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    char *data = NULL;
+    if (fseek(fp, 0, SEEK_END) == 0 && (*len = ftell(fp)) >= 0) {
+        rewind(fp);
+        data = malloc(*len + 1);
+        if (data && fread(data, 1, *len, fp) != (size_t)*len) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(fp);
+    return data;
+}
+
+// The port of an IPv4 or IPv6 address, in network byte order
+static unsigned short sa_port(const struct sockaddr_storage *ss) {
+    if (ss->ss_family == AF_INET6) {
+        return ((const struct sockaddr_in6 *)ss)->sin6_port;
+    }
+    return ((const struct sockaddr_in *)ss)->sin_port;
+}
+
+static void transmit(Client *c) {
+    const struct sockaddr_storage *to = c->have_tid ? &c->tid : &server;
+    sendto(c->fd, c->last, c->last_len, 0, (const struct sockaddr *)to, server_len);
+    c->deadline = now_ms() + TIMEOUT_MS;
+}
+
+static void start_transfer(Client *c) {
+    c->fd = socket(server.ss_family, SOCK_DGRAM, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (src_addrs) {
+        struct sockaddr_in src;
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + started % src_addrs);
+        if (bind(c->fd, (struct sockaddr *)&src, sizeof(src)) < 0) {
+            perror("bind");
+            exit(1);
+        }
+    }
+    c->upload = (started + 1) * upload_pct / 100 != started * upload_pct / 100;
+    c->index = started;
+    c->t_start = now_us();
+    c->crc = 0;
+    c->net_cr = 0;
+    c->t_first = 0;
+    c->tsize = -1;
+    if (req_windowsize > 1 && !c->upload) {
+        // A whole window can arrive before we read any of it. Don't shrink
+        // the default for small blocks: each datagram costs more than its size.
+        int rcvbuf = ((req_blksize ? req_blksize : DATA_SIZE) + 4) * req_windowsize * 2;
+        int cur = 0;
+        socklen_t len = sizeof(cur);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &cur, &len) < 0 || rcvbuf > cur) {
+            setsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+    }
+    c->have_tid = 0;
+    c->expected = 1;
+    c->retries = 0;
+    c->bytes = 0;
+    c->blksize = DATA_SIZE;
+    c->windowsize = 1;
+    c->since_ack = 0;
+    c->acked = 0;
+    c->next = 1;
+    c->nblocks = send_len / DATA_SIZE + 1;
+
+    unsigned short op = htons(c->upload ? TFTP_WRQ : TFTP_RRQ);
+    memcpy(c->last, &op, 2);
+    size_t len = 2;
+    if (c->upload) {
+        len += sprintf(c->last + len, "%s.up.%ld", filename, started) + 1;
+    } else {
+        len += sprintf(c->last + len, "%s", filename) + 1;
+    }
+    len += sprintf(c->last + len, netascii ? "netascii" : "octet") + 1;
+    if (req_blksize) {
+        len += sprintf(c->last + len, "blksize") + 1;
+        len += sprintf(c->last + len, "%d", req_blksize) + 1;
+    }
+    if (req_windowsize) {
+        len += sprintf(c->last + len, "windowsize") + 1;
+        len += sprintf(c->last + len, "%d", req_windowsize) + 1;
+    }
+    if (want_tsize) {
+        len += sprintf(c->last + len, "tsize") + 1;
+        len += sprintf(c->last + len, "%ld", c->upload ? send_len : 0) + 1;
+    }
+    c->last_len = len;
+    started++;
+    transmit(c);
+    if (dup_requests) {
+        transmit(c);
+    }
+}
+
+// Compare what a finished transfer moved with the local file.
+static int transfer_intact(Client *c) {
+    if (!c->upload) {
+        return c->crc == file_crc;
+    }
+    char name[PATH_MAX];
+    long len;
+    snprintf(name, sizeof(name), "%s.up.%ld", filename, c->index);
+    char *data = read_file(name, &len);
+    int ok = data && len == file_len && crc32(0, data, len) == file_crc;
+    free(data);
+    return ok;
+}
+
+static void finish_transfer(Client *c, int ok) {
+    close(c->fd);
+    c->fd = -1;
+    if (ok && want_tsize && !c->upload && c->tsize != c->bytes) {
+        fprintf(stderr, "transfer %ld: tsize %ld, received %ld\n", c->index, c->tsize, c->bytes);
+        corrupt++;
+        ok = 0;
+    } else if (ok && verify && !transfer_intact(c)) {
+        fprintf(stderr, "transfer %ld (%s) is corrupt\n", c->index, c->upload ? "upload" : "download");
+        corrupt++;
+        ok = 0;
+    }
+    if (ok) {
+        first_us[completed] = c->t_first - c->t_start;
+        latency_us[completed++] = now_us() - c->t_start;
+        total_bytes += c->bytes;
+    } else {
+        failed++;
+    }
+}
+
+static void send_ack(Client *c, unsigned short block) {
+    unsigned short ack = htons(TFTP_ACK);
+    unsigned short blk = htons(block);
+    memcpy(c->last, &ack, 2);
+    memcpy(c->last + 2, &blk, 2);
+    c->last_len = 4;
+    c->since_ack = 0;
+    transmit(c);
+}
+
+// Apply the values the server accepted in its OACK.
+static void parse_oack(Client *c, const char *p, const char *end) {
+    while (p < end) {
+        const char *name = p;
+        const char *value = name + strnlen(name, end - name) + 1;
+        if (value >= end) {
+            break;
+        }
+        if (strcasecmp(name, "blksize") == 0) {
+            c->blksize = atoi(value);
+        } else if (strcasecmp(name, "windowsize") == 0) {
+            c->windowsize = atoi(value);
+        } else if (strcasecmp(name, "tsize") == 0) {
+            c->tsize = atol(value);
+        }
+        p = value + strnlen(value, end - value) + 1;
+    }
+}
+
+// Upload: send the window of blocks after the last one ACKed.
+static void send_window(Client *c) {
+    static char buf[MAX_PACKET];
+    unsigned short op = htons(TFTP_DATA);
+    memcpy(buf, &op, 2);
+
+    c->next = c->acked + 1;
+    for (int i = 0; i < c->windowsize && c->next <= c->nblocks; i++, c->next++) {
+        unsigned short blk = htons((unsigned short)c->next);
+        long off = (long)(c->next - 1) * c->blksize;
+        long len = send_len - off < c->blksize ? send_len - off : c->blksize;
+        memcpy(buf + 2, &blk, 2);
+        memcpy(buf + 4, send_data + off, len);
+        sendto(c->fd, buf, len + 4, 0, (const struct sockaddr *)&c->tid, server_len);
+    }
+    c->deadline = now_ms() + TIMEOUT_MS;
+}
+
+// Upload: the server answers with OACK or ACK.
+static int handle_upload(Client *c, unsigned short op, unsigned short block, const char *buf, ssize_t n) {
+    if (c->next == 1) {
+        // Waiting for the answer to our WRQ
+        if (op == TFTP_OACK) {
+            parse_oack(c, buf + 2, buf + n);
+            c->nblocks = send_len / c->blksize + 1;
+        } else if (op != TFTP_ACK || block != 0) {
+            return 0;
+        }
+        c->retries = 0;
+        send_window(c);
+        return 0;
+    }
+    if (op != TFTP_ACK) {
+        return 0;
+    }
+
+    // Map the 16-bit block onto the blocks we have in flight
+    unsigned short ahead = block - (unsigned short)c->acked;
+    if (ahead > c->next - 1 - c->acked) {
+        return 0; // Stale ACK from before a wraparound
+    }
+    if (ahead == 0) {
+        // The server saw a gap and restarts us from its last good block
+        retransmits++;
+        send_window(c);
+        return 0;
+    }
+    if (c->t_first == 0) {
+        c->t_first = now_us();
+    }
+    c->acked += ahead;
+    c->retries = 0;
+    if (c->acked == c->nblocks) {
+        c->bytes = send_len;
+        finish_transfer(c, 1);
+        return 1;
+    }
+    // A whole window, or the server stopped partway (it lost a block, or
+    // paused for its disk): go on from the block after the ACK (RFC 7440)
+    send_window(c);
+    return 0;
+}
+
+// The whole of data in netascii; *len is updated to the new length.
+static char *netascii_encode(const char *data, long *len) {
+    char *out = malloc(*len * 2 + 1);
+    long n = 0;
+    for (long i = 0; i < *len; i++) {
+        if (data[i] == '\n' || data[i] == '\r') {
+            out[n++] = '\r';
+            out[n++] = data[i] == '\n' ? '\n' : '\0';
+        } else {
+            out[n++] = data[i];
+        }
+    }
+    *len = n;
+    return out;
+}
+
+// Download: add one netascii block, translated back, to the CRC.
+static void netascii_crc(Client *c, const char *p, long len, int last) {
+    char out[MAX_PACKET + 1];
+    long n = 0;
+    for (long i = 0; i < len; i++) {
+        if (c->net_cr) {
+            c->net_cr = 0;
+            if (p[i] == '\n' || p[i] == '\0') {
+                out[n++] = p[i] == '\n' ? '\n' : '\r';
+                continue;
+            }
+            out[n++] = '\r';
+        }
+        if (p[i] == '\r') {
+            c->net_cr = 1;
+        } else {
+            out[n++] = p[i];
+        }
+    }
+    if (last && c->net_cr) {
+        out[n++] = '\r';
+    }
+    c->crc = crc32(c->crc, out, n);
+}
+
+// Returns 1 when the transfer is over.
+static int handle_packet(Client *c) {
+    static char buf[MAX_PACKET];
+    struct sockaddr_storage from;
+    socklen_t fromlen = sizeof(from);
+    ssize_t n = recvfrom(c->fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+    if (n < 4) {
+        return 0;
+    }
+
+    unsigned short op, block;
+    memcpy(&op, buf, 2);
+    memcpy(&block, buf + 2, 2);
+    op = ntohs(op);
+    block = ntohs(block);
+
+    if (op == TFTP_ERROR) {
+        fprintf(stderr, "server error: %s\n", buf + 4);
+        finish_transfer(c, 0);
+        return 1;
+    }
+    if (!c->have_tid && (op == TFTP_OACK || (op == TFTP_DATA && block == 1) || (op == TFTP_ACK && block == 0))) {
+        c->tid = from;
+        c->have_tid = 1;
+    }
+    if (!c->have_tid || sa_port(&from) != sa_port(&c->tid)) {
+        return 0; // Not from our server TID
+    }
+    if (c->upload) {
+        return handle_upload(c, op, block, buf, n);
+    }
+
+    if (op == TFTP_OACK) {
+        if (c->expected == 1) {
+            parse_oack(c, buf + 2, buf + n);
+            c->retries = 0;
+            send_ack(c, 0);
+        }
+        return 0;
+    }
+    if (op != TFTP_DATA) {
+        return 0;
+    }
+    if (block != c->expected) {
+        // Lost or duplicate block: ask for a new window after the last good one
+        send_ack(c, c->expected - 1);
+        return 0;
+    }
+
+    int last = n - 4 < c->blksize;
+    if (c->t_first == 0) {
+        c->t_first = now_us();
+    }
+    c->bytes += n - 4;
+    if (verify && netascii) {
+        netascii_crc(c, buf + 4, n - 4, last);
+    } else if (verify) {
+        c->crc = crc32(c->crc, buf + 4, n - 4);
+    }
+    c->retries = 0;
+    c->expected++;
+    c->since_ack++;
+    if (last || c->since_ack >= c->windowsize) {
+        send_ack(c, block);
+    } else {
+        c->deadline = now_ms() + TIMEOUT_MS;
+    }
+
+    if (last) {
+        finish_transfer(c, 1);
+        return 1;
+    }
+    return 0;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// The pct-th percentile of sorted times in us, in ms
+static double percentile(const long *us, int pct) {
+    return completed ? us[(completed - 1) * pct / 100] / 1000.0 : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-u | -m pct] [-c] [-a] [-s] [-D] [-A n] <host> <port> <file> <clients> <transfers> [blksize [windowsize]]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *prog = argv[0];
+    int opt;
+    while ((opt = getopt(argc, argv, "um:casDA:")) != -1) {
+        switch (opt) {
+            case 'u':
+                upload_pct = 100;
+                break;
+            case 'm':
+                upload_pct = atoi(optarg);
+                if (upload_pct < 0 || upload_pct > 100) {
+                    usage(prog);
+                }
+                break;
+            case 'c':
+                verify = 1;
+                break;
+            case 'a':
+                netascii = 1;
+                break;
+            case 's':
+                want_tsize = 1;
+                break;
+            case 'D':
+                dup_requests = 1;
+                break;
+            case 'A':
+                src_addrs = atoi(optarg);
+                if (src_addrs < 1 || src_addrs > 254) {
+                    usage(prog);
+                }
+                break;
+            default:
+                usage(prog);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 6 || argc > 8) {
+        usage(prog);
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    int gai = getaddrinfo(argv[1], argv[2], &hints, &res);
+    if (gai != 0) {
+        fprintf(stderr, "Invalid address %s port %s: %s\n", argv[1], argv[2], gai_strerror(gai));
+        exit(1);
+    }
+    memcpy(&server, res->ai_addr, res->ai_addrlen);
+    server_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    if (src_addrs && server.ss_family != AF_INET) {
+        fprintf(stderr, "-A needs an IPv4 server address\n");
+        exit(1);
+    }
+    filename = argv[3];
+    int nclients = atoi(argv[4]);
+    long transfers = atol(argv[5]);
+    req_blksize = argc > 6 ? atoi(argv[6]) : 0;
+    req_windowsize = argc > 7 ? atoi(argv[7]) : 0;
+    if (nclients <= 0 || transfers < nclients) {
+        fprintf(stderr, "Need 0 < clients <= transfers\n");
+        exit(1);
+    }
+
+    if (upload_pct > 0 || verify) {
+        if ((file_data = read_file(filename, &file_len)) == NULL) {
+            perror(filename);
+            exit(1);
+        }
+        file_crc = crc32(0, file_data, file_len);
+    }
+    send_data = file_data;
+    send_len = file_len;
+    if (netascii && upload_pct > 0) {
+        send_data = netascii_encode(file_data, &send_len);
+    }
+    latency_us = calloc(transfers, sizeof(long));
+    first_us = calloc(transfers, sizeof(long));
+
+    Client *clients = calloc(nclients, sizeof(Client));
+    struct pollfd *pfds = calloc(nclients, sizeof(struct pollfd));
+    long t0 = now_ms();
+
+    for (int i = 0; i < nclients; i++) {
+        start_transfer(&clients[i]);
+    }
+
+    while (completed + failed < transfers) {
+        long now = now_ms();
+        long next = now + TIMEOUT_MS;
+        for (int i = 0; i < nclients; i++) {
+            pfds[i].fd = clients[i].fd;
+            pfds[i].events = POLLIN;
+            if (clients[i].fd >= 0 && clients[i].deadline < next) {
+                next = clients[i].deadline;
+            }
+        }
+
+        int nready = poll(pfds, nclients, next > now ? (int)(next - now) : 0);
+        if (nready < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+
+        now = now_ms();
+        for (int i = 0; i < nclients; i++) {
+            Client *c = &clients[i];
+            if (c->fd < 0) {
+                continue;
+            }
+            int done = 0;
+            if (pfds[i].revents & POLLIN) {
+                done = handle_packet(c);
+            } else if (c->deadline <= now) {
+                if (++c->retries > MAX_RETRIES) {
+                    finish_transfer(c, 0);
+                    done = 1;
+                } else {
+                    retransmits++;
+                    if (c->upload && c->have_tid) {
+                        send_window(c);
+                    } else if (c->have_tid) {
+                        send_ack(c, c->expected - 1);
+                    } else {
+                        transmit(c);
+                    }
+                }
+            }
+            if (done && started < transfers) {
+                start_transfer(c);
+            }
+        }
+    }
+
+    double secs = (now_ms() - t0) / 1000.0;
+    qsort(latency_us, completed, sizeof(long), cmp_long);
+    qsort(first_us, completed, sizeof(long), cmp_long);
+    printf("clients=%d transfers=%ld failed=%ld retransmits=%ld seconds=%.3f transfers/sec=%.1f MB/s=%.2f "
+           "corrupt=%ld p50_ms=%.2f p99_ms=%.2f first_p50_ms=%.2f\n",
+           nclients, completed, failed, retransmits, secs, completed / secs, total_bytes / secs / 1e6,
+           corrupt, percentile(latency_us, 50), percentile(latency_us, 99), percentile(first_us, 50));
+    free(clients);
+    free(pfds);
+    if (send_data != file_data) {
+        free(send_data);
+    }
+    free(file_data);
+    free(latency_us);
+    free(first_us);
+    return failed ? 1 : 0;
+}
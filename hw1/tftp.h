@@ -0,0 +1,365 @@
+#ifndef TFTP_H
+#define TFTP_H
+
+#include "unpthread.h"
+#include "unprtt.h"
+#include <arpa/inet.h>
+#include <string.h>
+#include <limits.h>
+
+#define TFTP_RRQ   1
+#define TFTP_WRQ   2
+#define TFTP_DATA  3
+#define TFTP_ACK   4
+#define TFTP_ERROR 5
+#define TFTP_OACK  6
+#define DATA_SIZE 512
+#define PACKET_BUFFER_SIZE (DATA_SIZE + 4)
+
+// Option negotiation limits (RFC 2348, RFC 7440)
+#define TFTP_MIN_BLKSIZE 8
+#define TFTP_MAX_BLKSIZE 65464
+#define TFTP_MAX_WINDOW  64
+#define MAX_PACKET_SIZE (TFTP_MAX_BLKSIZE + 4)
+#define TFTP_MAX_BATCH   TFTP_MAX_WINDOW  // Datagrams per recvmmsg()/sendmmsg()
+
+// TFTP Error Codes
+#define TFTP_ERR_NOT_DEFINED 0
+#define TFTP_ERR_FILE_NOT_FOUND 1
+#define TFTP_ERR_ACCESS_VIOLATION 2
+#define TFTP_ERR_DISK_FULL 3
+#define TFTP_ERR_ILLEGAL_OP 4
+#define TFTP_ERR_UNKNOWN_TID 5
+#define TFTP_ERR_FILE_EXISTS 6
+#define TFTP_ERR_NO_SUCH_USER 7
+#define TFTP_ERR_OPTION 8
+
+#define TFTP_PORT 69 // Standard TFTP port, for reference, not for use in binding.
+#define TFTP_MAX_LISTEN 4 // Listen addresses (-l)
+
+#define TFTP_TIMEOUT_MS 1000  // Retransmission timer before the first RTT sample
+#define TFTP_MIN_RTO_MS 50    // Bounds for the adaptive timer; lib/rtt.c clamps
+#define TFTP_MAX_RTO_MS 5000  // to 2..60 s, far too coarse for a LAN
+#define TFTP_MAX_RETRIES 10   // Abort after this many unanswered retransmissions
+#define TFTP_DUPACK_THRESHOLD 2  // Duplicate ACKs that trigger a fast retransmit
+#define STAGE_POLL_MS 10      // Recheck a staging file that is behind the client
+#define ADMIT_WAIT_MS 5000    // Longest a request waits for a session slot (-S)
+#define ADMIT_RETRY_MS 10     // Recheck the admission queue while it is not empty
+
+// How WRQ data reaches the disk (-W) and when it is synced (-f)
+enum write_mode { WRITE_SYNC, WRITE_BEHIND, WRITE_DIRECT };
+enum fsync_policy { FSYNC_NONE, FSYNC_CHUNK, FSYNC_CLOSE };
+
+// Runtime settings, filled in from the command line in tftp_server.c
+struct tftp_config {
+    unsigned max_window;                // Cap on negotiated windowsize
+    int use_mmap;                       // Serve RRQs from a mapping instead of fread()
+    size_t cache_budget;                // Bytes of file contents to cache, 0 = off
+    int batch;                          // Datagrams per batched syscall, 1 = no batching
+    int threads;                        // Worker threads in reuseport mode
+    int timer_wheel;                    // Timer wheel, or scan all sessions per wakeup
+    enum write_mode write_mode;         // fwrite() in the session, or a writer thread
+    enum fsync_policy fsync_policy;     // Sync after every chunk, once at the end, or never
+    const char *stage_dir;              // Serve name.gz decompressed, staged here (-z), or NULL
+    unsigned max_sessions;              // Concurrent transfers, more are queued (-S), 0 = no limit
+    unsigned queue_len;                 // Requests that may wait for a slot (-Q)
+    unsigned long client_rate;          // RRQ bytes/sec per client address (-R), 0 = no limit
+    unsigned long subnet_rate;          // RRQ bytes/sec per /24 or /64 (-N), 0 = no limit
+    const char *listen_hosts[TFTP_MAX_LISTEN];  // Addresses to listen on (-l)
+    int nlisten;                        // 0 = one dual-stack socket on every address
+};
+extern struct tftp_config tftp_cfg;
+
+// File cache counters, see tftp_cache.c
+struct cache_stats {
+    unsigned long hits;                 // Lookups served from memory
+    unsigned long misses;               // Lookups that went to disk
+    unsigned long evictions;            // Entries dropped to stay in budget
+    unsigned long bytes_loaded;         // Total bytes read from disk into the cache
+    size_t bytes;                       // Bytes currently cached
+    unsigned entries;                   // Files currently cached
+};
+extern struct cache_stats cache_stats;
+struct cache_entry;
+struct wb_stream;
+
+// One datagram for io_recv(); the caller provides buf and size
+struct io_dgram {
+    char *buf;
+    size_t size;
+    ssize_t len;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+// Socket I/O counters, see tftp_io.c
+struct io_stats {
+    unsigned long syscalls;             // recv/send calls, batched or not
+    unsigned long dgrams_in;
+    unsigned long dgrams_out;
+};
+extern struct io_stats io_stats;
+
+// Transfer metrics, see tftp_metrics.c. All fields are updated with
+// relaxed atomics and may be shared between processes.
+#define METRICS_BUCKETS 10
+struct histogram {
+    unsigned long counts[METRICS_BUCKETS + 1];  // Per bucket, last one unbounded
+    unsigned long sum;
+};
+struct tftp_metrics {
+    volatile int debug_level;           // vlog() verbosity, see below
+    unsigned long sessions_active;
+    unsigned long sessions_total;
+    unsigned long rrq_total;
+    unsigned long wrq_total;
+    unsigned long transfers_completed;
+    unsigned long transfers_failed;
+    unsigned long bytes_in;             // DATA payload received
+    unsigned long bytes_out;            // DATA payload sent, retransmissions included
+    unsigned long retransmits;
+    unsigned long timeouts;
+    unsigned long errors_sent;
+    unsigned long requests_duplicate;   // Dropped: the same request is being served or queued
+    unsigned long requests_queued;      // Waited for a session slot (-S)
+    unsigned long requests_refused;     // Answered "Server busy."
+    struct histogram duration_ms;       // Completed transfers
+    struct histogram throughput;        // Completed transfers, bytes/sec
+};
+extern struct tftp_metrics *metrics;
+#define METRIC_ADD(field, n) __atomic_fetch_add(&metrics->field, (n), __ATOMIC_RELAXED)
+
+// Debug levels (-d, SIGUSR2): errors always go to stderr
+#define VERBOSE_TRANSFER 1              // One line per request and transfer outcome
+#define VERBOSE_BLOCK    2              // Every block, ACK and retransmission
+#define vlog(level, ...)                           \
+    do {                                           \
+        if (metrics->debug_level >= (level)) {     \
+            printf(__VA_ARGS__);                   \
+        }                                          \
+    } while (0)
+
+// Retransmission timers, see tftp_timer.c
+#define WHEEL_L0_SLOTS 256              // 1 ms each
+#define WHEEL_LN_SLOTS 64               // Per higher level, each 64 times coarser
+#define WHEEL_LEVELS   3                // Higher levels: reach ~18 hours
+struct timer {
+    struct timer *next, **pprev;        // Slot list; pprev is NULL when not scheduled
+    long expires;                       // now_ms() time
+    void *data;
+};
+struct timer_wheel {
+    long now;                           // Next tick to process
+    unsigned count;                     // Timers scheduled
+    long armed;                         // Tick the timerfd is set for, -1 if none
+    int fd;                             // timerfd
+    struct timer *l0[WHEEL_L0_SLOTS];
+    struct timer *ln[WHEEL_LEVELS][WHEEL_LN_SLOTS];
+};
+
+// Admission control, see tftp_admit.c
+#define ADMIT_BUCKETS 1024
+struct admit_req {                      // A request waiting for a session slot
+    struct admit_req *next;
+    int fd;                             // Listen socket it came in on, for replies
+    long arrived;                       // now_ms()
+    uint16_t opcode;
+    char filename[128];
+    struct io_dgram d;                  // d.buf points at data
+    char data[];
+};
+struct admit_queue {
+    struct admit_req *head, *tail;
+    unsigned count;
+};
+struct admit_entry;
+struct admit_table {                    // Fork mode: requests live children are serving
+    struct admit_entry *by_req[ADMIT_BUCKETS];
+    struct admit_entry *by_pid[ADMIT_BUCKETS];
+};
+struct shape_bucket;
+
+// Return values of the session state machine
+#define SESSION_CONTINUE 0
+#define SESSION_DONE     1
+
+// What a write-behind upload is waiting for, see session_resume()
+#define WB_WAIT_ROOM   1                // Room in the ring for another block
+#define WB_WAIT_FINISH 2                // The file written out and synced
+
+/*
+ * One RRQ or WRQ transfer. The session owns a socket connected to the
+ * client's TID, so every datagram read from it belongs to this transfer.
+ * The state machine is driven by session_input() on every received
+ * packet and session_timeout() when the retransmission deadline passes;
+ * it never blocks, so one process can run any number of sessions.
+ */
+struct tftp_session {
+    int fd;                             // Data socket (our TID)
+    int connected;                      // fd is ours and connected, else shared
+    int port;                           // Local port fd is bound to
+    struct sockaddr_storage cliaddr;    // Client TID
+    socklen_t clilen;
+    uint16_t opcode;                    // TFTP_RRQ or TFTP_WRQ
+    int netascii;                       // Mode "netascii": translate line ends
+    char filename[128];
+    FILE *file;                         // RRQ fread() path, WRQ with -W sync
+    struct wb_stream *wb;               // WRQ: write-behind stream, or NULL
+    const char *map;                    // RRQ: whole file mapped read-only, or NULL
+    off_t map_len;
+    struct cache_entry *cached;         // RRQ: cache entry map points into, or NULL
+    int stage_fd;                       // RRQ: staged variant still being written
+    unsigned staging : 1;               // stage_fd is open; map is only valid up to staged
+    unsigned stalled : 1;               // Waiting for staged data or rate tokens, not an ACK
+    off_t staged;
+    struct shape_bucket *shape[2];      // RRQ: client and subnet token buckets, or NULL
+
+    // Negotiated options (RFC 2347); the opt_ flags say which go in the OACK
+    size_t blksize;
+    unsigned windowsize;
+    off_t tsize;
+    unsigned opt_blksize : 1, opt_windowsize : 1, opt_tsize : 1;
+    unsigned oack_pending : 1;          // OACK sent, waiting for ACK 0 / DATA 1
+    unsigned replied : 1;               // Client has answered our first packet
+    unsigned completed : 1;             // Last block delivered
+    long started;                       // now_ms() when the request arrived
+    uint64_t bytes;                     // File bytes moved, for the throughput histogram
+
+    // Block numbers are absolute; the wire carries the low 16 bits
+    uint64_t acked;                     // RRQ: highest block ACKed by the client
+    uint64_t next;                      // RRQ: next block to send
+    uint64_t last_block;                // RRQ: final (short) block, 0 until read
+    uint64_t file_block;                // RRQ: block the file offset points at
+    uint64_t received;                  // WRQ: highest block written in order
+    unsigned unacked;                   // WRQ: blocks received since our last ACK
+
+    // Netascii blocks don't start at (block - 1) * blksize. An RRQ keeps
+    // where each block in flight starts, so going back can rebuild it.
+    off_t net_offset[TFTP_MAX_WINDOW + 1];  // File offset, by block % (TFTP_MAX_WINDOW + 1)
+    signed char net_pending[TFTP_MAX_WINDOW + 1];  // Split line end carried in, or -1
+    off_t net_file_pos;                 // RRQ fread() path: offset of s->file
+    char *net_buf;                      // RRQ: fread() staging, WRQ: decoded block
+    int net_cr;                         // WRQ: last block ended in a CR
+
+    // Write-behind (WRQ): waiting for the writer, see session_room()
+    int wb_wait;                        // WB_WAIT_ROOM or WB_WAIT_FINISH, else 0
+    int wb_dropped;                     // DATA dropped while waiting: re-ACK on resume
+
+    // Sliding window and adaptive retransmission (RRQ)
+    struct rtt_info rtt;                // Jacobson estimator state, see lib/rtt.c
+    int have_rtt;                       // Got a first RTT sample
+    long rto;                           // Current timeout in ms, including backoff
+    uint64_t high;                      // Highest block ever sent
+    uint64_t recover;                   // Highest block sent when we last went back
+    unsigned dupacks;                   // Duplicate ACKs seen for s->acked
+    uint32_t sent_ts[TFTP_MAX_WINDOW];  // rtt_ts() of each block in flight, by block % TFTP_MAX_WINDOW
+    unsigned char resent[TFTP_MAX_WINDOW];  // Block was retransmitted (Karn: no RTT sample)
+
+    char *packet;                       // Last packet sent, kept for retransmission
+    size_t packet_len;
+    int retries;
+    long deadline;                      // Monotonic ms at which to retransmit
+    struct timer timer;                 // deadline on the owner's wheel, if any
+    struct timer_wheel *wheel;
+
+    struct tftp_session *hnext;         // Session table hash chain
+    struct tftp_session *prev_live, *next_live;  // List of all live sessions
+};
+
+// Sessions keyed by client TID, plus a list of all of them for timer scans
+#define SESSION_BUCKETS 1024
+struct session_table {
+    struct tftp_session *buckets[SESSION_BUCKETS];
+    struct tftp_session *live;
+};
+
+// tftp_server.c
+extern volatile sig_atomic_t stats_requested;  // Set by SIGUSR1
+void print_stats(void);
+
+// tftp_session.c
+long now_ms(void);
+int request_filename(const char *mesg, ssize_t n, char *filename, size_t fnlen);
+struct tftp_session *session_open(int fd, int port, SA *cliaddr, socklen_t clilen, const char *mesg, ssize_t n, int connected);
+int session_input(struct tftp_session *s, const char *pkt, ssize_t n);
+int session_timeout(struct tftp_session *s);
+int session_room(struct tftp_session *s);
+int session_resume(struct tftp_session *s);
+void session_close(struct tftp_session *s);
+void session_run(struct tftp_session *s);
+void session_set_wheel(struct tftp_session *s, struct timer_wheel *w);
+void send_error(int sockfd, int error_code, const char *error_msg);
+void send_error_to(int sockfd, SA *addr, socklen_t addrlen, int error_code, const char *error_msg);
+
+// tftp_cache.c
+struct cache_entry *cache_get(const char *path);
+void cache_put(struct cache_entry *e);
+const char *cache_data(const struct cache_entry *e);
+off_t cache_size(const struct cache_entry *e);
+
+// tftp_io.c
+int io_recv(int fd, struct io_dgram *d, int max, int flags);
+void io_send(int fd, const void *buf, size_t len, SA *to, socklen_t tolen);
+void io_sendv(int fd, SA *to, socklen_t tolen, const char *hdr, const char *data, size_t len);
+void io_queue(int fd, SA *to, socklen_t tolen, const char *hdr, const char *data, size_t len);
+void io_flush(void);
+int listen_socket(const char *host, int port, int v6only, int reuseport);
+int data_socket(SA *cliaddr, socklen_t clilen, int port);
+
+// tftp_engine.c
+struct tftp_session *table_lookup(struct session_table *t, SA *cliaddr, socklen_t clilen);
+void table_insert(struct session_table *t, struct tftp_session *s);
+void table_remove(struct session_table *t, struct tftp_session *s);
+void engine_run(const int *listenfds, int nlisten, int start_port, int end_port);
+
+// tftp_worker.c
+void workers_run(int port);
+
+// tftp_metrics.c
+void metrics_init(void);
+void metrics_session_start(struct tftp_session *s);
+void metrics_session_end(struct tftp_session *s);
+void metrics_serve(int port);
+
+// tftp_netascii.c
+size_t netascii_encode(const char *src, size_t srclen, size_t *consumed, char *dst, size_t dstlen, int *pending);
+size_t netascii_decode(const char *src, size_t len, char *dst, int *cr);
+off_t netascii_size(const char *p, size_t len);
+
+// tftp_stage.c
+int stage_open(const char *path, off_t *size, int *growing);
+int stage_check(int fd, off_t size, off_t *avail);
+
+// tftp_admit.c
+int admit_acquire(void);
+void admit_release(void);
+int admit_duplicate(const struct tftp_session *s, const struct io_dgram *d);
+void admit_enqueue(struct admit_queue *q, int fd, const struct io_dgram *d);
+struct admit_req *admit_dequeue(struct admit_queue *q);
+int admit_busy(struct admit_table *t, SA *addr, socklen_t addrlen, int opcode, const char *filename);
+void admit_track(struct admit_table *t, SA *addr, socklen_t addrlen, int opcode, const char *filename, pid_t pid);
+void admit_untrack(struct admit_table *t, pid_t pid);
+void shape_init(void);
+void shape_attach(struct tftp_session *s);
+void shape_detach(struct tftp_session *s);
+long shape_delay(struct tftp_session *s);
+void shape_charge(struct tftp_session *s, size_t bytes);
+
+// tftp_timer.c
+void wheel_init(struct timer_wheel *w);
+void timer_schedule(struct timer_wheel *w, struct timer *t, long expires);
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+struct timer *wheel_expired(struct timer_wheel *w, long now);
+void wheel_arm(struct timer_wheel *w);
+void wheel_ack(struct timer_wheel *w);
+
+// tftp_writer.c
+struct wb_stream *wb_open(const char *path);
+size_t wb_room(struct wb_stream *w, size_t want);
+int wb_append(struct wb_stream *w, const char *data, size_t len);
+int wb_finish(struct wb_stream *w);
+void wb_abort(struct wb_stream *w);
+int wb_notify_fd(void);
+void wb_notify_ack(void);
+
+#endif
@@ -0,0 +1,393 @@
+#include "tftp.h"
+#include <sys/mman.h>
+
+/*
+ * Admission control and rate limiting.
+ *
+ * Duplicate requests. A client that retransmits its RRQ before our first
+ * packet reaches it must not get a second transfer. The epoll engine and
+ * the reuseport workers find the live session by the client's TID and
+ * compare requests (admit_duplicate()). The fork-mode parent has no
+ * sessions, so it keeps a table of the requests its live children are
+ * serving, keyed by client address, port, opcode and filename, and drops
+ * requests that are already in it.
+ *
+ * Session limit (-S). At most max_sessions transfers run at once; the
+ * slots are counted in one atomic shared by the reuseport workers. A
+ * request that finds them all taken waits in a FIFO queue of the event
+ * loop that received it, up to queue_len requests (-Q) and ADMIT_WAIT_MS,
+ * and is started when a slot frees up. A full queue and a request that
+ * waited too long are answered with "Server busy.". The client's own
+ * retransmissions of a queued request are dropped.
+ *
+ * Bandwidth (-R, -N). DATA for RRQs is paced by token buckets, one per
+ * client address and one per /24 (IPv6: /64), that live in a shared mapping so fork
+ * mode's children draw from the same ones. A bucket is a single GCRA
+ * "theoretical arrival time" that sending a block pushes forward by its
+ * size over the rate; taking from a bucket is one compare-and-swap. A
+ * client only ACKs whole windows (RFC 7440), so sessions are paced a
+ * window at a time: every block sent is charged, and a new window may
+ * start while that time is at most SHAPE_BURST_MS ahead of now. Until
+ * then the session arms its timer for when it will be, like one that is
+ * waiting for staged data.
+ */
+
+// Taken by the session limit, see admit_acquire()
+static unsigned admitted;
+
+// Start another transfer if the session limit allows. Returns 1 and takes
+// a slot, or 0.
+int admit_acquire(void) {
+    unsigned n = __atomic_load_n(&admitted, __ATOMIC_RELAXED);
+    do {
+        if (tftp_cfg.max_sessions && n >= tftp_cfg.max_sessions) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&admitted, &n, n + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+void admit_release(void) {
+    __atomic_fetch_sub(&admitted, 1, __ATOMIC_RELAXED);
+}
+
+// Same client TID asking for the same transfer. Note that sock_cmp_port()
+// returns 1 when the ports are equal.
+static int same_request(SA *a, socklen_t alen, int aop, const char *afile,
+                        SA *b, socklen_t blen, int bop, const char *bfile) {
+    return alen == blen && aop == bop && sock_cmp_addr(a, b, alen) == 0 && sock_cmp_port(a, b, alen) == 1 &&
+           strcmp(afile, bfile) == 0;
+}
+
+/*
+ * Is the request in d one that the live session s of the same client TID
+ * is already serving? Either s hasn't heard from the client yet, so this
+ * is a retransmission, or it asks for the same transfer again. Anything
+ * else means the client reused its port for a new transfer.
+ */
+int admit_duplicate(const struct tftp_session *s, const struct io_dgram *d) {
+    char filename[128] = "";
+    int opcode = request_filename(d->buf, d->len, filename, sizeof(filename));
+
+    if (!s->replied || (opcode == s->opcode && strcmp(filename, s->filename) == 0)) {
+        METRIC_ADD(requests_duplicate, 1);
+        return 1;
+    }
+    return 0;
+}
+
+static void busy(int fd, SA *addr, socklen_t addrlen) {
+    METRIC_ADD(requests_refused, 1);
+    send_error_to(fd, addr, addrlen, TFTP_ERR_NOT_DEFINED, "Server busy.");
+}
+
+/* ---------------- Admission queue ---------------- */
+
+/*
+ * Queue the request in d until a session slot is free, unless the same
+ * request is already waiting. Refuses it if the queue is full.
+ */
+void admit_enqueue(struct admit_queue *q, int fd, const struct io_dgram *d) {
+    char filename[128] = "";
+    int opcode = request_filename(d->buf, d->len, filename, sizeof(filename));
+
+    for (struct admit_req *r = q->head; r; r = r->next) {
+        if (same_request((SA *)&r->d.addr, r->d.addrlen, r->opcode, r->filename,
+                         (SA *)&d->addr, d->addrlen, opcode, filename)) {
+            METRIC_ADD(requests_duplicate, 1);
+            return;
+        }
+    }
+    if (q->count >= tftp_cfg.queue_len) {
+        busy(fd, (SA *)&d->addr, d->addrlen);
+        return;
+    }
+    // One extra byte so the request can be NUL-terminated
+    struct admit_req *r = malloc(sizeof(*r) + d->len + 1);
+    if (r == NULL) {
+        busy(fd, (SA *)&d->addr, d->addrlen);
+        return;
+    }
+    r->next = NULL;
+    r->fd = fd;
+    r->arrived = now_ms();
+    r->opcode = opcode;
+    strcpy(r->filename, filename);
+    memcpy(r->data, d->buf, d->len);
+    r->d.buf = r->data;
+    r->d.size = d->len;
+    r->d.len = d->len;
+    memcpy(&r->d.addr, &d->addr, d->addrlen);
+    r->d.addrlen = d->addrlen;
+
+    if (q->tail) {
+        q->tail->next = r;
+    } else {
+        q->head = r;
+    }
+    q->tail = r;
+    q->count++;
+    METRIC_ADD(requests_queued, 1);
+    vlog(VERBOSE_TRANSFER, "All %u session slots busy, %u requests queued\n", tftp_cfg.max_sessions, q->count);
+}
+
+static struct admit_req *queue_pop(struct admit_queue *q) {
+    struct admit_req *r = q->head;
+    q->head = r->next;
+    if (q->head == NULL) {
+        q->tail = NULL;
+    }
+    q->count--;
+    return r;
+}
+
+/*
+ * Take the oldest queued request if a session slot is free, after
+ * refusing the ones that have waited longer than ADMIT_WAIT_MS. The
+ * caller owns the slot and must free() the request.
+ */
+struct admit_req *admit_dequeue(struct admit_queue *q) {
+    long now = now_ms();
+
+    while (q->head && now - q->head->arrived > ADMIT_WAIT_MS) {
+        struct admit_req *r = queue_pop(q);
+        busy(r->fd, (SA *)&r->d.addr, r->d.addrlen);
+        free(r);
+    }
+    if (q->head == NULL || !admit_acquire()) {
+        return NULL;
+    }
+    return queue_pop(q);
+}
+
+/* ---------------- Fork mode: requests being served ---------------- */
+
+struct admit_entry {
+    struct admit_entry *req_next;       // by_req hash chain
+    struct admit_entry *pid_next;       // by_pid hash chain
+    pid_t pid;
+    int opcode;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char filename[128];
+};
+
+static unsigned req_hash(SA *addr, socklen_t addrlen, int opcode, const char *filename) {
+    unsigned h = (2166136261u ^ (unsigned)sock_get_port(addr, addrlen)) * 16777619u;
+    h = (h ^ (unsigned)opcode) * 16777619u;
+    for (const char *p = filename; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return h % ADMIT_BUCKETS;
+}
+
+// Is a live child already serving this request?
+int admit_busy(struct admit_table *t, SA *addr, socklen_t addrlen, int opcode, const char *filename) {
+    for (struct admit_entry *e = t->by_req[req_hash(addr, addrlen, opcode, filename)]; e; e = e->req_next) {
+        if (same_request((SA *)&e->addr, e->addrlen, e->opcode, e->filename, addr, addrlen, opcode, filename)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Remember that child pid is serving the request, until admit_untrack()
+void admit_track(struct admit_table *t, SA *addr, socklen_t addrlen, int opcode, const char *filename, pid_t pid) {
+    struct admit_entry *e = Malloc(sizeof(*e));
+    e->pid = pid;
+    e->opcode = opcode;
+    memcpy(&e->addr, addr, addrlen);
+    e->addrlen = addrlen;
+    snprintf(e->filename, sizeof(e->filename), "%s", filename);
+
+    unsigned h = req_hash(addr, addrlen, opcode, filename);
+    e->req_next = t->by_req[h];
+    t->by_req[h] = e;
+    e->pid_next = t->by_pid[pid % ADMIT_BUCKETS];
+    t->by_pid[pid % ADMIT_BUCKETS] = e;
+}
+
+// Child pid has been reaped
+void admit_untrack(struct admit_table *t, pid_t pid) {
+    struct admit_entry **pp = &t->by_pid[pid % ADMIT_BUCKETS];
+    while (*pp && (*pp)->pid != pid) {
+        pp = &(*pp)->pid_next;
+    }
+    struct admit_entry *e = *pp;
+    if (e == NULL) {
+        return; // Not a transfer child
+    }
+    *pp = e->pid_next;
+
+    pp = &t->by_req[req_hash((SA *)&e->addr, e->addrlen, e->opcode, e->filename)];
+    while (*pp != e) {
+        pp = &(*pp)->req_next;
+    }
+    *pp = e->req_next;
+    free(e);
+}
+
+/* ---------------- Token buckets ---------------- */
+
+#define SHAPE_SLOTS 4096                // Buckets in the shared table
+#define SHAPE_PROBE 16                  // Slots searched from a key's home slot
+#define SHAPE_BURST_MS 50               // How far ahead of its rate a bucket may send
+#define SHAPE_SUBNET_MASK 0xffffff00u   // IPv4 /24
+#define SHAPE_SUBNET6_BYTES 8           // IPv6 /64
+
+struct shape_bucket {
+    uint64_t key;                       // Address or subnet, 0 = never used
+    uint64_t tat;                       // GCRA theoretical arrival time, ns
+    unsigned users;                     // Sessions attached
+};
+
+static struct shape_table {
+    char lock;                          // Spinlock for attaching and detaching
+    struct shape_bucket slots[SHAPE_SLOTS];
+} *shapes;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Map the bucket table, before any fork(), if -R or -N was given
+void shape_init(void) {
+    if (!tftp_cfg.client_rate && !tftp_cfg.subnet_rate) {
+        return;
+    }
+    void *p = mmap(NULL, sizeof(*shapes), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        err_sys("mmap error");
+    }
+    shapes = p;
+}
+
+// The bucket key for a client address, or for its subnet; never 0. An
+// IPv4 address is the key itself, v4-mapped ones included; an IPv6 one
+// is hashed, with the top bit set so it can't meet an IPv4 key.
+static uint64_t shape_key(const struct sockaddr_storage *ss, int subnet) {
+    uint32_t a;
+
+    if (ss->ss_family == AF_INET6) {
+        const struct in6_addr *in6 = &((const struct sockaddr_in6 *)ss)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(in6)) {
+            memcpy(&a, &in6->s6_addr[12], sizeof(a));
+            a = ntohl(a);
+        } else {
+            uint64_t h = 14695981039346656037ull;
+            for (int i = 0; i < (subnet ? SHAPE_SUBNET6_BYTES : 16); i++) {
+                h = (h ^ in6->s6_addr[i]) * 1099511628211ull;
+            }
+            return h << 2 | 1ull << 63 | (subnet ? 2 : 1);
+        }
+    } else {
+        a = ntohl(((const struct sockaddr_in *)ss)->sin_addr.s_addr);
+    }
+    if (subnet) {
+        a &= SHAPE_SUBNET_MASK;
+    }
+    return (uint64_t)a << 2 | (subnet ? 2 : 1);
+}
+
+static void shape_lock(void) {
+    while (__atomic_test_and_set(&shapes->lock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void shape_unlock(void) {
+    __atomic_clear(&shapes->lock, __ATOMIC_RELEASE);
+}
+
+// Find the bucket for key, or set one up, and attach to it
+static struct shape_bucket *bucket_get(uint64_t key) {
+    unsigned home = (key * 0x9e3779b97f4a7c15ull) >> 52;  // Top 12 bits: SHAPE_SLOTS
+    struct shape_bucket *idle = NULL;
+
+    shape_lock();
+    for (int i = 0; i < SHAPE_PROBE; i++) {
+        struct shape_bucket *b = &shapes->slots[(home + i) % SHAPE_SLOTS];
+        if (b->key == key) {
+            idle = b;
+            break;
+        }
+        if (idle == NULL && b->users == 0) {
+            idle = b;
+        }
+    }
+    if (idle == NULL) {
+        // Every slot nearby is in use: share one, which only makes the
+        // limit stricter for both keys
+        idle = &shapes->slots[home];
+    } else if (idle->key != key) {
+        idle->key = key;
+        idle->tat = 0;
+    }
+    idle->users++;
+    shape_unlock();
+    return idle;
+}
+
+// Give an RRQ the buckets of its client and subnet
+void shape_attach(struct tftp_session *s) {
+    if (shapes == NULL || s->opcode != TFTP_RRQ) {
+        return;
+    }
+    if (tftp_cfg.client_rate) {
+        s->shape[0] = bucket_get(shape_key(&s->cliaddr, 0));
+    }
+    if (tftp_cfg.subnet_rate) {
+        s->shape[1] = bucket_get(shape_key(&s->cliaddr, 1));
+    }
+}
+
+void shape_detach(struct tftp_session *s) {
+    if (shapes == NULL || (s->shape[0] == NULL && s->shape[1] == NULL)) {
+        return;
+    }
+    shape_lock();
+    for (int i = 0; i < 2; i++) {
+        if (s->shape[i]) {
+            s->shape[i]->users--;
+            s->shape[i] = NULL;
+        }
+    }
+    shape_unlock();
+}
+
+// How many ms until the session's buckets let it send, 0 if they do now
+long shape_delay(struct tftp_session *s) {
+    const uint64_t burst = SHAPE_BURST_MS * 1000000ull;
+    uint64_t now = now_ns();
+    uint64_t late = 0;
+
+    for (int i = 0; i < 2; i++) {
+        if (s->shape[i]) {
+            uint64_t tat = __atomic_load_n(&s->shape[i]->tat, __ATOMIC_RELAXED);
+            if (tat > now + burst && tat - now - burst > late) {
+                late = tat - now - burst;
+            }
+        }
+    }
+    return (long)((late + 999999) / 1000000);
+}
+
+// Take bytes that were sent from the session's buckets. They may go into
+// debt, which shape_delay() then makes the next window wait out.
+void shape_charge(struct tftp_session *s, size_t bytes) {
+    const unsigned long rate[2] = { tftp_cfg.client_rate, tftp_cfg.subnet_rate };
+    uint64_t now = now_ns();
+
+    for (int i = 0; i < 2; i++) {
+        if (s->shape[i]) {
+            uint64_t cost = bytes * 1000000000ull / rate[i];
+            uint64_t tat = __atomic_load_n(&s->shape[i]->tat, __ATOMIC_RELAXED);
+            uint64_t next;
+            do {
+                next = (tat > now ? tat : now) + cost;
+            } while (!__atomic_compare_exchange_n(&s->shape[i]->tat, &tat, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        }
+    }
+}
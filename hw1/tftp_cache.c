@@ -0,0 +1,275 @@
+#include "tftp.h"
+
+/*
+ * Read-only file cache shared by every RRQ session in the process. When
+ * hundreds of clients boot from the same image at once, the file is read
+ * from disk once and each session sends DATA straight out of the cached
+ * copy (see rrq_send_window()).
+ *
+ * Entries are keyed by path and validated against the file's inode,
+ * size and mtime on every lookup, so a file replaced or rewritten on
+ * disk is loaded again. The contents are preloaded into memory rather
+ * than mapped, which keeps the memory budget exact and means a file
+ * truncated underneath a transfer can't fault the server.
+ *
+ * Referenced entries are never evicted; when the least recently used
+ * unreferenced entries can't make room, the file is served uncached.
+ * In fork mode the parent fills the cache before forking, so children
+ * share the loaded pages copy-on-write. Reuseport worker threads share
+ * one cache under cache_lock; lookups happen once per request, not per
+ * packet, so a plain mutex is enough. The lock is not held while a file
+ * is read in: the entry goes in the table marked loading, and sessions
+ * that want the same file wait on cache_loaded instead of reading it too.
+ */
+
+#define CACHE_BUCKETS 64
+
+struct cache_entry {
+    char path[128];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *data;
+    unsigned refs;                      // Sessions currently sending from data
+    int loading;                        // data is being read in, without cache_lock
+    int stale;                          // Dropped from the table, free on last put
+    struct cache_entry *hnext;          // Hash chain
+    struct cache_entry *prev, *next;    // LRU list, most recently used first
+};
+
+struct cache_stats cache_stats;
+
+static struct cache_entry *table[CACHE_BUCKETS];
+static struct cache_entry *lru_head, *lru_tail;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_loaded = PTHREAD_COND_INITIALIZER;  // Some entry stopped loading
+
+static unsigned path_hash(const char *path) {
+    unsigned h = 2166136261u;
+    while (*path) {
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    }
+    return h % CACHE_BUCKETS;
+}
+
+static void lru_unlink(struct cache_entry *e) {
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        lru_head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        lru_tail = e->prev;
+    }
+}
+
+static void lru_push(struct cache_entry *e) {
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head) {
+        lru_head->prev = e;
+    } else {
+        lru_tail = e;
+    }
+    lru_head = e;
+}
+
+static void entry_free(struct cache_entry *e) {
+    free(e->data);
+    free(e);
+}
+
+// Take e out of the table. Its memory goes once no session uses it.
+static void cache_drop(struct cache_entry *e) {
+    struct cache_entry **pp = &table[path_hash(e->path)];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    lru_unlink(e);
+
+    cache_stats.bytes -= e->size;
+    cache_stats.entries--;
+    if (e->refs == 0) {
+        entry_free(e);
+    } else {
+        e->stale = 1;
+    }
+}
+
+// Evict unreferenced entries, least recently used first, until size more
+// bytes fit in the budget. Returns -1 if they can't.
+static int make_room(off_t size) {
+    struct cache_entry *e = lru_tail;
+    while (cache_stats.bytes + size > tftp_cfg.cache_budget && e != NULL) {
+        struct cache_entry *prev = e->prev;
+        if (e->refs == 0) {
+            vlog(VERBOSE_TRANSFER, "Cache: evicting '%s'\n", e->path);
+            cache_drop(e);
+            cache_stats.evictions++;
+        }
+        e = prev;
+    }
+    return cache_stats.bytes + size > tftp_cfg.cache_budget ? -1 : 0;
+}
+
+static int read_file(int fd, char *buf, off_t size) {
+    off_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, buf + done, size - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1; // Error, or the file shrank while we read it
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int same_file(const struct cache_entry *e, const struct stat *st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void log_lookup(const char *what, const char *path) {
+    vlog(VERBOSE_TRANSFER, "Cache %s for '%s' (hits %lu, misses %lu, evictions %lu, %zu bytes in %u files)\n",
+           what, path, cache_stats.hits, cache_stats.misses, cache_stats.evictions,
+           cache_stats.bytes, cache_stats.entries);
+}
+
+// Called with cache_lock held, which it drops while reading the file in;
+// st is path's stat() from before the lock was taken
+static struct cache_entry *lookup(const char *path, struct stat *st) {
+    struct cache_entry *e;
+
+    if (strlen(path) >= sizeof(e->path)) {
+        return NULL;
+    }
+
+    unsigned h = path_hash(path);
+    for (e = table[h]; e; e = e->hnext) {
+        if (strcmp(e->path, path) == 0) {
+            break;
+        }
+    }
+    if (e != NULL && e->loading) {
+        // Another session is reading it in: wait for that, not the disk
+        e->refs++;
+        while (e->loading) {
+            Pthread_cond_wait(&cache_loaded, &cache_lock);
+        }
+        if (--e->refs == 0 && e->stale) {
+            entry_free(e); // The load failed
+            return NULL;
+        }
+        if (e->stale) {
+            return NULL;
+        }
+    }
+    if (e != NULL) {
+        if (same_file(e, st)) {
+            cache_stats.hits++;
+            lru_unlink(e);
+            lru_push(e);
+            e->refs++;
+            log_lookup("hit", path);
+            return e;
+        }
+        // Changed on disk since we loaded it
+        cache_drop(e);
+    }
+
+    cache_stats.misses++;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    // Size the entry from the file we actually opened, and hold its
+    // place in the budget while it loads
+    if (fstat(fd, st) < 0 || (size_t)st->st_size > tftp_cfg.cache_budget || make_room(st->st_size) < 0) {
+        close(fd);
+        log_lookup("miss (not cached)", path);
+        return NULL;
+    }
+    e = calloc(1, sizeof(*e));
+    if (e == NULL) {
+        close(fd);
+        return NULL;
+    }
+    strcpy(e->path, path);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->refs = 1;
+    e->loading = 1;
+    e->hnext = table[h];
+    table[h] = e;
+    lru_push(e);
+    cache_stats.bytes += e->size;
+    cache_stats.entries++;
+
+    Pthread_mutex_unlock(&cache_lock);
+    char *data = malloc(e->size);
+    int ok = data != NULL && read_file(fd, data, e->size) == 0;
+    close(fd);
+    Pthread_mutex_lock(&cache_lock);
+
+    e->data = data;
+    e->loading = 0;
+    Pthread_cond_broadcast(&cache_loaded);
+    if (!ok) {
+        // Waiters see it stale and read the file themselves
+        cache_drop(e);
+        if (--e->refs == 0) {
+            entry_free(e);
+        }
+        return NULL;
+    }
+    cache_stats.bytes_loaded += e->size;
+    log_lookup("miss", path);
+    return e;
+}
+
+/*
+ * Return a referenced cache entry holding the current contents of path,
+ * loading it on a miss, or NULL if the caller should read the file
+ * itself: the cache is disabled, path is not a non-empty regular file,
+ * it doesn't fit in the budget, or loading it failed. Every non-NULL
+ * result must be released with cache_put().
+ */
+struct cache_entry *cache_get(const char *path) {
+    struct stat st;
+
+    if (tftp_cfg.cache_budget == 0) {
+        return NULL;
+    }
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return NULL;
+    }
+    Pthread_mutex_lock(&cache_lock);
+    struct cache_entry *e = lookup(path, &st);
+    Pthread_mutex_unlock(&cache_lock);
+    return e;
+}
+
+void cache_put(struct cache_entry *e) {
+    Pthread_mutex_lock(&cache_lock);
+    if (--e->refs == 0 && e->stale) {
+        entry_free(e);
+    }
+    Pthread_mutex_unlock(&cache_lock);
+}
+
+const char *cache_data(const struct cache_entry *e) {
+    return e->data;
+}
+
+off_t cache_size(const struct cache_entry *e) {
+    return e->size;
+}
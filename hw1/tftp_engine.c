@@ -0,0 +1,387 @@
+#include "tftp.h"
+#include <sys/epoll.h>
+
+/*
+ * Single-process transfer engine. Every session's socket and the listen
+ * sockets are registered with one epoll instance; a listen socket is
+ * tagged with its slot in listeners[], session sockets with their session.
+ * Retransmission deadlines sit on a timer wheel whose timerfd is in the
+ * epoll set too (tagged with the wheel), so only sessions whose timer
+ * expired are looked at. With -T scan every session's deadline is
+ * checked after every wakeup instead, and the epoll timeout is set to
+ * the nearest one. Requests beyond the session limit (-S) wait in an
+ * admission queue that is drained after every wakeup.
+ */
+
+#define MAX_EVENTS 64
+
+static struct session_table table;
+static struct timer_wheel wheel;
+static struct admit_queue queue;
+static unsigned char *ports_in_use;                  // Indexed by port - start_port
+static int epfd;
+static int listeners[TFTP_MAX_LISTEN];               // One per -l address
+static int nlisteners;
+
+// Events returned by the current epoll_wait() that have not been handled
+// yet. A session removed while handling one event may still appear later
+// in the batch, so session_remove() points those entries at retired.
+static struct epoll_event events[MAX_EVENTS];
+static int next_event, nevents;
+static char retired;
+static char notified;                                // Tag of the write-behind eventfd
+
+static unsigned tid_hash(const struct sockaddr_storage *ss) {
+    const unsigned char *p;
+    size_t len;
+    unsigned h;
+
+    if (ss->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+        p = (const unsigned char *)&sin6->sin6_addr;
+        len = sizeof(sin6->sin6_addr);
+        h = (2166136261u ^ sin6->sin6_port) * 16777619u;
+    } else {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+        p = (const unsigned char *)&sin->sin_addr;
+        len = sizeof(sin->sin_addr);
+        h = (2166136261u ^ sin->sin_port) * 16777619u;
+    }
+
+    while (len--) {
+        h = (h ^ *p++) * 16777619u;
+    }
+    return h % SESSION_BUCKETS;
+}
+
+/*
+ * Session table keyed by client TID, shared with the reuseport workers
+ * (each of which owns its own table).
+ */
+struct tftp_session *table_lookup(struct session_table *t, SA *cliaddr, socklen_t clilen) {
+    struct tftp_session *s;
+    for (s = t->buckets[tid_hash((struct sockaddr_storage *)cliaddr)]; s; s = s->hnext) {
+        // Note that sock_cmp_port() returns 1 when the ports are equal
+        if (s->clilen == clilen &&
+            sock_cmp_addr((SA *)&s->cliaddr, cliaddr, clilen) == 0 &&
+            sock_cmp_port((SA *)&s->cliaddr, cliaddr, clilen) == 1) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+void table_insert(struct session_table *t, struct tftp_session *s) {
+    unsigned h = tid_hash(&s->cliaddr);
+    s->hnext = t->buckets[h];
+    t->buckets[h] = s;
+
+    s->prev_live = NULL;
+    s->next_live = t->live;
+    if (t->live) {
+        t->live->prev_live = s;
+    }
+    t->live = s;
+}
+
+void table_remove(struct session_table *t, struct tftp_session *s) {
+    struct tftp_session **pp = &t->buckets[tid_hash(&s->cliaddr)];
+    while (*pp != s) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = s->hnext;
+
+    if (s->prev_live) {
+        s->prev_live->next_live = s->next_live;
+    } else {
+        t->live = s->next_live;
+    }
+    if (s->next_live) {
+        s->next_live->prev_live = s->prev_live;
+    }
+}
+
+static void session_remove(struct tftp_session *s, int start_port) {
+    table_remove(&table, s);
+
+    for (int i = next_event; i < nevents; i++) {
+        if (events[i].data.ptr == s) {
+            events[i].data.ptr = &retired;
+        }
+    }
+
+    ports_in_use[s->port - start_port] = 0;
+    // Closing the socket also drops it from the epoll set
+    session_close(s);
+    admit_release();
+}
+
+// Find a port in the range that no live session is bound to. Unlike the
+// fork mode's round-robin counter, this never hands out a port that is
+// still in use when the range wraps.
+static int port_alloc(int start_port, int end_port, int *next_port) {
+    int span = end_port - start_port;
+    for (int i = 0; i < span; i++) {
+        int port = *next_port;
+        if (++*next_port > end_port) {
+            *next_port = start_port + 1;
+        }
+        if (!ports_in_use[port - start_port]) {
+            ports_in_use[port - start_port] = 1;
+            return port;
+        }
+    }
+    return -1;
+}
+
+// Start a session for the request in d, which has a session slot.
+// Returns 0 if it could not be started.
+static int start_request(int listenfd, struct io_dgram *d, int start_port, int end_port, int *next_port) {
+    char *mesg = d->buf;
+    ssize_t n = d->len;
+    struct sockaddr_storage cliaddr;
+    socklen_t clilen = d->addrlen;
+
+    memcpy(&cliaddr, &d->addr, clilen);
+    mesg[n] = '\0';
+
+    struct tftp_session *old = table_lookup(&table, (SA *)&cliaddr, clilen);
+    if (old != NULL) {
+        // The client reused its port for a new transfer before we saw the
+        // final ACK of the previous one, so that transfer is over.
+        session_remove(old, start_port);
+    }
+
+    int port = port_alloc(start_port, end_port, next_port);
+    if (port < 0) {
+        fprintf(stderr, "Warning: Port range exhausted.\n");
+        send_error_to(listenfd, (SA *)&cliaddr, clilen, TFTP_ERR_NOT_DEFINED, "Server busy.");
+        return 0;
+    }
+
+    // Create a new socket for the transfer
+    int data_sockfd = data_socket((SA *)&cliaddr, clilen, port);
+    if (data_sockfd < 0) {
+        err_ret("cannot set up data socket on port %d", port);
+        ports_in_use[port - start_port] = 0;
+        return 0;
+    }
+
+    struct tftp_session *s = session_open(data_sockfd, port, (SA *)&cliaddr, clilen, mesg, n, 1);
+    if (s == NULL) {
+        close(data_sockfd);
+        ports_in_use[port - start_port] = 0;
+        return 0;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, data_sockfd, &ev) < 0) {
+        err_ret("epoll_ctl error");
+        session_close(s);
+        ports_in_use[port - start_port] = 0;
+        return 0;
+    }
+    table_insert(&table, s);
+    if (tftp_cfg.timer_wheel) {
+        session_set_wheel(s, &wheel);
+    }
+    return 1;
+}
+
+// A request arrived on a listen socket: start it, or queue it if every
+// session slot is taken.
+static void accept_request(int listenfd, struct io_dgram *d, int start_port, int end_port, int *next_port) {
+    struct tftp_session *old = table_lookup(&table, (SA *)&d->addr, d->addrlen);
+    if (old != NULL && admit_duplicate(old, d)) {
+        return;
+    }
+    if (queue.count || !admit_acquire()) {
+        admit_enqueue(&queue, listenfd, d); // Behind the ones already waiting
+        return;
+    }
+    if (!start_request(listenfd, d, start_port, end_port, next_port)) {
+        admit_release();
+    }
+}
+
+// Start queued requests for as long as there are free session slots.
+static void admit_queued(int start_port, int end_port, int *next_port) {
+    struct admit_req *r;
+
+    while ((r = admit_dequeue(&queue)) != NULL) {
+        if (!start_request(r->fd, &r->d, start_port, end_port, next_port)) {
+            admit_release();
+        }
+        free(r);
+    }
+}
+
+// The wheel's timerfd fired: run the sessions whose deadline has passed.
+static void fire_timers(int start_port) {
+    struct timer *t;
+
+    wheel_ack(&wheel);
+    long now = now_ms();
+    while ((t = wheel_expired(&wheel, now)) != NULL) {
+        struct tftp_session *s = t->data;
+        if (session_timeout(s) == SESSION_DONE) {
+            session_remove(s, start_port);
+        }
+    }
+}
+
+// Stop or restart polling s's socket while its upload waits for the writer.
+static void session_watch(struct tftp_session *s, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = s };
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev) < 0) {
+        err_ret("epoll_ctl error");
+    }
+}
+
+// The write-behind thread signalled: let uploads waiting for it go on.
+static void resume_sessions(int start_port) {
+    struct tftp_session *s = table.live;
+
+    wb_notify_ack();
+    while (s) {
+        struct tftp_session *nexts = s->next_live;
+        int paused = s->wb_wait == WB_WAIT_ROOM;
+        if (session_resume(s) == SESSION_DONE) {
+            session_remove(s, start_port);
+        } else if (paused && !s->wb_wait) {
+            session_watch(s, EPOLLIN);
+        }
+        s = nexts;
+    }
+}
+
+// -T scan: fire every expired retransmission timer and return the number
+// of ms until the next one, or -1 if there are no sessions.
+static int run_timers(int start_port) {
+    long now = now_ms();
+    long next = -1;
+    struct tftp_session *s = table.live;
+
+    while (s) {
+        struct tftp_session *nexts = s->next_live;
+        if (s->deadline <= now && session_timeout(s) == SESSION_DONE) {
+            session_remove(s, start_port);
+        } else if (next < 0 || s->deadline - now < next) {
+            next = s->deadline - now;
+        }
+        s = nexts;
+    }
+    return next < 0 ? -1 : (int)(next > 0 ? next : 0);
+}
+
+void engine_run(const int *listenfds, int nlisten, int start_port, int end_port) {
+    // One extra byte so a request can be NUL-terminated
+    static char recv_buffer[TFTP_MAX_BATCH][MAX_PACKET_SIZE + 1];
+    static struct io_dgram rx[TFTP_MAX_BATCH];
+    int next_port = start_port + 1;
+
+    for (int i = 0; i < TFTP_MAX_BATCH; i++) {
+        rx[i].buf = recv_buffer[i];
+        rx[i].size = MAX_PACKET_SIZE;
+    }
+
+    ports_in_use = Calloc(end_port - start_port + 1, 1);
+
+    if ((epfd = epoll_create1(0)) < 0) {
+        err_sys("epoll_create1 error");
+    }
+    struct epoll_event ev = { .events = EPOLLIN };
+    for (nlisteners = 0; nlisteners < nlisten; nlisteners++) {
+        listeners[nlisteners] = listenfds[nlisteners];
+        ev.data.ptr = &listeners[nlisteners];
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, listeners[nlisteners], &ev) < 0) {
+            err_sys("epoll_ctl error");
+        }
+    }
+    if (tftp_cfg.timer_wheel) {
+        wheel_init(&wheel);
+        ev.data.ptr = &wheel;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, wheel.fd, &ev) < 0) {
+            err_sys("epoll_ctl error");
+        }
+    }
+    if (tftp_cfg.write_mode != WRITE_SYNC) {
+        ev.data.ptr = &notified;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, wb_notify_fd(), &ev) < 0) {
+            err_sys("epoll_ctl error");
+        }
+    }
+
+    printf("Waiting for requests (epoll mode)...\n");
+    for (;;) {
+        if (stats_requested) {
+            print_stats();
+        }
+        admit_queued(start_port, end_port, &next_port);
+        int timeout = -1;
+        if (tftp_cfg.timer_wheel) {
+            wheel_arm(&wheel);
+        } else {
+            timeout = run_timers(start_port);
+        }
+        if (queue.count && (timeout < 0 || timeout > ADMIT_RETRY_MS)) {
+            timeout = ADMIT_RETRY_MS; // Refuse requests that have waited too long
+        }
+        nevents = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (nevents < 0) {
+            nevents = 0;
+            if (errno == EINTR) {
+                continue;
+            }
+            err_sys("epoll_wait error");
+        }
+
+        for (next_event = 0; next_event < nevents; ) {
+            struct tftp_session *s = events[next_event++].data.ptr;
+            if (s == (void *)&retired) {
+                continue;
+            }
+            if (s == (void *)&wheel) {
+                fire_timers(start_port);
+                continue;
+            }
+            if (s == (void *)&notified) {
+                resume_sessions(start_port);
+                continue;
+            }
+            if ((int *)s >= listeners && (int *)s < listeners + nlisteners) {
+                int listenfd = *(int *)s;
+                int n = io_recv(listenfd, rx, TFTP_MAX_BATCH, MSG_DONTWAIT);
+                if (n < 0 && errno != EINTR && errno != EAGAIN) {
+                    err_ret("recvfrom error");
+                }
+                for (int i = 0; i < n; i++) {
+                    accept_request(listenfd, &rx[i], start_port, end_port, &next_port);
+                }
+                continue;
+            }
+
+            // Only read what the session can take; a full upload ring
+            // leaves the rest queued on the socket
+            int room = session_room(s);
+            if (room == 0) {
+                session_watch(s, 0);
+                continue;
+            }
+            int n = io_recv(s->fd, rx, room, MSG_DONTWAIT);
+            if (n < 0) {
+                // e.g. ECONNREFUSED: the client has gone away
+                if (errno != EINTR && errno != EAGAIN) {
+                    session_remove(s, start_port);
+                }
+                continue;
+            }
+            for (int i = 0; i < n; i++) {
+                if (session_input(s, rx[i].buf, rx[i].len) == SESSION_DONE) {
+                    session_remove(s, start_port);
+                    break;
+                }
+            }
+        }
+    }
+}
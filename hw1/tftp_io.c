@@ -0,0 +1,228 @@
+#define _GNU_SOURCE // recvmmsg(), sendmmsg()
+#include "tftp.h"
+
+/*
+ * Datagram I/O for the listen and session sockets. With -b N the server
+ * drains up to N queued datagrams per recvmmsg() and sends a window of
+ * DATA packets with one sendmmsg(); with -b 1 every datagram costs one
+ * recvfrom()/send(), as before. io_stats counts the socket syscalls made
+ * either way so the two can be compared.
+ */
+
+struct io_stats io_stats;
+
+// DATA packets queued by io_queue() for the next io_flush(), per thread
+static __thread struct mmsghdr out_msgs[TFTP_MAX_BATCH];
+static __thread struct iovec out_iov[TFTP_MAX_BATCH][2];
+static __thread char out_hdr[TFTP_MAX_BATCH][4];
+static __thread struct sockaddr_storage out_to[TFTP_MAX_BATCH];
+static __thread unsigned out_count;
+static __thread int out_fd = -1;
+
+// Worker threads share the counters
+#define STAT_ADD(field, n) __atomic_fetch_add(&io_stats.field, (n), __ATOMIC_RELAXED)
+
+/*
+ * Receive up to max datagrams from fd into d[0..max-1], whose buf and
+ * size must be set by the caller. Blocks for the first one unless flags
+ * has MSG_DONTWAIT, then takes whatever else is already queued. Returns
+ * the number received, or -1 with errno set.
+ */
+int io_recv(int fd, struct io_dgram *d, int max, int flags) {
+    if (max > tftp_cfg.batch) {
+        max = tftp_cfg.batch;
+    }
+
+    if (max <= 1) {
+        d[0].addrlen = sizeof(d[0].addr);
+        d[0].len = recvfrom(fd, d[0].buf, d[0].size, flags, (SA *)&d[0].addr, &d[0].addrlen);
+        STAT_ADD(syscalls, 1);
+        if (d[0].len < 0) {
+            return -1;
+        }
+        STAT_ADD(dgrams_in, 1);
+        return 1;
+    }
+
+    struct mmsghdr msgs[TFTP_MAX_BATCH];
+    struct iovec iov[TFTP_MAX_BATCH];
+    memset(msgs, 0, max * sizeof(msgs[0]));
+    for (int i = 0; i < max; i++) {
+        iov[i].iov_base = d[i].buf;
+        iov[i].iov_len = d[i].size;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &d[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(d[i].addr);
+    }
+
+    int n = recvmmsg(fd, msgs, max, flags | MSG_WAITFORONE, NULL);
+    STAT_ADD(syscalls, 1);
+    if (n < 0) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        d[i].len = msgs[i].msg_len;
+        d[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+    }
+    STAT_ADD(dgrams_in, n);
+    return n;
+}
+
+// Send one datagram. to is NULL on a connected socket.
+void io_send(int fd, const void *buf, size_t len, SA *to, socklen_t tolen) {
+    sendto(fd, buf, len, 0, to, to ? tolen : 0);
+    STAT_ADD(syscalls, 1);
+    STAT_ADD(dgrams_out, 1);
+}
+
+// Send a 4-byte header and len bytes of payload as one datagram.
+void io_sendv(int fd, SA *to, socklen_t tolen, const char *hdr, const char *data, size_t len) {
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    iov[0].iov_base = (void *)hdr;
+    iov[0].iov_len = 4;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = to;
+    msg.msg_namelen = to ? tolen : 0;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len ? 2 : 1;
+    sendmsg(fd, &msg, 0);
+    STAT_ADD(syscalls, 1);
+    STAT_ADD(dgrams_out, 1);
+}
+
+/*
+ * Queue a header + payload datagram for fd, to go out with the next
+ * io_flush(). The header and address are copied; the payload must stay
+ * valid until the flush. Without batching it is sent right away.
+ */
+void io_queue(int fd, SA *to, socklen_t tolen, const char *hdr, const char *data, size_t len) {
+    if (tftp_cfg.batch <= 1) {
+        io_sendv(fd, to, tolen, hdr, data, len);
+        return;
+    }
+    if (out_count > 0 && (fd != out_fd || out_count == (unsigned)tftp_cfg.batch)) {
+        io_flush();
+    }
+
+    unsigned i = out_count++;
+    out_fd = fd;
+    memcpy(out_hdr[i], hdr, 4);
+    out_iov[i][0].iov_base = out_hdr[i];
+    out_iov[i][0].iov_len = 4;
+    out_iov[i][1].iov_base = (void *)data;
+    out_iov[i][1].iov_len = len;
+    memset(&out_msgs[i], 0, sizeof(out_msgs[i]));
+    if (to) {
+        memcpy(&out_to[i], to, tolen);
+        out_msgs[i].msg_hdr.msg_name = &out_to[i];
+        out_msgs[i].msg_hdr.msg_namelen = tolen;
+    }
+    out_msgs[i].msg_hdr.msg_iov = out_iov[i];
+    out_msgs[i].msg_hdr.msg_iovlen = len ? 2 : 1;
+}
+
+// Send everything io_queue() has collected.
+void io_flush(void) {
+    unsigned sent = 0;
+    while (sent < out_count) {
+        int n = sendmmsg(out_fd, out_msgs + sent, out_count - sent, 0);
+        STAT_ADD(syscalls, 1);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break; // Dropped like a failed send(); the retransmit timer recovers
+        }
+        sent += n;
+    }
+    STAT_ADD(dgrams_out, sent);
+    out_count = 0;
+}
+
+/*
+ * Bind a UDP socket to port on host, like udp_server() in lib/: every
+ * address getaddrinfo() returns is tried until one binds. A NULL host
+ * means a single dual-stack socket on "::", which also takes IPv4
+ * clients as v4-mapped addresses, or 0.0.0.0 if the host has no IPv6.
+ * Set v6only when another socket listens on IPv4 at the same port.
+ */
+int listen_socket(const char *host, int port, int v6only, int reuseport) {
+    const int on = 1;
+    const int families[] = { AF_INET6, AF_INET };
+    char serv[8];
+    int n, fd;
+    struct addrinfo hints, *res, *ai;
+
+    snprintf(serv, sizeof(serv), "%d", port);
+    for (int f = 0; f < 2; f++) {
+        bzero(&hints, sizeof(hints));
+        hints.ai_flags = AI_PASSIVE;
+        hints.ai_family = host ? AF_UNSPEC : families[f];
+        hints.ai_socktype = SOCK_DGRAM;
+        if ((n = getaddrinfo(host, serv, &hints, &res)) != 0) {
+            if (host) {
+                err_quit("cannot listen on %s port %d: %s", host, port, gai_strerror(n));
+            }
+            continue;
+        }
+
+        for (ai = res; ai; ai = ai->ai_next) {
+            if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+                continue;
+            }
+            if (reuseport) {
+                Setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+            }
+            if (ai->ai_family == AF_INET6) {
+                Setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+            }
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                freeaddrinfo(res);
+                return fd;
+            }
+            close(fd);
+        }
+        freeaddrinfo(res);
+        if (host) {
+            break;
+        }
+    }
+    err_sys("cannot listen on %s port %d", host ? host : "*", port);
+    return -1;
+}
+
+/*
+ * A socket for one transfer: bound to port on the wildcard address of
+ * the client's family and connected to the client. A client that came
+ * in on a dual-stack socket has a v4-mapped IPv6 address, so its socket
+ * must take IPv4 too. Returns -1 with errno set on failure.
+ */
+int data_socket(SA *cliaddr, socklen_t clilen, int port) {
+    struct sockaddr_storage servaddr;
+    int fd = socket(cliaddr->sa_family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (cliaddr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)cliaddr;
+        int v6only = !IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr);
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+    memcpy(&servaddr, cliaddr, clilen);
+    sock_set_wild((SA *)&servaddr, clilen);
+    sock_set_port((SA *)&servaddr, clilen, htons(port));
+
+    if (bind(fd, (SA *)&servaddr, clilen) < 0 || connect(fd, cliaddr, clilen) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
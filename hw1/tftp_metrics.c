@@ -0,0 +1,212 @@
+#include "tftp.h"
+#include <stdarg.h>
+#include <sys/mman.h>
+
+/*
+ * Transfer counters and histograms, served as Prometheus text over HTTP
+ * on 127.0.0.1 (-M port). Every update is a relaxed atomic add, so
+ * sessions never take a lock to count. The counters live in a shared
+ * anonymous mapping made before the first fork(), so in fork mode the
+ * children update the same memory that the parent's endpoint reads.
+ * The debug level lives there too, so SIGUSR2 in the parent also
+ * reaches transfers that are already running.
+ */
+
+// Upper bounds of the histogram buckets; one more bucket catches the rest
+static const unsigned long duration_bounds[METRICS_BUCKETS] = {
+    1, 5, 10, 50, 100, 500, 1000, 5000, 10000, 60000,          // ms
+};
+static const unsigned long throughput_bounds[METRICS_BUCKETS] = {
+    10000, 100000, 1000000, 3000000, 10000000, 30000000,       // bytes/sec
+    100000000, 300000000, 1000000000, 3000000000UL,
+};
+
+// Until metrics_init() runs, count into process memory
+static struct tftp_metrics boot_metrics = { .debug_level = VERBOSE_TRANSFER };
+struct tftp_metrics *metrics = &boot_metrics;
+
+void metrics_init(void) {
+    void *p = mmap(NULL, sizeof(*metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        err_sys("mmap error");
+    }
+    memcpy(p, &boot_metrics, sizeof(boot_metrics));
+    metrics = p;
+}
+
+static void observe(struct histogram *h, const unsigned long *bounds, unsigned long value) {
+    int i = 0;
+    while (i < METRICS_BUCKETS && value > bounds[i]) {
+        i++;
+    }
+    __atomic_fetch_add(&h->counts[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+}
+
+void metrics_session_start(struct tftp_session *s) {
+    METRIC_ADD(sessions_active, 1);
+    METRIC_ADD(sessions_total, 1);
+    if (s->opcode == TFTP_RRQ) {
+        METRIC_ADD(rrq_total, 1);
+    } else {
+        METRIC_ADD(wrq_total, 1);
+    }
+}
+
+void metrics_session_end(struct tftp_session *s) {
+    __atomic_fetch_sub(&metrics->sessions_active, 1, __ATOMIC_RELAXED);
+    if (!s->completed) {
+        METRIC_ADD(transfers_failed, 1);
+        return;
+    }
+    METRIC_ADD(transfers_completed, 1);
+
+    long ms = now_ms() - s->started;
+    observe(&metrics->duration_ms, duration_bounds, ms);
+    // Transfers that finish within a clock tick count as taking 1 ms
+    observe(&metrics->throughput, throughput_bounds, s->bytes * 1000 / (ms > 0 ? ms : 1));
+}
+
+/* ---------------- Exposition ---------------- */
+
+struct text {
+    char buf[8192];
+    size_t len;
+};
+
+static void put(struct text *t, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(t->buf + t->len, sizeof(t->buf) - t->len, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        t->len += n;
+        if (t->len >= sizeof(t->buf)) {
+            t->len = sizeof(t->buf) - 1; // Truncated; the buffer is sized for all of it
+        }
+    }
+}
+
+static unsigned long load(const unsigned long *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void put_counter(struct text *t, const char *name, const char *type, const char *help, unsigned long value) {
+    put(t, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+// Prometheus buckets are cumulative; scale converts bounds and sum to the unit
+static void put_histogram(struct text *t, const char *name, const char *help, const struct histogram *h,
+                          const unsigned long *bounds, double scale) {
+    unsigned long count = 0;
+
+    put(t, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        count += load(&h->counts[i]);
+        put(t, "%s_bucket{le=\"%g\"} %lu\n", name, bounds[i] * scale, count);
+    }
+    count += load(&h->counts[METRICS_BUCKETS]);
+    put(t, "%s_bucket{le=\"+Inf\"} %lu\n", name, count);
+    put(t, "%s_sum %g\n%s_count %lu\n", name, load(&h->sum) * scale, name, count);
+}
+
+static void render(struct text *t) {
+    struct tftp_metrics *m = metrics;
+
+    t->len = 0;
+    put_counter(t, "tftp_sessions_active", "gauge", "Transfers in progress.", load(&m->sessions_active));
+    put_counter(t, "tftp_sessions_total", "counter", "Transfers started.", load(&m->sessions_total));
+    put_counter(t, "tftp_rrq_total", "counter", "Read requests accepted.", load(&m->rrq_total));
+    put_counter(t, "tftp_wrq_total", "counter", "Write requests accepted.", load(&m->wrq_total));
+    put_counter(t, "tftp_transfers_completed_total", "counter", "Transfers that finished.", load(&m->transfers_completed));
+    put_counter(t, "tftp_transfers_failed_total", "counter", "Transfers aborted or timed out.", load(&m->transfers_failed));
+    put_counter(t, "tftp_bytes_in_total", "counter", "DATA payload bytes received.", load(&m->bytes_in));
+    put_counter(t, "tftp_bytes_out_total", "counter", "DATA payload bytes sent, including retransmissions.", load(&m->bytes_out));
+    put_counter(t, "tftp_retransmits_total", "counter", "DATA blocks and ACKs sent again.", load(&m->retransmits));
+    put_counter(t, "tftp_timeouts_total", "counter", "Retransmission timer expiries.", load(&m->timeouts));
+    put_counter(t, "tftp_errors_sent_total", "counter", "ERROR packets sent.", load(&m->errors_sent));
+    put_counter(t, "tftp_requests_duplicate_total", "counter", "Requests dropped as retransmissions of one being served.",
+                load(&m->requests_duplicate));
+    put_counter(t, "tftp_requests_queued_total", "counter", "Requests that waited for a session slot.", load(&m->requests_queued));
+    put_counter(t, "tftp_requests_refused_total", "counter", "Requests refused with Server busy.", load(&m->requests_refused));
+    put_counter(t, "tftp_socket_syscalls_total", "counter", "Socket syscalls made by this process.", load(&io_stats.syscalls));
+    put_counter(t, "tftp_cache_hits_total", "counter", "File cache hits in this process.", load(&cache_stats.hits));
+    put_counter(t, "tftp_cache_misses_total", "counter", "File cache misses in this process.", load(&cache_stats.misses));
+    put_histogram(t, "tftp_transfer_duration_seconds", "Time from request to last packet of completed transfers.",
+                  &m->duration_ms, duration_bounds, 0.001);
+    put_histogram(t, "tftp_transfer_throughput_bytes_per_second", "File bytes over duration of completed transfers.",
+                  &m->throughput, throughput_bounds, 1);
+    put_counter(t, "tftp_debug_level", "gauge", "Current verbosity (-d, toggled by SIGUSR2).", (unsigned long)m->debug_level);
+}
+
+// Answer one HTTP request on connfd. Only GET /metrics is served.
+static void serve_client(int connfd, struct text *body) {
+    char req[1024];
+    char head[256];
+    ssize_t n = read(connfd, req, sizeof(req) - 1);
+    if (n <= 0) {
+        return;
+    }
+    req[n] = '\0';
+
+    int found = strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET / ", 6) == 0;
+    if (found) {
+        render(body);
+    } else {
+        body->len = 0;
+        put(body, "Not found\n");
+    }
+    int len = snprintf(head, sizeof(head),
+                       "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                       found ? "200 OK" : "404 Not Found", body->len);
+    if (write(connfd, head, len) == len) {
+        write(connfd, body->buf, body->len);
+    }
+}
+
+static void *metrics_main(void *arg) {
+    int listenfd = (int)(intptr_t)arg;
+    static struct text body;
+
+    // Leave SIGUSR1/SIGUSR2 to the threads that poll for their flags, and
+    // SIGCHLD to the fork-mode listener it has to wake up
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    Pthread_detach(pthread_self());
+    for (;;) {
+        int connfd = accept(listenfd, NULL, NULL);
+        if (connfd < 0) {
+            continue; // The client went away before we got to it
+        }
+        serve_client(connfd, &body);
+        close(connfd);
+    }
+    return NULL;
+}
+
+/*
+ * Serve the metrics on http://127.0.0.1:port/metrics from a thread of
+ * this process.
+ */
+void metrics_serve(int port) {
+    const int on = 1;
+    struct sockaddr_in addr;
+    pthread_t tid;
+
+    int listenfd = Socket(AF_INET, SOCK_STREAM, 0);
+    Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    Bind(listenfd, (SA *)&addr, sizeof(addr));
+    Listen(listenfd, LISTENQ);
+
+    Pthread_create(&tid, NULL, metrics_main, (void *)(intptr_t)listenfd);
+    vlog(VERBOSE_TRANSFER, "Metrics on http://127.0.0.1:%d/metrics\n", port);
+}
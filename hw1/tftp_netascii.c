@@ -0,0 +1,137 @@
+#include "tftp.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Netascii (RFC 764 line ends, as TFTP uses them): on the wire a newline
+ * is CR LF and a bare carriage return is CR NUL. Files are stored with
+ * plain '\n' and '\r', so sending expands and receiving collapses.
+ *
+ * Both directions stream one DATA block at a time. An expansion can be
+ * cut in half by the end of a block, so the encoder hands back the byte
+ * it still owes the next block, and the decoder remembers a CR that was
+ * the last byte of a block. Runs of ordinary bytes between line ends are
+ * copied with memcpy(), so text with long lines costs little more than
+ * octet mode.
+ */
+
+// Offset of the first '\r' or '\n' in p[0..len), or len if there is none
+static size_t scan_eol(const char *p, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (p[i] == '\r' || p[i] == '\n') {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Fill dst with up to dstlen bytes of netascii for the file bytes in src.
+ * *pending is the second half of a line end that the previous block had
+ * no room for (LF or NUL), or -1; on return it is the same for this
+ * block. *consumed is set to how many bytes of src went into dst.
+ * Returns the bytes written, which is less than dstlen only once src is
+ * used up and nothing is pending.
+ */
+size_t netascii_encode(const char *src, size_t srclen, size_t *consumed, char *dst, size_t dstlen, int *pending) {
+    size_t in = 0, out = 0;
+
+    if (*pending >= 0 && dstlen > 0) {
+        dst[out++] = *pending;
+        *pending = -1;
+    }
+    while (out < dstlen && in < srclen) {
+        size_t room = dstlen - out;
+        size_t run = scan_eol(src + in, srclen - in < room ? srclen - in : room);
+        memcpy(dst + out, src + in, run);
+        in += run;
+        out += run;
+        if (out == dstlen || in == srclen) {
+            break;
+        }
+
+        char second = src[in++] == '\n' ? '\n' : '\0';
+        dst[out++] = '\r';
+        if (out == dstlen) {
+            *pending = second; // Opens the next block
+            break;
+        }
+        dst[out++] = second;
+    }
+    *consumed = in;
+    return out;
+}
+
+/*
+ * Collapse the netascii in src into dst, which needs room for len + 1
+ * bytes. *cr says the previous block ended with a CR, and on return
+ * whether this one did; at the end of the transfer a CR still held back
+ * is written as-is. A CR followed by anything but LF or NUL is not valid
+ * netascii; it is kept, along with the byte after it.
+ */
+size_t netascii_decode(const char *src, size_t len, char *dst, int *cr) {
+    size_t in = 0, out = 0;
+
+    if (*cr && len > 0) {
+        *cr = 0;
+        if (src[0] == '\n' || src[0] == '\0') {
+            dst[out++] = src[0] == '\n' ? '\n' : '\r';
+            in = 1;
+        } else {
+            dst[out++] = '\r';
+        }
+    }
+    while (in < len) {
+        const char *p = memchr(src + in, '\r', len - in);
+        size_t run = p ? (size_t)(p - (src + in)) : len - in;
+        memcpy(dst + out, src + in, run);
+        in += run;
+        out += run;
+        if (in == len) {
+            break;
+        }
+
+        if (in + 1 == len) {
+            *cr = 1; // Its partner is in the next block
+            in++;
+            break;
+        }
+        char next = src[in + 1];
+        if (next == '\n') {
+            dst[out++] = '\n';
+            in += 2;
+        } else if (next == '\0') {
+            dst[out++] = '\r';
+            in += 2;
+        } else {
+            dst[out++] = '\r';
+            in++;
+        }
+    }
+    return out;
+}
+
+// Size of the netascii form of len file bytes, for the tsize option
+off_t netascii_size(const char *p, size_t len) {
+    off_t size = len;
+    size_t i = 0;
+
+    while ((i += scan_eol(p + i, len - i)) < len) {
+        size++;
+        i++;
+    }
+    return size;
+}
@@ -1,430 +1,410 @@
-#include "unp.h"
-#include <arpa/inet.h>
-#include <string.h>
-
-#define TFTP_RRQ   1
-#define TFTP_WRQ   2
-#define TFTP_DATA  3
-#define TFTP_ACK   4
-#define TFTP_ERROR 5
-#define DATA_SIZE 512
-#define PACKET_BUFFER_SIZE (DATA_SIZE + 4)
-
-// TFTP Error Codes
-#define TFTP_ERR_NOT_DEFINED 0
-#define TFTP_ERR_FILE_NOT_FOUND 1
-#define TFTP_ERR_ACCESS_VIOLATION 2
-#define TFTP_ERR_DISK_FULL 3
-#define TFTP_ERR_ILLEGAL_OP 4
-#define TFTP_ERR_UNKNOWN_TID 5
-#define TFTP_ERR_FILE_EXISTS 6
-#define TFTP_ERR_NO_SUCH_USER 7
-
-static void sig_alrm(int signo);
-volatile sig_atomic_t timeout_occured = 0;
-
-#define TFTP_PORT 69 // Standard TFTP port, for reference, not for use in binding.
-
-// We will use one global variable to track the next available port.
-// This is safe because of fork(). The parent updates it, and each child
-// gets a copy-on-write page. When the child increments it, it doesn't
-// affect the parent's version. However, for this to work correctly,
-// the parent needs to manage the port number.
-// A better approach is needed. Let's pass it as an argument.
-
-void handle_request(int starting_port, int end_port, SA *pcliaddr, socklen_t clilen, char *mesg);
-void dg_tftp_listen(int sockfd, int start_port, int end_port, SA *pcliaddr, socklen_t clilen);
-void handle_rrq(int sockfd, char *request);
-void handle_wrq(int sockfd, char *request);
-void send_error(int sockfd, int error_code, const char *error_msg);
+#include "tftp.h"
+#include <poll.h>
+
+// In fork mode we use one variable to track the next available port.
+// The parent updates it, and each child gets a copy-on-write page with
+// the port it should bind. The parent also remembers which request each
+// live child is serving, so a retransmitted request doesn't get a second
+// child, and holds requests back while -S children are running.
+
+void handle_request(int port_to_use, int end_port, SA *pcliaddr, socklen_t clilen, char *mesg, ssize_t n);
+void dg_tftp_listen(int start_port, int end_port);
+static void sig_chld(int signo);
+static void sig_usr1(int signo);
+static void sig_usr2(int signo);
+
+volatile sig_atomic_t stats_requested;
+static volatile sig_atomic_t child_exited;
+static int listenfds[TFTP_MAX_LISTEN];  // One per -l address, or one dual-stack socket
+static int nlisten;
+
+struct tftp_config tftp_cfg = {
+    .max_window = TFTP_MAX_WINDOW,
+    .use_mmap = 1,
+    .cache_budget = 64 * 1024 * 1024,
+    .batch = 1,
+    .threads = 1,
+    .timer_wheel = 1,
+    .write_mode = WRITE_SYNC,
+    .fsync_policy = FSYNC_NONE,
+    .queue_len = 256,
+};
+
+enum server_mode { MODE_FORK, MODE_EPOLL, MODE_REUSEPORT };
+
+static void usage(void) {
+    err_quit("usage: tftp.out [-m fork|epoll] [-w max_window] [-r fread|mmap] [-c cache_mb] [-b batch]\n"
+             "               [-W sync|behind|direct] [-f none|chunk|close] [-d level] [-M metrics_port]\n"
+             "               [-T wheel|scan] [-z stage_dir] [-S max_sessions] [-Q queue_len]\n"
+             "               [-R client_kbps] [-N subnet_kbps] [-l address]...\n"
+             "               <start_port> <end_port>\n"
+             "       tftp.out -m reuseport [-t threads] [options] <port>");
+}
 
 int main(int argc, char **argv) {
-    int sockfd;
-    struct sockaddr_in servaddr, cliaddr;
-
-    if (argc != 3) {
-        err_quit("usage: tftp.out <start_port> <end_port>");
+    enum server_mode mode = MODE_FORK;
+    int c;
+    int metrics_port = 0;
+
+    // Line-buffered even when redirected to a file, so a log read while
+    // the server runs, or after it is killed, has every line written
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    tftp_cfg.threads = ncpu > 0 ? ncpu : 1;
+    metrics_init(); // Before any fork(), so children count into the same place
+
+    while ((c = getopt(argc, argv, "m:w:r:c:b:t:W:f:d:M:T:z:S:Q:R:N:l:")) != -1) {
+        switch (c) {
+            case 'm':
+                if (strcmp(optarg, "epoll") == 0) {
+                    mode = MODE_EPOLL;
+                } else if (strcmp(optarg, "fork") == 0) {
+                    mode = MODE_FORK;
+                } else if (strcmp(optarg, "reuseport") == 0) {
+                    mode = MODE_REUSEPORT;
+                } else {
+                    usage();
+                }
+                break;
+            case 't':
+                tftp_cfg.threads = atoi(optarg);
+                if (tftp_cfg.threads < 1) {
+                    usage();
+                }
+                break;
+            case 'w':
+                tftp_cfg.max_window = atoi(optarg);
+                if (tftp_cfg.max_window < 1 || tftp_cfg.max_window > TFTP_MAX_WINDOW) {
+                    err_quit("max_window must be between 1 and %d", TFTP_MAX_WINDOW);
+                }
+                break;
+            case 'r':
+                if (strcmp(optarg, "mmap") == 0) {
+                    tftp_cfg.use_mmap = 1;
+                } else if (strcmp(optarg, "fread") == 0) {
+                    tftp_cfg.use_mmap = 0;
+                } else {
+                    usage();
+                }
+                break;
+            case 'c':
+                if (atoi(optarg) < 0) {
+                    usage();
+                }
+                tftp_cfg.cache_budget = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 'b':
+                tftp_cfg.batch = atoi(optarg);
+                if (tftp_cfg.batch < 1 || tftp_cfg.batch > TFTP_MAX_BATCH) {
+                    err_quit("batch must be between 1 and %d", TFTP_MAX_BATCH);
+                }
+                break;
+            case 'W':
+                if (strcmp(optarg, "sync") == 0) {
+                    tftp_cfg.write_mode = WRITE_SYNC;
+                } else if (strcmp(optarg, "behind") == 0) {
+                    tftp_cfg.write_mode = WRITE_BEHIND;
+                } else if (strcmp(optarg, "direct") == 0) {
+                    tftp_cfg.write_mode = WRITE_DIRECT;
+                } else {
+                    usage();
+                }
+                break;
+            case 'f':
+                if (strcmp(optarg, "none") == 0) {
+                    tftp_cfg.fsync_policy = FSYNC_NONE;
+                } else if (strcmp(optarg, "chunk") == 0) {
+                    tftp_cfg.fsync_policy = FSYNC_CHUNK;
+                } else if (strcmp(optarg, "close") == 0) {
+                    tftp_cfg.fsync_policy = FSYNC_CLOSE;
+                } else {
+                    usage();
+                }
+                break;
+            case 'T':
+                if (strcmp(optarg, "wheel") == 0) {
+                    tftp_cfg.timer_wheel = 1;
+                } else if (strcmp(optarg, "scan") == 0) {
+                    tftp_cfg.timer_wheel = 0;
+                } else {
+                    usage();
+                }
+                break;
+            case 'z':
+                tftp_cfg.stage_dir = optarg;
+                break;
+            case 'S':
+                if (atoi(optarg) < 0) {
+                    usage();
+                }
+                tftp_cfg.max_sessions = atoi(optarg);
+                break;
+            case 'Q':
+                if (atoi(optarg) < 0) {
+                    usage();
+                }
+                tftp_cfg.queue_len = atoi(optarg);
+                break;
+            case 'R':
+                if (atol(optarg) < 0) {
+                    usage();
+                }
+                tftp_cfg.client_rate = (unsigned long)atol(optarg) * 1024;
+                break;
+            case 'N':
+                if (atol(optarg) < 0) {
+                    usage();
+                }
+                tftp_cfg.subnet_rate = (unsigned long)atol(optarg) * 1024;
+                break;
+            case 'l':
+                if (tftp_cfg.nlisten == TFTP_MAX_LISTEN) {
+                    err_quit("at most %d listen addresses", TFTP_MAX_LISTEN);
+                }
+                tftp_cfg.listen_hosts[tftp_cfg.nlisten++] = optarg;
+                break;
+            case 'd':
+                metrics->debug_level = atoi(optarg);
+                break;
+            case 'M':
+                metrics_port = atoi(optarg);
+                if (metrics_port <= 0 || metrics_port > 65535) {
+                    err_quit("invalid metrics port %d", metrics_port);
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    Signal(SIGUSR2, sig_usr2);
+    shape_init(); // Before any fork(), like the metrics
+    if (metrics_port) {
+        metrics_serve(metrics_port);
     }
 
-    int start_port = atoi(argv[1]);
-    int end_port = atoi(argv[2]); // We'll use this later
+    if (mode == MODE_REUSEPORT) {
+        // One port for everything: the range is not needed
+        if (argc - optind != 1) {
+            usage();
+        }
+        int port = atoi(argv[optind]);
+        if (port <= 0 || port > 65535) {
+            err_quit("invalid port %d", port);
+        }
+        Signal(SIGUSR1, sig_usr1);
+        workers_run(port);
+        exit(0);
+    }
 
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(start_port);
+    if (argc - optind != 2) {
+        usage();
+    }
 
-    sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+    int start_port = atoi(argv[optind]);
+    int end_port = atoi(argv[optind + 1]);
+    if (start_port <= 0 || end_port <= start_port || end_port > 65535) {
+        err_quit("invalid port range %d-%d", start_port, end_port);
+    }
 
-    Bind(sockfd, (SA *)&servaddr, sizeof(servaddr));
+    // An IPv6 wildcard socket only leaves IPv4 to a second one if asked
+    // to, so make them all v6only when there is more than one
+    if (tftp_cfg.nlisten == 0) {
+        listenfds[nlisten++] = listen_socket(NULL, start_port, 0, 0);
+    }
+    for (int i = 0; i < tftp_cfg.nlisten; i++) {
+        listenfds[nlisten++] = listen_socket(tftp_cfg.listen_hosts[i], start_port, tftp_cfg.nlisten > 1, 0);
+    }
 
-    dg_tftp_listen(sockfd, start_port, end_port, (SA *)&cliaddr, sizeof(cliaddr));
+    Signal(SIGUSR1, sig_usr1);
+    if (mode == MODE_EPOLL) {
+        engine_run(listenfds, nlisten, start_port, end_port);
+    } else {
+        // Not restarted, so a child exiting wakes the listener to reap it
+        Signal_intr(SIGCHLD, sig_chld);
+        dg_tftp_listen(start_port, end_port);
+    }
 
     exit(0);
 }
 
-void dg_tftp_listen(int sockfd, int start_port, int end_port, SA *pcliaddr, socklen_t clilen) {
-    socklen_t len;
-    char mesg[MAXLINE];
+// Fork a child for the request in d, which has a session slot
+static void fork_request(struct admit_table *children, struct io_dgram *d, int start_port, int end_port, int *next_port) {
+    char *req = d->buf;
+    ssize_t n = d->len;
     pid_t childpid;
-    
-    // We start using ports *after* the listening port.
-    int next_port = start_port + 1;
 
-    for (;;) {
-        len = clilen;
-        printf("Waiting for request...\n");
-        // We need to pass the received message to the child.
-        // Let's receive it here and pass it.
-        ssize_t n = Recvfrom(sockfd, mesg, MAXLINE, 0, pcliaddr, &len);
-        mesg[n] = '\0'; // null terminate
-
-        if ((childpid = Fork()) == 0) { // Child process
-            handle_request(next_port, end_port, pcliaddr, len, mesg);
-            exit(0); // Child terminates after handling request
-        } else { // Parent process
-            // The parent increments the port for the *next* child.
-            next_port++;
-            if (next_port > end_port) {
-                // Handle port exhaustion if necessary, for now, just print.
-                fprintf(stderr, "Warning: Port range exhausted.\n");
-                next_port = start_port + 1; // Or some other strategy
-            }
+    req[n] = '\0'; // null terminate
+
+    // Load the file into the cache before forking, so this child and
+    // every later one share one copy instead of each reading the disk
+    char filename[128] = "";
+    struct cache_entry *cached = NULL;
+    int opcode = request_filename(req, n, filename, sizeof(filename));
+    if (opcode == TFTP_RRQ) {
+        cached = cache_get(filename);
+    }
+
+    fflush(stdout); // Don't let the child inherit and repeat buffered output
+    if ((childpid = Fork()) == 0) { // Child process
+        for (int i = 0; i < nlisten; i++) {
+            Close(listenfds[i]);
         }
+        handle_request(*next_port, end_port, (SA *)&d->addr, d->addrlen, req, n);
+        exit(0); // Child terminates after handling request
+    }
+
+    // Parent process
+    if (cached) {
+        cache_put(cached);
+    }
+    admit_track(children, (SA *)&d->addr, d->addrlen, opcode, filename, childpid);
+    // The parent increments the port for the *next* child.
+    ++*next_port;
+    if (*next_port > end_port) {
+        // Handle port exhaustion if necessary, for now, just print.
+        fprintf(stderr, "Warning: Port range exhausted.\n");
+        *next_port = start_port + 1; // Or some other strategy
     }
 }
 
-void handle_request(int port_to_use, int end_port, SA *pcliaddr, socklen_t clilen, char *mesg) {
-    if (port_to_use > end_port) {
-        // TODO: Send a proper TFTP error back
-        err_msg("No available ports to handle the request.");
+// Read the requests waiting on sockfd and fork a child for each, unless
+// it is a duplicate or has to wait for a session slot
+static void listen_input(struct admit_table *children, struct admit_queue *queue, int sockfd, struct io_dgram *rx,
+                         int start_port, int end_port, int *next_port) {
+    // We need to pass the received message to the child.
+    // Let's receive it here and pass it. With batching, every request
+    // already queued comes back from the same call.
+    int nrx = io_recv(sockfd, rx, TFTP_MAX_BATCH, 0);
+    if (nrx < 0) {
+        if (errno != EINTR) {
+            err_sys("recvfrom error");
+        }
         return;
     }
 
-    printf("Child process created to handle request from %s, using port %d\n", Sock_ntop(pcliaddr, clilen), port_to_use);
-
-    // Create a new socket for the transfer
-    int data_sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
-    
-    struct sockaddr_in servaddr;
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(port_to_use);
-
-    Bind(data_sockfd, (SA *)&servaddr, sizeof(servaddr));
-
-    // Parse opcode from the message
-    uint16_t opcode = ntohs(*(uint16_t*)mesg);
-
-    // The client's address is in pcliaddr. We need to connect our new socket to it.
-    Connect(data_sockfd, pcliaddr, clilen);
-
-    switch (opcode) {
-        case TFTP_RRQ:
-            printf("Received RRQ\n");
-            handle_rrq(data_sockfd, mesg);
-            break;
-        case TFTP_WRQ:
-            printf("Received WRQ\n");
-            handle_wrq(data_sockfd, mesg);
-            break;
-        default:
-            send_error(data_sockfd, TFTP_ERR_ILLEGAL_OP, "Invalid TFTP operation.");
-            fprintf(stderr, "Invalid opcode: %d\n", opcode);
-            break;
+    for (int i = 0; i < nrx; i++) {
+        char filename[128] = "";
+        rx[i].buf[rx[i].len] = '\0';
+        int opcode = request_filename(rx[i].buf, rx[i].len, filename, sizeof(filename));
+        if (admit_busy(children, (SA *)&rx[i].addr, rx[i].addrlen, opcode, filename)) {
+            // Client retransmitted a request a child is already serving
+            METRIC_ADD(requests_duplicate, 1);
+            continue;
+        }
+        if (queue->count || !admit_acquire()) {
+            admit_enqueue(queue, sockfd, &rx[i]); // Behind the ones already waiting
+            continue;
+        }
+        fork_request(children, &rx[i], start_port, end_port, next_port);
     }
-
-    Close(data_sockfd);
 }
 
-void handle_wrq(int sockfd, char *request) {
-    char filename[128];
-    char mode[32];
-
-    sscanf(request + 2, "%s", filename);
-    sscanf(request + 2 + strlen(filename) + 1, "%s", mode);
+void dg_tftp_listen(int start_port, int end_port) {
+    static char mesg[TFTP_MAX_BATCH][MAXLINE];
+    static struct io_dgram rx[TFTP_MAX_BATCH];
+    static struct admit_table children;
+    static struct admit_queue queue;
+    struct admit_req *r;
+    struct pollfd pfd[TFTP_MAX_LISTEN];
+    pid_t pid;
 
-    printf("WRQ for filename: '%s', mode: '%s'\n", filename, mode);
+    // We start using ports *after* the listening port.
+    int next_port = start_port + 1;
 
-    if (strcasecmp(mode, "octet") != 0) {
-        send_error(sockfd, TFTP_ERR_ILLEGAL_OP, "Only octet mode is supported.");
-        return;
+    for (int i = 0; i < TFTP_MAX_BATCH; i++) {
+        rx[i].buf = mesg[i];
+        rx[i].size = MAXLINE - 1;
     }
-
-    // Check if file already exists
-    if (access(filename, F_OK) == 0) {
-        send_error(sockfd, TFTP_ERR_FILE_EXISTS, "File already exists.");
-        return;
+    for (int i = 0; i < nlisten; i++) {
+        pfd[i].fd = listenfds[i];
+        pfd[i].events = POLLIN;
     }
 
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL) {
-        send_error(sockfd, TFTP_ERR_ACCESS_VIOLATION, "Cannot create file.");
-        return;
-    }
-
-    char recv_buffer[PACKET_BUFFER_SIZE];
-    char send_buffer[4]; // For ACKs
-    uint16_t block_number = 0;
-
-    // Send initial ACK(0)
-    uint16_t temp_opcode = htons(TFTP_ACK);
-    memcpy(send_buffer, &temp_opcode, sizeof(temp_opcode));
-    uint16_t temp_block = htons(block_number);
-    memcpy(send_buffer + 2, &temp_block, sizeof(temp_block));
-    send(sockfd, send_buffer, 4, 0);
-    printf("Sent ACK for block 0\n");
-
-    block_number++;
-
-    // Setup SIGALRM handler
-    struct sigaction sa;
-    sa.sa_handler = sig_alrm;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGALRM, &sa, NULL);
-
-    while (1) {
-        int retransmit_count = 0;
-        ssize_t n = -1;
-        
-        while (retransmit_count < 10) {
-            timeout_occured = 0;
-            alarm(1);
-            n = recv(sockfd, recv_buffer, sizeof(recv_buffer), 0);
-            alarm(0);
-
-            if (n >= 0) {
-                break;
-            }
-            if (errno == EINTR) {
-                if (timeout_occured) {
-                    printf("Timeout waiting for DATA block %d. Retransmitting ACK for block %d...\n", block_number, block_number - 1);
-                    // Retransmit previous ACK
-                    temp_block = htons(block_number - 1);
-                    memcpy(send_buffer + 2, &temp_block, sizeof(temp_block));
-                    send(sockfd, send_buffer, 4, 0);
-                    retransmit_count++;
-                    continue;
-                }
-            } else {
-                err_sys("recv error");
-                fclose(file);
-                return;
+    for (;;) {
+        if (stats_requested) {
+            print_stats();
+        }
+        if (child_exited) {
+            child_exited = 0;
+            while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+                admit_untrack(&children, pid);
+                admit_release();
             }
         }
-
-        if (retransmit_count == 10) {
-            fprintf(stderr, "Connection timed out waiting for DATA block %d.\n", block_number);
-            fclose(file);
-            remove(filename); // Clean up partial file
-            return;
+        while ((r = admit_dequeue(&queue)) != NULL) {
+            fork_request(&children, &r->d, start_port, end_port, &next_port);
+            free(r);
         }
-
-        uint16_t opcode, recv_block;
-        memcpy(&opcode, recv_buffer, sizeof(opcode));
-        opcode = ntohs(opcode);
-        memcpy(&recv_block, recv_buffer + 2, sizeof(recv_block));
-        recv_block = ntohs(recv_block);
-
-
-        if (opcode != TFTP_DATA) {
-            send_error(sockfd, TFTP_ERR_ILLEGAL_OP, "Expected DATA packet.");
-            break;
+        vlog(VERBOSE_BLOCK, "Waiting for request...\n");
+        if (queue.count || nlisten > 1) {
+            // Wait for any listen socket. A SIGCHLD can slip in between
+            // the reaping above and here, so don't block for long while
+            // requests wait.
+            if (poll(pfd, nlisten, queue.count ? ADMIT_RETRY_MS : -1) <= 0) {
+                continue;
+            }
+        } else {
+            pfd[0].revents = POLLIN; // Just block in recvfrom()
         }
 
-        if (recv_block == block_number) {
-            fwrite(recv_buffer + 4, 1, n - 4, file);
-            
-            // Send ACK for current block
-            temp_opcode = htons(TFTP_ACK);
-            memcpy(send_buffer, &temp_opcode, sizeof(temp_opcode));
-            temp_block = htons(block_number);
-            memcpy(send_buffer + 2, &temp_block, sizeof(temp_block));
-            send(sockfd, send_buffer, 4, 0);
-            printf("Sent ACK for block %d\n", block_number);
-
-            if (n - 4 < DATA_SIZE) {
-                printf("File transfer completed.\n");
-                break; // Last packet
+        for (int j = 0; j < nlisten; j++) {
+            if (pfd[j].revents & POLLIN) {
+                listen_input(&children, &queue, listenfds[j], rx, start_port, end_port, &next_port);
             }
-            block_number++;
-        } else if (recv_block < block_number) {
-            // Re-send ACK for this old packet, in case our ACK was lost
-            printf("Received duplicate block %d. Resending ACK.\n", recv_block);
-            temp_opcode = htons(TFTP_ACK);
-            memcpy(send_buffer, &temp_opcode, sizeof(temp_opcode));
-            temp_block = htons(recv_block);
-            memcpy(send_buffer + 2, &temp_block, sizeof(temp_block));
-            send(sockfd, send_buffer, 4, 0);
-        } else {
-            // Block from the future?
-            send_error(sockfd, TFTP_ERR_ILLEGAL_OP, "Unexpected block number.");
-            break;
         }
     }
-
-    fclose(file);
 }
 
-void handle_rrq(int sockfd, char *request) {
-    char filename[128];
-    char mode[32];
-    
-    // The request format is: | 2 bytes opcode | filename | 1 byte 0 | mode | 1 byte 0 |
-    sscanf(request + 2, "%s", filename);
-    sscanf(request + 2 + strlen(filename) + 1, "%s", mode);
-
-    printf("RRQ for filename: '%s', mode: '%s'\n", filename, mode);
-
-    if (strcasecmp(mode, "octet") != 0) {
-        send_error(sockfd, TFTP_ERR_NOT_DEFINED, "Only octet mode is supported.");
+void handle_request(int port_to_use, int end_port, SA *pcliaddr, socklen_t clilen, char *mesg, ssize_t n) {
+    if (port_to_use > end_port) {
+        // TODO: Send a proper TFTP error back
+        err_msg("No available ports to handle the request.");
         return;
     }
 
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        send_error(sockfd, TFTP_ERR_FILE_NOT_FOUND, "File not found.");
-        return;
-    }
+    vlog(VERBOSE_TRANSFER, "Child process created to handle request from %s, using port %d\n", Sock_ntop(pcliaddr, clilen), port_to_use);
 
-    uint16_t block_number = 1;
-    char send_buffer[PACKET_BUFFER_SIZE];
-    char recv_buffer[PACKET_BUFFER_SIZE];
-    ssize_t bytes_read;
-
-    // Setup SIGALRM handler
-    struct sigaction sa;
-    sa.sa_handler = sig_alrm;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGALRM, &sa, NULL);
-
-    while ((bytes_read = fread(send_buffer + 4, 1, DATA_SIZE, file)) > 0) {
-        // Construct DATA packet
-        uint16_t temp_opcode = htons(TFTP_DATA);
-        memcpy(send_buffer, &temp_opcode, sizeof(temp_opcode));
-        uint16_t temp_block = htons(block_number);
-        memcpy(send_buffer + 2, &temp_block, sizeof(temp_block));
-        
-        int retransmit_count = 0;
-        while (retransmit_count < 10) {
-            timeout_occured = 0;
-            send(sockfd, send_buffer, bytes_read + 4, 0);
-            alarm(1); // Set 1-second alarm
-
-            ssize_t n = recv(sockfd, recv_buffer, sizeof(recv_buffer), 0);
-
-            if (n >= 0) {
-                alarm(0); // Cancel alarm
-                uint16_t ack_opcode, ack_block;
-                memcpy(&ack_opcode, recv_buffer, sizeof(ack_opcode));
-                ack_opcode = ntohs(ack_opcode);
-                memcpy(&ack_block, recv_buffer + 2, sizeof(ack_block));
-                ack_block = ntohs(ack_block);
-
-
-                if (ack_opcode == TFTP_ACK && ack_block == block_number) {
-                    printf("Received ACK for block %d\n", block_number);
-                    break; // Correct ACK received, move to next block
-                } else {
-                    // Wrong ACK or packet, ignore and wait for correct one or timeout
-                    // This handles the "Sorcerer's Apprentice Syndrome"
-                    continue;
-                }
-            } else if (errno == EINTR) {
-                if (timeout_occured) {
-                    printf("Timeout waiting for ACK for block %d. Retransmitting... (Attempt %d)\n", block_number, retransmit_count + 1);
-                    retransmit_count++;
-                    continue;
-                }
-            } else {
-                err_sys("recv error");
-                break;
-            }
-        }
-
-        if (retransmit_count == 10) {
-            fprintf(stderr, "Connection timed out after 10 retransmissions for block %d.\n", block_number);
-            fclose(file);
-            return;
-        }
-
-        block_number++;
-
-        if (bytes_read < DATA_SIZE) {
-            break; // Last packet
-        }
+    // Create a new socket for the transfer, of the client's address
+    // family, and connect it to the client's address in pcliaddr.
+    int data_sockfd = data_socket(pcliaddr, clilen, port_to_use);
+    if (data_sockfd < 0) {
+        err_sys("cannot set up data socket on port %d", port_to_use);
     }
-    
-    // Check if the loop terminated because of an empty file or a read that is a multiple of 512
-    if ((bytes_read == 0 && ftell(file) == 0) || (bytes_read == DATA_SIZE)) {
-         // File is empty, or file size is a multiple of 512.
-         // Send one final DATA packet with 0 bytes.
-        if (bytes_read == DATA_SIZE) {
-            block_number++;
-        }
-        
-        uint16_t temp_opcode = htons(TFTP_DATA);
-        memcpy(send_buffer, &temp_opcode, sizeof(temp_opcode));
-        uint16_t temp_block = htons(block_number);
-        memcpy(send_buffer + 2, &temp_block, sizeof(temp_block));
-
-        int retransmit_count = 0;
-        while (retransmit_count < 10) {
-            timeout_occured = 0;
-            send(sockfd, send_buffer, 4, 0);
-            alarm(1);
-
-            ssize_t n = recv(sockfd, recv_buffer, sizeof(recv_buffer), 0);
-            if (n >= 0) {
-                alarm(0);
-                uint16_t ack_opcode, ack_block;
-                memcpy(&ack_opcode, recv_buffer, sizeof(ack_opcode));
-                ack_opcode = ntohs(ack_opcode);
-                memcpy(&ack_block, recv_buffer + 2, sizeof(ack_block));
-                ack_block = ntohs(ack_block);
-                if (ack_opcode == TFTP_ACK && ack_block == block_number) {
-                    printf("Received final ACK for block %d\n", block_number);
-                    break;
-                }
-            } else if (errno == EINTR) {
-                if (timeout_occured) {
-                    retransmit_count++;
-                    continue;
-                }
-            } else {
-                err_sys("recv error");
-                break;
-            }
-        }
-        if (retransmit_count == 10) {
-             fprintf(stderr, "Connection timed out waiting for final ACK.\n");
-        }
+
+    // The child runs the same session state machine as the epoll engine,
+    // just with a single session and a blocking wait.
+    struct tftp_session *s = session_open(data_sockfd, port_to_use, pcliaddr, clilen, mesg, n, 1);
+    if (s == NULL) {
+        Close(data_sockfd);
+        return;
     }
+    session_run(s);
+    session_close(s);
+}
 
+// Dump the counters on SIGUSR1. The handler only sets a flag; the main
+// loop prints once its current syscall returns.
+static void sig_usr1(int signo) {
+    stats_requested = 1;
+}
 
-    printf("File transfer completed.\n");
-    fclose(file);
+void print_stats(void) {
+    stats_requested = 0;
+    printf("Stats: %lu socket syscalls, %lu datagrams in, %lu datagrams out; "
+           "cache hits %lu, misses %lu, evictions %lu\n",
+           io_stats.syscalls, io_stats.dgrams_in, io_stats.dgrams_out,
+           cache_stats.hits, cache_stats.misses, cache_stats.evictions);
+    fflush(stdout);
 }
 
-void send_error(int sockfd, int error_code, const char *error_msg) {
-    char buffer[PACKET_BUFFER_SIZE];
-    size_t msg_len = strlen(error_msg);
-    
-    uint16_t temp_opcode = htons(TFTP_ERROR);
-    memcpy(buffer, &temp_opcode, sizeof(temp_opcode));
-    uint16_t temp_code = htons(error_code);
-    memcpy(buffer + 2, &temp_code, sizeof(temp_code));
-    strcpy(buffer + 4, error_msg);
-    buffer[4 + msg_len] = 0;
-
-    send(sockfd, buffer, 4 + msg_len + 1, 0);
-    printf("Sent ERROR packet: %s\n", error_msg);
+// Toggle per-block logging on SIGUSR2. The level is in shared memory,
+// so in fork mode running children pick it up as well.
+static void sig_usr2(int signo) {
+    metrics->debug_level = metrics->debug_level >= VERBOSE_BLOCK ? VERBOSE_TRANSFER : VERBOSE_BLOCK;
 }
 
-static void sig_alrm(int signo) {
-    timeout_occured = 1;
-    return;
+// The listener reaps, so that it can free the child's session slot
+static void sig_chld(int signo) {
+    child_exited = 1;
 }
@@ -0,0 +1,1164 @@
+#include "tftp.h"
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+
+static const char *parse_request(const char *mesg, ssize_t n, char *filename, size_t fnlen, char *mode, size_t modelen);
+static int negotiate_options(struct tftp_session *s, const char *p, const char *end);
+static int rrq_start(struct tftp_session *s);
+static int rrq_open(struct tftp_session *s);
+static void rrq_netascii_tsize(struct tftp_session *s);
+static int rrq_open_growing(struct tftp_session *s, int fd, off_t size);
+static int rrq_staged(struct tftp_session *s);
+static ssize_t rrq_netascii_block(struct tftp_session *s);
+static int rrq_input(struct tftp_session *s, uint16_t opcode, uint16_t block);
+static int rrq_send_window(struct tftp_session *s);
+static int rrq_dupack(struct tftp_session *s);
+static int wrq_start(struct tftp_session *s);
+static int wrq_input(struct tftp_session *s, uint16_t opcode, uint16_t block, const char *pkt, ssize_t n);
+static int wrq_write(struct tftp_session *s, const char *data, size_t len, int last);
+static int wrq_finish(struct tftp_session *s);
+static int wrq_ack(struct tftp_session *s, int last);
+static void wrq_abort(struct tftp_session *s);
+static void build_ack(char *buf, uint16_t block);
+static void send_ack(struct tftp_session *s, uint16_t block);
+static void transmit(struct tftp_session *s);
+static void transmit_data(struct tftp_session *s, const char *data, size_t len);
+static void rtt_sample(struct tftp_session *s, uint64_t block);
+static void reject(int fd, int connected, SA *cliaddr, socklen_t clilen, int error_code, const char *error_msg);
+static void session_error(struct tftp_session *s, int error_code, const char *error_msg);
+static void session_send(struct tftp_session *s, const void *buf, size_t len);
+static void session_arm(struct tftp_session *s);
+static void session_arm_in(struct tftp_session *s, long ms);
+
+long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/*
+ * Create a session for the request in mesg and send its first packet
+ * (OACK if any option was accepted, otherwise DATA 1 for an RRQ or ACK 0
+ * for a WRQ). fd is either a socket of the session's own, connected to
+ * the client, or (connected == 0) a socket shared with other sessions
+ * that we sendto() the client on and never close. Returns NULL if the
+ * request was refused; an ERROR has then been sent and the caller still
+ * owns fd.
+ */
+struct tftp_session *session_open(int fd, int port, SA *cliaddr, socklen_t clilen, const char *mesg, ssize_t n, int connected) {
+    char mode[32];
+    uint16_t opcode;
+
+    if (n < 4) {
+        reject(fd, connected, cliaddr, clilen, TFTP_ERR_ILLEGAL_OP, "Malformed request.");
+        return NULL;
+    }
+    memcpy(&opcode, mesg, sizeof(opcode));
+    opcode = ntohs(opcode);
+
+    if (opcode != TFTP_RRQ && opcode != TFTP_WRQ) {
+        reject(fd, connected, cliaddr, clilen, TFTP_ERR_ILLEGAL_OP, "Invalid TFTP operation.");
+        fprintf(stderr, "Invalid opcode: %d\n", opcode);
+        return NULL;
+    }
+
+    struct tftp_session *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        reject(fd, connected, cliaddr, clilen, TFTP_ERR_NOT_DEFINED, "Out of memory.");
+        return NULL;
+    }
+    s->started = now_ms();
+    s->fd = fd;
+    s->connected = connected;
+    s->port = port;
+    s->opcode = opcode;
+    memcpy(&s->cliaddr, cliaddr, clilen);
+    s->clilen = clilen;
+    s->blksize = DATA_SIZE;
+    s->windowsize = 1;
+    s->tsize = -1;
+    rtt_init(&s->rtt);
+    s->rto = TFTP_TIMEOUT_MS;
+
+    // The request format is: | 2 bytes opcode | filename | 1 byte 0 | mode | 1 byte 0 |
+    // optionally followed by RFC 2347 | option | 1 byte 0 | value | 1 byte 0 | pairs.
+    const char *options = parse_request(mesg, n, s->filename, sizeof(s->filename), mode, sizeof(mode));
+    if (options == NULL) {
+        reject(fd, connected, cliaddr, clilen, TFTP_ERR_ILLEGAL_OP, "Malformed request.");
+        free(s);
+        return NULL;
+    }
+
+    vlog(VERBOSE_TRANSFER, "%s for filename: '%s', mode: '%s'\n", opcode == TFTP_RRQ ? "RRQ" : "WRQ", s->filename, mode);
+
+    if (strcasecmp(mode, "netascii") == 0) {
+        s->netascii = 1;
+    } else if (strcasecmp(mode, "octet") != 0) {
+        reject(fd, connected, cliaddr, clilen, opcode == TFTP_RRQ ? TFTP_ERR_NOT_DEFINED : TFTP_ERR_ILLEGAL_OP,
+                   "Only octet and netascii modes are supported.");
+        free(s);
+        return NULL;
+    }
+
+    if (negotiate_options(s, options, mesg + n) < 0) {
+        reject(fd, connected, cliaddr, clilen, TFTP_ERR_OPTION, "Invalid option value.");
+        free(s);
+        return NULL;
+    }
+
+    // Room for one full DATA packet, and for an OACK with every option
+    s->packet = malloc(s->blksize + 4 > PACKET_BUFFER_SIZE ? s->blksize + 4 : PACKET_BUFFER_SIZE);
+    if (s->netascii) {
+        // A decoded block can be one byte longer than it was on the wire
+        s->net_buf = malloc(s->blksize + 1);
+    }
+    if (s->packet == NULL || (s->netascii && s->net_buf == NULL)) {
+        reject(fd, connected, cliaddr, clilen, TFTP_ERR_NOT_DEFINED, "Out of memory.");
+        free(s->packet);
+        free(s);
+        return NULL;
+    }
+
+    if (opcode == TFTP_WRQ && s->windowsize > 1 && connected) {
+        // A whole window can arrive before we read any of it. Each datagram
+        // is also charged its kernel overhead, so small blocks never shrink
+        // the default buffer.
+        int rcvbuf = (s->blksize + 4) * s->windowsize * 2;
+        int cur = 0;
+        socklen_t len = sizeof(cur);
+        if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &cur, &len) < 0 || rcvbuf > cur) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+    }
+
+    shape_attach(s);
+    int rc = (opcode == TFTP_RRQ) ? rrq_start(s) : wrq_start(s);
+    if (rc == SESSION_DONE) {
+        shape_detach(s);
+        if (s->file) {
+            fclose(s->file);
+        }
+        if (s->cached) {
+            cache_put(s->cached);
+        } else if (s->map) {
+            munmap((void *)s->map, s->map_len);
+        }
+        if (s->staging) {
+            close(s->stage_fd);
+        }
+        free(s->net_buf);
+        free(s->packet);
+        free(s);
+        return NULL;
+    }
+    metrics_session_start(s);
+    return s;
+}
+
+/*
+ * Feed one datagram received on the session socket to the state machine.
+ */
+int session_input(struct tftp_session *s, const char *pkt, ssize_t n) {
+    uint16_t opcode, block;
+
+    if (n < 4) {
+        return SESSION_CONTINUE; // Runt packet, let the timer deal with it
+    }
+    memcpy(&opcode, pkt, sizeof(opcode));
+    opcode = ntohs(opcode);
+    memcpy(&block, pkt + 2, sizeof(block));
+    block = ntohs(block);
+
+    if (opcode == TFTP_ERROR) {
+        fprintf(stderr, "Client aborted transfer of '%s': %.*s\n", s->filename, (int)(n > 4 ? n - 4 : 0), pkt + 4);
+        if (s->opcode == TFTP_WRQ) {
+            wrq_abort(s);
+        }
+        return SESSION_DONE;
+    }
+
+    s->replied = 1;
+    if (s->opcode == TFTP_RRQ) {
+        return rrq_input(s, opcode, block);
+    }
+    return wrq_input(s, opcode, block, pkt, n);
+}
+
+/*
+ * The retransmission deadline passed without the packet we were waiting for.
+ */
+int session_timeout(struct tftp_session *s) {
+    if (s->stalled) {
+        s->stalled = 0;
+        return rrq_send_window(s);
+    }
+    if (s->wb_wait) {
+        // Not the client's fault: keep waiting for the writer
+        session_arm(s);
+        return SESSION_CONTINUE;
+    }
+    METRIC_ADD(timeouts, 1);
+    if (++s->retries >= TFTP_MAX_RETRIES) {
+        if (s->opcode == TFTP_RRQ) {
+            fprintf(stderr, "Connection timed out after %d retransmissions for block %d.\n", TFTP_MAX_RETRIES, (uint16_t)(s->acked + 1));
+        } else {
+            fprintf(stderr, "Connection timed out waiting for DATA block %d.\n", (uint16_t)(s->received + 1));
+            wrq_abort(s);
+        }
+        return SESSION_DONE;
+    }
+
+    if (s->oack_pending) {
+        METRIC_ADD(retransmits, 1);
+        transmit(s);
+        return SESSION_CONTINUE;
+    }
+
+    int retries = s->retries;
+    if (s->opcode == TFTP_RRQ) {
+        vlog(VERBOSE_BLOCK, "Timeout waiting for ACK for block %d. Retransmitting... (Attempt %d)\n", (uint16_t)(s->next - 1), retries);
+        // Back off, then go back to the first unacknowledged block and
+        // resend the window
+        s->rto = s->rto * 2 > TFTP_MAX_RTO_MS ? TFTP_MAX_RTO_MS : s->rto * 2;
+        s->recover = s->next - 1;
+        s->dupacks = 0;
+        s->next = s->acked + 1;
+        if (rrq_send_window(s) == SESSION_DONE) {
+            return SESSION_DONE;
+        }
+    } else {
+        vlog(VERBOSE_BLOCK, "Timeout waiting for DATA block %d. Retransmitting ACK for block %d...\n", (uint16_t)(s->received + 1), (uint16_t)s->received);
+        METRIC_ADD(retransmits, 1);
+        send_ack(s, (uint16_t)s->received);
+        s->unacked = 0;
+    }
+    s->retries = retries;
+    return SESSION_CONTINUE;
+}
+
+/*
+ * The write-behind thread signalled wb_notify_fd(): carry on with an
+ * upload that was waiting for it. Any other session is left alone, so
+ * the event loop can simply offer this to all of its sessions.
+ */
+int session_resume(struct tftp_session *s) {
+    if (s->wb_wait == WB_WAIT_FINISH) {
+        return wrq_finish(s);
+    }
+    if (s->wb_wait != WB_WAIT_ROOM) {
+        return SESSION_CONTINUE;
+    }
+
+    s->wb_wait = 0;
+    if (s->wb_dropped) {
+        // ACK what we have so the client resends the rest from there
+        s->wb_dropped = 0;
+        send_ack(s, (uint16_t)s->received);
+        s->unacked = 0;
+    }
+    return SESSION_CONTINUE;
+}
+
+/*
+ * How many datagrams s can take right now. An upload whose write-behind
+ * ring has no room for another block takes none: the event loop should
+ * stop reading its socket until session_resume(). Loops that share a
+ * socket between sessions can't, so wrq_input() drops the DATA instead.
+ */
+int session_room(struct tftp_session *s) {
+    if (s->wb == NULL) {
+        return TFTP_MAX_BATCH;
+    }
+    if (s->wb_wait) {
+        return 0;
+    }
+    // A netascii block can decode to one byte more than it came as
+    size_t n = wb_room(s->wb, s->blksize + 1) / (s->blksize + 1);
+    if (n == 0) {
+        s->wb_wait = WB_WAIT_ROOM;
+        return 0;
+    }
+    return n < TFTP_MAX_BATCH ? (int)n : TFTP_MAX_BATCH;
+}
+
+void session_close(struct tftp_session *s) {
+    metrics_session_end(s);
+    shape_detach(s);
+    if (s->wheel) {
+        timer_cancel(s->wheel, &s->timer);
+    }
+    if (s->opcode == TFTP_WRQ && (s->wb || s->file)) {
+        wrq_abort(s); // Closed before the last block arrived
+    }
+    if (s->file) {
+        fclose(s->file);
+    }
+    if (s->cached) {
+        cache_put(s->cached);
+    } else if (s->map) {
+        munmap((void *)s->map, s->map_len);
+    }
+    if (s->staging) {
+        close(s->stage_fd);
+    }
+    if (s->connected) {
+        Close(s->fd);
+    }
+    free(s->net_buf);
+    free(s->packet);
+    free(s);
+}
+
+/*
+ * Keep s->deadline on w from now on, for event loops that run many
+ * sessions. Without a wheel the owner polls s->deadline itself.
+ */
+void session_set_wheel(struct tftp_session *s, struct timer_wheel *w) {
+    s->wheel = w;
+    s->timer.data = s;
+    timer_schedule(w, &s->timer, s->deadline);
+}
+
+/*
+ * Drive a single session to completion, blocking in poll(). Used by the
+ * fork-per-request mode where each child owns exactly one transfer.
+ */
+void session_run(struct tftp_session *s) {
+    static char recv_buffer[TFTP_MAX_BATCH][MAX_PACKET_SIZE];
+    static struct io_dgram rx[TFTP_MAX_BATCH];
+    struct pollfd pfd[2] = { { .fd = s->fd, .events = POLLIN } };
+    int nfds = 1;
+    int rc = SESSION_CONTINUE;
+
+    if (s->wb) {
+        // The write-behind thread wakes us through this
+        pfd[nfds].fd = wb_notify_fd();
+        pfd[nfds++].events = POLLIN;
+    }
+
+    for (int i = 0; i < TFTP_MAX_BATCH; i++) {
+        rx[i].buf = recv_buffer[i];
+        rx[i].size = MAX_PACKET_SIZE;
+    }
+
+    while (rc == SESSION_CONTINUE) {
+        long wait = s->deadline - now_ms();
+        int room = session_room(s);
+        pfd[0].fd = room > 0 ? s->fd : -1; // Ignored while waiting for the writer
+        int nready = poll(pfd, nfds, wait > 0 ? (int)wait : 0);
+
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err_ret("poll error");
+            break;
+        }
+        if (nready == 0) {
+            rc = session_timeout(s);
+            continue;
+        }
+        if (nfds > 1 && (pfd[1].revents & POLLIN)) {
+            wb_notify_ack();
+            rc = session_resume(s);
+        }
+        if (rc != SESSION_CONTINUE || pfd[0].revents == 0) {
+            continue;
+        }
+
+        int n = io_recv(s->fd, rx, room, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            err_ret("recv error");
+            break;
+        }
+        for (int i = 0; i < n && rc == SESSION_CONTINUE; i++) {
+            rc = session_input(s, rx[i].buf, rx[i].len);
+        }
+    }
+}
+
+static size_t build_error(char *buffer, int error_code, const char *error_msg) {
+    size_t msg_len = strlen(error_msg);
+
+    uint16_t temp_opcode = htons(TFTP_ERROR);
+    memcpy(buffer, &temp_opcode, sizeof(temp_opcode));
+    uint16_t temp_code = htons(error_code);
+    memcpy(buffer + 2, &temp_code, sizeof(temp_code));
+    strcpy(buffer + 4, error_msg);
+    buffer[4 + msg_len] = 0;
+    return 4 + msg_len + 1;
+}
+
+void send_error(int sockfd, int error_code, const char *error_msg) {
+    char buffer[PACKET_BUFFER_SIZE];
+    size_t len = build_error(buffer, error_code, error_msg);
+
+    send(sockfd, buffer, len, 0);
+    METRIC_ADD(errors_sent, 1);
+    vlog(VERBOSE_TRANSFER, "Sent ERROR packet: %s\n", error_msg);
+}
+
+// Same as send_error, for an unconnected socket such as the listen socket.
+void send_error_to(int sockfd, SA *addr, socklen_t addrlen, int error_code, const char *error_msg) {
+    char buffer[PACKET_BUFFER_SIZE];
+    size_t len = build_error(buffer, error_code, error_msg);
+
+    sendto(sockfd, buffer, len, 0, addr, addrlen);
+    METRIC_ADD(errors_sent, 1);
+    vlog(VERBOSE_TRANSFER, "Sent ERROR packet: %s\n", error_msg);
+}
+
+// Refuse a request on fd, which may or may not be connected to the client.
+static void reject(int fd, int connected, SA *cliaddr, socklen_t clilen, int error_code, const char *error_msg) {
+    if (connected) {
+        send_error(fd, error_code, error_msg);
+    } else {
+        send_error_to(fd, cliaddr, clilen, error_code, error_msg);
+    }
+}
+
+static void session_error(struct tftp_session *s, int error_code, const char *error_msg) {
+    reject(s->fd, s->connected, (SA *)&s->cliaddr, s->clilen, error_code, error_msg);
+}
+
+// Send to the client, naming it unless the socket is connected to it.
+static void session_send(struct tftp_session *s, const void *buf, size_t len) {
+    io_send(s->fd, buf, len, s->connected ? NULL : (SA *)&s->cliaddr, s->clilen);
+}
+
+// Restart the retransmission timer, on the owner's wheel if it has one.
+static void session_arm(struct tftp_session *s) {
+    s->stalled = 0;
+    session_arm_in(s, s->rto);
+}
+
+static void session_arm_in(struct tftp_session *s, long ms) {
+    s->deadline = now_ms() + ms;
+    if (s->wheel) {
+        timer_schedule(s->wheel, &s->timer, s->deadline);
+    }
+}
+
+/* ---------------- Request parsing ---------------- */
+
+/*
+ * Copy the filename of the request in mesg into filename and return its
+ * opcode, or -1 if the request is malformed. Lets the fork-mode parent
+ * look at a request before handing it to a child.
+ */
+int request_filename(const char *mesg, ssize_t n, char *filename, size_t fnlen) {
+    char mode[32];
+    uint16_t opcode;
+
+    if (n < 4) {
+        return -1;
+    }
+    memcpy(&opcode, mesg, sizeof(opcode));
+    if (parse_request(mesg, n, filename, fnlen, mode, sizeof(mode)) == NULL) {
+        return -1;
+    }
+    return ntohs(opcode);
+}
+
+// Copy the NUL-terminated string at *p (bounded by end) into dst and
+// advance *p past its terminator. Fails if the string is unterminated or
+// does not fit.
+static int take_string(const char **p, const char *end, char *dst, size_t dstlen) {
+    const char *nul = memchr(*p, '\0', end - *p);
+    if (nul == NULL || (size_t)(nul - *p) >= dstlen) {
+        return -1;
+    }
+    memcpy(dst, *p, nul - *p + 1);
+    *p = nul + 1;
+    return 0;
+}
+
+// Returns a pointer to the first option, or NULL if the request is malformed.
+static const char *parse_request(const char *mesg, ssize_t n, char *filename, size_t fnlen, char *mode, size_t modelen) {
+    const char *p = mesg + 2;
+    const char *end = mesg + n;
+
+    if (take_string(&p, end, filename, fnlen) < 0 || filename[0] == '\0') {
+        return NULL;
+    }
+    if (take_string(&p, end, mode, modelen) < 0) {
+        return NULL;
+    }
+    return p;
+}
+
+static int parse_number(const char *str, long long min, long long max, long long *out) {
+    char *endp;
+    errno = 0;
+    long long v = strtoll(str, &endp, 10);
+    if (errno != 0 || endp == str || *endp != '\0' || v < min || v > max) {
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+/*
+ * RFC 2347 option negotiation. Recognised options are applied to the
+ * session and remembered so send_oack() can echo them; unknown options
+ * are ignored as the RFC requires. A client asking for more than we
+ * allow gets our maximum back in the OACK. Returns -1 on a malformed or
+ * out-of-range value.
+ */
+static int negotiate_options(struct tftp_session *s, const char *p, const char *end) {
+    char name[32], value[32];
+    long long v;
+
+    while (p < end) {
+        if (take_string(&p, end, name, sizeof(name)) < 0 ||
+            take_string(&p, end, value, sizeof(value)) < 0) {
+            // Trailing garbage or an over-long unknown option; nothing we negotiate
+            return 0;
+        }
+
+        if (strcasecmp(name, "blksize") == 0) {
+            // RFC 2348
+            if (parse_number(value, TFTP_MIN_BLKSIZE, LLONG_MAX, &v) < 0) {
+                return -1;
+            }
+            s->blksize = v > TFTP_MAX_BLKSIZE ? TFTP_MAX_BLKSIZE : v;
+            s->opt_blksize = 1;
+        } else if (strcasecmp(name, "windowsize") == 0) {
+            // RFC 7440
+            if (parse_number(value, 1, 65535, &v) < 0) {
+                return -1;
+            }
+            s->windowsize = v > tftp_cfg.max_window ? tftp_cfg.max_window : v;
+            s->opt_windowsize = 1;
+        } else if (strcasecmp(name, "tsize") == 0) {
+            // RFC 2349: 0 in an RRQ asks for the size, a WRQ announces it
+            if (parse_number(value, 0, LLONG_MAX, &v) < 0) {
+                return -1;
+            }
+            s->tsize = v;
+            s->opt_tsize = 1;
+        }
+    }
+    return 0;
+}
+
+static int has_options(const struct tftp_session *s) {
+    return s->opt_blksize || s->opt_tsize || s->opt_windowsize;
+}
+
+// Put an OACK for the accepted options in s->packet and send it.
+static void send_oack(struct tftp_session *s) {
+    uint16_t temp_opcode = htons(TFTP_OACK);
+    char *p = s->packet;
+
+    memcpy(p, &temp_opcode, sizeof(temp_opcode));
+    p += 2;
+    if (s->opt_blksize) {
+        p += sprintf(p, "blksize") + 1;
+        p += sprintf(p, "%zu", s->blksize) + 1;
+    }
+    if (s->opt_tsize) {
+        p += sprintf(p, "tsize") + 1;
+        p += sprintf(p, "%lld", (long long)s->tsize) + 1;
+    }
+    if (s->opt_windowsize) {
+        p += sprintf(p, "windowsize") + 1;
+        p += sprintf(p, "%u", s->windowsize) + 1;
+    }
+    s->packet_len = p - s->packet;
+    s->retries = 0;
+    s->oack_pending = 1;
+    transmit(s);
+    vlog(VERBOSE_BLOCK, "Sent OACK (blksize %zu, windowsize %u)\n", s->blksize, s->windowsize);
+}
+
+/* ---------------- RRQ ---------------- */
+
+static int rrq_start(struct tftp_session *s) {
+    // Hot files come out of the shared cache without touching the disk
+    if ((s->cached = cache_get(s->filename)) != NULL) {
+        s->map = cache_data(s->cached);
+        s->map_len = cache_size(s->cached);
+        s->tsize = s->map_len;
+    } else if (rrq_open(s) < 0) {
+        return SESSION_DONE;
+    }
+    if (s->opt_tsize && s->netascii) {
+        rrq_netascii_tsize(s);
+    }
+
+    s->acked = 0;
+    s->next = 1;
+    s->file_block = 1;
+    s->net_offset[1] = 0;
+    s->net_pending[1] = -1;
+    if (has_options(s)) {
+        // DATA 1 follows once the client ACKs the OACK with block 0
+        send_oack(s);
+        return SESSION_CONTINUE;
+    }
+    return rrq_send_window(s);
+}
+
+// Open an uncached file for reading. Sends an ERROR and returns -1 on failure.
+static int rrq_open(struct tftp_session *s) {
+    s->file = fopen(s->filename, "rb");
+    if (s->file == NULL && errno == ENOENT && tftp_cfg.stage_dir) {
+        off_t size;
+        int growing;
+        int fd = stage_open(s->filename, &size, &growing);
+        if (fd >= 0 && growing && size > 0) {
+            return rrq_open_growing(s, fd, size);
+        }
+        if (fd >= 0 && (s->file = fdopen(fd, "rb")) == NULL) {
+            close(fd);
+        }
+    }
+    if (s->file == NULL) {
+        session_error(s, errno == EIO ? TFTP_ERR_NOT_DEFINED : TFTP_ERR_FILE_NOT_FOUND,
+                      errno == EIO ? "Staging failed." : "File not found.");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fileno(s->file), &st) < 0) {
+        session_error(s, TFTP_ERR_NOT_DEFINED, "Cannot stat file.");
+        return -1;
+    }
+    s->tsize = st.st_size;
+
+    // Map regular files once and send DATA straight from the page cache.
+    // Empty files can't be mapped and other file types may not support it;
+    // those (and any mmap failure) fall back to fread(). The mapping
+    // covers the size at open time; like any mmap reader we would take a
+    // SIGBUS if the file were truncated underneath us mid-transfer.
+    if (tftp_cfg.use_mmap && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(s->file), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            s->map = map;
+            s->map_len = st.st_size;
+            fclose(s->file); // The mapping keeps the file referenced
+            s->file = NULL;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Serve a staging file that gzip is still writing. It is mapped at its
+ * final size up front, and blocks are only sent out of the part that
+ * rrq_staged() has seen written.
+ */
+static int rrq_open_growing(struct tftp_session *s, int fd, off_t size) {
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        session_error(s, TFTP_ERR_NOT_DEFINED, "Cannot map file.");
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    s->map = map;
+    s->map_len = size;
+    s->tsize = size;
+    s->stage_fd = fd;
+    s->staging = 1;
+    s->staged = 0;
+    return 0;
+}
+
+/*
+ * Whether the next block's bytes are in the staging file yet. The last
+ * block also waits for gzip to exit, so a file that turns out longer
+ * than its trailer said is never sent cut short. Returns 1 if they are,
+ * 0 if not yet, or -1 if staging failed.
+ */
+static int rrq_staged(struct tftp_session *s) {
+    off_t end;
+    if (s->netascii) {
+        end = s->net_offset[s->next % (TFTP_MAX_WINDOW + 1)] + s->blksize;
+    } else {
+        end = (off_t)s->next * s->blksize;
+    }
+    if (end < s->map_len && end <= s->staged) {
+        return 1;
+    }
+
+    int rc = stage_check(s->stage_fd, s->map_len, &s->staged);
+    if (rc != 0) {
+        close(s->stage_fd);
+        s->staging = 0;
+    }
+    if (rc < 0) {
+        return -1;
+    }
+    return rc == 1 || (end < s->map_len && end <= s->staged);
+}
+
+/*
+ * tsize is the size the client will receive, so for netascii every line
+ * end in the file counts twice. That takes a pass over the file, which
+ * is only made when it is mapped; otherwise tsize is left out of the
+ * OACK, as RFC 2349 allows.
+ */
+static void rrq_netascii_tsize(struct tftp_session *s) {
+    if (s->map && !s->staging) {
+        s->tsize = netascii_size(s->map, s->map_len);
+    } else {
+        s->opt_tsize = 0;
+    }
+}
+
+/*
+ * Put netascii block s->next in s->packet + 4, continuing from where the
+ * previous block left off in the file, and note where the block after it
+ * starts. Returns the block's length, or -1 on a read error.
+ */
+static ssize_t rrq_netascii_block(struct tftp_session *s) {
+    unsigned slot = s->next % (TFTP_MAX_WINDOW + 1);
+    off_t offset = s->net_offset[slot];
+    int pending = s->net_pending[slot];
+    const char *src;
+    size_t avail, consumed;
+
+    if (s->map) {
+        src = s->map + offset;
+        avail = s->map_len - offset;
+    } else {
+        // The block may need fewer file bytes than were read last time
+        if (s->net_file_pos != offset && fseeko(s->file, offset, SEEK_SET) < 0) {
+            return -1;
+        }
+        avail = fread(s->net_buf, 1, s->blksize, s->file);
+        if (avail < s->blksize && ferror(s->file)) {
+            return -1;
+        }
+        s->net_file_pos = offset + avail;
+        src = s->net_buf;
+    }
+
+    size_t len = netascii_encode(src, avail, &consumed, s->packet + 4, s->blksize, &pending);
+    slot = (s->next + 1) % (TFTP_MAX_WINDOW + 1);
+    s->net_offset[slot] = offset + consumed;
+    s->net_pending[slot] = pending;
+    return len;
+}
+
+/*
+ * Send DATA blocks s->next .. s->acked + windowsize. Block numbers are
+ * kept as 64-bit counters and only truncated to 16 bits on the wire, so
+ * transfers longer than 65535 blocks roll over to 0. A short (possibly
+ * empty) block is the final packet; this also covers files whose size
+ * is a multiple of blksize.
+ *
+ * With a mapped file the payload is never copied: the 4-byte header in
+ * s->packet and a pointer into the mapping go out together via sendmsg().
+ * Otherwise the block is fread() into s->packet behind the header, as
+ * is every netascii block once its line ends are expanded.
+ *
+ * The window stops short while a staging file is behind the client. A
+ * new window waits until the client's token buckets (-R, -N) allow it.
+ */
+static int rrq_send_window(struct tftp_session *s) {
+    s->retries = 0;
+    while (s->next <= s->acked + s->windowsize && (s->last_block == 0 || s->next <= s->last_block)) {
+        const char *data;
+        size_t bytes_read;
+        long wait = 0;
+
+        if (s->staging) {
+            int ready = rrq_staged(s);
+            if (ready < 0) {
+                session_error(s, TFTP_ERR_NOT_DEFINED, "Staging failed.");
+                return SESSION_DONE;
+            }
+            if (!ready) {
+                wait = STAGE_POLL_MS;
+            }
+        }
+        if (!wait && s->next == s->acked + 1 && (s->shape[0] || s->shape[1])) {
+            // Pace whole windows: the client only ACKs once it has one
+            wait = shape_delay(s);
+        }
+        if (wait) {
+            if (s->next == s->acked + 1) {
+                // Nothing in flight to wait for, so come back when the
+                // data or the tokens should be there
+                s->stalled = 1;
+                session_arm_in(s, wait);
+            }
+            break;
+        }
+
+        if (s->netascii) {
+            ssize_t len = rrq_netascii_block(s);
+            if (len < 0) {
+                session_error(s, TFTP_ERR_NOT_DEFINED, "Read error.");
+                return SESSION_DONE;
+            }
+            bytes_read = len;
+            data = s->packet + 4;
+        } else if (s->map) {
+            off_t offset = (off_t)(s->next - 1) * s->blksize;
+            off_t left = offset < s->map_len ? s->map_len - offset : 0;
+            bytes_read = left < (off_t)s->blksize ? (size_t)left : s->blksize;
+            data = s->map + (left ? offset : 0);
+        } else {
+            if (s->file_block != s->next) {
+                // Retransmitting: rewind to the first block of the window
+                if (fseeko(s->file, (off_t)(s->next - 1) * s->blksize, SEEK_SET) < 0) {
+                    session_error(s, TFTP_ERR_NOT_DEFINED, "Read error.");
+                    return SESSION_DONE;
+                }
+                s->file_block = s->next;
+            }
+
+            bytes_read = fread(s->packet + 4, 1, s->blksize, s->file);
+            if (bytes_read < s->blksize && ferror(s->file)) {
+                session_error(s, TFTP_ERR_NOT_DEFINED, "Read error.");
+                return SESSION_DONE;
+            }
+            s->file_block++;
+            data = s->packet + 4;
+        }
+        if (bytes_read < s->blksize) {
+            s->last_block = s->next;
+        }
+
+        uint16_t temp_opcode = htons(TFTP_DATA);
+        memcpy(s->packet, &temp_opcode, sizeof(temp_opcode));
+        uint16_t temp_block = htons((uint16_t)s->next);
+        memcpy(s->packet + 2, &temp_block, sizeof(temp_block));
+        s->packet_len = bytes_read + 4;
+
+        unsigned slot = s->next % TFTP_MAX_WINDOW;
+        s->sent_ts[slot] = rtt_ts(&s->rtt);
+        s->resent[slot] = s->next <= s->high;
+        if (s->next > s->high) {
+            s->high = s->next;
+            s->bytes += bytes_read;
+        } else {
+            METRIC_ADD(retransmits, 1);
+        }
+        METRIC_ADD(bytes_out, bytes_read);
+        if (s->shape[0] || s->shape[1]) {
+            shape_charge(s, bytes_read);
+        }
+        // The timer covers the oldest unacknowledged block: start it when
+        // that block goes out, and leave it alone for the ones behind it
+        int oldest = s->next == s->acked + 1;
+        s->next++;
+
+        transmit_data(s, data, bytes_read);
+        if (oldest) {
+            session_arm(s);
+        }
+    }
+    io_flush();
+    return SESSION_CONTINUE;
+}
+
+static int rrq_input(struct tftp_session *s, uint16_t opcode, uint16_t block) {
+    if (opcode != TFTP_ACK) {
+        return SESSION_CONTINUE;
+    }
+
+    if (s->oack_pending) {
+        if (block != 0) {
+            return SESSION_CONTINUE;
+        }
+        s->oack_pending = 0;
+        return rrq_send_window(s);
+    }
+
+    // Map the 16-bit block number onto the blocks in flight. Anything
+    // outside acked .. next-1 is a stale ACK; ignoring it avoids the
+    // "Sorcerer's Apprentice Syndrome".
+    uint64_t acked = s->acked + (uint16_t)(block - (uint16_t)s->acked);
+    if (acked == s->acked) {
+        return rrq_dupack(s);
+    }
+    if (acked >= s->next) {
+        return SESSION_CONTINUE;
+    }
+
+    vlog(VERBOSE_BLOCK, "Received ACK for block %d\n", block);
+    rtt_sample(s, acked);
+    s->acked = acked;
+    s->dupacks = 0;
+    if (s->acked == s->last_block) {
+        vlog(VERBOSE_TRANSFER, "File transfer completed.\n");
+        s->completed = 1;
+        return SESSION_DONE; // That was the last packet
+    }
+
+    // Slide the window: keep windowsize blocks in flight past the ACK.
+    // The timer now covers the oldest block still unacknowledged.
+    session_arm(s);
+    return rrq_send_window(s);
+}
+
+/*
+ * A repeated ACK for s->acked while later blocks are in flight means the
+ * client is missing s->acked + 1 and is re-ACKing its last in-order block
+ * for every later block that arrives. TFTP has no selective ACK, so after
+ * TFTP_DUPACK_THRESHOLD of them we go back and resend from s->acked + 1
+ * without waiting for the timer. Only one such go-back is made per loss:
+ * duplicates keep arriving for the rest of the old window, and acting on
+ * each of them would resend the window over and over. With windowsize 1
+ * a duplicate ACK only means the client saw a retransmitted block, so it
+ * is ignored as RFC 1350 requires.
+ */
+static int rrq_dupack(struct tftp_session *s) {
+    if (s->windowsize == 1 || s->next == s->acked + 1 || s->acked < s->recover) {
+        return SESSION_CONTINUE;
+    }
+    if (++s->dupacks < TFTP_DUPACK_THRESHOLD) {
+        return SESSION_CONTINUE;
+    }
+
+    vlog(VERBOSE_BLOCK, "Duplicate ACKs for block %d. Fast retransmit.\n", (uint16_t)s->acked);
+    s->recover = s->next - 1;
+    s->dupacks = 0;
+    s->next = s->acked + 1;
+    return rrq_send_window(s);
+}
+
+/*
+ * Feed the round trip time of block into the estimator, unless the block
+ * was retransmitted and the ACK could belong to either copy (Karn).
+ * lib/rtt.c's rtt_stop() does the Jacobson/Karels update of srtt and
+ * rttvar; its own RTO is clamped to whole seconds, so we derive ours from
+ * srtt + 4 * rttvar with sub-second bounds. This also cancels backoff.
+ */
+static void rtt_sample(struct tftp_session *s, uint64_t block) {
+    unsigned slot = block % TFTP_MAX_WINDOW;
+    if (s->resent[slot]) {
+        return;
+    }
+
+    uint32_t ms = rtt_ts(&s->rtt) - s->sent_ts[slot];
+    if (!s->have_rtt) {
+        // Seed the estimator from the first sample (RFC 6298) rather
+        // than rtt_init()'s 0.75 s deviation, which takes dozens of
+        // samples to decay on a LAN.
+        s->rtt.rtt_srtt = ms / 1000.0;
+        s->rtt.rtt_rttvar = ms / 2000.0;
+        s->have_rtt = 1;
+    } else {
+        rtt_stop(&s->rtt, ms);
+    }
+
+    long rto = (long)((s->rtt.rtt_srtt + 4.0 * s->rtt.rtt_rttvar) * 1000.0 + 0.5);
+    if (rto < TFTP_MIN_RTO_MS) {
+        rto = TFTP_MIN_RTO_MS;
+    } else if (rto > TFTP_MAX_RTO_MS) {
+        rto = TFTP_MAX_RTO_MS;
+    }
+    s->rto = rto;
+}
+
+/* ---------------- WRQ ---------------- */
+
+static int wrq_start(struct tftp_session *s) {
+    // Check if file already exists
+    if (access(s->filename, F_OK) == 0) {
+        session_error(s, TFTP_ERR_FILE_EXISTS, "File already exists.");
+        return SESSION_DONE;
+    }
+
+    if (tftp_cfg.write_mode == WRITE_SYNC) {
+        s->file = fopen(s->filename, "wb");
+    } else {
+        s->wb = wb_open(s->filename);
+    }
+    if (s->file == NULL && s->wb == NULL) {
+        session_error(s, TFTP_ERR_ACCESS_VIOLATION, "Cannot create file.");
+        return SESSION_DONE;
+    }
+
+    s->received = 0;
+    if (has_options(s)) {
+        // The OACK takes the place of ACK 0
+        send_oack(s);
+        return SESSION_CONTINUE;
+    }
+    send_ack(s, 0);
+    vlog(VERBOSE_BLOCK, "Sent ACK for block 0\n");
+    return SESSION_CONTINUE;
+}
+
+static int wrq_input(struct tftp_session *s, uint16_t opcode, uint16_t block, const char *pkt, ssize_t n) {
+    if (opcode != TFTP_DATA) {
+        session_error(s, TFTP_ERR_ILLEGAL_OP, "Expected DATA packet.");
+        return SESSION_DONE;
+    }
+    s->oack_pending = 0;
+
+    if (session_room(s) == 0) {
+        // On a shared socket: the client resends once session_resume() ACKs
+        s->wb_dropped = 1;
+        return SESSION_CONTINUE;
+    }
+
+    if (block != (uint16_t)(s->received + 1)) {
+        // Duplicate or out-of-order block. Re-ACK the last block we have
+        // in order, in case our ACK was lost or the client needs to
+        // restart its window from there.
+        vlog(VERBOSE_BLOCK, "Received out-of-order block %d. Resending ACK for block %d.\n", block, (uint16_t)s->received);
+        METRIC_ADD(retransmits, 1);
+        send_ack(s, (uint16_t)s->received);
+        s->unacked = 0;
+        return SESSION_CONTINUE;
+    }
+
+    size_t len = n - 4;
+    if (len > s->blksize) {
+        session_error(s, TFTP_ERR_ILLEGAL_OP, "DATA larger than negotiated block size.");
+        wrq_abort(s);
+        return SESSION_DONE;
+    }
+
+    int last = len < s->blksize;
+    const char *data = pkt + 4;
+    size_t data_len = len;
+    if (s->netascii) {
+        data_len = netascii_decode(data, len, s->net_buf, &s->net_cr);
+        if (last && s->net_cr) {
+            s->net_buf[data_len++] = '\r'; // A stray CR at the very end
+        }
+        data = s->net_buf;
+    }
+    if (wrq_write(s, data, data_len, last) < 0) {
+        session_error(s, TFTP_ERR_DISK_FULL, "Write error.");
+        wrq_abort(s);
+        return SESSION_DONE;
+    }
+    s->received++;
+    s->unacked++;
+    s->bytes += len;
+    METRIC_ADD(bytes_in, len);
+
+    if (last && s->wb) {
+        return wrq_finish(s);
+    }
+    return wrq_ack(s, last);
+}
+
+/*
+ * Hand one block to the file. With write-behind the block is only copied
+ * into the stream's ring, which session_room() made sure has space, so it
+ * can be ACKed before it reaches the disk. Returns -1 on a write error.
+ */
+static int wrq_write(struct tftp_session *s, const char *data, size_t len, int last) {
+    if (s->wb) {
+        return wb_append(s->wb, data, len);
+    }
+
+    if (fwrite(data, 1, len, s->file) != len) {
+        return -1;
+    }
+    if (tftp_cfg.fsync_policy == FSYNC_CHUNK || (last && tftp_cfg.fsync_policy == FSYNC_CLOSE)) {
+        if (fflush(s->file) != 0 || fdatasync(fileno(s->file)) < 0) {
+            return -1;
+        }
+    }
+    if (last) {
+        int rc = fclose(s->file);
+        s->file = NULL;
+        return rc == 0 ? 0 : -1;
+    }
+    return 0;
+}
+
+/*
+ * All of a write-behind upload is in the ring. The file has to be
+ * complete (and synced, if -f asks for it) before the client sees the
+ * last ACK, so until the writer says so the session waits in
+ * WB_WAIT_FINISH.
+ */
+static int wrq_finish(struct tftp_session *s) {
+    if (wb_finish(s->wb) < 0) {
+        if (errno == EAGAIN) {
+            s->wb_wait = WB_WAIT_FINISH;
+            return SESSION_CONTINUE;
+        }
+        s->wb = NULL; // Freed either way
+        session_error(s, TFTP_ERR_DISK_FULL, "Write error.");
+        wrq_abort(s);
+        return SESSION_DONE;
+    }
+    s->wb = NULL;
+    s->wb_wait = 0;
+    return wrq_ack(s, 1);
+}
+
+// ACK block received, or wait for more of the window.
+static int wrq_ack(struct tftp_session *s, int last) {
+    // With a window, one ACK covers windowsize blocks
+    if (last || s->unacked >= s->windowsize) {
+        send_ack(s, (uint16_t)s->received);
+        s->unacked = 0;
+        vlog(VERBOSE_BLOCK, "Sent ACK for block %d\n", (uint16_t)s->received);
+    } else {
+        s->retries = 0;
+        session_arm(s);
+    }
+
+    if (last) {
+        vlog(VERBOSE_TRANSFER, "File transfer completed.\n");
+        s->completed = 1;
+        return SESSION_DONE; // Last packet
+    }
+    return SESSION_CONTINUE;
+}
+
+// Drop a partial upload.
+static void wrq_abort(struct tftp_session *s) {
+    if (s->wb) {
+        wb_abort(s->wb);
+        s->wb = NULL;
+    }
+    if (s->file) {
+        fclose(s->file);
+        s->file = NULL;
+    }
+    remove(s->filename); // Clean up partial file
+}
+
+static void build_ack(char *buf, uint16_t block) {
+    uint16_t temp_opcode = htons(TFTP_ACK);
+    memcpy(buf, &temp_opcode, sizeof(temp_opcode));
+    uint16_t temp_block = htons(block);
+    memcpy(buf + 2, &temp_block, sizeof(temp_block));
+}
+
+static void send_ack(struct tftp_session *s, uint16_t block) {
+    build_ack(s->packet, block);
+    s->packet_len = 4;
+    s->retries = 0;
+    transmit(s);
+}
+
+// (Re)send the packet in s->packet and re-arm the retransmission timer.
+static void transmit(struct tftp_session *s) {
+    session_send(s, s->packet, s->packet_len);
+    session_arm(s);
+}
+
+// Send the DATA header in s->packet followed by len bytes at data, which
+// is either s->packet + 4 already or points into the file mapping. Mapped
+// blocks are queued so a whole window can go out in one sendmmsg(); the
+// caller flushes them. Unlike transmit(), this leaves the timer to the
+// caller.
+static void transmit_data(struct tftp_session *s, const char *data, size_t len) {
+    if (data == s->packet + 4) {
+        session_send(s, s->packet, s->packet_len);
+        return;
+    }
+    io_queue(s->fd, s->connected ? NULL : (SA *)&s->cliaddr, s->clilen, s->packet, data, len);
+}
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE // close_range()
+#include "tftp.h"
+#include <sys/file.h>
+
+/*
+ * Pre-staged variants (-z dir). An RRQ for a file that doesn't exist,
+ * but has a gzip-compressed name.gz next to it, is served the
+ * decompressed contents. The first such request starts `gzip -dc` into
+ * a staging file in dir and sends DATA from that file while it grows.
+ * Later requests find the finished copy and serve it like any other
+ * file, so the archive on slow storage is read and inflated only once.
+ *
+ * The staging file is named after the archive's path, inode, size and
+ * mtime, so replacing the .gz stages it again. gzip holds an exclusive
+ * flock() on the file until it exits. A reader that can take the lock
+ * while the file is still shorter than the size in the gzip trailer
+ * knows the decompression failed. The trailer (ISIZE) also gives tsize
+ * before any data exists. ISIZE is the size of the last member mod 2^32,
+ * so multi-member archives and files of 4 GB or more fail that check and
+ * are refused.
+ */
+
+#define GZIP_MIN_SIZE 18  // 10-byte header, empty deflate stream, 8-byte trailer
+
+// The uncompressed size from the trailer of the gzip file fd, or -1
+static off_t gzip_size(int fd, off_t len) {
+    unsigned char magic[2], trailer[4];
+
+    if (len < GZIP_MIN_SIZE || pread(fd, magic, 2, 0) != 2 || magic[0] != 0x1f || magic[1] != 0x8b ||
+        pread(fd, trailer, 4, len - 4) != 4) {
+        return -1;
+    }
+    return (off_t)trailer[0] | (off_t)trailer[1] << 8 | (off_t)trailer[2] << 16 | (off_t)trailer[3] << 24;
+}
+
+static void stage_name(char *name, size_t len, const char *gzpath, const struct stat *st) {
+    unsigned h = 2166136261u;
+    for (const char *p = gzpath; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    snprintf(name, len, "%s/%08x-%lx-%lx-%lld-%ld.%09ld", tftp_cfg.stage_dir, h, (unsigned long)st->st_dev,
+             (unsigned long)st->st_ino, (long long)st->st_size, (long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+}
+
+/*
+ * Start decompressing gzfd into a new staging file called name. The
+ * file is created and locked under a temporary name and then linked
+ * into place, so nobody sees it unlocked before gzip has it. Returns 0
+ * when name exists afterwards, whoever made it, or -1 on failure.
+ */
+static int stage_start(int gzfd, const char *name) {
+    char tmp[PATH_MAX + 8];
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", name);
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        return -1;
+    }
+    fchmod(fd, 0644);
+    flock(fd, LOCK_EX);
+    if (link(tmp, name) < 0) {
+        int err = errno;
+        unlink(tmp);
+        close(fd);
+        return err == EEXIST ? 0 : -1; // Lost the race to another request
+    }
+    unlink(tmp);
+
+    // Fork twice so gzip belongs to init and nobody has to reap it. It
+    // keeps the lock through the descriptor it inherits as stdout.
+    lseek(gzfd, 0, SEEK_SET);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (fork() == 0) {
+            sigset_t none;
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, NULL);
+            dup2(gzfd, STDIN_FILENO);
+            dup2(fd, STDOUT_FILENO);
+            // One call however high RLIMIT_NOFILE is; kernels before
+            // 5.9 don't have it and get the loop
+            if (close_range(STDERR_FILENO + 1, ~0U, 0) < 0) {
+                for (int i = STDERR_FILENO + 1; i < sysconf(_SC_OPEN_MAX); i++) {
+                    close(i);
+                }
+            }
+            execlp("gzip", "gzip", "-dc", (char *)NULL);
+            _exit(127);
+        }
+        _exit(0);
+    }
+    close(fd);
+    if (pid < 0) {
+        unlink(name);
+        return -1;
+    }
+    waitpid(pid, NULL, 0); // The first child, which exits at once
+    vlog(VERBOSE_TRANSFER, "Staging %s\n", name);
+    return 0;
+}
+
+/*
+ * Open the decompressed variant of path, staging it if nobody has yet.
+ * Returns a read-only descriptor and sets *size to the uncompressed size
+ * and *growing if the file is still being written (see stage_check()).
+ * Returns -1 with errno set, ENOENT if there is no usable path.gz.
+ */
+int stage_open(const char *path, off_t *size, int *growing) {
+    char gzpath[PATH_MAX], name[PATH_MAX];
+    struct stat st;
+
+    snprintf(gzpath, sizeof(gzpath), "%s.gz", path);
+    int gzfd = open(gzpath, O_RDONLY);
+    if (gzfd < 0) {
+        return -1;
+    }
+    if (fstat(gzfd, &st) < 0 || !S_ISREG(st.st_mode) || (*size = gzip_size(gzfd, st.st_size)) < 0) {
+        close(gzfd);
+        errno = ENOENT;
+        return -1;
+    }
+    stage_name(name, sizeof(name), gzpath, &st);
+
+    // A staging file left short by a failed gzip is removed and redone once
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int fd = open(name, O_RDONLY);
+        if (fd < 0) {
+            if (errno != ENOENT || stage_start(gzfd, name) < 0) {
+                break;
+            }
+            fd = open(name, O_RDONLY);
+            if (fd < 0) {
+                break;
+            }
+        }
+        off_t avail;
+        int rc = stage_check(fd, *size, &avail);
+        if (rc >= 0) {
+            close(gzfd);
+            *growing = rc == 0;
+            return fd;
+        }
+        close(fd);
+        unlink(name);
+    }
+    close(gzfd);
+    errno = EIO;
+    return -1;
+}
+
+/*
+ * Look at how far the staging file fd has got. Sets *avail to the bytes
+ * written so far, at most size, and returns 1 once gzip has exited
+ * leaving exactly size bytes, 0 while it is still running, or -1 if it
+ * failed or wrote something else.
+ */
+int stage_check(int fd, off_t size, off_t *avail) {
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    *avail = st.st_size < size ? st.st_size : size;
+    if (flock(fd, LOCK_SH | LOCK_NB) < 0) {
+        return 0; // gzip still holds it
+    }
+    flock(fd, LOCK_UN);
+    // It may have written more between the fstat() and the flock()
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    *avail = st.st_size < size ? st.st_size : size;
+    return st.st_size == size ? 1 : -1;
+}
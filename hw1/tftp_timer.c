@@ -0,0 +1,186 @@
+#include "tftp.h"
+#include <sys/timerfd.h>
+
+/*
+ * Hierarchical timer wheel for the retransmission deadlines of a set of
+ * sessions, in the style of the classic Linux kernel timer wheel. Level 0
+ * has a slot for each of the next 256 ms; each higher level has 64 slots
+ * covering 64 times the span of the level below. A timer goes into the
+ * lowest level whose span reaches its deadline, so scheduling and
+ * cancelling are O(1), and the timers of a higher slot are redistributed
+ * ("cascaded") downwards once each time level 0 wraps around.
+ *
+ * The wheel owns a timerfd armed for the next non-empty level-0 slot, or
+ * the next cascade, whichever comes first. An event loop polls the fd
+ * along with its sockets and only looks at the wheel when it fires, so a
+ * process with thousands of idle sessions does no per-session work on
+ * each wakeup.
+ */
+
+#define L0_MASK (WHEEL_L0_SLOTS - 1)
+#define LN_MASK (WHEEL_LN_SLOTS - 1)
+#define L0_BITS 8
+#define LN_BITS 6
+#define WHEEL_SPAN (1L << (L0_BITS + WHEEL_LEVELS * LN_BITS))
+
+static void timer_link(struct timer **slot, struct timer *t) {
+    t->next = *slot;
+    if (t->next) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void timer_unlink(struct timer *t) {
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+    t->pprev = NULL;
+}
+
+// Put t in the slot for t->expires relative to the wheel's current tick.
+static void wheel_add(struct timer_wheel *w, struct timer *t) {
+    long delta = t->expires - w->now;
+
+    if (delta < WHEEL_L0_SLOTS) {
+        timer_link(&w->l0[t->expires & L0_MASK], t);
+        return;
+    }
+    int level = 0;
+    int shift = L0_BITS;
+    while (level < WHEEL_LEVELS - 1 && delta >= 1L << (shift + LN_BITS)) {
+        level++;
+        shift += LN_BITS;
+    }
+    timer_link(&w->ln[level][(t->expires >> shift) & LN_MASK], t);
+}
+
+// Move every timer of slot index of a higher level down the wheel.
+// Returns index, so the caller knows whether this level wrapped too.
+static int cascade(struct timer_wheel *w, int level, int index) {
+    struct timer *t = w->ln[level][index];
+    w->ln[level][index] = NULL;
+    while (t) {
+        struct timer *next = t->next;
+        wheel_add(w, t);
+        t = next;
+    }
+    return index;
+}
+
+void wheel_init(struct timer_wheel *w) {
+    memset(w, 0, sizeof(*w));
+    w->now = now_ms();
+    w->armed = -1;
+    w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (w->fd < 0) {
+        err_sys("timerfd_create error");
+    }
+}
+
+/*
+ * (Re)schedule t to fire at expires, in now_ms() time. A deadline that
+ * has already passed fires on the next wheel_expired().
+ */
+void timer_schedule(struct timer_wheel *w, struct timer *t, long expires) {
+    if (t->pprev) {
+        timer_unlink(t);
+    } else {
+        if (w->count == 0) {
+            w->now = now_ms(); // The wheel stopped turning while it was empty
+        }
+        w->count++;
+    }
+    if (expires < w->now) {
+        expires = w->now;
+    } else if (expires - w->now >= WHEEL_SPAN) {
+        expires = w->now + WHEEL_SPAN - 1;
+    }
+    t->expires = expires;
+    wheel_add(w, t);
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t) {
+    if (t->pprev) {
+        timer_unlink(t);
+        w->count--;
+    }
+}
+
+/*
+ * Take one timer that expired at or before now off the wheel, or return
+ * NULL when there are none left. Call it in a loop; the caller may
+ * schedule and cancel timers between calls.
+ */
+struct timer *wheel_expired(struct timer_wheel *w, long now) {
+    while (w->now <= now) {
+        if (w->count == 0) {
+            w->now = now + 1; // Nothing to walk past
+            break;
+        }
+        struct timer **slot = &w->l0[w->now & L0_MASK];
+        if (*slot) {
+            struct timer *t = *slot;
+            timer_unlink(t);
+            w->count--;
+            return t;
+        }
+
+        w->now++;
+        if ((w->now & L0_MASK) == 0) {
+            int shift = L0_BITS;
+            for (int level = 0; level < WHEEL_LEVELS; level++, shift += LN_BITS) {
+                if (cascade(w, level, (w->now >> shift) & LN_MASK) != 0) {
+                    break;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Arm the timerfd for the next tick the wheel has to look at: the first
+ * non-empty level-0 slot, or the next cascade, which may bring timers
+ * down from higher levels. Disarms it when the wheel is empty. Only
+ * calls timerfd_settime() when that tick changed.
+ */
+void wheel_arm(struct timer_wheel *w) {
+    long next = -1;
+
+    if (w->count > 0) {
+        next = w->now;
+        while (w->l0[next & L0_MASK] == NULL) {
+            next++;
+            if ((next & L0_MASK) == 0) {
+                break; // Cascade point
+            }
+        }
+    }
+    if (next == w->armed) {
+        return;
+    }
+    w->armed = next;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (next >= 0) {
+        // An all-zero it_value would disarm; tick 0 never comes up anyway
+        its.it_value.tv_sec = next / 1000;
+        its.it_value.tv_nsec = (next % 1000) * 1000000L;
+    }
+    if (timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        err_sys("timerfd_settime error");
+    }
+}
+
+// Consume the timerfd's expiry count after poll() reported it readable.
+void wheel_ack(struct timer_wheel *w) {
+    uint64_t expirations;
+    if (read(w->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        err_ret("timerfd read error");
+    }
+    w->armed = -1; // Expired, so it needs setting again
+}
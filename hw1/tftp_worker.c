@@ -0,0 +1,240 @@
+#include "tftp.h"
+#include <poll.h>
+
+/*
+ * Single-port mode. Each of tftp_cfg.threads workers binds its own
+ * SO_REUSEPORT socket to the server port, one per listen address (-l),
+ * and the kernel hashes every client address and port onto one of the
+ * group, so a transfer's request and all of its later packets reach the
+ * same worker. The worker keeps its sessions in a private table keyed by
+ * client TID and runs each over the socket its request came in on,
+ * sending with sendto(), with their retransmission
+ * timers on a private timer wheel. No per-transfer port is
+ * needed, and the threads share nothing but the file cache, the
+ * counters and the session limit. A worker whose requests are queued
+ * for a slot (-S) polls the queue, since other workers free slots too.
+ */
+
+struct worker {
+    pthread_t tid;
+    int fd[TFTP_MAX_LISTEN];            // One per listen address
+    int nfd;
+    int port;
+    struct session_table table;
+    struct timer_wheel wheel;
+    struct admit_queue queue;
+};
+
+static int worker_socket(const char *host, int port) {
+    int fd = listen_socket(host, port, tftp_cfg.nlisten > 1, 1);
+
+    // Every transfer of this worker shares one receive queue
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    return fd;
+}
+
+static void worker_remove(struct worker *w, struct tftp_session *s) {
+    table_remove(&w->table, s);
+    session_close(s); // Leaves the shared socket open
+    admit_release();
+}
+
+// Start a session for the request in d, which came in on fd and has a
+// session slot.
+static void worker_start(struct worker *w, int fd, struct io_dgram *d) {
+    struct tftp_session *s = table_lookup(&w->table, (SA *)&d->addr, d->addrlen);
+    if (s != NULL) {
+        // The client reused its port for a new transfer
+        worker_remove(w, s);
+    }
+    d->buf[d->len] = '\0';
+    s = session_open(fd, w->port, (SA *)&d->addr, d->addrlen, d->buf, d->len, 0);
+    if (s == NULL) {
+        admit_release();
+        return;
+    }
+    table_insert(&w->table, s);
+    if (tftp_cfg.timer_wheel) {
+        session_set_wheel(s, &w->wheel);
+    }
+}
+
+// Hand a datagram to the transfer of the client it came from, or start one.
+static void worker_input(struct worker *w, int fd, struct io_dgram *d) {
+    uint16_t opcode = 0;
+    if (d->len >= 2) {
+        memcpy(&opcode, d->buf, sizeof(opcode));
+        opcode = ntohs(opcode);
+    }
+    struct tftp_session *s = table_lookup(&w->table, (SA *)&d->addr, d->addrlen);
+
+    if (opcode == TFTP_RRQ || opcode == TFTP_WRQ) {
+        if (s != NULL && admit_duplicate(s, d)) {
+            return;
+        }
+        if (w->queue.count || !admit_acquire()) {
+            admit_enqueue(&w->queue, fd, d); // Behind the ones already waiting
+            return;
+        }
+        worker_start(w, fd, d);
+        return;
+    }
+
+    if (s == NULL) {
+        // Not part of any transfer we know. Never answer an ERROR with one.
+        if (opcode != TFTP_ERROR) {
+            send_error_to(fd, (SA *)&d->addr, d->addrlen, TFTP_ERR_UNKNOWN_TID, "Unknown transfer ID.");
+        }
+        return;
+    }
+    if (session_input(s, d->buf, d->len) == SESSION_DONE) {
+        worker_remove(w, s);
+    }
+}
+
+// The wheel's timerfd fired: run the sessions whose deadline has passed.
+static void worker_fire(struct worker *w) {
+    struct timer *t;
+
+    wheel_ack(&w->wheel);
+    long now = now_ms();
+    while ((t = wheel_expired(&w->wheel, now)) != NULL) {
+        struct tftp_session *s = t->data;
+        if (session_timeout(s) == SESSION_DONE) {
+            worker_remove(w, s);
+        }
+    }
+}
+
+// The write-behind thread signalled: let uploads waiting for it go on.
+static void worker_resume(struct worker *w) {
+    struct tftp_session *s = w->table.live;
+
+    wb_notify_ack();
+    while (s) {
+        struct tftp_session *nexts = s->next_live;
+        if (session_resume(s) == SESSION_DONE) {
+            worker_remove(w, s);
+        }
+        s = nexts;
+    }
+}
+
+// -T scan: fire every expired retransmission timer and return the number
+// of ms until the next one, or -1 if the worker has no sessions.
+static int worker_timers(struct worker *w) {
+    long now = now_ms();
+    long next = -1;
+    struct tftp_session *s = w->table.live;
+
+    while (s) {
+        struct tftp_session *nexts = s->next_live;
+        if (s->deadline <= now && session_timeout(s) == SESSION_DONE) {
+            worker_remove(w, s);
+        } else if (next < 0 || s->deadline - now < next) {
+            next = s->deadline - now;
+        }
+        s = nexts;
+    }
+    return next < 0 ? -1 : (int)(next > 0 ? next : 0);
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    int batch = tftp_cfg.batch;
+    // One extra byte so a request can be NUL-terminated
+    char *bufs = Malloc((size_t)batch * (MAX_PACKET_SIZE + 1));
+    struct io_dgram *rx = Calloc(batch, sizeof(*rx));
+    struct pollfd pfd[TFTP_MAX_LISTEN + 2];
+    int npfd = w->nfd + 2;
+
+    for (int i = 0; i < w->nfd; i++) {
+        pfd[i].fd = w->fd[i];
+        pfd[i].events = POLLIN;
+    }
+    pfd[w->nfd].fd = -1;                    // Timer wheel, unless -T scan
+    pfd[w->nfd].events = POLLIN;
+    pfd[w->nfd + 1].fd = -1;                // Write-behind wakeups, unless -W sync
+    pfd[w->nfd + 1].events = POLLIN;
+
+    for (int i = 0; i < batch; i++) {
+        rx[i].buf = bufs + (size_t)i * (MAX_PACKET_SIZE + 1);
+        rx[i].size = MAX_PACKET_SIZE;
+    }
+
+    if (tftp_cfg.timer_wheel) {
+        wheel_init(&w->wheel);
+        pfd[w->nfd].fd = w->wheel.fd;
+    }
+    if (tftp_cfg.write_mode != WRITE_SYNC) {
+        pfd[w->nfd + 1].fd = wb_notify_fd();
+    }
+
+    for (;;) {
+        struct admit_req *r;
+
+        if (stats_requested) {
+            print_stats();
+        }
+        while ((r = admit_dequeue(&w->queue)) != NULL) {
+            worker_start(w, r->fd, &r->d);
+            free(r);
+        }
+        int timeout = -1;
+        if (tftp_cfg.timer_wheel) {
+            wheel_arm(&w->wheel);
+        } else {
+            timeout = worker_timers(w);
+        }
+        if (w->queue.count && (timeout < 0 || timeout > ADMIT_RETRY_MS)) {
+            timeout = ADMIT_RETRY_MS;
+        }
+        int nready = poll(pfd, npfd, timeout);
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err_sys("poll error");
+        }
+        if (pfd[w->nfd].revents & POLLIN) {
+            worker_fire(w);
+        }
+        if (pfd[w->nfd + 1].revents & POLLIN) {
+            worker_resume(w);
+        }
+        for (int j = 0; j < w->nfd; j++) {
+            if (!(pfd[j].revents & POLLIN)) {
+                continue;
+            }
+            int n = io_recv(w->fd[j], rx, batch, MSG_DONTWAIT);
+            for (int i = 0; i < n; i++) {
+                worker_input(w, w->fd[j], &rx[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+void workers_run(int port) {
+    int nworkers = tftp_cfg.threads;
+    struct worker *workers = Calloc(nworkers, sizeof(*workers));
+
+    // Bind the whole group before any worker starts reading, so the
+    // kernel's hash doesn't change under the first transfers
+    for (int i = 0; i < nworkers; i++) {
+        if (tftp_cfg.nlisten == 0) {
+            workers[i].fd[workers[i].nfd++] = worker_socket(NULL, port);
+        }
+        for (int j = 0; j < tftp_cfg.nlisten; j++) {
+            workers[i].fd[workers[i].nfd++] = worker_socket(tftp_cfg.listen_hosts[j], port);
+        }
+        workers[i].port = port;
+    }
+
+    printf("Waiting for requests (%d reuseport workers on port %d)...\n", nworkers, port);
+    for (int i = 1; i < nworkers; i++) {
+        Pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+    }
+    worker_main(&workers[0]);
+}
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE // O_DIRECT
+#include "tftp.h"
+#include <sys/eventfd.h>
+
+/*
+ * Write-behind for WRQ uploads. Each upload gets a ring buffer aligned
+ * for O_DIRECT; the session copies every DATA block into the ring and
+ * ACKs it straight away, and one writer thread per process drains the
+ * rings to disk in WB_CHUNK-sized aligned pwrite()s.
+ *
+ * Nothing here waits for the writer: the thread running the session may
+ * run many others. wb_room() says how much more the ring can take, and
+ * wb_finish() fails with EAGAIN until the file is complete. Either way
+ * the stream is then marked waiting, and once the writer has moved on it
+ * signals the eventfd of the thread that opened it (wb_notify_fd()),
+ * whose event loop calls session_resume() to carry on.
+ *
+ * The final, partial chunk can't be written with O_DIRECT, so O_DIRECT
+ * is switched off for that one write. With -f chunk every chunk is
+ * followed by fdatasync(); with -f close the writer fsync()s the file
+ * once it is all written, before wb_finish() reports it complete, i.e.
+ * before the final ACK.
+ */
+
+#define WB_ALIGN 4096
+#define WB_CHUNK (256 * 1024)
+#define WB_RING_SIZE (4 * WB_CHUNK)
+
+struct wb_stream {
+    int fd;
+    char *ring;
+    uint64_t head;                      // Bytes appended by the session
+    uint64_t tail;                      // Bytes written to the file
+    int finishing;                      // No more data: write out the partial tail too
+    int done;                           // Finishing, and all written (and synced)
+    int busy;                           // Writer is in pwrite() or fsync() on this stream
+    int error;                          // errno of a failed write, 0 if none
+    int queued;                         // On the writer's queue
+    int waiting;                        // The session is waiting: signal notify
+    int orphaned;                       // Aborted while busy: the writer frees it
+    int notify;                         // eventfd of the thread running the session
+    struct wb_stream *next_queued;
+};
+
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_work = PTHREAD_COND_INITIALIZER;      // Queue non-empty
+static struct wb_stream *queue_head, *queue_tail;
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static __thread int notify_fd = -1;
+
+// Bytes the writer can take from w right now. Called with wb_lock held.
+static size_t writable(const struct wb_stream *w) {
+    uint64_t pending = w->head - w->tail;
+    size_t offset = w->tail % WB_RING_SIZE;
+    size_t len = pending < WB_RING_SIZE - offset ? pending : WB_RING_SIZE - offset;
+
+    if (w->finishing) {
+        return len;
+    }
+    // Only whole chunks until the end of the upload
+    return len >= WB_CHUNK ? WB_CHUNK : 0;
+}
+
+// Queue w for the writer if it has something to do: chunks to write, or
+// once finishing, the rest of the file and then the close-out.
+static void enqueue(struct wb_stream *w) {
+    if (w->queued || w->busy || w->error || w->done || (writable(w) == 0 && !w->finishing)) {
+        return;
+    }
+    w->queued = 1;
+    w->next_queued = NULL;
+    if (queue_tail) {
+        queue_tail->next_queued = w;
+    } else {
+        queue_head = w;
+    }
+    queue_tail = w;
+    Pthread_cond_signal(&wb_work);
+}
+
+static void wb_free(struct wb_stream *w) {
+    close(w->fd);
+    free(w->ring);
+    free(w);
+}
+
+static void *writer_main(void *arg) {
+    Pthread_detach(pthread_self());
+    Pthread_mutex_lock(&wb_lock);
+    for (;;) {
+        while (queue_head == NULL) {
+            Pthread_cond_wait(&wb_work, &wb_lock);
+        }
+        struct wb_stream *w = queue_head;
+        if ((queue_head = w->next_queued) == NULL) {
+            queue_tail = NULL;
+        }
+        w->queued = 0;
+
+        size_t len = writable(w);
+        char *buf = w->ring + w->tail % WB_RING_SIZE;
+        off_t offset = w->tail;
+        w->busy = 1;
+        Pthread_mutex_unlock(&wb_lock);
+
+        ssize_t n = 0;
+        int err = 0;
+        if (len > 0) {
+            // Direct I/O needs the length aligned; only the last write isn't
+            if (tftp_cfg.write_mode == WRITE_DIRECT && len % WB_ALIGN != 0) {
+                fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+            }
+            n = pwrite(w->fd, buf, len, offset);
+            err = n < 0 ? errno : 0;
+            if (n >= 0 && tftp_cfg.fsync_policy == FSYNC_CHUNK && fdatasync(w->fd) < 0) {
+                err = errno;
+            }
+        } else if (tftp_cfg.fsync_policy == FSYNC_CLOSE) {
+            // All written on a finishing stream: sync it before it's done
+            if (fsync(w->fd) < 0) {
+                err = errno;
+            }
+        }
+
+        Pthread_mutex_lock(&wb_lock);
+        w->busy = 0;
+        if (w->orphaned) {
+            wb_free(w);
+            continue;
+        }
+        if (err) {
+            w->error = err;
+        } else if (len > 0) {
+            w->tail += n;
+        } else {
+            w->done = 1;
+        }
+        enqueue(w);
+        if (w->waiting) {
+            uint64_t one = 1;
+            w->waiting = 0;
+            if (write(w->notify, &one, sizeof(one)) < 0) {
+                err_ret("eventfd write error");
+            }
+        }
+    }
+    return NULL;
+}
+
+static void writer_start(void) {
+    pthread_t tid;
+    Pthread_create(&tid, NULL, writer_main, NULL);
+}
+
+/*
+ * The calling thread's eventfd, created on first use. The writer signals
+ * it when an upload this thread opened can go on; the thread's event loop
+ * watches it, reads it to reset it and calls session_resume().
+ */
+int wb_notify_fd(void) {
+    if (notify_fd < 0 && (notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        err_sys("eventfd error");
+    }
+    return notify_fd;
+}
+
+// Reset the calling thread's eventfd once its loop has seen it fire.
+void wb_notify_ack(void) {
+    uint64_t count;
+    if (read(notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        err_ret("eventfd read error");
+    }
+}
+
+/*
+ * Create path for writing, failing if it exists. Returns NULL with errno
+ * set on failure.
+ */
+struct wb_stream *wb_open(const char *path) {
+    int flags = O_WRONLY | O_CREAT | O_EXCL;
+    int fd = -1;
+
+    if (tftp_cfg.write_mode == WRITE_DIRECT) {
+        fd = open(path, flags | O_DIRECT, 0644);
+        if (fd < 0 && errno == EINVAL) {
+            // The filesystem can't do direct I/O (tmpfs, for one)
+            fd = open(path, flags, 0644);
+        }
+    } else {
+        fd = open(path, flags, 0644);
+    }
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct wb_stream *w = calloc(1, sizeof(*w));
+    if (w == NULL || posix_memalign((void **)&w->ring, WB_ALIGN, WB_RING_SIZE) != 0) {
+        free(w);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    w->fd = fd;
+    w->notify = wb_notify_fd();
+    pthread_once(&writer_once, writer_start);
+    return w;
+}
+
+/*
+ * Free space in the ring. If that is less than want, the writer signals
+ * wb_notify_fd() once it has made more. After a failed write there is
+ * always room, so that wb_append() gets to report the error.
+ */
+size_t wb_room(struct wb_stream *w, size_t want) {
+    Pthread_mutex_lock(&wb_lock);
+    size_t room = w->error ? want : WB_RING_SIZE - (w->head - w->tail);
+    if (room < want) {
+        // A nearly full ring always has a chunk queued, so the writer will
+        w->waiting = 1;
+    }
+    Pthread_mutex_unlock(&wb_lock);
+    return room;
+}
+
+/*
+ * Copy len bytes to the end of the upload. Returns 0 once they are in
+ * the ring, or -1 with errno set if an earlier write failed or, EAGAIN,
+ * if wb_room() said they wouldn't fit.
+ */
+int wb_append(struct wb_stream *w, const char *data, size_t len) {
+    Pthread_mutex_lock(&wb_lock);
+    if (w->error || WB_RING_SIZE - (w->head - w->tail) < len) {
+        errno = w->error ? w->error : EAGAIN;
+        Pthread_mutex_unlock(&wb_lock);
+        return -1;
+    }
+    size_t offset = w->head % WB_RING_SIZE;
+    Pthread_mutex_unlock(&wb_lock);
+
+    // The writer never touches the free part of the ring
+    size_t first = len < WB_RING_SIZE - offset ? len : WB_RING_SIZE - offset;
+    memcpy(w->ring + offset, data, first);
+    memcpy(w->ring, data + first, len - first);
+
+    Pthread_mutex_lock(&wb_lock);
+    w->head += len;
+    enqueue(w);
+    Pthread_mutex_unlock(&wb_lock);
+    return 0;
+}
+
+/*
+ * Write out everything appended so far, fsync if the policy asks for it,
+ * and close the file. Returns -1 with errno EAGAIN while the writer is
+ * still at it: call again once wb_notify_fd() fires. Otherwise returns 0
+ * on success or -1 with errno set, and w is freed.
+ */
+int wb_finish(struct wb_stream *w) {
+    Pthread_mutex_lock(&wb_lock);
+    if (!w->done && !w->error) {
+        if (!w->finishing) {
+            w->finishing = 1;
+            enqueue(w);
+        }
+        w->waiting = 1;
+        Pthread_mutex_unlock(&wb_lock);
+        errno = EAGAIN;
+        return -1;
+    }
+    int err = w->error;
+    Pthread_mutex_unlock(&wb_lock);
+
+    wb_free(w);
+    errno = err;
+    return err ? -1 : 0;
+}
+
+// Give up on the upload. The caller removes the partial file.
+void wb_abort(struct wb_stream *w) {
+    Pthread_mutex_lock(&wb_lock);
+    // Keep the writer off w; a write already under way frees it when done
+    w->error = w->error ? w->error : ECANCELED;
+    if (w->queued) {
+        struct wb_stream **pp = &queue_head;
+        struct wb_stream *prev = NULL;
+        while (*pp != w) {
+            prev = *pp;
+            pp = &(*pp)->next_queued;
+        }
+        *pp = w->next_queued;
+        if (queue_tail == w) {
+            queue_tail = prev;
+        }
+        w->queued = 0;
+    }
+    if (w->busy) {
+        w->orphaned = 1;
+        Pthread_mutex_unlock(&wb_lock);
+        return;
+    }
+    Pthread_mutex_unlock(&wb_lock);
+    wb_free(w);
+}
@@ -0,0 +1,68 @@
+#!/bin/bash
+
+# Fan-out cost per broadcast at 1000 recipients: heap allocations, bytes
+# allocated, bytes copied in user space and socket writes, counted by the
+# copy_count.so preload library. Two cases:
+#
+#   idle        1000 clients that read nothing until the end; their
+#               socket buffers take every line, so nothing is queued
+#   backlogged  1000 clients that never read (4 KB receive buffers),
+#               server run with -s drop; once the kernel stops taking
+#               data every line is queued, and dropped, per client
+#
+# Each case runs twice, for a short and a long time, and the difference
+# is divided by the difference in messages sent, so connecting and
+# logging in cancel out. 2 talkers send 40 messages/s of 100 (idle) or
+# 900 (backlogged) bytes.
+#
+# SOURCE=path measures another version of chatroom_server.c, e.g.
+#   git show <commit>:hw2/chatroom_server.c > /tmp/old.c; SOURCE=/tmp/old.c ./bench_fanout.sh
+#
+# Run from hw2: ./bench_fanout.sh
+
+PORT=${PORT:-12000}
+SOURCE=${SOURCE:-chatroom_server.c}
+RECIPIENTS=${RECIPIENTS:-1000}
+
+cd "$(dirname "$0")" || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+
+echo "Compiling..."
+# no builtins and no fortify wrappers, so every copy is a library call
+gcc -O2 -fno-builtin -U_FORTIFY_SOURCE -pthread -o "$WORKDIR/server" "$SOURCE" || exit 1
+gcc -O2 -Wall -shared -fPIC -o "$WORKDIR/copy_count.so" copy_count.c -ldl || exit 1
+gcc -O2 -Wall -o chat_bench chat_bench.c || exit 1
+
+field() {
+    echo "$1" | sed -n "s|.*\b$2=\([0-9.]*\).*|\1|p"
+}
+
+# measure <seconds> <server options> <chat_bench options>; sets SENT and COUNTS
+measure() {
+    COPY_COUNT_OUT="$WORKDIR/counts" LD_PRELOAD="$WORKDIR/copy_count.so" \
+        "$WORKDIR/server" $2 $PORT 3 $((RECIPIENTS + 100)) > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+    OUT=$(./chat_bench -t 2 -r 20 -d $1 $3 127.0.0.1 $PORT)
+    kill -INT $SERVER_PID
+    wait $SERVER_PID
+    SENT=$(field "$OUT" sent)
+    COUNTS=$(cat "$WORKDIR/counts")
+}
+
+printf "%-11s %8s %12s %8s %13s %8s\n" case allocs alloc_bytes copies copy_bytes writes
+for CASE in "idle:5:10::-i $RECIPIENTS -l 100" "backlogged:20:30:-s drop:-s $RECIPIENTS -l 900"; do
+    IFS=: read -r NAME SHORT LONG SERVER_ARGS BENCH_ARGS <<< "$CASE"
+    measure $SHORT "$SERVER_ARGS" "$BENCH_ARGS"
+    SENT1=$SENT
+    COUNTS1=$COUNTS
+    measure $LONG "$SERVER_ARGS" "$BENCH_ARGS"
+    ROW=$NAME
+    for F in allocs alloc_bytes copies copy_bytes writes; do
+        ROW="$ROW $(awk -v a=$(field "$COUNTS1" $F) -v b=$(field "$COUNTS" $F) -v n=$((SENT - SENT1)) \
+            'BEGIN { printf "%.1f", (b - a) / n }')"
+    done
+    printf "%-11s %8s %12s %8s %13s %8s\n" $ROW
+done
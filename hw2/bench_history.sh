@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# History cost on the broadcast path: the bench_rooms.sh cases run with
+# room history off (-H 0) and at its default of 16 KB per room. 19000
+# idle clients and 100 talkers, 10 s per case; with history on, every
+# client also gets the lobby's history when it connects and its room's
+# when it joins. Reports deliveries per second, delivery latency at the
+# talkers and the server's CPU use.
+#
+# Run from hw2: ./bench_history.sh
+
+PORT=${PORT:-12000}
+SERVER=${SERVER:-./chatroom_server.out}
+IDLE=${IDLE:-19000}
+TALKERS=${TALKERS:-100}
+CASES=${CASES:-"0:0.5 1000:100 1000:300"}
+HISTORY=${HISTORY:-"0 16"}
+SECONDS_PER_CASE=${SECONDS_PER_CASE:-10}
+
+cd "$(dirname "$0")" || exit 1
+
+echo "Compiling..."
+make -s chatroom_server.out || exit 1
+gcc -O2 -Wall -o chat_bench chat_bench.c || exit 1
+
+field() {
+    echo "$1" | sed -n "s|.* $2=\([0-9.%/]*\).*|\1|p"
+}
+
+printf "%8s %6s %6s %8s %20s %12s %9s %9s %8s\n" history rooms rate sent delivered "per sec" p50_ms p99_ms cpu
+for CASE in $CASES; do
+    IFS=: read -r ROOMS RATE <<< "$CASE"
+    for H in $HISTORY; do
+        $SERVER -H $H $PORT 3 20000 > /dev/null 2>&1 &
+        SERVER_PID=$!
+        sleep 0.5
+        OUT=$(./chat_bench -p $SERVER_PID -j $ROOMS -i $IDLE -t $TALKERS -r $RATE -d $SECONDS_PER_CASE 127.0.0.1 $PORT)
+        kill -INT $SERVER_PID 2>/dev/null
+        wait $SERVER_PID 2>/dev/null
+        printf "%8s %6s %6s %8s %20s %12s %9s %9s %8s\n" ${H}KB $ROOMS $RATE "$(field "$OUT" sent)" \
+            "$(field "$OUT" delivered_idle)" "$(field "$OUT" deliveries/sec)" "$(field "$OUT" p50_ms)" \
+            "$(field "$OUT" p99_ms)" "$(field "$OUT" server_cpu)"
+    done
+done
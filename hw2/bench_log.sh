@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# Broadcast log cost: 19000 idle clients and 100 talkers spread over 1000
+# rooms, at 10000 and 30000 messages/s offered (the second more than one
+# core keeps up with), with the log off and on at group commit intervals
+# of 50 ms (the default) and 1 ms. Reports messages sent and delivered
+# per second, delivery latency at the talkers, the server's CPU use, and
+# the lines the log wrote, the fdatasync() calls it took and the lines
+# it dropped because its ring was full.
+#
+# The log goes in LOG_DIR, a fresh temporary directory by default; point
+# it at the disk to measure.
+#
+# Run from hw2: ./bench_log.sh
+
+PORT=${PORT:-12000}
+SERVER=${SERVER:-./chatroom_server.out}
+IDLE=${IDLE:-19000}
+TALKERS=${TALKERS:-100}
+ROOMS=${ROOMS:-1000}
+RATES=${RATES:-"100 300"}
+SYNC_MS=${SYNC_MS:-"off 50 1"}
+SECONDS_PER_CASE=${SECONDS_PER_CASE:-10}
+
+cd "$(dirname "$0")" || exit 1
+
+if [ -z "$LOG_DIR" ]; then
+    LOG_DIR=$(mktemp -d)
+    trap 'rm -rf "$LOG_DIR"' EXIT
+else
+    trap 'rm -f "$LOG_DIR/bench.log" "$LOG_DIR/server.out"' EXIT
+fi
+
+echo "Compiling..."
+make -s chatroom_server.out || exit 1
+gcc -O2 -Wall -o chat_bench chat_bench.c || exit 1
+
+field() {
+    echo "$1" | sed -n "s|.* $2=\([0-9.%/]*\).*|\1|p"
+}
+
+printf "%6s %6s %8s %8s %20s %12s %9s %9s %8s %9s %8s %8s\n" log rate "msgs/s" sent delivered "per sec" \
+    p50_ms p99_ms cpu logged commits dropped
+for RATE in $RATES; do
+    for SYNC in $SYNC_MS; do
+        rm -f "$LOG_DIR/bench.log"
+        if [ "$SYNC" = off ]; then
+            $SERVER $PORT 3 20000 > "$LOG_DIR/server.out" 2>&1 &
+        else
+            $SERVER -L "$LOG_DIR/bench.log" -T $SYNC $PORT 3 20000 > "$LOG_DIR/server.out" 2>&1 &
+        fi
+        SERVER_PID=$!
+        sleep 0.5
+        OUT=$(./chat_bench -p $SERVER_PID -j $ROOMS -i $IDLE -t $TALKERS -r $RATE -d $SECONDS_PER_CASE 127.0.0.1 $PORT)
+        kill -INT $SERVER_PID 2>/dev/null
+        wait $SERVER_PID 2>/dev/null
+        # "Log: <lines> lines in <commits> commits, <dropped> not logged"
+        read -r LOGGED COMMITS DROPPED <<< "$(sed -n 's/^Log: \([0-9]*\) lines in \([0-9]*\) commits, \([0-9]*\) not logged/\1 \2 \3/p' "$LOG_DIR/server.out")"
+        SENT=$(field "$OUT" sent)
+        printf "%6s %6s %8s %8s %20s %12s %9s %9s %8s %9s %8s %8s\n" $SYNC $RATE $((SENT / SECONDS_PER_CASE)) $SENT \
+            "$(field "$OUT" delivered_idle)" "$(field "$OUT" deliveries/sec)" "$(field "$OUT" p50_ms)" \
+            "$(field "$OUT" p99_ms)" "$(field "$OUT" server_cpu)" "${LOGGED:--}" "${COMMITS:--}" "${DROPPED:--}"
+    done
+done
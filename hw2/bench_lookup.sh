@@ -0,0 +1,51 @@
+#!/bin/bash
+
+# Per-message cost as the number of connected clients grows: round trips
+# for a login (the server checks the name is free), /who, and a command
+# answered to the sender alone, measured by lookup_bench with 10 up to
+# 19000 clients connected, 100 of them logged in. The last row repeats
+# the largest case while a talker broadcasts 2 lines per second to every
+# client, so the probes run alongside fan-outs.
+#
+# 50000 clients would need more descriptors than RLIMIT_NOFILE allows
+# here (20000, for the server and the bench together), so CLIENTS stops
+# at 19000.
+#
+# SOURCE=path measures another version of chatroom_server.c, e.g.
+#   git show <commit>:hw2/chatroom_server.c > /tmp/old.c; SOURCE=/tmp/old.c ./bench_lookup.sh
+#
+# Run from hw2: ./bench_lookup.sh
+
+PORT=${PORT:-12000}
+SOURCE=${SOURCE:-chatroom_server.c}
+CLIENTS=${CLIENTS:-"10 100 1000 10000 19000"}
+ROUNDS=${ROUNDS:-100}
+BUSY_RATE=${BUSY_RATE:-2}
+
+cd "$(dirname "$0")" || exit 1
+
+WORKDIR=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+
+echo "Compiling..."
+gcc -O2 -pthread -I. -o "$WORKDIR/server" "$SOURCE" || exit 1
+gcc -O2 -Wall -pthread -o lookup_bench lookup_bench.c || exit 1
+
+field() {
+    echo "$1" | sed -n "s|.*\b$2=\([0-9.]*\).*|\1|p"
+}
+
+MAX=$(echo $CLIENTS | awk '{ print $NF }')
+printf "%8s %6s %10s %10s %10s %10s %12s %12s\n" clients bcast login_p50 login_p99 who_p50 who_p99 unicast_p50 unicast_p99
+for CASE in $(for N in $CLIENTS; do echo $N:0; done) $MAX:$BUSY_RATE; do
+    IFS=: read -r N RATE <<< "$CASE"
+    "$WORKDIR/server" $PORT 3 20000 > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+    OUT=$(./lookup_bench -k $ROUNDS -b $RATE 127.0.0.1 $PORT $N)
+    kill -INT $SERVER_PID
+    wait $SERVER_PID
+    printf "%8s %6s %10s %10s %10s %10s %12s %12s\n" $N $RATE \
+        "$(field "$OUT" login_p50_us)" "$(field "$OUT" login_p99_us)" "$(field "$OUT" who_p50_us)" \
+        "$(field "$OUT" who_p99_us)" "$(field "$OUT" unicast_p50_us)" "$(field "$OUT" unicast_p99_us)"
+done
@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Reactor benchmark: 100 talkers, each sending a message every 20 s on
+# average (5 messages/s in all), with 0, 900 and 10000 idle clients
+# connected. Every message goes to every other client, so the server
+# delivers (idle + 99) lines per message. Reports delivery latency at the
+# talkers, how long the idle clients took to connect, and the server's
+# CPU use while the talkers send.
+#
+# SERVER=path runs another build, e.g. the select() version; it cannot
+# take more than FD_SETSIZE descriptors, so give it IDLE="0 900".
+#
+# Run from hw2: ./bench_reactor.sh
+
+PORT=${PORT:-12000}
+SERVER=${SERVER:-./chatroom_server.out}
+IDLE=${IDLE:-"0 900 10000"}
+TALKERS=${TALKERS:-100}
+RATE=${RATE:-0.05}
+SECONDS_PER_CASE=${SECONDS_PER_CASE:-20}
+
+cd "$(dirname "$0")" || exit 1
+
+echo "Compiling..."
+make -s chatroom_server.out || exit 1
+gcc -O2 -Wall -o chat_bench chat_bench.c || exit 1
+
+field() {
+    echo "$1" | sed -n "s|.* $2=\([0-9.%/]*\).*|\1|p"
+}
+
+printf "%6s %8s %16s %9s %8s %8s %8s %10s %8s\n" idle talkers delivered "per sec" p50_ms p99_ms max_ms connect_s cpu
+for N in $IDLE; do
+    $SERVER $PORT 3 20000 > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+    OUT=$(./chat_bench -p $SERVER_PID -i $N -t $TALKERS -r $RATE -d $SECONDS_PER_CASE 127.0.0.1 $PORT)
+    kill -INT $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null
+    printf "%6s %8s %16s %9s %8s %8s %8s %10s %8s\n" $N $TALKERS "$(field "$OUT" delivered_idle)" \
+        "$(field "$OUT" deliveries/sec)" "$(field "$OUT" p50_ms)" "$(field "$OUT" p99_ms)" \
+        "$(field "$OUT" max_ms)" "$(field "$OUT" connect_s)" "$(field "$OUT" server_cpu)"
+done
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# Room fan-out benchmark: 19000 idle clients and 100 talkers, first all in
+# the lobby, where every message goes to every client, then spread over
+# 1000 rooms of about 19, where a message goes to its room only. Talkers
+# send at RATE messages/s each for 10 s; the rates are chosen to push
+# each case to about what one core can send. Reports messages and lines
+# delivered, deliveries per second, delivery latency at the talkers and
+# the server's CPU use.
+#
+# 50000 clients would need more descriptors than RLIMIT_NOFILE allows
+# here (20000, for the server and the bench together), so IDLE defaults
+# to 19000.
+#
+# Run from hw2: ./bench_rooms.sh
+
+PORT=${PORT:-12000}
+SERVER=${SERVER:-./chatroom_server.out}
+IDLE=${IDLE:-19000}
+TALKERS=${TALKERS:-100}
+CASES=${CASES:-"0:0.5 1000:100 1000:300"}
+SECONDS_PER_CASE=${SECONDS_PER_CASE:-10}
+
+cd "$(dirname "$0")" || exit 1
+
+echo "Compiling..."
+make -s chatroom_server.out || exit 1
+gcc -O2 -Wall -o chat_bench chat_bench.c || exit 1
+
+field() {
+    echo "$1" | sed -n "s|.* $2=\([0-9.%/]*\).*|\1|p"
+}
+
+printf "%6s %6s %6s %8s %20s %12s %9s %9s %8s\n" rooms idle rate sent delivered "per sec" p50_ms p99_ms cpu
+for CASE in $CASES; do
+    IFS=: read -r ROOMS RATE <<< "$CASE"
+    $SERVER $PORT 3 20000 > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+    OUT=$(./chat_bench -p $SERVER_PID -j $ROOMS -i $IDLE -t $TALKERS -r $RATE -d $SECONDS_PER_CASE 127.0.0.1 $PORT)
+    kill -INT $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null
+    printf "%6s %6s %6s %8s %20s %12s %9s %9s %8s\n" $ROOMS $IDLE $RATE "$(field "$OUT" sent)" \
+        "$(field "$OUT" delivered_idle)" "$(field "$OUT" deliveries/sec)" "$(field "$OUT" p50_ms)" \
+        "$(field "$OUT" p99_ms)" "$(field "$OUT" server_cpu)"
+done
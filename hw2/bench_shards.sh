@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Multi-reactor benchmark: the server run with 1, 2, 4 and 8 reactors,
+# 19000 idle clients and 100 talkers sending 50 messages/s in all for
+# 10 s, more than one core can fan out to every client. Reports the
+# lines delivered per second, delivery latency at the talkers and the
+# server's CPU use.
+#
+# 20000 clients and the bench's own sockets do not fit in the 20000
+# descriptors RLIMIT_NOFILE allows here, so IDLE defaults to 19000.
+#
+# Run from hw2: ./bench_shards.sh
+
+PORT=${PORT:-12000}
+SERVER=${SERVER:-./chatroom_server.out}
+REACTORS=${REACTORS:-"1 2 4 8"}
+IDLE=${IDLE:-19000}
+TALKERS=${TALKERS:-100}
+RATE=${RATE:-0.5}
+SECONDS_PER_CASE=${SECONDS_PER_CASE:-10}
+
+cd "$(dirname "$0")" || exit 1
+
+echo "Compiling..."
+make -s chatroom_server.out || exit 1
+gcc -O2 -Wall -o chat_bench chat_bench.c || exit 1
+
+field() {
+    echo "$1" | sed -n "s|.* $2=\([0-9.%/]*\).*|\1|p"
+}
+
+printf "%8s %6s %20s %9s %9s %9s %8s\n" reactors idle delivered "per sec" p50_ms p99_ms cpu
+for R in $REACTORS; do
+    $SERVER -r $R $PORT 3 20000 > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+    OUT=$(./chat_bench -p $SERVER_PID -i $IDLE -t $TALKERS -r $RATE -d $SECONDS_PER_CASE 127.0.0.1 $PORT)
+    kill -INT $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null
+    printf "%8s %6s %20s %9s %9s %9s %8s\n" $R $IDLE "$(field "$OUT" delivered_idle)" \
+        "$(field "$OUT" deliveries/sec)" "$(field "$OUT" p50_ms)" "$(field "$OUT" p99_ms)" \
+        "$(field "$OUT" server_cpu)"
+done
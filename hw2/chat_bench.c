@@ -0,0 +1,442 @@
+/*
+ * Load generator and latency benchmark for the chatroom server.
+ *
+ * Connects <talkers> clients that log in as t0, t1, ... and <idle>
+ * clients that connect but never send a line, then for <seconds> has
+ * every talker send a message at <rate> per second (evenly spaced, with
+ * a random phase). A message carries its send time, so every talker that
+ * receives it records the delivery latency. Idle clients are not read
+ * while the test runs; what the server sent them waits in their socket
+ * buffers and is counted when they are drained at the end.
+ *
+ * -s adds <slow> clients that stop reading once set up: they shrink their
+ * receive buffer to 4 KB and are only counted at the end, along with how
+ * many the server disconnected. -l pads every message to <length> bytes, so the
+ * slow clients fall behind sooner.
+ *
+ * -j spreads every client over <rooms> rooms, r0, r1, ..., by connection
+ * order, with at least two talkers in each room that has one, so every
+ * message still reaches a talker. Each client logs in (idle clients as
+ * i0, i1, ...) and joins its room before the test, and a message is only
+ * expected in its sender's room.
+ * Without -j everyone stays in the lobby and gets every message.
+ *
+ * Prints the messages sent, the lines delivered to talkers and to idle
+ * clients against the number expected (every client but the sender),
+ * deliveries per second, and the median, 99th percentile and maximum
+ * latency, and how long the idle clients took to connect. With -p the
+ * server's CPU use (user + system, from /proc/<pid>/stat) over the sending
+ * phase is reported as well. The exit status is non-zero if a connection
+ * failed.
+ *
+ * Build: gcc -O2 -Wall -o chat_bench chat_bench.c
+ * Usage: ./chat_bench [-i idle] [-s slow] [-t talkers] [-r rate] [-l length] [-d seconds]
+ *                     [-j rooms] [-p server_pid] <host> <port>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define LINE_MAX_LEN 2048
+#define MAX_SAMPLES  (4 * 1024 * 1024)
+#define SLOW_RCVBUF  4096
+
+typedef struct Conn {
+    int fd;
+    int talker;                 // Logs in and sends; else idle
+    int registered;             // Saw "Let's start chatting", or "You joined" under -j
+    int room;
+    long lines;                 // Lines received
+    long next_send_us;          // Talker: when to send the next message
+    char buf[LINE_MAX_LEN];     // Talker: partial line
+    int len;
+} Conn;
+
+static Conn *conns;
+static int nidle = 0, nslow = 0, ntalkers = 10;
+static int msg_len = 0;         // -l: pad messages to this many bytes
+static double rate = 1.0;       // Messages per second per talker
+static int seconds = 10;
+static long *samples;           // Latencies in us
+static long nsamples;
+static long sent;
+static long talker_chat_lines;  // Chat messages delivered to talkers
+static long expect_talkers, expect_idle, expect_slow;   // Deliveries due
+static int server_pid;          // -p: report this process's CPU use
+static int nrooms = 0;          // -j: clients spread over this many rooms
+static int *room_talkers, *room_idle, *room_slow;   // Members per room
+
+static long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+// CPU time used by process pid so far, in clock ticks
+static long cpu_ticks(int pid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+
+    // Fields 14 and 15, counted after the parenthesised command name
+    char *p = strrchr(buf, ')');
+    long utime = 0, stime = 0;
+    if (p != NULL) {
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld", &utime, &stime);
+    }
+    return utime + stime;
+}
+
+// rcvbuf > 0 sets SO_RCVBUF first, so the window is small from the start
+static int connect_to(struct addrinfo *ai, int rcvbuf) {
+    int fd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (rcvbuf > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static void send_line(Conn *c, const char *line) {
+    size_t len = strlen(line);
+    if (send(c->fd, line, len, 0) != (ssize_t)len) {
+        perror("send");
+        exit(1);
+    }
+}
+
+// One complete line received by a talker
+static void talker_line(Conn *c, char *line) {
+    char *m = strstr(line, ": m ");
+    if (m != NULL) {
+        talker_chat_lines++;
+        if (nsamples < MAX_SAMPLES) {
+            samples[nsamples++] = now_us() - atol(m + 4);
+        }
+    } else if (strncmp(line, "Let's start chatting", 20) == 0) {
+        if (nrooms) {
+            // a worker per line: /join must not overtake the login
+            char join[32];
+            snprintf(join, sizeof(join), "/join r%d\n", c->room);
+            send_line(c, join);
+        } else {
+            c->registered = 1;
+        }
+    } else if (strncmp(line, "You joined", 10) == 0) {
+        c->registered = 1;
+    }
+}
+
+// Read what is waiting on c. Returns -1 if the server closed it.
+static int drain(Conn *c) {
+    char buf[65536];
+    for (;;) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] == '\n') {
+                c->lines++;
+            }
+            if (!c->talker) {
+                continue;
+            }
+            if (buf[i] == '\n') {
+                c->buf[c->len] = '\0';
+                talker_line(c, c->buf);
+                c->len = 0;
+            } else if (c->len < LINE_MAX_LEN - 1) {
+                c->buf[c->len++] = buf[i];
+            }
+        }
+    }
+}
+
+// Wait for a line starting with prefix on a non-talker; what comes before
+// it is counted but not kept
+static void await_line(Conn *c, const char *prefix) {
+    char buf[4096];
+    int len = 0;
+    long deadline = now_us() + 10 * 1000000L;
+    for (;;) {
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+        if (now_us() > deadline || poll(&pfd, 1, 1000) < 0) {
+            fprintf(stderr, "no \"%s\" from the server\n", prefix);
+            exit(1);
+        }
+        ssize_t n = recv(c->fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            fprintf(stderr, "server closed a connection waiting for \"%s\"\n", prefix);
+            exit(1);
+        }
+        if (n < 0) {
+            continue;
+        }
+        len += n;
+        buf[len] = '\0';
+        if (strstr(buf, prefix) != NULL) {
+            return;
+        }
+        // keep the tail in case the reply is split
+        if (len > 64) {
+            memmove(buf, buf + len - 64, 64);
+            len = 64;
+        }
+    }
+}
+
+// -j: log in a non-talker and wait until it is in its room
+static void join_room(Conn *c, const char *name) {
+    char line[LINE_MAX_LEN];
+    snprintf(line, sizeof(line), "%s\n", name);
+    send_line(c, line);
+    await_line(c, "Let's start chatting");
+    snprintf(line, sizeof(line), "/join r%d\n", c->room);
+    send_line(c, line);
+    await_line(c, "You joined");
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-i idle] [-s slow] [-t talkers] [-r rate] [-l length] [-d seconds] "
+            "[-j rooms] [-p server_pid] <host> <port>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "i:s:t:r:l:d:j:p:")) != -1) {
+        switch (opt) {
+            case 'i':
+                nidle = atoi(optarg);
+                break;
+            case 's':
+                nslow = atoi(optarg);
+                break;
+            case 't':
+                ntalkers = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'l':
+                msg_len = atoi(optarg);
+                break;
+            case 'd':
+                seconds = atoi(optarg);
+                break;
+            case 'j':
+                nrooms = atoi(optarg);
+                break;
+            case 'p':
+                server_pid = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || nidle < 0 || nslow < 0 || ntalkers < 2 || msg_len < 0 || msg_len >= 1000 || rate <= 0 || seconds <= 0 || nrooms < 0) {
+        usage(argv[0]);
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *ai;
+    int gai = getaddrinfo(argv[optind], argv[optind + 1], &hints, &ai);
+    if (gai != 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], gai_strerror(gai));
+        exit(1);
+    }
+
+    int nconns = ntalkers + nidle + nslow;
+    conns = calloc(nconns, sizeof(Conn));
+    int rooms = nrooms ? nrooms : 1;
+    room_talkers = calloc(rooms, sizeof(int));
+    room_idle = calloc(rooms, sizeof(int));
+    room_slow = calloc(rooms, sizeof(int));
+    int talker_rooms = ntalkers / 2 < rooms ? ntalkers / 2 : rooms;
+    for (int i = 0; i < nconns; i++) {
+        conns[i].room = i % (i < ntalkers ? talker_rooms : rooms);
+        if (i < ntalkers) {
+            room_talkers[conns[i].room]++;
+        } else if (i < ntalkers + nidle) {
+            room_idle[conns[i].room]++;
+        } else {
+            room_slow[conns[i].room]++;
+        }
+    }
+    samples = malloc(MAX_SAMPLES * sizeof(long));
+    int epfd = epoll_create1(0);
+
+    // Talkers first, so their logins are only announced to each other.
+    // Idle clients connect once every talker is logged in.
+    char line[LINE_MAX_LEN];
+    for (int i = 0; i < ntalkers; i++) {
+        Conn *c = &conns[i];
+        c->fd = connect_to(ai, 0);
+        c->talker = 1;
+        snprintf(line, sizeof(line), "t%d\n", i);
+        send_line(c, line);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    // Wait for every talker to be logged in
+    struct epoll_event events[256];
+    long deadline = now_us() + 30 * 1000000L;
+    int registered = 0;
+    while (registered < ntalkers) {
+        if (now_us() > deadline) {
+            fprintf(stderr, "only %d of %d talkers logged in\n", registered, ntalkers);
+            exit(1);
+        }
+        int n = epoll_wait(epfd, events, 256, 100);
+        for (int i = 0; i < n; i++) {
+            Conn *c = events[i].data.ptr;
+            int was = c->registered;
+            if (drain(c) < 0) {
+                fprintf(stderr, "server closed a talker connection\n");
+                exit(1);
+            }
+            registered += c->registered - was;
+        }
+    }
+    for (int i = 0; i < ntalkers; i++) {
+        conns[i].lines = 0;
+    }
+    talker_chat_lines = 0;
+    long connect_start = now_us();
+    for (int i = ntalkers; i < nconns; i++) {
+        conns[i].fd = connect_to(ai, i < ntalkers + nidle ? 0 : SLOW_RCVBUF);
+        if (nrooms) {
+            snprintf(line, sizeof(line), "%c%d", i < ntalkers + nidle ? 'i' : 's', i - ntalkers);
+            join_room(&conns[i], line);
+        }
+    }
+    double connect_s = (now_us() - connect_start) / 1e6;
+
+    // count from here: let the last welcomes, history replays and joins
+    // arrive, then forget them
+    usleep(500000);
+    for (int i = 0; i < nconns; i++) {
+        drain(&conns[i]);
+        conns[i].lines = 0;
+    }
+    talker_chat_lines = 0;
+
+    // Send for the given time
+    long cpu_start = server_pid ? cpu_ticks(server_pid) : 0;
+    long start = now_us();
+    long period = (long)(1000000 / rate);
+    long stop = start + seconds * 1000000L;
+    srand(getpid());
+    for (int i = 0; i < ntalkers; i++) {
+        conns[i].next_send_us = start + rand() % period;
+    }
+    for (;;) {
+        long now = now_us();
+        long next = stop + 1000000L;   // Keep reading for a second after the last send
+        if (now >= next) {
+            break;
+        }
+        for (int i = 0; i < ntalkers; i++) {
+            Conn *c = &conns[i];
+            if (c->next_send_us < stop && c->next_send_us <= now) {
+                int n = snprintf(line, sizeof(line), "m %ld ", now_us());
+                while (n < msg_len - 1) {
+                    line[n++] = 'x';
+                }
+                line[n++] = '\n';
+                line[n] = '\0';
+                send_line(c, line);
+                sent++;
+                expect_talkers += room_talkers[c->room] - 1;
+                expect_idle += room_idle[c->room];
+                expect_slow += room_slow[c->room];
+                c->next_send_us += period;
+            }
+            if (c->next_send_us < stop && c->next_send_us < next) {
+                next = c->next_send_us;
+            }
+        }
+        int timeout = (int)((next - now_us() + 999) / 1000);
+        int n = epoll_wait(epfd, events, 256, timeout > 0 ? timeout : 0);
+        for (int i = 0; i < n; i++) {
+            if (drain(events[i].data.ptr) < 0) {
+                fprintf(stderr, "server closed a talker connection\n");
+                exit(1);
+            }
+        }
+    }
+    double elapsed = (now_us() - start) / 1e6;
+    double cpu = server_pid ? (cpu_ticks(server_pid) - cpu_start) * 100.0 / sysconf(_SC_CLK_TCK) / elapsed : 0;
+
+    // Count what the idle and slow clients got
+    long idle_lines = 0, slow_lines = 0;
+    int slow_closed = 0;
+    for (int i = ntalkers; i < nconns; i++) {
+        int closed = drain(&conns[i]) < 0;
+        long lines = conns[i].lines;
+        if (i < ntalkers + nidle) {
+            idle_lines += lines;
+        } else {
+            slow_lines += lines;
+            slow_closed += closed;
+        }
+    }
+
+    qsort(samples, nsamples, sizeof(long), cmp_long);
+    double p50 = nsamples ? samples[nsamples / 2] / 1000.0 : 0;
+    double p99 = nsamples ? samples[(nsamples - 1) * 99 / 100] / 1000.0 : 0;
+    double max = nsamples ? samples[nsamples - 1] / 1000.0 : 0;
+    long delivered = talker_chat_lines + idle_lines;
+    printf("idle=%d talkers=%d rooms=%d sent=%ld delivered_talkers=%ld/%ld delivered_idle=%ld/%ld "
+           "delivered_slow=%ld/%ld slow_closed=%d/%d "
+           "deliveries/sec=%.0f p50_ms=%.2f p99_ms=%.2f max_ms=%.2f connect_s=%.2f server_cpu=%.1f%%\n",
+           nidle, ntalkers, nrooms, sent, talker_chat_lines, expect_talkers, idle_lines, expect_idle,
+           slow_lines, expect_slow, slow_closed, nslow,
+           delivered / elapsed, p50, p99, max, connect_s, cpu);
+
+    freeaddrinfo(ai);
+    return 0;
+}
@@ -1,15 +1,22 @@
 
 /*
  * CSCI 4220 - Assignment 2 Reference Solution
- * Concurrent Chatroom Server (select() + pthread worker pool)
+ * Concurrent Chatroom Server (epoll reactors + pthread worker pool)
  * Classic IRC-style "/me" action messages: *username text*
  *
  * This program demonstrates:
- *   - I/O multiplexing with select()
+ *   - I/O multiplexing with edge-triggered epoll reactors, one per shard of clients
  *   - Multi-threaded worker pool using pthreads
- *   - Thread-safe producer/consumer queues
+ *   - Lock-free producer/consumer rings and a slab allocator for Jobs
  *   - Message broadcasting to multiple clients
- *   - Basic command handling (/who, /me, /quit)
+ *   - Input framed in place: recv() into shared chunks, SIMD newline scan
+ *   - Bounded per-client outbound queues with a slow-consumer policy
+ *   - Shared, reference-counted broadcast buffers sent with gathered writes
+ *   - A hashed username index and lock-free client lookup for workers
+ *   - Named rooms with per-shard subscriber sets, so fan-out follows room size
+ *   - Per-room message history in a byte-budgeted ring, replayed on entry
+ *   - An append-only broadcast log with group-commit fsync, replayed at startup
+ *   - Basic command handling (/who, /me, /join, /part, /history, /quit)
  *
  * Build:
  *   clang -Wall -Wextra -O2 -pthread chatroom_server.c -o chatroom_server.out
@@ -17,154 +24,450 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "lockfree.h"
+#include "linescan.h"
+
 #define MAX_NAME     32
 #define MAX_MSG      1024
 #define MAX_CLIENTS  64
-#define INBUF        2048
+#define INBUF        2048       // Longest partial line a client may leave pending
+#define IN_CHUNK     4096       // Input chunk, header included
+#define MAX_EVENTS   256
+#define OUTQ_KB      64         // Default outbound queue limit per client
+#define BLOCK_MS     2000       // Longest -s block waits for one client to make room
+#define IOV_BATCH    64         // Queued messages per gathered write
+#define RING_SIZE    4096       // Jobs each queue holds
+#define NAME_BUCKETS 65536      // Username index chains, a power of two
+#define ROOM_BUCKETS 4096       // Room table chains, a power of two
+#define MAX_ROOMS    65536
+#define LOBBY        "lobby"    // Where every client starts, and /part returns to
+#define HISTORY_KB   16         // Default history kept per room
+#define LOG_RING     65536      // Broadcasts waiting for the log writer
+#define LOG_SYNC_MS  50         // Default group commit interval
+#define LOG_SYNC_KB  256        // Default bytes that start a commit early
+#define LOG_TAIL_MB  64         // Log read back at startup to rebuild history
+#define LOG_BATCH    256        // Lines per writev()
 
 /* ---------------- Data Structures ---------------- */
 
+/*
+ * An outgoing line, formatted once and never changed after. A broadcast
+ * puts the same Msg on every reactor's mailbox and every recipient's
+ * outbound queue, each holding a reference; the last msg_put() frees it.
+ */
+typedef struct Msg {
+    atomic_int refs;
+    struct Room *room;      // Broadcast: the room it goes to
+    int exclude_fd;         // Broadcast: the sender, who does not get it; else -1
+    size_t len;
+    char data[];
+} Msg;
+
+/*
+ * Input from a client. recv() writes straight into a chunk, and every
+ * complete line in it becomes a Job pointing at the line where it lies,
+ * '\n' replaced by '\0', instead of a copy. The client and each such Job
+ * hold a reference; the last in_put() gives the chunk back to in_slab.
+ * A line left incomplete when the chunk fills is the only thing copied,
+ * into the client's next chunk.
+ */
+typedef struct InChunk {
+    atomic_int refs;
+    int len;                // Bytes received into data
+    char data[];
+} InChunk;
+
+#define IN_DATA ((int)(IN_CHUNK - offsetof(InChunk, data)))
+
 typedef struct Job {
     int sender_fd;                  // The file descriptor (socket) of the client who sent the message
-    char username[MAX_NAME];        // Username of the sender
-    char msg[MAX_MSG];              // Raw message text sent by the client
-    struct Job *next;               // Pointer to the next Job in the queue (linked-list structure)
+    unsigned long sender_id;        // Client id, in case the fd is reused meanwhile
+    InChunk *chunk;                 // Holds msg; the Job owns a reference
+    char *msg;                      // Raw message text sent by the client, at most MAX_MSG - 1 chars
+    Msg *out;                       // Set by process_message: the line to broadcast
+    struct Room *room;              // Set by process_message: the room out goes to
 } Job;
 
 /*
- * Thread-safe FIFO queue structure.
- * Used for both job_queue (raw messages from clients)
- * and bcast_queue (formatted messages ready to broadcast).
+ * job_queue holds raw messages from clients for the workers: a lock-free
+ * ring, plus a semaphore counting its Jobs for idle workers to sleep on.
+ * Formatted broadcasts go to every reactor's mailbox (see Reactor). Jobs
+ * come from job_slab rather than malloc().
  */
 typedef struct Queue {
-    Job *head;              // Pointer to the first Job in the queue
-    Job *tail;              // Pointer to the last Job in the queue
-    pthread_mutex_t mtx;    // Mutex to protect access to the queue
-    pthread_cond_t cv;      // Condition variable for thread signaling
-    int closed;             // Flag: 1 when queue is closed (no new Jobs)
+    Ring ring;
+    sem_t items;            // Jobs pushed and not yet claimed by q_pop
+    atomic_int closed;      // Flag: 1 when queue is closed (no new Jobs)
 } Queue;
 
-static Queue job_queue, bcast_queue;
+static Queue job_queue;
+static Slab job_slab;
+static Slab in_slab;        // InChunks
 
 /* ---------------- Client Management ---------------- */
 typedef struct Client {
     int fd;
+    unsigned long id;       // Unique per connection, unlike fd
     char username[MAX_NAME];
-    char inbuf[INBUF];
-    int inbuf_len;
-    struct Client *next;
+    InChunk *in;            // Input being framed; NULL while nothing is pending
+    int in_start;           // Start of the incomplete line in in->data
+
+    // outbound queue, drained on EPOLLOUT: a ring of shared messages,
+    // allocated the first time a send would block and bounded by
+    // out_limit bytes
+    pthread_mutex_t out_mtx;
+    Msg **outq;
+    int out_head;           // Oldest message
+    int out_count;
+    int out_cap;
+    size_t out_off;         // Bytes of the oldest message already sent
+    size_t out_bytes;       // Bytes queued and not yet sent
+    int closing;            // Over its limit under -s disconnect, or removed
+
+    struct Reactor *reactor;    // The shard it belongs to
+    _Atomic(struct Room *) room;    // Changed under rooms_lock; NULL once removed
+    struct Client *prev;
+    struct Client *next;    // After removal: next on the retired list
+    unsigned long retired_gp;
+
+    // username index links, under names_lock
+    atomic_int name_state;  // NAME_NONE, NAME_SET or NAME_RELEASED; changes under names_lock
+    struct Client *hash_next;
+    struct Client *named_prev;
+    struct Client *named_next;
 } Client;
 
-static Client *clients = NULL;
-static pthread_mutex_t clients_mtx = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * A reactor: one epoll instance watching a shard of the client sockets
+ * and an eventfd, all edge-triggered. Each event carries its fd, and
+ * client_by_fd maps it straight to the Client, so a wakeup costs O(ready
+ * fds) no matter how many clients are connected. Reactor 0, the main
+ * thread, also watches the listening socket and hands each new Client
+ * to the reactor with the fewest clients through its arrivals ring.
+ *
+ * A shard's client list belongs to its reactor, the only thread that
+ * adds or removes its clients, so it walks the list without a lock.
+ * Workers only look a Client up by fd. A broadcast is posted to every
+ * reactor's mailbox, and each sends it to its own clients; the wake_fd
+ * write after a post gets it out right away.
+ */
+typedef struct Reactor {
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;
+    Ring mailbox;           // Msgs to broadcast to this shard
+    Ring arrivals;          // New Clients from reactor 0
+    Client *clients;
+    atomic_int nclients;    // Including arrivals not yet taken in
+    Client *retired;        // Removed, waiting for the workers (see rcu_gp)
+    Client **fanout;        // A broadcast's recipients, see broadcast_message()
+    int fanout_cap;
+} Reactor;
+
+static Reactor *reactors;
+static int num_reactors = 1;
+static _Thread_local Reactor *self;     // The calling reactor; NULL in workers
+static unsigned long next_client_id = 1;
+
+/*
+ * Workers read client_by_fd and the Clients it points to without taking
+ * a lock (quiescent-state RCU). remove_client() unlinks a Client, starts
+ * a new grace period by bumping rcu_gp and puts the Client on its
+ * reactor's retired list; reclaim_clients() frees it once every worker is
+ * idle or has started its current Job since then. Each worker publishes
+ * the grace period it started its Job in, or 0 while it waits for one.
+ */
+static atomic_ulong rcu_gp = 1;
+static atomic_ulong *worker_gp;
+
+/*
+ * Logged-in clients by username, case-insensitively: a hash for logins to
+ * check in O(1), and a list, newest first, for /who. Logins and removals
+ * take names_lock for writing; /who only reads.
+ */
+enum { NAME_NONE, NAME_SET, NAME_RELEASED };
+enum { CLAIM_OK, CLAIM_TAKEN, CLAIM_NAMED, CLAIM_GONE };
+static Client *name_table[NAME_BUCKETS];
+static Client *named = NULL;
+static pthread_rwlock_t names_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Rooms. Every client is in exactly one: the lobby from the time it
+ * connects, or the last one it joined. A room keeps a sorted array of
+ * its members' fds per reactor, so a reactor sends a room's broadcast by
+ * walking its own slice of the room, in time proportional to the room's
+ * size rather than the number of clients. Membership and the room table
+ * change under rooms_lock for writing; reactors read the arrays under it
+ * while they fan out. Rooms last until shutdown.
+ */
+typedef struct RoomShard {
+    int *fds;
+    int count;
+    int cap;
+} RoomShard;
+
+/*
+ * A room's recent broadcasts, replayed to clients that enter it: the
+ * formatted lines back to back in a ring of history_bytes, the oldest
+ * whole lines dropped to make room for a new one. Only reactor 0
+ * appends, as it fans a broadcast out, so an append never waits for
+ * anything. Clients entering the room read it under rooms_lock for
+ * writing, when no append can be running; /history reads it without the
+ * lock and copies again if seq changed meanwhile (a seqlock: seq is odd
+ * while an append runs).
+ */
+typedef struct History {
+    _Atomic(char *) buf;    // history_bytes, allocated with the first line
+    atomic_size_t start;    // Offset of the oldest line
+    atomic_size_t len;      // Bytes held, whole lines only
+    atomic_uint seq;
+} History;
+
+typedef struct Room {
+    char name[MAX_NAME];
+    struct Room *next;      // Hash chain
+    int members;
+    History history;
+    RoomShard shard[];      // One per reactor
+} Room;
+
+static Room *room_table[ROOM_BUCKETS];
+static Room *lobby;
+static int num_rooms = 0;
+static pthread_rwlock_t rooms_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static _Atomic(Client *) *client_by_fd = NULL;   // Indexed by fd, NULL if not a client
+static int max_fds;                     // Size of client_by_fd (RLIMIT_NOFILE)
 static int server_fd = -1;
 static int num_workers;
 static int max_clients;
-static int current_clients = 0;
+static atomic_int current_clients = 0;
 static volatile int shutdown_flag = 0;
 
+/*
+ * What to do when a client's outbound queue would pass out_limit bytes:
+ * drop its oldest queued lines, disconnect it, or wait for it to read,
+ * which stalls every other client the way a blocking send() did.
+ */
+enum { SLOW_DROP, SLOW_DISCONNECT, SLOW_BLOCK };
+static int slow_policy = SLOW_DISCONNECT;
+static size_t out_limit = OUTQ_KB * 1024;
+static size_t history_bytes = HISTORY_KB * 1024;   // Per room; 0 keeps none
+
+/*
+ * The broadcast log (-L): every broadcast appended to log_path as
+ * "<room> <line>", in the order reactor 0 fans them out. Reactor 0 puts
+ * a reference to each Msg on log_ring as it keeps the line in the room's
+ * history; the writer thread writes what has gathered with writev() and
+ * then calls fdatasync() once for the whole batch (group commit), every
+ * log_sync_ms or as soon as log_sync_bytes are waiting. Nothing on the
+ * broadcast path touches the disk: a line that finds log_ring full is
+ * counted in log_dropped instead of waiting for the writer.
+ */
+static const char *log_path = NULL;
+static int log_fd = -1;
+static int log_sync_ms = LOG_SYNC_MS;
+static size_t log_sync_bytes = LOG_SYNC_KB * 1024;
+static Ring log_ring;
+static sem_t log_wake;                  // Posted when log_sync_bytes are waiting, or to stop
+static atomic_int log_stop;
+static pthread_t log_thread;
+static size_t log_pending;              // Reactor 0: bytes queued since the last post
+static atomic_long log_dropped;
+static long log_lines, log_commits;     // Writer only
+
 /* ---------------- Function Declarations ---------------- */
 static void *worker_thread(void *arg);
+static void reactor_init(Reactor *r);
+static void reactor_loop(Reactor *r);
+static void *reactor_thread(void *arg);
+static void reactor_post(Reactor *r, Ring *ring, void *item);
 static void handle_new_connection(int server_fd);
+static void add_client(Reactor *r, Client *new_client);
+static void take_arrivals(Reactor *r);
 static void handle_client_message(Client *client);
 static void remove_client(Client *client);
-static void broadcast_message(const char *msg, int exclude_fd);
-static void send_to_client(int fd, const char *msg);
-static int is_username_taken(const char *username);
+static void broadcast_message(Reactor *r, Msg *msg);
+static void broadcast_all(Msg *msg);
+static void drain_mailbox(Reactor *r);
+static void send_to_client(Client *client, const char *msg);
+static Msg *msg_printf(const char *fmt, ...);
+static void msg_put(Msg *msg);
+static InChunk *in_alloc(void);
+static void in_put(InChunk *in);
+static void client_send(Client *client, Msg *msg);
+static int client_flush(Client *client);
+static void client_clear_queue(Client *client);
+static int claim_username(Client *client, const char *username);
+static void release_username(Client *client, char *username_copy);
+static void reclaim_clients(Reactor *r);
+static int valid_name(const char *name);
+static Room *room_get(const char *name);
+static int room_enter(Client *client, Room *room);
+static void room_leave(Client *client);
+static void change_room(Job *job, Client *sender, const char *name);
+static void history_append(History *h, const char *line, size_t len);
+static Msg *history_copy(History *h, int lines);
+static Msg *history_take(Room *room);
+static void history_replay(Client *client, Msg *msg);
+static void log_open(void);
+static void log_append(Msg *msg);
+static void *log_writer(void *arg);
+static void log_close(void);
 static void to_lowercase(char *str);
 static void process_message(Job *job);
 static void handle_signal(int sig);
 
 /* ---------------- Queue Utilities ---------------- */
 static void q_init(Queue *q) {
-    q->head = NULL;
-    q->tail = NULL;
-    q->closed = 0;
-    pthread_mutex_init(&q->mtx, NULL);
-    pthread_cond_init(&q->cv, NULL);
+    if (ring_init(&q->ring, RING_SIZE) < 0) {
+        perror("malloc");
+        exit(1);
+    }
+    sem_init(&q->items, 0, 0);
+    atomic_init(&q->closed, 0);
 }
+// Wakes every worker; only async-signal-safe calls, for handle_signal
 static void q_close(Queue *q) {
-    pthread_mutex_lock(&q->mtx);
-    q->closed = 1;
-    pthread_cond_broadcast(&q->cv);
-    pthread_mutex_unlock(&q->mtx);
-}
-static void q_push(Queue *q, Job *j) {
-    pthread_mutex_lock(&q->mtx);
-    j->next = NULL;
-    
-    if (q->tail == NULL) {
-        q->head = q->tail = j;
-    } else {
-        q->tail->next = j;
-        q->tail = j;
+    atomic_store(&q->closed, 1);
+    for (int i = 0; i < num_workers; i++) {
+        sem_post(&q->items);
     }
-    
-    pthread_cond_signal(&q->cv);
-    pthread_mutex_unlock(&q->mtx);
 }
-static Job *q_pop(Queue *q) {
-    pthread_mutex_lock(&q->mtx);
-    
-    while (q->head == NULL && !q->closed) {
-        pthread_cond_wait(&q->cv, &q->mtx);
-    }
-    
-    if (q->closed && q->head == NULL) {
-        pthread_mutex_unlock(&q->mtx);
-        return NULL;
-    }
-    
-    Job *j = q->head;
-    q->head = q->head->next;
-    if (q->head == NULL) {
-        q->tail = NULL;
+// Returns 0 if the queue is full
+static int q_push(Queue *q, Job *j) {
+    if (!ring_try_push(&q->ring, j)) {
+        return 0;
     }
-    
-    pthread_mutex_unlock(&q->mtx);
-    return j;
+    sem_post(&q->items);
+    return 1;
 }
-
-static Job *q_try_pop(Queue *q) {
-    pthread_mutex_lock(&q->mtx);
-    
-    if (q->head == NULL) {
-        pthread_mutex_unlock(&q->mtx);
-        return NULL;
+static Job *q_pop(Queue *q) {
+    while (sem_wait(&q->items) < 0) {
+        if (errno != EINTR) {
+            return NULL;
+        }
     }
-    
-    Job *j = q->head;
-    q->head = q->head->next;
-    if (q->head == NULL) {
-        q->tail = NULL;
+
+    // one Job is ours, but the push that posted may still be filling
+    // its cell, or filled a later one than the cell at the tail
+    for (;;) {
+        Job *j = ring_try_pop(&q->ring);
+        if (j != NULL) {
+            return j;
+        }
+        if (atomic_load(&q->closed)) {
+            return NULL;
+        }
+        sched_yield();
     }
-    
-    pthread_mutex_unlock(&q->mtx);
-    return j;
 }
 
 /* ---------------- Main ---------------- */
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s drop|disconnect|block] [-q queue_kb] [-r reactors] [-H history_kb]\n"
+                    "          [-L log_file] [-T sync_ms] [-B sync_kb] <port> <num_workers> <max_clients>\n", prog);
+    exit(1);
+}
+
 int main(int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <port> <num_workers> <max_clients>\n", argv[0]);
-        exit(1);
+    int ch;
+    int history_set = 0;
+    while ((ch = getopt(argc, argv, "s:q:r:H:L:T:B:")) != -1) {
+        switch (ch) {
+            case 's':
+                if (strcmp(optarg, "drop") == 0) {
+                    slow_policy = SLOW_DROP;
+                } else if (strcmp(optarg, "disconnect") == 0) {
+                    slow_policy = SLOW_DISCONNECT;
+                } else if (strcmp(optarg, "block") == 0) {
+                    slow_policy = SLOW_BLOCK;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case 'q':
+                // at least two of the longest lines (/who) must fit
+                if (atoi(optarg) < 4) {
+                    usage(argv[0]);
+                }
+                out_limit = (size_t)atoi(optarg) * 1024;
+                break;
+            case 'r':
+                num_reactors = atoi(optarg);
+                if (num_reactors < 1 || num_reactors > 64) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'H':
+                if (atoi(optarg) < 0) {
+                    usage(argv[0]);
+                }
+                history_bytes = (size_t)atoi(optarg) * 1024;
+                history_set = 1;
+                break;
+            case 'L':
+                log_path = optarg;
+                break;
+            case 'T':
+                log_sync_ms = atoi(optarg);
+                if (log_sync_ms < 1) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'B':
+                if (atoi(optarg) < 1) {
+                    usage(argv[0]);
+                }
+                log_sync_bytes = (size_t)atoi(optarg) * 1024;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3) {
+        usage(argv[0]);
+    }
+    // a replay goes out as one message, which has to fit in a queue; the
+    // default history shrinks to a smaller -q, an explicit -H must fit
+    if (history_bytes > out_limit) {
+        if (history_set) {
+            fprintf(stderr, "History of %zu KB (-H) does not fit in the %zu KB client queue (-q)\n",
+                    history_bytes / 1024, out_limit / 1024);
+            exit(1);
+        }
+        history_bytes = out_limit;
     }
     
-    int port = atoi(argv[1]);
-    num_workers = atoi(argv[2]);
-    max_clients = atoi(argv[3]);
+    int port = atoi(argv[optind]);
+    num_workers = atoi(argv[optind + 1]);
+    max_clients = atoi(argv[optind + 2]);
     
     if (port <= 0 || num_workers <= 0 || max_clients <= 0) {
         fprintf(stderr, "Invalid arguments\n");
@@ -173,9 +476,30 @@ int main(int argc, char **argv) {
     
     // signal handler for graceful shutdown
     signal(SIGINT, handle_signal);
+    // a client that hangs up must not kill the server on the next send()
+    signal(SIGPIPE, SIG_IGN);
     
     q_init(&job_queue);
-    q_init(&bcast_queue);
+    slab_init(&job_slab, sizeof(Job));
+    slab_init(&in_slab, IN_CHUNK);
+
+    // every client costs a descriptor: raise the soft limit as far as allowed
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    max_fds = (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) ? (int)rl.rlim_cur : 65536;
+    client_by_fd = calloc(max_fds, sizeof(*client_by_fd));
+    if (client_by_fd == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    
+    // history from the log comes back before the first client can connect
+    if (log_path != NULL) {
+        log_open();
+    }
     
     // server socket
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -203,75 +527,58 @@ int main(int argc, char **argv) {
         exit(1);
     }
     
-    // listen for connections
-    if (listen(server_fd, 10) < 0) {
+    // listen for connections; a burst of connects must not overflow the backlog
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("listen");
         exit(1);
     }
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+    // reactors; reactor 0 accepts
+    reactors = calloc(num_reactors, sizeof(Reactor));
+    if (reactors == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_reactors; i++) {
+        reactor_init(&reactors[i]);
+    }
+    lobby = room_get(LOBBY);
+    if (lobby == NULL) {
+        exit(1);
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET };
+    ev.data.fd = server_fd;
+    if (epoll_ctl(reactors[0].epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
     
     printf("Chatroom server listening on port %d\n", port);
-    printf("Workers: %d, Max clients: %d\n", num_workers, max_clients);
+    printf("Workers: %d, Reactors: %d, Max clients: %d\n", num_workers, num_reactors, max_clients);
     
     // worker threads
     pthread_t *workers = malloc(num_workers * sizeof(pthread_t));
+    worker_gp = calloc(num_workers, sizeof(*worker_gp));
+    if (workers == NULL || worker_gp == NULL) {
+        perror("malloc");
+        exit(1);
+    }
     for (int i = 0; i < num_workers; i++) {
-        if (pthread_create(&workers[i], NULL, worker_thread, NULL) != 0) {
+        if (pthread_create(&workers[i], NULL, worker_thread, (void *)(intptr_t)i) != 0) {
             perror("pthread_create");
             exit(1);
         }
     }
     
-    // select() loop
-    fd_set read_fds;
-    int max_fd = server_fd;
-    
-    while (!shutdown_flag) {
-        FD_ZERO(&read_fds);
-        FD_SET(server_fd, &read_fds);
-        max_fd = server_fd;
-
-        // add all client sockets to read set
-        pthread_mutex_lock(&clients_mtx);
-        Client *client = clients;
-        while (client) {
-            FD_SET(client->fd, &read_fds);
-            if (client->fd > max_fd) max_fd = client->fd;
-            client = client->next;
-        }
-        pthread_mutex_unlock(&clients_mtx);
-
-        struct timeval timeout = {1, 0};
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
-
-        if (activity < 0 && errno != EINTR) {
-            perror("select");
-            break;
-        }
-
-        if (FD_ISSET(server_fd, &read_fds)) {
-            handle_new_connection(server_fd);
-        }
-
-        pthread_mutex_lock(&clients_mtx);
-        client = clients;
-        while (client) {
-            Client *next = client->next;
-            if (FD_ISSET(client->fd, &read_fds)) {
-                pthread_mutex_unlock(&clients_mtx);
-                handle_client_message(client);
-                pthread_mutex_lock(&clients_mtx);
-            }
-            client = next;
-        }
-        pthread_mutex_unlock(&clients_mtx);
-
-        // process broadcast queue
-        Job *bcast_job;
-        while ((bcast_job = q_try_pop(&bcast_queue)) != NULL) {
-            broadcast_message(bcast_job->msg, bcast_job->sender_fd);
-            free(bcast_job);
+    // the other reactors get threads, the main thread is reactor 0
+    for (int i = 1; i < num_reactors; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, reactor_thread, &reactors[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
         }
     }
+    reactor_loop(&reactors[0]);
     
     // cleanup
     printf("Shutting down server...\n");
@@ -281,53 +588,206 @@ int main(int argc, char **argv) {
         close(server_fd);
     }
     
-    // close all client connections
-    pthread_mutex_lock(&clients_mtx);
-    Client *client = clients;
-    while (client) {
-        Client *next = client->next;
-        close(client->fd);
-        free(client);
-        client = next;
-    }
-    clients = NULL;
-    pthread_mutex_unlock(&clients_mtx);
+    for (int i = 1; i < num_reactors; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
     
-    // close queues
-    if (!job_queue.closed) {
+    // close the job queue
+    if (!atomic_load(&job_queue.closed)) {
         q_close(&job_queue);
     }
-    if (!bcast_queue.closed) {
-        q_close(&bcast_queue);
-    }
     
-    // wait for all worker threads to exit
+    // wait for all worker threads to exit; they may still be using clients
     for (int i = 0; i < num_workers; i++) {
         pthread_join(workers[i], NULL);
     }
+
+    // write and sync what the log writer has left, while rooms still exist
+    if (log_fd >= 0) {
+        log_close();
+    }
+    
+    // close all client connections, free the ones already removed, and
+    // drop what is still in the rings
+    for (int i = 0; i < num_reactors; i++) {
+        Reactor *r = &reactors[i];
+        Client *client;
+        while ((client = ring_try_pop(&r->arrivals)) != NULL) {
+            client->next = r->clients;
+            r->clients = client;
+        }
+        client = r->clients;
+        while (client) {
+            Client *next = client->next;
+            close(client->fd);
+            client_clear_queue(client);
+            if (client->in != NULL) {
+                in_put(client->in);
+            }
+            pthread_mutex_destroy(&client->out_mtx);
+            free(client);
+            client = next;
+        }
+        r->clients = NULL;
+        reclaim_clients(r);
+
+        Msg *msg;
+        while ((msg = ring_try_pop(&r->mailbox)) != NULL) {
+            msg_put(msg);
+        }
+        ring_destroy(&r->mailbox);
+        ring_destroy(&r->arrivals);
+        free(r->fanout);
+        close(r->wake_fd);
+        close(r->epoll_fd);
+    }
     
+    for (int b = 0; b < ROOM_BUCKETS; b++) {
+        while (room_table[b]) {
+            Room *room = room_table[b];
+            room_table[b] = room->next;
+            for (int i = 0; i < num_reactors; i++) {
+                free(room->shard[i].fds);
+            }
+            free(atomic_load(&room->history.buf));
+            free(room);
+        }
+    }
+    free(reactors);
     free(workers);
+    free(worker_gp);
+    free(client_by_fd);
     printf("Server shutdown complete\n");
     return 0;
 }
 
 /* ---------------- Worker Thread Function ---------------- */
 static void *worker_thread(void *arg) {
-    (void)arg;
+    int id = (int)(intptr_t)arg;
     
     while (!shutdown_flag) {
+        // idle: holds no Client pointers, so none has to wait for it
+        atomic_store(&worker_gp[id], 0);
         Job *job = q_pop(&job_queue);
         if (job == NULL) {
             break;
         }
+        atomic_store(&worker_gp[id], atomic_load(&rcu_gp));
         
+        job->out = NULL;
+        job->room = NULL;
         process_message(job);
-        free(job);
+
+        // a broadcast goes to every reactor's mailbox; a sender removed
+        // meanwhile has no room left to send it to
+        if (job->out != NULL) {
+            if (job->room != NULL) {
+                job->out->exclude_fd = job->sender_fd;
+                job->out->room = job->room;
+                broadcast_all(job->out);
+            }
+            msg_put(job->out);
+        }
+        in_put(job->chunk);
+        slab_free(&job_slab, job);
     }
     
     return NULL;
 }
 
+/* ---------------- Reactor Functions ---------------- */
+static void reactor_init(Reactor *r) {
+    r->epoll_fd = epoll_create1(0);
+    r->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (r->epoll_fd < 0 || r->wake_fd < 0) {
+        perror("epoll_create1/eventfd");
+        exit(1);
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET };
+    ev.data.fd = r->wake_fd;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    if (ring_init(&r->mailbox, RING_SIZE) < 0 || ring_init(&r->arrivals, RING_SIZE) < 0) {
+        perror("malloc");
+        exit(1);
+    }
+    r->clients = NULL;
+    atomic_init(&r->nclients, 0);
+    r->retired = NULL;
+    r->fanout = NULL;
+    r->fanout_cap = 0;
+}
+
+static void reactor_loop(Reactor *r) {
+    struct epoll_event events[MAX_EVENTS];
+    self = r;
+
+    while (!shutdown_flag) {
+        // the timeout only bounds how long a SIGINT handled by another thread goes unnoticed
+        int nready = epoll_wait(r->epoll_fd, events, MAX_EVENTS, 1000);
+
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < nready; i++) {
+            int fd = events[i].data.fd;
+            Client *client;
+            if (fd == server_fd && r == &reactors[0]) {
+                handle_new_connection(server_fd);
+            } else if (fd == r->wake_fd) {
+                uint64_t count;
+                while (read(r->wake_fd, &count, sizeof(count)) > 0) {
+                    // drained below
+                }
+            } else if ((client = atomic_load(&client_by_fd[fd])) != NULL && client->reactor == r) {
+                // a client removed earlier in this batch has no entry
+                // left, or its fd went to a client of another shard
+                if (events[i].events & EPOLLOUT) {
+                    pthread_mutex_lock(&client->out_mtx);
+                    client_flush(client);
+                    pthread_mutex_unlock(&client->out_mtx);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    handle_client_message(client);
+                }
+            }
+        }
+
+        take_arrivals(r);
+        drain_mailbox(r);
+        reclaim_clients(r);
+    }
+}
+
+static void *reactor_thread(void *arg) {
+    reactor_loop(arg);
+    return NULL;
+}
+
+/*
+ * Push item on one of r's rings and wake r. A reactor waiting for room
+ * empties its own mailbox meanwhile, in case r is waiting on it.
+ */
+static void reactor_post(Reactor *r, Ring *ring, void *item) {
+    uint64_t one = 1;
+    while (!ring_try_push(ring, item)) {
+        if (self != NULL) {
+            drain_mailbox(self);
+        }
+        sched_yield();
+    }
+    if (write(r->wake_fd, &one, sizeof(one)) < 0) {
+        // counter saturated: r has a wakeup pending anyway
+    }
+}
+
 /* ---------------- Signal Handler ---------------- */
 static void handle_signal(int sig) {
     (void)sig;
@@ -340,197 +800,1144 @@ static void handle_signal(int sig) {
         server_fd = -1;
     }
     
-    // mark queues as closed to signal worker threads to exit
+    // mark the job queue as closed to signal worker threads to exit
     q_close(&job_queue);
-    q_close(&bcast_queue);
 }
 
 /* ---------------- Client Management Functions ---------------- */
+// Reactor 0: accept new clients and hand each to the least loaded reactor
 static void handle_new_connection(int server_fd) {
-    if (current_clients >= max_clients) {
-        // reject connection
+    // edge-triggered: accept everything that is waiting, not just one
+    for (;;) {
         struct sockaddr_in client_addr;
         socklen_t addr_len = sizeof(client_addr);
         int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &addr_len);
-        if (client_fd >= 0) {
-            send_to_client(client_fd, "Server is full. Please try again later.\n");
+
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        if (current_clients >= max_clients || client_fd >= max_fds) {
+            // reject connection; best effort, it is not a client to queue for
+            const char *full = "Server is full. Please try again later.\n";
+            if (send(client_fd, full, strlen(full), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+                // closing it anyway
+            }
+            close(client_fd);
+            continue;
+        }
+
+        // create new client
+        Client *new_client = malloc(sizeof(Client));
+        if (new_client == NULL) {
+            perror("malloc failed");
             close(client_fd);
+            continue;
         }
+        new_client->fd = client_fd;
+        new_client->id = next_client_id++;
+        new_client->username[0] = '\0';
+        atomic_init(&new_client->name_state, NAME_NONE);
+        new_client->in = NULL;
+        new_client->in_start = 0;
+        pthread_mutex_init(&new_client->out_mtx, NULL);
+        new_client->outq = NULL;
+        new_client->out_head = 0;
+        new_client->out_count = 0;
+        new_client->out_cap = 0;
+        new_client->out_off = 0;
+        new_client->out_bytes = 0;
+        new_client->closing = 0;
+        new_client->prev = NULL;
+        new_client->hash_next = NULL;
+        new_client->named_prev = NULL;
+        new_client->named_next = NULL;
+
+        Reactor *r = &reactors[0];
+        for (int i = 1; i < num_reactors; i++) {
+            if (atomic_load(&reactors[i].nclients) < atomic_load(&r->nclients)) {
+                r = &reactors[i];
+            }
+        }
+        new_client->reactor = r;
+        atomic_init(&new_client->room, NULL);
+        atomic_fetch_add(&r->nclients, 1);
+        atomic_fetch_add(&current_clients, 1);
+        if (r == self) {
+            add_client(r, new_client);
+        } else {
+            reactor_post(r, &r->arrivals, new_client);
+        }
+    }
+}
+
+// Reactor r: start serving a new client of its own
+static void add_client(Reactor *r, Client *new_client) {
+    // add to client list and fd table; the store publishes the
+    // initialized Client to workers
+    new_client->next = r->clients;
+    if (r->clients) {
+        r->clients->prev = new_client;
+    }
+    r->clients = new_client;
+    atomic_store(&client_by_fd[new_client->fd], new_client);
+
+    // everyone starts in the lobby, and sees what was said there lately
+    send_to_client(new_client, "Welcome to Chatroom! Please enter your username:\n");
+    pthread_rwlock_wrlock(&rooms_lock);
+    int entered = room_enter(new_client, lobby);
+    Msg *replay = entered == 0 ? history_take(lobby) : NULL;
+    pthread_rwlock_unlock(&rooms_lock);
+    if (entered < 0) {
+        remove_client(new_client);
         return;
     }
-    
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &addr_len);
-    
-    if (client_fd < 0) {
-        perror("accept");
+    history_replay(new_client, replay);
+
+    // EPOLLOUT stays registered: edge-triggered, it only fires once a
+    // send() that hit a full socket buffer can go on
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET };
+    ev.data.fd = new_client->fd;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, new_client->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        remove_client(new_client);
         return;
     }
-    
-    // create new client
-    Client *new_client = malloc(sizeof(Client));
-    new_client->fd = client_fd;
-    new_client->username[0] = '\0';
-    new_client->inbuf_len = 0;
-    new_client->next = NULL;
-    
-    // add to client list
-    pthread_mutex_lock(&clients_mtx);
-    new_client->next = clients;
-    clients = new_client;
-    current_clients++;
-    pthread_mutex_unlock(&clients_mtx);
-    
-    // send welcome message
-    send_to_client(client_fd, "Welcome to Chatroom! Please enter your username:\n");
+}
+
+// Reactor: take in the clients reactor 0 has handed over
+static void take_arrivals(Reactor *r) {
+    Client *new_client;
+    while ((new_client = ring_try_pop(&r->arrivals)) != NULL) {
+        add_client(r, new_client);
+    }
 }
 
 static void handle_client_message(Client *client) {
-    char buffer[1024];
-    int bytes_read = recv(client->fd, buffer, sizeof(buffer) - 1, 0);
+    // edge-triggered: read until the socket is drained
+    for (;;) {
+        InChunk *in = client->in;
+        if (in == NULL) {
+            in = client->in = in_alloc();
+            client->in_start = 0;
+            if (in == NULL) {
+                remove_client(client);
+                return;
+            }
+        }
 
-    if (bytes_read <= 0) {
-        // client disconnected or error occurred
-        remove_client(client);
-        return;
+        // receive in place, after what is already in the chunk
+        int bytes_read = recv(client->fd, in->data + in->len, IN_DATA - in->len, MSG_DONTWAIT);
+
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // nothing pending: an idle client holds no chunk
+            if (client->in_start == in->len) {
+                in_put(in);
+                client->in = NULL;
+            }
+            return;
+        }
+        if (bytes_read <= 0) {
+            // client disconnected or error occurred
+            remove_client(client);
+            return;
+        }
+
+        // the bytes before the new ones hold no '\n', so scan only these
+        char *line_start = in->data + client->in_start;
+        char *scan = in->data + in->len;
+        char *end = scan + bytes_read;
+        in->len += bytes_read;
+
+        // process all complete lines (ending in '\n')
+        char *newline;
+        while ((newline = find_newline(scan, end - scan)) != NULL) {
+            *newline = '\0'; // null-terminate the line to treat it as a string
+
+            // handle the optional '\r' for cross-platform compatibility
+            if (newline > line_start && *(newline - 1) == '\r') {
+                *(newline - 1) = '\0';
+            }
+
+            if (line_start[0] != '\0') {
+                Job *job = slab_alloc(&job_slab);
+                if (job == NULL) {
+                    perror("slab_alloc failed");
+                    line_start = scan = newline + 1;
+                    continue;
+                }
+                // the Job points into the chunk; longer lines are cut
+                // where the old fixed-size copy cut them
+                if (newline - line_start >= MAX_MSG) {
+                    line_start[MAX_MSG - 1] = '\0';
+                }
+                job->sender_fd = client->fd;
+                job->sender_id = client->id;
+                job->chunk = in;
+                job->msg = line_start;
+                atomic_fetch_add(&in->refs, 1);
+
+                // full: the workers may be waiting for room in our
+                // mailbox, so make some while waiting for them
+                while (!q_push(&job_queue, job)) {
+                    drain_mailbox(client->reactor);
+                    sched_yield();
+                }
+            }
+
+            // move to the start of the next potential line
+            line_start = scan = newline + 1;
+        }
+        client->in_start = line_start - in->data;
+
+        int remaining_len = in->len - client->in_start;
+        if (remaining_len >= INBUF) {
+            // a line too long to be a message: disconnect the client
+            remove_client(client);
+            return;
+        }
+        if (in->len == IN_DATA) {
+            // chunk full: carry the incomplete line over to a fresh one;
+            // Jobs still using this one keep it until they finish
+            InChunk *next = in_alloc();
+            if (next == NULL) {
+                remove_client(client);
+                return;
+            }
+            memcpy(next->data, line_start, remaining_len);
+            next->len = remaining_len;
+            client->in = next;
+            client->in_start = 0;
+            in_put(in);
+        }
     }
+}
 
-    buffer[bytes_read] = '\0';
+// Reactor: remove one of its own clients
+static void remove_client(Client *client) {
+    Reactor *r = client->reactor;
+    char username_copy[MAX_NAME] = {0};
+    int fd_to_close = client->fd;
 
-    // append received data to the client's personal input buffer
-    if (client->inbuf_len + bytes_read < INBUF) {
-        memcpy(client->inbuf + client->inbuf_len, buffer, bytes_read);
-        client->inbuf_len += bytes_read;
+    // unlink from the client list and the fd table
+    if (client->prev) {
+        client->prev->next = client->next;
     } else {
-        // buffer overflow, handle error (e.g., disconnect client)
-        remove_client(client);
+        r->clients = client->next;
+    }
+    if (client->next) {
+        client->next->prev = client->prev;
+    }
+    atomic_store(&client_by_fd[fd_to_close], NULL);
+
+    atomic_fetch_sub(&r->nclients, 1);
+    atomic_fetch_sub(&current_clients, 1);
+
+    // copy username for the leave message, and free the name
+    release_username(client, username_copy);
+
+    // leave the room; a worker sees room == NULL and leaves it alone
+    pthread_rwlock_wrlock(&rooms_lock);
+    Room *room = atomic_load(&client->room);
+    room_leave(client);
+    pthread_rwlock_unlock(&rooms_lock);
+
+    // a worker may still hold the Client: once closing is set it sends
+    // nothing more, so the queue can go and the fd can be reused. Closing
+    // the socket also takes it out of the epoll set.
+    pthread_mutex_lock(&client->out_mtx);
+    client->closing = 1;
+    client_clear_queue(client);
+    pthread_mutex_unlock(&client->out_mtx);
+    close(fd_to_close);
+    if (client->in != NULL) {
+        in_put(client->in);
+        client->in = NULL;
+    }
+
+    // the memory itself waits for the workers
+    client->retired_gp = atomic_fetch_add(&rcu_gp, 1) + 1;
+    client->next = r->retired;
+    r->retired = client;
+
+    // broadcast the leave message to its room
+    if (strlen(username_copy) > 0 && room != NULL) {
+        Msg *leave_msg = msg_printf("%s has left the chat.\n", username_copy);
+        if (leave_msg != NULL) {
+            leave_msg->room = room;
+            broadcast_all(leave_msg);
+            msg_put(leave_msg);
+        }
+    }
+}
+
+// Reactor: free its removed clients that no worker can still be using
+static void reclaim_clients(Reactor *r) {
+    unsigned long oldest = ULONG_MAX;
+    for (int i = 0; i < num_workers; i++) {
+        unsigned long gp = atomic_load(&worker_gp[i]);
+        if (gp != 0 && gp < oldest) {
+            oldest = gp;
+        }
+    }
+
+    Client **link = &r->retired;
+    while (*link) {
+        Client *client = *link;
+        if (client->retired_gp <= oldest) {
+            *link = client->next;
+            pthread_mutex_destroy(&client->out_mtx);
+            free(client);
+        } else {
+            link = &client->next;
+        }
+    }
+}
+
+/*
+ * Reactor r: send msg to its own clients in msg's room; reactor 0 also
+ * keeps it in the room's history and the log. The recipients are listed
+ * under rooms_lock and sent to after it is released, since a send can
+ * wait on a slow client (-s block) and /join would wait with it. Only r
+ * removes its clients, so the listed ones stay valid meanwhile; one that
+ * changes room after the listing still gets this line.
+ */
+static void broadcast_message(Reactor *r, Msg *msg) {
+    pthread_rwlock_rdlock(&rooms_lock);
+    if (r == &reactors[0]) {
+        if (history_bytes > 0) {
+            history_append(&msg->room->history, msg->data, msg->len);
+        }
+        if (log_fd >= 0) {
+            log_append(msg);
+        }
+    }
+    RoomShard *sh = &msg->room->shard[r - reactors];
+    if (sh->count > r->fanout_cap) {
+        Client **fanout = realloc(r->fanout, sh->count * sizeof(Client *));
+        if (fanout == NULL) {
+            perror("realloc");
+            pthread_rwlock_unlock(&rooms_lock);
+            return;
+        }
+        r->fanout = fanout;
+        r->fanout_cap = sh->count;
+    }
+    int n = 0;
+    for (int i = 0; i < sh->count; i++) {
+        Client *client = atomic_load(&client_by_fd[sh->fds[i]]);
+        if (sh->fds[i] != msg->exclude_fd && client != NULL) {
+            r->fanout[n++] = client;
+        }
+    }
+    pthread_rwlock_unlock(&rooms_lock);
+
+    for (int i = 0; i < n; i++) {
+        client_send(r->fanout[i], msg);
+    }
+}
+
+// Send msg to every client in its room: a reactor does its own shard at
+// once, and every other shard gets a reference in its mailbox
+static void broadcast_all(Msg *msg) {
+    for (int i = 0; i < num_reactors; i++) {
+        Reactor *r = &reactors[i];
+        if (r == self) {
+            broadcast_message(r, msg);
+        } else {
+            atomic_fetch_add(&msg->refs, 1);
+            reactor_post(r, &r->mailbox, msg);
+        }
+    }
+}
+
+// Reactor: send everything posted to its mailbox
+static void drain_mailbox(Reactor *r) {
+    Msg *msg;
+    while ((msg = ring_try_pop(&r->mailbox)) != NULL) {
+        broadcast_message(r, msg);
+        msg_put(msg);
+    }
+}
+
+// Format a line into a new Msg holding one reference
+static Msg *msg_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    Msg *msg = malloc(sizeof(Msg) + len + 1);
+    if (msg == NULL) {
+        perror("malloc failed");
+        return NULL;
+    }
+    va_start(ap, fmt);
+    vsnprintf(msg->data, len + 1, fmt, ap);
+    va_end(ap);
+    msg->room = NULL;
+    msg->exclude_fd = -1;
+    msg->len = len;
+    atomic_init(&msg->refs, 1);
+    return msg;
+}
+
+static void msg_put(Msg *msg) {
+    if (atomic_fetch_sub(&msg->refs, 1) == 1) {
+        free(msg);
+    }
+}
+
+// An empty InChunk holding one reference
+static InChunk *in_alloc(void) {
+    InChunk *in = slab_alloc(&in_slab);
+    if (in == NULL) {
+        perror("slab_alloc failed");
+        return NULL;
+    }
+    atomic_init(&in->refs, 1);
+    in->len = 0;
+    return in;
+}
+
+static void in_put(InChunk *in) {
+    if (atomic_fetch_sub(&in->refs, 1) == 1) {
+        slab_free(&in_slab, in);
+    }
+}
+
+// Queue text for one client; nothing is sent once it is removed
+static void send_to_client(Client *client, const char *text) {
+    Msg *msg = msg_printf("%s", text);
+    if (msg == NULL) {
         return;
     }
+    client_send(client, msg);
+    msg_put(msg);
+}
+
+// Take the oldest message off the client's queue
+static void client_pop(Client *client) {
+    Msg *msg = client->outq[client->out_head];
+    client->out_bytes -= msg->len - client->out_off;
+    client->out_off = 0;
+    client->out_head = (client->out_head + 1) % client->out_cap;
+    client->out_count--;
+    msg_put(msg);
+}
+
+// Release everything still queued for a client that is going away
+static void client_clear_queue(Client *client) {
+    while (client->out_count > 0) {
+        client_pop(client);
+    }
+    free(client->outq);
+    client->outq = NULL;
+    client->out_cap = 0;
+}
+
+/*
+ * Send what the socket takes from the client's queue, up to IOV_BATCH
+ * messages per call. Call with out_mtx held. Returns -1 if the connection
+ * failed; the reactor sees that as EOF.
+ */
+static int client_flush(Client *client) {
+    while (client->out_count > 0) {
+        struct iovec iov[IOV_BATCH];
+        int n = 0;
+        while (n < client->out_count && n < IOV_BATCH) {
+            Msg *msg = client->outq[(client->out_head + n) % client->out_cap];
+            size_t skip = n == 0 ? client->out_off : 0;
+            iov[n].iov_base = msg->data + skip;
+            iov[n].iov_len = msg->len - skip;
+            n++;
+        }
 
-    // process all complete lines (ending in '\n') from the buffer
-    char *line_start = client->inbuf;
-    char *newline;
-    while ((newline = strchr(line_start, '\n')) != NULL) {
-        *newline = '\0'; // null-terminate the line to treat it as a string
+        // writev() with MSG_DONTWAIT and MSG_NOSIGNAL
+        struct msghdr mh = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t sent = sendmsg(client->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
 
-        // handle the optional '\r' for cross-platform compatibility
-        if (newline > line_start && *(newline - 1) == '\r') {
-            *(newline - 1) = '\0';
+        while (sent > 0) {
+            size_t left = client->outq[client->out_head]->len - client->out_off;
+            if ((size_t)sent < left) {
+                client->out_off += sent;
+                client->out_bytes -= sent;
+                break;
+            }
+            sent -= left;
+            client_pop(client);
         }
+    }
+    return 0;
+}
+
+// Make room for len more bytes by discarding the oldest queued messages.
+// One that is partly sent stays, or the client would get half a line.
+// Returns 0 if len bytes still do not fit.
+static int drop_oldest(Client *client, size_t len) {
+    int keep = client->out_off > 0;
+    while (client->out_count > keep && client->out_bytes + len > out_limit) {
+        // the partly sent message moves up into the dropped one's slot
+        int victim = (client->out_head + keep) % client->out_cap;
+        Msg *msg = client->outq[victim];
+        client->outq[victim] = client->outq[client->out_head];
+        client->out_head = (client->out_head + 1) % client->out_cap;
+        client->out_count--;
+        client->out_bytes -= msg->len;
+        msg_put(msg);
+    }
+    return client->out_bytes + len <= out_limit;
+}
+
+/*
+ * Send msg to a client without blocking: straight to the socket while its
+ * queue is empty, and if the socket does not take all of it the client
+ * queues a reference to msg for the reactor to send on EPOLLOUT. Nothing
+ * is copied per recipient. A queue that would pass out_limit gets the
+ * slow-consumer policy. Call from the reactor, or from a worker for the
+ * Client its Job looked up, so the client cannot be freed meanwhile.
+ */
+static void client_send(Client *client, Msg *msg) {
+    size_t off = 0;
+
+    pthread_mutex_lock(&client->out_mtx);
+    if (client->closing) {
+        pthread_mutex_unlock(&client->out_mtx);
+        return;
+    }
 
-        if (strlen(line_start) > 0) {
-            // allocate and populate the job struct
-            Job *job = malloc(sizeof(Job));
-            if (job == NULL) {
-                perror("malloc failed");
+    if (client->out_count == 0) {
+        while (off < msg->len) {
+            ssize_t n = send(client->fd, msg->data + off, msg->len - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
                 continue;
             }
-            job->sender_fd = client->fd;
-            strncpy(job->username, client->username, MAX_NAME - 1);
-            job->username[MAX_NAME-1] = '\0';
+            if (n < 0) {
+                break;
+            }
+            off += n;
+        }
+        if (off == msg->len || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            // all sent, or the connection failed and the reactor will see EOF
+            pthread_mutex_unlock(&client->out_mtx);
+            return;
+        }
+    }
 
-            strncpy(job->msg, line_start, MAX_MSG - 1);
-            job->msg[MAX_MSG - 1] = '\0';
+    size_t len = msg->len - off;
+    if (client->out_bytes + len > out_limit) {
+        if (slow_policy == SLOW_DISCONNECT) {
+            // the reactor sees EOF and removes it
+            client->closing = 1;
+            shutdown(client->fd, SHUT_RDWR);
+            pthread_mutex_unlock(&client->out_mtx);
+            return;
+        }
+        if (slow_policy == SLOW_DROP && !drop_oldest(client, len)) {
+            pthread_mutex_unlock(&client->out_mtx);
+            return;
+        }
+        // block: wait until the client has read enough. The sending
+        // reactor or worker does nothing else meanwhile, so a client that
+        // has not made room within BLOCK_MS is shut down as with
+        // disconnect rather than stall it for good.
+        struct timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (slow_policy == SLOW_BLOCK && client->out_bytes + len > out_limit) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long left = BLOCK_MS - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+            struct pollfd pfd = { .fd = client->fd, .events = POLLOUT };
+            int ready = left > 0 ? poll(&pfd, 1, (int)left) : 0;
+            if (ready == 0) {
+                client->closing = 1;
+                shutdown(client->fd, SHUT_RDWR);
+                pthread_mutex_unlock(&client->out_mtx);
+                return;
+            }
+            if ((ready < 0 && errno != EINTR) || client_flush(client) < 0) {
+                pthread_mutex_unlock(&client->out_mtx);
+                return;
+            }
+        }
+    }
 
-            q_push(&job_queue, job);
+    // append, growing the ring if it is full
+    if (client->out_count == client->out_cap) {
+        int cap = client->out_cap ? client->out_cap * 2 : 16;
+        Msg **outq = malloc(cap * sizeof(Msg *));
+        if (outq == NULL) {
+            perror("malloc failed");
+            pthread_mutex_unlock(&client->out_mtx);
+            return;
+        }
+        for (int i = 0; i < client->out_count; i++) {
+            outq[i] = client->outq[(client->out_head + i) % client->out_cap];
         }
+        free(client->outq);
+        client->outq = outq;
+        client->out_head = 0;
+        client->out_cap = cap;
+    }
+    if (client->out_count == 0) {
+        client->out_off = off;
+    }
+    atomic_fetch_add(&msg->refs, 1);
+    client->outq[(client->out_head + client->out_count) % client->out_cap] = msg;
+    client->out_count++;
+    client->out_bytes += len;
+    pthread_mutex_unlock(&client->out_mtx);
+}
 
-        // move to the start of the next potential line
-        line_start = newline + 1;
+// FNV-1a over the lowercased name, for usernames and room names
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; name[i]; i++) {
+        h = (h ^ (unsigned char)tolower((unsigned char)name[i])) * 16777619u;
     }
+    return h;
+}
 
-    // move any remaining partial message to the beginning of the buffer
-    int remaining_len = client->inbuf_len - (line_start - client->inbuf);
-    if (remaining_len > 0) {
-        memmove(client->inbuf, line_start, remaining_len);
+// Letters, digits and underscores only, at least one
+static int valid_name(const char *name) {
+    if (name[0] == '\0') {
+        return 0;
     }
-    client->inbuf_len = remaining_len;
+    for (int i = 0; name[i]; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_') {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-static void remove_client(Client *client) {
-    char username_copy[MAX_NAME] = {0};
-    int fd_to_close = client->fd;
+// Give the client username unless another client has it, checking and
+// inserting under one lock. Two lines a client sent together can reach
+// two workers at once, so the client's own state is checked there too:
+// CLAIM_NAMED if it already has a name, CLAIM_GONE if it was removed.
+static int claim_username(Client *client, const char *username) {
+    unsigned b = name_hash(username) & (NAME_BUCKETS - 1);
 
-    pthread_mutex_lock(&clients_mtx);
+    pthread_rwlock_wrlock(&names_lock);
+    int state = atomic_load(&client->name_state);
+    if (state != NAME_NONE) {
+        pthread_rwlock_unlock(&names_lock);
+        return state == NAME_SET ? CLAIM_NAMED : CLAIM_GONE;
+    }
+    for (Client *c = name_table[b]; c; c = c->hash_next) {
+        if (strcasecmp(c->username, username) == 0) {
+            pthread_rwlock_unlock(&names_lock);
+            return CLAIM_TAKEN;
+        }
+    }
+    strncpy(client->username, username, MAX_NAME - 1);
+    client->username[MAX_NAME - 1] = '\0';
+    client->hash_next = name_table[b];
+    name_table[b] = client;
+    client->named_prev = NULL;
+    client->named_next = named;
+    if (named) {
+        named->named_prev = client;
+    }
+    named = client;
+    // publishes the name: once NAME_SET, username never changes
+    atomic_store(&client->name_state, NAME_SET);
+    pthread_rwlock_unlock(&names_lock);
+    return CLAIM_OK;
+}
 
-    // remove client from the linked list
-    if (clients == client) {
-        clients = client->next;
+// Reactor, removing the client: take its name out of the index and copy
+// it to username_copy (MAX_NAME bytes), or leave that empty if it had
+// none. No claim can succeed for it afterwards.
+static void release_username(Client *client, char *username_copy) {
+    pthread_rwlock_wrlock(&names_lock);
+    int state = atomic_load(&client->name_state);
+    atomic_store(&client->name_state, NAME_RELEASED);
+    if (state != NAME_SET) {
+        pthread_rwlock_unlock(&names_lock);
+        return;
+    }
+    memcpy(username_copy, client->username, MAX_NAME);
+    Client **link = &name_table[name_hash(client->username) & (NAME_BUCKETS - 1)];
+    while (*link != client) {
+        link = &(*link)->hash_next;
+    }
+    *link = client->hash_next;
+    if (client->named_prev) {
+        client->named_prev->named_next = client->named_next;
     } else {
-        Client *prev = clients;
-        while (prev && prev->next != client) {
-            prev = prev->next;
+        named = client->named_next;
+    }
+    if (client->named_next) {
+        client->named_next->named_prev = client->named_prev;
+    }
+    pthread_rwlock_unlock(&names_lock);
+}
+
+/* ---------------- Room Functions ---------------- */
+
+// Find a room by name, case-insensitively, creating it if there is none.
+// Call with rooms_lock held for writing. Returns NULL if there are
+// MAX_ROOMS already or memory ran out.
+static Room *room_get(const char *name) {
+    unsigned b = name_hash(name) & (ROOM_BUCKETS - 1);
+    for (Room *room = room_table[b]; room; room = room->next) {
+        if (strcasecmp(room->name, name) == 0) {
+            return room;
         }
-        if (prev) {
-            prev->next = client->next;
+    }
+    if (num_rooms >= MAX_ROOMS) {
+        return NULL;
+    }
+    Room *room = calloc(1, sizeof(Room) + num_reactors * sizeof(RoomShard));
+    if (room == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    strncpy(room->name, name, MAX_NAME - 1);
+    room->next = room_table[b];
+    room_table[b] = room;
+    num_rooms++;
+    return room;
+}
+
+// Where fd is in a shard's sorted array, or would go
+static int shard_find(RoomShard *sh, int fd) {
+    int lo = 0, hi = sh->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (sh->fds[mid] < fd) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
+    return lo;
+}
 
-    current_clients--;
+// Put a client in room. Call with rooms_lock held for writing. Returns
+// -1 if out of memory.
+static int room_enter(Client *client, Room *room) {
+    RoomShard *sh = &room->shard[client->reactor - reactors];
+    if (sh->count == sh->cap) {
+        int cap = sh->cap ? sh->cap * 2 : 4;
+        int *fds = realloc(sh->fds, cap * sizeof(int));
+        if (fds == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        sh->fds = fds;
+        sh->cap = cap;
+    }
+    int i = shard_find(sh, client->fd);
+    memmove(&sh->fds[i + 1], &sh->fds[i], (sh->count - i) * sizeof(int));
+    sh->fds[i] = client->fd;
+    sh->count++;
+    room->members++;
+    atomic_store(&client->room, room);
+    return 0;
+}
 
-    // copy username so we can broadcast the message *after* unlocking
-    if (strlen(client->username) > 0) {
-        strncpy(username_copy, client->username, MAX_NAME - 1);
+// Take a client out of its room. Call with rooms_lock held for writing.
+static void room_leave(Client *client) {
+    Room *room = atomic_load(&client->room);
+    if (room == NULL) {
+        return;
     }
+    RoomShard *sh = &room->shard[client->reactor - reactors];
+    int i = shard_find(sh, client->fd);
+    memmove(&sh->fds[i], &sh->fds[i + 1], (sh->count - i - 1) * sizeof(int));
+    sh->count--;
+    room->members--;
+    atomic_store(&client->room, NULL);
+}
 
-    // free the client's resources while still under the lock
-    close(fd_to_close);
-    free(client);
+/*
+ * Worker: move the sender to the named room. The sender is told, its old
+ * room gets a broadcast, and the "joined" line for the new room is left
+ * in job->out.
+ */
+static void change_room(Job *job, Client *sender, const char *name) {
+    char reply[256];
 
-    pthread_mutex_unlock(&clients_mtx);
+    if (!valid_name(name) || strlen(name) >= MAX_NAME) {
+        send_to_client(sender, "Invalid room name. Use letters, digits, or underscores only.\n");
+        return;
+    }
 
-    // broadcast the leave message outside the critical section
-    if (strlen(username_copy) > 0) {
-        char leave_msg[256];
-        snprintf(leave_msg, sizeof(leave_msg), "%s has left the chat.\n", username_copy);
-        broadcast_message(leave_msg, -1);
+    pthread_rwlock_wrlock(&rooms_lock);
+    Room *old = atomic_load(&sender->room);
+    if (old == NULL) {
+        // removed meanwhile
+        pthread_rwlock_unlock(&rooms_lock);
+        return;
     }
+    Room *room = room_get(name);
+    if (room == NULL) {
+        pthread_rwlock_unlock(&rooms_lock);
+        send_to_client(sender, "Too many rooms. Join an existing one.\n");
+        return;
+    }
+    if (room == old) {
+        pthread_rwlock_unlock(&rooms_lock);
+        snprintf(reply, sizeof(reply), "You are already in %s.\n", room->name);
+        send_to_client(sender, reply);
+        return;
+    }
+    room_leave(sender);
+    if (room_enter(sender, room) < 0) {
+        // old has room for it: it was just in there
+        room_enter(sender, old);
+        pthread_rwlock_unlock(&rooms_lock);
+        send_to_client(sender, "Could not join the room. Try again later.\n");
+        return;
+    }
+    int members = room->members;
+    Msg *replay = history_take(room);
+    pthread_rwlock_unlock(&rooms_lock);
+
+    // sending can wait on the client, so not under the lock
+    snprintf(reply, sizeof(reply), "You joined %s (%d user%s).\n", room->name, members, members == 1 ? "" : "s");
+    send_to_client(sender, reply);
+    history_replay(sender, replay);
+
+    Msg *left = msg_printf("%s left %s.\n", sender->username, old->name);
+    if (left != NULL) {
+        left->room = old;
+        broadcast_all(left);
+        msg_put(left);
+    }
+    job->out = msg_printf("%s joined %s.\n", sender->username, room->name);
+    job->room = room;
 }
 
-static void broadcast_message(const char *msg, int exclude_fd) {
-    pthread_mutex_lock(&clients_mtx);
-    
-    Client *client = clients;
-    while (client) {
-        if (client->fd != exclude_fd) {
-            send_to_client(client->fd, msg);
+/* ---------------- History Functions ---------------- */
+
+// Reactor 0, fanning a broadcast out under rooms_lock for reading (or
+// log_open() before the reactors start): keep its line, ending in '\n',
+// in its room's history. Lines longer than the whole ring are not kept.
+static void history_append(History *h, const char *line, size_t len) {
+    if (len == 0 || len > history_bytes) {
+        return;
+    }
+    char *buf = atomic_load_explicit(&h->buf, memory_order_relaxed);
+    if (buf == NULL) {
+        buf = malloc(history_bytes);
+        if (buf == NULL) {
+            perror("malloc failed");
+            return;
         }
-        client = client->next;
+        atomic_store_explicit(&h->buf, buf, memory_order_release);
     }
-    
-    pthread_mutex_unlock(&clients_mtx);
+    size_t start = atomic_load_explicit(&h->start, memory_order_relaxed);
+    size_t held = atomic_load_explicit(&h->len, memory_order_relaxed);
+    unsigned seq = atomic_load_explicit(&h->seq, memory_order_relaxed);
+    atomic_store_explicit(&h->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    // drop the oldest lines until the new one fits; every line ends in '\n'
+    while (held + len > history_bytes) {
+        size_t first = history_bytes - start < held ? history_bytes - start : held;
+        char *nl = find_newline(buf + start, first);
+        if (nl == NULL) {
+            nl = find_newline(buf, held - first);
+        }
+        size_t drop = ((size_t)(nl - buf) + history_bytes - start) % history_bytes + 1;
+        start = (start + drop) % history_bytes;
+        held -= drop;
+    }
+
+    // copy it in after the newest, wrapping at the end of the ring
+    size_t end = (start + held) % history_bytes;
+    size_t first = history_bytes - end < len ? history_bytes - end : len;
+    memcpy(buf + end, line, first);
+    memcpy(buf, line + first, len - first);
+    held += len;
+
+    atomic_store_explicit(&h->start, start, memory_order_relaxed);
+    atomic_store_explicit(&h->len, held, memory_order_relaxed);
+    atomic_store_explicit(&h->seq, seq + 2, memory_order_release);
 }
 
-static void send_to_client(int fd, const char *msg) {
-    int len = strlen(msg);
-    int sent = 0;
-    
-    while (sent < len) {
-        int bytes = send(fd, msg + sent, len - sent, 0);
-        if (bytes <= 0) {
+// The last lines lines of a history, or all of it if lines is 0, as one
+// Msg holding one reference; NULL if it is empty. Safe to call while
+// reactor 0 appends.
+static Msg *history_copy(History *h, int lines) {
+    char *buf = atomic_load_explicit(&h->buf, memory_order_acquire);
+    if (buf == NULL) {
+        return NULL;
+    }
+    Msg *msg = malloc(sizeof(Msg) + history_bytes + 1);
+    if (msg == NULL) {
+        perror("malloc failed");
+        return NULL;
+    }
+
+    // copy the ring out in order, again if an append ran meanwhile
+    size_t len;
+    for (;;) {
+        unsigned seq = atomic_load_explicit(&h->seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        size_t start = atomic_load_explicit(&h->start, memory_order_relaxed);
+        len = atomic_load_explicit(&h->len, memory_order_relaxed);
+        size_t first = history_bytes - start < len ? history_bytes - start : len;
+        memcpy(msg->data, buf + start, first);
+        memcpy(msg->data + first, buf, len - first);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&h->seq, memory_order_relaxed) == seq) {
             break;
         }
-        sent += bytes;
     }
+    if (len == 0) {
+        free(msg);
+        return NULL;
+    }
+
+    // keep the last lines lines: each '\n' before the end starts one
+    if (lines > 0) {
+        size_t cut = 0;
+        for (size_t i = len - 1; i > 0; i--) {
+            if (msg->data[i - 1] == '\n' && --lines == 0) {
+                cut = i;
+                break;
+            }
+        }
+        len -= cut;
+        memmove(msg->data, msg->data + cut, len);
+    }
+    msg->data[len] = '\0';
+    msg->room = NULL;
+    msg->exclude_fd = -1;
+    msg->len = len;
+    atomic_init(&msg->refs, 1);
+    return msg;
 }
 
-static int is_username_taken(const char *username) {
-    pthread_mutex_lock(&clients_mtx);
-    
-    Client *client = clients;
-    while (client) {
-        if (strcasecmp(client->username, username) == 0) {
-            pthread_mutex_unlock(&clients_mtx);
-            return 1;
+// What a client entering room should see of what it said lately, or
+// NULL. Call with rooms_lock held for writing, as the client enters: no
+// broadcast is being fanned out, so the copy ends where the lines the
+// client gets live begin.
+static Msg *history_take(Room *room) {
+    if (history_bytes == 0) {
+        return NULL;
+    }
+    return history_copy(&room->history, 0);
+}
+
+// Send a client the copy history_take() made, as one message: a single
+// send(), or one entry of a gathered write behind what is queued. Call
+// after releasing rooms_lock, since a slow client can make the send wait;
+// a line broadcast meanwhile may reach the client before its replay.
+static void history_replay(Client *client, Msg *msg) {
+    if (msg != NULL) {
+        client_send(client, msg);
+        msg_put(msg);
+    }
+}
+
+/* ---------------- Log Functions ---------------- */
+
+// Open the log for appending, rebuild room histories from its tail, and
+// start the writer. Runs in main before the server starts listening.
+static void log_open(void) {
+    log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (log_fd < 0) {
+        perror(log_path);
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(log_fd, &st) < 0) {
+        perror("fstat");
+        exit(1);
+    }
+
+    // map the last LOG_TAIL_MB, from a page boundary
+    off_t size = st.st_size;
+    off_t off = 0;
+    if (size > (off_t)LOG_TAIL_MB << 20) {
+        off = (size - ((off_t)LOG_TAIL_MB << 20)) & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+    }
+    long restored = 0;
+    if (size > 0) {
+        char *map = mmap(NULL, size - off, PROT_READ, MAP_PRIVATE, log_fd, off);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        const char *p = map;
+        const char *end = map + (size - off);
+
+        // a record cut short by a crash has no '\n': cut it off the file
+        const char *last = end;
+        while (last > p && last[-1] != '\n') {
+            last--;
+        }
+        if (last < end && ftruncate(log_fd, size - (end - last)) < 0) {
+            perror("ftruncate");
+            exit(1);
+        }
+
+        // start at the first whole record in the window
+        if (off > 0) {
+            const char *nl = find_newline(p, last - p);
+            p = nl != NULL ? nl + 1 : last;
+        }
+
+        // the lines go through history_append() as when they were sent,
+        // so each room keeps its newest history_bytes
+        pthread_rwlock_wrlock(&rooms_lock);
+        while (history_bytes > 0 && p < last) {
+            const char *nl = find_newline(p, last - p);
+            const char *space = memchr(p, ' ', nl - p);
+            char name[MAX_NAME];
+            if (space != NULL && space - p < MAX_NAME) {
+                memcpy(name, p, space - p);
+                name[space - p] = '\0';
+                Room *room = valid_name(name) ? room_get(name) : NULL;
+                if (room != NULL) {
+                    history_append(&room->history, space + 1, nl + 1 - (space + 1));
+                    restored++;
+                }
+            }
+            p = nl + 1;
+        }
+        pthread_rwlock_unlock(&rooms_lock);
+        munmap(map, size - off);
+    }
+
+    if (ring_init(&log_ring, LOG_RING) < 0) {
+        perror("malloc");
+        exit(1);
+    }
+    sem_init(&log_wake, 0, 0);
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    printf("Log: %s, %ld lines of history restored\n", log_path, restored);
+}
+
+// Reactor 0: hand a broadcast to the log writer; never waits for it
+static void log_append(Msg *msg) {
+    atomic_fetch_add(&msg->refs, 1);
+    if (!ring_try_push(&log_ring, msg)) {
+        msg_put(msg);
+        atomic_fetch_add(&log_dropped, 1);
+        return;
+    }
+    log_pending += msg->len;
+    if (log_pending >= log_sync_bytes) {
+        log_pending = 0;
+        sem_post(&log_wake);
+    }
+}
+
+// Write all of iov, going on after short writes
+static int write_all(struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(log_fd, iov, count);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
         }
-        client = client->next;
     }
-    
-    pthread_mutex_unlock(&clients_mtx);
     return 0;
 }
 
+// The log writer: every log_sync_ms, or when woken early, write what has
+// gathered and sync it with one fdatasync()
+static void *log_writer(void *arg) {
+    (void)arg;
+    struct iovec iov[LOG_BATCH * 3];
+    Msg *batch[LOG_BATCH];
+
+    for (;;) {
+        int stopping = atomic_load(&log_stop);
+        if (!stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (log_sync_ms % 1000) * 1000000L;
+            deadline.tv_sec += log_sync_ms / 1000 + deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            while (sem_timedwait(&log_wake, &deadline) < 0 && errno == EINTR) {
+            }
+        }
+
+        // "<room> <line>" per broadcast, LOG_BATCH to a writev()
+        long lines = 0;
+        for (;;) {
+            int n = 0;
+            Msg *msg;
+            while (n < LOG_BATCH && (msg = ring_try_pop(&log_ring)) != NULL) {
+                batch[n] = msg;
+                iov[3 * n] = (struct iovec){ msg->room->name, strlen(msg->room->name) };
+                iov[3 * n + 1] = (struct iovec){ " ", 1 };
+                iov[3 * n + 2] = (struct iovec){ msg->data, msg->len };
+                n++;
+            }
+            if (n == 0) {
+                break;
+            }
+            if (write_all(iov, 3 * n) < 0) {
+                perror("log write");
+            }
+            for (int i = 0; i < n; i++) {
+                msg_put(batch[i]);
+            }
+            lines += n;
+        }
+        if (lines > 0) {
+            if (fdatasync(log_fd) < 0) {
+                perror("fdatasync");
+            }
+            log_lines += lines;
+            log_commits++;
+        }
+        if (stopping) {
+            return NULL;
+        }
+    }
+}
+
+// Stop the writer once it has written and synced everything queued
+static void log_close(void) {
+    atomic_store(&log_stop, 1);
+    sem_post(&log_wake);
+    pthread_join(log_thread, NULL);
+    ring_destroy(&log_ring);
+    sem_destroy(&log_wake);
+    close(log_fd);
+    printf("Log: %ld lines in %ld commits, %ld not logged\n", log_lines, log_commits, atomic_load(&log_dropped));
+}
+
 static void to_lowercase(char *str) {
     for (int i = 0; str[i]; i++) {
         str[i] = tolower(str[i]);
@@ -539,73 +1946,54 @@ static void to_lowercase(char *str) {
 
 /* ---------------- Message Processing Function ---------------- */
 static void process_message(Job *job) {
-    // find the client who sent this message
-    pthread_mutex_lock(&clients_mtx);
-    Client *sender = NULL;
-    Client *client = clients;
-    while (client) {
-        if (client->fd == job->sender_fd) {
-            sender = client;
-            break;
-        }
-        client = client->next;
-    }
-    pthread_mutex_unlock(&clients_mtx);
+    // find the client who sent this message; if it left, the fd may
+    // already belong to someone else
+    Client *sender = atomic_load(&client_by_fd[job->sender_fd]);
     
-    if (sender == NULL) {
+    if (sender == NULL || sender->id != job->sender_id) {
         return;
     }
+    job->room = atomic_load(&sender->room);
     
-    // handle username setup
-    if (strlen(sender->username) == 0) {
+    // handle username setup; the name is only read once it is set, and
+    // is never changed after
+    if (atomic_load(&sender->name_state) == NAME_NONE) {
         // username message
         char username[MAX_NAME];
         strncpy(username, job->msg, MAX_NAME - 1);
         username[MAX_NAME - 1] = '\0';
         
-        // validate username (letters, digits, underscores only)
-        int valid = 1;
-        for (int i = 0; username[i]; i++) {
-            if (!isalnum(username[i]) && username[i] != '_') {
-                valid = 0;
-                break;
-            }
-        }
-        
-        if (!valid || strlen(username) == 0) {
-            send_to_client(sender->fd, "Invalid username. Use letters, digits, or underscores only.\n");
-            send_to_client(sender->fd, "Please enter your username:\n");
+        // validate username (letters, digits, underscores only), then
+        // take it unless it is taken
+        int claim = valid_name(username) ? claim_username(sender, username) : -1;
+        if (claim == -1 && atomic_load(&sender->name_state) == NAME_NONE) {
+            send_to_client(sender, "Invalid username. Use letters, digits, or underscores only.\n");
+            send_to_client(sender, "Please enter your username:\n");
             return;
         }
-        
-        // check if username is taken
-        if (is_username_taken(username)) {
+        if (claim == CLAIM_TAKEN) {
             char error_msg[256];
             snprintf(error_msg, sizeof(error_msg), "Username \"%s\" is already in use. Try another:\n", username);
-            send_to_client(sender->fd, error_msg);
+            send_to_client(sender, error_msg);
+            return;
+        }
+        if (claim == CLAIM_OK) {
+            // send private welcome message
+            char welcome_msg[256];
+            snprintf(welcome_msg, sizeof(welcome_msg), "Let's start chatting, %s!\n", username);
+            send_to_client(sender, welcome_msg);
+
+            // a public "joined" message for broadcast; sender_fd excludes
+            // the new client from it
+            job->out = msg_printf("%s joined the chat.\n", username);
+            return;
+        }
+
+        // another worker logged the client in meanwhile (CLAIM_NAMED, or
+        // a line that is no name): this line is a chat line after all
+        if (atomic_load(&sender->name_state) != NAME_SET) {
             return;
         }
-        
-        // set username
-        strncpy(sender->username, username, MAX_NAME - 1);
-        sender->username[MAX_NAME - 1] = '\0';
-        
-        // send private welcome message
-        char welcome_msg[256];
-        snprintf(welcome_msg, sizeof(welcome_msg), "Let's start chatting, %s!\n", username);
-        send_to_client(sender->fd, welcome_msg);
-
-        // create and enqueue a public "joined" message for broadcast
-        char join_msg[256];
-        snprintf(join_msg, sizeof(join_msg), "%s joined the chat.\n", username);
-
-        Job *bcast_job = malloc(sizeof(Job));
-        bcast_job->sender_fd = sender->fd; // exclude the new client from the broadcast
-        strncpy(bcast_job->msg, join_msg, MAX_MSG - 1);
-        bcast_job->msg[MAX_MSG - 1] = '\0';
-        q_push(&bcast_queue, bcast_job);
-        
-        return;
     }
     
     // process regular message or command
@@ -623,7 +2011,7 @@ static void process_message(Job *job) {
         
         // parse command and arguments
         if (sscanf(msg, "%255s %1023[^\n]", cmd, args) < 1) {
-            send_to_client(sender->fd, "Invalid command. Type /who, /me, or /quit.\n");
+            send_to_client(sender, "Invalid command. Type /who, /me, /join, /part, /history, or /quit.\n");
             return;
         }
         
@@ -631,61 +2019,73 @@ static void process_message(Job *job) {
         
         if (strcmp(cmd, "/who") == 0) {
             // list all connected users
-            pthread_mutex_lock(&clients_mtx);
             char who_msg[2048] = "Active users:\n";
-            client = clients;
-            while (client) {
-                if (strlen(client->username) > 0) {
-                    strncat(who_msg, " - ", sizeof(who_msg) - strlen(who_msg) - 1);
-                    strncat(who_msg, client->username, sizeof(who_msg) - strlen(who_msg) - 1);
-                    strncat(who_msg, "\n", sizeof(who_msg) - strlen(who_msg) - 1);
+            size_t len = strlen(who_msg);
+            pthread_rwlock_rdlock(&names_lock);
+            for (Client *c = named; c; c = c->named_next) {
+                // the reply holds as many names as fit
+                int n = snprintf(who_msg + len, sizeof(who_msg) - len, " - %s\n", c->username);
+                if (n < 0 || (size_t)n >= sizeof(who_msg) - len) {
+                    who_msg[len] = '\0';
+                    break;
                 }
-                client = client->next;
+                len += n;
             }
-            pthread_mutex_unlock(&clients_mtx);
+            pthread_rwlock_unlock(&names_lock);
             
-            send_to_client(sender->fd, who_msg);
+            send_to_client(sender, who_msg);
             
         } else if (strcmp(cmd, "/me") == 0) {
             // action message
             if (strlen(args) == 0) {
-                send_to_client(sender->fd, "Usage: /me <action>\n");
+                send_to_client(sender, "Usage: /me <action>\n");
                 return;
             }
             
-            char action_msg[2048];
-            snprintf(action_msg, sizeof(action_msg), "*%s %s*\n", sender->username, args);
+            job->out = msg_printf("*%s %s*\n", sender->username, args);
             
-            // create broadcast job
-            Job *bcast_job = malloc(sizeof(Job));
-            bcast_job->sender_fd = sender->fd;
-            strncpy(bcast_job->username, sender->username, MAX_NAME - 1);
-            bcast_job->username[MAX_NAME - 1] = '\0';
-            strncpy(bcast_job->msg, action_msg, MAX_MSG - 1);
-            bcast_job->msg[MAX_MSG - 1] = '\0';
+        } else if (strcmp(cmd, "/join") == 0) {
+            // move to a room, creating it if need be
+            if (strlen(args) == 0) {
+                send_to_client(sender, "Usage: /join <room>\n");
+                return;
+            }
+            change_room(job, sender, args);
             
-            q_push(&bcast_queue, bcast_job);
+        } else if (strcmp(cmd, "/part") == 0) {
+            // back to the lobby
+            change_room(job, sender, LOBBY);
+            
+        } else if (strcmp(cmd, "/history") == 0) {
+            // the room's last N lines, or all it kept
+            int lines = atoi(args);
+            if (lines < 0 || (lines == 0 && strlen(args) > 0)) {
+                send_to_client(sender, "Usage: /history [lines]\n");
+                return;
+            }
+            if (history_bytes == 0 || job->room == NULL) {
+                send_to_client(sender, "History is off.\n");
+                return;
+            }
+            Msg *history = history_copy(&job->room->history, lines);
+            if (history == NULL) {
+                send_to_client(sender, "No history yet.\n");
+                return;
+            }
+            client_send(sender, history);
+            msg_put(history);
             
         } else if (strcmp(cmd, "/quit") == 0) {
-            close(sender->fd);
-            return; 
+            // let the reactor see EOF and remove the client; closing the
+            // fd here would leave it in the client list
+            shutdown(sender->fd, SHUT_RDWR);
+            return;
         } else {
-            send_to_client(sender->fd, "Invalid command. Type /who, /me, or /quit.\n");
+            send_to_client(sender, "Invalid command. Type /who, /me, /join, /part, /history, or /quit.\n");
         }
         
     } else {
         // regular message
-        char formatted_msg[2048];
-        snprintf(formatted_msg, sizeof(formatted_msg), "%s: %s\n", sender->username, msg);
-        
-        // create broadcast job
-        Job *bcast_job = malloc(sizeof(Job));
-        bcast_job->sender_fd = sender->fd;
-        strncpy(bcast_job->username, sender->username, MAX_NAME - 1);
-        bcast_job->username[MAX_NAME - 1] = '\0';
-        strncpy(bcast_job->msg, formatted_msg, MAX_MSG - 1);
-        bcast_job->msg[MAX_MSG - 1] = '\0';
-        
-        q_push(&bcast_queue, bcast_job);
+        job->out = msg_printf("%s: %s\n", sender->username, msg);
     }
 }
\ No newline at end of file
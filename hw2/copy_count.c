@@ -0,0 +1,149 @@
+/*
+ * LD_PRELOAD library that counts what a server does per message: heap
+ * allocations, bytes copied by the C library calls that copy (memcpy,
+ * memmove, strcpy, strncpy, strncat, snprintf, vsnprintf), and socket
+ * writes. The totals go to the file named by $COPY_COUNT_OUT, or stderr,
+ * when the process exits.
+ *
+ * Calls the compiler turns into inline code are not seen, so build the
+ * program being measured with -fno-builtin -U_FORTIFY_SOURCE.
+ *
+ * Build: gcc -O2 -Wall -shared -fPIC -o copy_count.so copy_count.c -ldl
+ * Usage: COPY_COUNT_OUT=counts.txt LD_PRELOAD=./copy_count.so ./chatroom_server.out ...
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <dlfcn.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static atomic_long allocs, alloc_bytes;
+static atomic_long copies, copy_bytes;
+static atomic_long writes, write_bytes;
+
+static void count_copy(size_t n) {
+    atomic_fetch_add(&copies, 1);
+    atomic_fetch_add(&copy_bytes, (long)n);
+}
+
+static void count_write(ssize_t n) {
+    atomic_fetch_add(&writes, 1);
+    if (n > 0) {
+        atomic_fetch_add(&write_bytes, (long)n);
+    }
+}
+
+void *malloc(size_t size) {
+    atomic_fetch_add(&allocs, 1);
+    atomic_fetch_add(&alloc_bytes, (long)size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    atomic_fetch_add(&allocs, 1);
+    atomic_fetch_add(&alloc_bytes, (long)(n * size));
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    atomic_fetch_add(&allocs, 1);
+    atomic_fetch_add(&alloc_bytes, (long)size);
+    return __libc_realloc(ptr, size);
+}
+
+#define REAL(ret, name, ...) \
+    static ret (*real)(__VA_ARGS__); \
+    if (real == NULL) { \
+        real = (ret (*)(__VA_ARGS__))dlsym(RTLD_NEXT, name); \
+    }
+
+void *memcpy(void *dst, const void *src, size_t n) {
+    REAL(void *, "memcpy", void *, const void *, size_t);
+    count_copy(n);
+    return real(dst, src, n);
+}
+
+void *memmove(void *dst, const void *src, size_t n) {
+    REAL(void *, "memmove", void *, const void *, size_t);
+    count_copy(n);
+    return real(dst, src, n);
+}
+
+char *strcpy(char *dst, const char *src) {
+    REAL(char *, "strcpy", char *, const char *);
+    count_copy(strlen(src) + 1);
+    return real(dst, src);
+}
+
+// strncpy() writes all n bytes, padding with NULs
+char *strncpy(char *dst, const char *src, size_t n) {
+    REAL(char *, "strncpy", char *, const char *, size_t);
+    count_copy(n);
+    return real(dst, src, n);
+}
+
+char *strncat(char *dst, const char *src, size_t n) {
+    REAL(char *, "strncat", char *, const char *, size_t);
+    size_t len = strnlen(src, n);
+    count_copy(len + 1);
+    return real(dst, src, n);
+}
+
+int vsnprintf(char *str, size_t size, const char *fmt, va_list ap) {
+    REAL(int, "vsnprintf", char *, size_t, const char *, va_list);
+    int n = real(str, size, fmt, ap);
+    if (n > 0 && size > 0) {
+        count_copy((size_t)n < size ? (size_t)n : size - 1);
+    }
+    return n;
+}
+
+int snprintf(char *str, size_t size, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(str, size, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+    REAL(ssize_t, "send", int, const void *, size_t, int);
+    ssize_t n = real(fd, buf, len, flags);
+    count_write(n);
+    return n;
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    REAL(ssize_t, "sendmsg", int, const struct msghdr *, int);
+    ssize_t n = real(fd, msg, flags);
+    count_write(n);
+    return n;
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    REAL(ssize_t, "writev", int, const struct iovec *, int);
+    ssize_t n = real(fd, iov, iovcnt);
+    count_write(n);
+    return n;
+}
+
+__attribute__((destructor)) static void report(void) {
+    const char *path = getenv("COPY_COUNT_OUT");
+    FILE *fp = path ? fopen(path, "w") : NULL;
+    fprintf(fp ? fp : stderr, "allocs=%ld alloc_bytes=%ld copies=%ld copy_bytes=%ld writes=%ld write_bytes=%ld\n",
+            atomic_load(&allocs), atomic_load(&alloc_bytes), atomic_load(&copies), atomic_load(&copy_bytes),
+            atomic_load(&writes), atomic_load(&write_bytes));
+    if (fp) {
+        fclose(fp);
+    }
+}
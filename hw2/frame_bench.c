@@ -0,0 +1,275 @@
+/*
+ * Microbenchmark of the chatroom server's input framing: splitting what
+ * recv() returns into lines and making a Job of each.
+ *
+ *   copy      the server's old path: recv() into a 1 KB stack buffer,
+ *             append it to the client's 2 KB buffer, strchr() for each
+ *             '\n', strncpy() the line into the Job's 1 KB array, and
+ *             memmove() the incomplete line to the front
+ *   in-place  the server's path now: recv() straight into a 4 KB chunk,
+ *             find_newline() from linescan.h over the new bytes, and a
+ *             Job that points at the line and takes a reference on the
+ *             chunk; the incomplete line is copied only when the chunk
+ *             fills. Timed with each of the scalar, SSE2 and AVX2
+ *             scanners, and with glibc's memchr() for comparison.
+ *
+ * Nothing touches a socket: "recv()" copies the next piece of a prepared
+ * stream of lines, at most -s bytes at a time (4096 by default), as a
+ * busy socket would hand them over. A Job is filled and dropped at once.
+ *
+ * Prints megabytes of input framed per second, the best of 3 runs, for
+ * lines of 16 to 1000 bytes, newline included; "server" is
+ * find_newline(), which picks a scanner for the CPU, and the speedup is
+ * its rate over copy's. -n sets the megabytes framed per run (256).
+ *
+ * Build: gcc -O2 -Wall -o frame_bench frame_bench.c
+ * Usage: ./frame_bench [-n megabytes] [-s segment]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "linescan.h"
+
+#define MAX_NAME  32
+#define MAX_MSG   1024
+#define INBUF     2048
+#define IN_CHUNK  4096
+#define STREAM    (1 << 20)
+
+typedef struct OldJob {
+    int sender_fd;
+    char username[MAX_NAME];
+    char msg[MAX_MSG];
+} OldJob;
+
+typedef struct InChunk {
+    atomic_int refs;
+    int len;
+    char data[IN_CHUNK - 8];
+} InChunk;
+
+typedef struct Job {
+    int sender_fd;
+    InChunk *chunk;
+    char *msg;
+} Job;
+
+typedef char *(*Scanner)(const char *p, size_t n);
+
+static char *stream;
+static size_t stream_len, stream_pos;
+static int segment = 4096;
+static long total_bytes = 256L << 20;
+static volatile long sink;      // Keeps the Jobs from being optimised away
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Lines of line_len bytes, '\n' included, filling about STREAM bytes
+static void make_stream(int line_len) {
+    int per = STREAM / line_len;
+    stream_len = (size_t)per * line_len;
+    for (int l = 0; l < per; l++) {
+        char *line = stream + (size_t)l * line_len;
+        for (int i = 0; i < line_len - 1; i++) {
+            line[i] = 'a' + (l + i) % 26;
+        }
+        line[line_len - 1] = '\n';
+    }
+    stream_pos = 0;
+}
+
+// Stands in for recv(): the next piece of the stream, wrapping around
+static int fake_recv(char *buf, int space) {
+    int n = space < segment ? space : segment;
+    size_t left = stream_len - stream_pos;
+    if ((size_t)n > left) {
+        n = (int)left;
+    }
+    memcpy(buf, stream + stream_pos, n);
+    stream_pos += n;
+    if (stream_pos == stream_len) {
+        stream_pos = 0;
+    }
+    return n;
+}
+
+/* ---------------- Copying, as the server had it ---------------- */
+
+static void frame_copy(void) {
+    static char inbuf[INBUF];
+    static OldJob job;
+    int inbuf_len = 0;
+    long framed = 0;
+    char buffer[1024];
+
+    while (framed < total_bytes) {
+        int bytes_read = fake_recv(buffer, sizeof(buffer) - 1);
+        framed += bytes_read;
+        if (inbuf_len + bytes_read >= INBUF) {
+            fprintf(stderr, "line too long\n");
+            exit(1);
+        }
+        memcpy(inbuf + inbuf_len, buffer, bytes_read);
+        inbuf_len += bytes_read;
+        inbuf[inbuf_len] = '\0';
+
+        char *line_start = inbuf;
+        char *newline;
+        while ((newline = strchr(line_start, '\n')) != NULL) {
+            *newline = '\0';
+            if (newline > line_start && *(newline - 1) == '\r') {
+                *(newline - 1) = '\0';
+            }
+            if (strlen(line_start) > 0) {
+                job.sender_fd = 4;
+                strncpy(job.username, "alice", MAX_NAME - 1);
+                strncpy(job.msg, line_start, MAX_MSG - 1);
+                job.msg[MAX_MSG - 1] = '\0';
+                sink += job.msg[0];
+            }
+            line_start = newline + 1;
+        }
+        int remaining_len = inbuf_len - (line_start - inbuf);
+        if (remaining_len > 0) {
+            memmove(inbuf, line_start, remaining_len);
+        }
+        inbuf_len = remaining_len;
+    }
+}
+
+/* ---------------- In place, as the server has it ---------------- */
+
+static InChunk chunks[2];
+
+static void frame_in_place(Scanner find) {
+    InChunk *in = &chunks[0];
+    int in_start = 0;
+    long framed = 0;
+    Job job;
+
+    atomic_init(&in->refs, 1);
+    in->len = 0;
+    while (framed < total_bytes) {
+        int bytes_read = fake_recv(in->data + in->len, (int)sizeof(in->data) - in->len);
+        framed += bytes_read;
+
+        char *line_start = in->data + in_start;
+        char *scan = in->data + in->len;
+        char *end = scan + bytes_read;
+        in->len += bytes_read;
+
+        char *newline;
+        while ((newline = find(scan, end - scan)) != NULL) {
+            *newline = '\0';
+            if (newline > line_start && *(newline - 1) == '\r') {
+                *(newline - 1) = '\0';
+            }
+            if (line_start[0] != '\0') {
+                if (newline - line_start >= MAX_MSG) {
+                    line_start[MAX_MSG - 1] = '\0';
+                }
+                job.sender_fd = 4;
+                job.chunk = in;
+                job.msg = line_start;
+                atomic_fetch_add(&in->refs, 1);
+                sink += job.msg[0];
+                atomic_fetch_sub(&job.chunk->refs, 1);     // the worker's in_put()
+            }
+            line_start = scan = newline + 1;
+        }
+        in_start = line_start - in->data;
+
+        int remaining_len = in->len - in_start;
+        if (remaining_len >= INBUF) {
+            fprintf(stderr, "line too long\n");
+            exit(1);
+        }
+        if (in->len == (int)sizeof(in->data)) {
+            InChunk *next = in == &chunks[0] ? &chunks[1] : &chunks[0];
+            atomic_init(&next->refs, 1);
+            memcpy(next->data, line_start, remaining_len);
+            next->len = remaining_len;
+            in = next;
+            in_start = 0;
+        }
+    }
+}
+
+static char *find_memchr(const char *p, size_t n) {
+    return memchr(p, '\n', n);
+}
+
+/* ---------------- Driver ---------------- */
+
+// Megabytes framed per second by one framer, the best of 3 runs
+static double run(Scanner find) {
+    double best = 0;
+    for (int i = 0; i < 3; i++) {
+        double start = now_s();
+        if (find == NULL) {
+            frame_copy();
+        } else {
+            frame_in_place(find);
+        }
+        double rate = total_bytes / (now_s() - start) / 1e6;
+        if (rate > best) {
+            best = rate;
+        }
+    }
+    return best;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n megabytes] [-s segment]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                total_bytes = atol(optarg) << 20;
+                break;
+            case 's':
+                segment = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc != optind || total_bytes <= 0 || segment <= 0) {
+        usage(argv[0]);
+    }
+    stream = malloc(STREAM);
+
+    static const int lengths[] = { 16, 64, 256, 1000 };
+    printf("%8s %10s %10s %10s %10s %10s %10s %8s\n", "line", "copy MB/s", "scalar", "sse2", "avx2", "memchr",
+           "server", "speedup");
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        make_stream(lengths[i]);
+        double copy = run(NULL);
+        double scalar = run(find_newline_scalar);
+#if defined(__SSE2__)
+        double sse2 = run(find_newline_sse2);
+        double avx2 = __builtin_cpu_supports("avx2") ? run(find_newline_avx2) : 0;
+#else
+        double sse2 = 0, avx2 = 0;
+#endif
+        double mc = run(find_memchr);
+        double server = run(find_newline);
+        printf("%8d %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %7.2fx\n", lengths[i], copy, scalar, sse2, avx2, mc,
+               server, server / copy);
+    }
+    free(stream);
+    return 0;
+}
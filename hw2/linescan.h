@@ -0,0 +1,106 @@
+/*
+ * Newline scanning for the chatroom server's input framing.
+ *
+ *   find_newline_scalar  one byte at a time; the fallback on other CPUs
+ *   find_newline_sse2    16 bytes per compare; SSE2 is part of x86-64
+ *   find_newline_avx2    32 bytes per compare, built with the avx2
+ *                        target attribute so the rest of the program
+ *                        needs no -mavx2
+ *   find_newline         AVX2 where the CPU has it, else SSE2, else
+ *                        scalar
+ *
+ * Each returns the first '\n' in [p, p + n), or NULL. Loads never go
+ * past p + n: the vector loops stop at the last whole block and finish
+ * with one block ending at p + n, or the scalar loop when n is shorter
+ * than a block, so the bytes after the data need not be readable or
+ * initialised.
+ */
+
+#ifndef LINESCAN_H
+#define LINESCAN_H
+
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+static inline char *find_newline_scalar(const char *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] == '\n') {
+            return (char *)p + i;
+        }
+    }
+    return NULL;
+}
+
+#if defined(__SSE2__)
+
+static inline char *find_newline_sse2(const char *p, size_t n) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+        if (mask != 0) {
+            return (char *)p + i + __builtin_ctz(mask);
+        }
+    }
+    // the tail: one more block ending at p + n, overlapping bytes
+    // already known to hold no '\n'
+    if (i < n && n >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p + n - 16));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+        return mask != 0 ? (char *)p + n - 16 + __builtin_ctz(mask) : NULL;
+    }
+    return find_newline_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline char *find_newline_avx2(const char *p, size_t n) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    // two blocks per step, tested together: one branch per 64 bytes
+    for (; i + 64 <= n; i += 64) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), nl);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 32)), nl);
+        if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) {
+            unsigned mask = (unsigned)_mm256_movemask_epi8(a);
+            if (mask != 0) {
+                return (char *)p + i + __builtin_ctz(mask);
+            }
+            return (char *)p + i + 32 + __builtin_ctz((unsigned)_mm256_movemask_epi8(b));
+        }
+    }
+    for (; i + 32 <= n; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl));
+        if (mask != 0) {
+            return (char *)p + i + __builtin_ctz(mask);
+        }
+    }
+    if (i < n && n >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(p + n - 32));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl));
+        return mask != 0 ? (char *)p + n - 32 + __builtin_ctz(mask) : NULL;
+    }
+    return find_newline_sse2(p + i, n - i);
+}
+
+static inline char *find_newline(const char *p, size_t n) {
+    // __builtin_cpu_supports() reads a flag libgcc sets at startup
+    if (n >= 32 && __builtin_cpu_supports("avx2")) {
+        return find_newline_avx2(p, n);
+    }
+    return find_newline_sse2(p, n);
+}
+
+#else
+
+static inline char *find_newline(const char *p, size_t n) {
+    return find_newline_scalar(p, n);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * Lock-free building blocks for the chatroom server's queues.
+ *
+ *   Ring  bounded multi-producer multi-consumer ring of pointers (Dmitry
+ *         Vyukov's design): every cell carries a sequence number that
+ *         says whose turn it is, so producers and consumers each claim a
+ *         slot with one compare-and-swap and never take a lock.
+ *   Slab  fixed-size object allocator: objects come from chunks of
+ *         SLAB_CHUNK that are never given back, and freed ones go on a
+ *         lock-free stack. The stack head carries a counter next to the
+ *         top index so a pop cannot be fooled by the same object being
+ *         freed again meanwhile (ABA).
+ *
+ * Neither blocks; a caller that has to wait for an item or for room
+ * decides how (see q_pop() in chatroom_server.c).
+ */
+
+#ifndef LOCKFREE_H
+#define LOCKFREE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define CACHE_LINE       64
+#define SLAB_CHUNK       256        // Objects allocated at a time
+#define SLAB_MAX_CHUNKS  4096       // Up to 1M objects per slab
+#define SLAB_HEADER      16         // Keeps objects 16-byte aligned
+
+/* ---------------- Ring ---------------- */
+
+typedef struct RingCell {
+    atomic_size_t seq;          // == position: free to push; == position + 1: holds an item
+    void *item;
+} RingCell;
+
+typedef struct Ring {
+    RingCell *cells;
+    size_t mask;                // Capacity - 1; capacity is a power of two
+    _Alignas(CACHE_LINE) atomic_size_t head;    // Next position to push
+    _Alignas(CACHE_LINE) atomic_size_t tail;    // Next position to pop
+} Ring;
+
+// capacity is rounded up to a power of two. Returns -1 if out of memory.
+static inline int ring_init(Ring *r, size_t capacity) {
+    size_t cap = 2;
+    while (cap < capacity) {
+        cap *= 2;
+    }
+    r->cells = malloc(cap * sizeof(RingCell));
+    if (r->cells == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < cap; i++) {
+        atomic_init(&r->cells[i].seq, i);
+    }
+    r->mask = cap - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return 0;
+}
+
+static inline void ring_destroy(Ring *r) {
+    free(r->cells);
+}
+
+// Returns 0 if the ring is full
+static inline int ring_try_push(Ring *r, void *item) {
+    size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    for (;;) {
+        RingCell *cell = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->item = item;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+        }
+    }
+}
+
+// Returns NULL if the ring is empty, or if the oldest push has claimed
+// its cell but not filled it yet
+static inline void *ring_try_pop(Ring *r) {
+    size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    for (;;) {
+        RingCell *cell = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                void *item = cell->item;
+                atomic_store_explicit(&cell->seq, pos + r->mask + 1, memory_order_release);
+                return item;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+}
+
+/* ---------------- Slab ---------------- */
+
+// Sits in front of every object
+typedef struct SlabHeader {
+    uint32_t index;             // Which slot this is
+    _Atomic uint32_t next;      // While free: index + 1 of the next free slot, 0 at the end
+} SlabHeader;
+
+typedef struct Slab {
+    size_t slot_size;           // SLAB_HEADER + object size, rounded to 16
+    _Atomic uint64_t free;      // Pop counter << 32 | (top index + 1); 0 is empty
+    char *chunks[SLAB_MAX_CHUNKS];
+    _Atomic uint32_t nchunks;
+    pthread_mutex_t grow_mtx;   // Only held to add a chunk
+} Slab;
+
+static inline void slab_init(Slab *s, size_t object_size) {
+    s->slot_size = (SLAB_HEADER + object_size + 15) & ~(size_t)15;
+    atomic_init(&s->free, 0);
+    atomic_init(&s->nchunks, 0);
+    pthread_mutex_init(&s->grow_mtx, NULL);
+}
+
+static inline SlabHeader *slab_slot(Slab *s, uint32_t index) {
+    return (SlabHeader *)(s->chunks[index / SLAB_CHUNK] + (size_t)(index % SLAB_CHUNK) * s->slot_size);
+}
+
+// Push the free slots first..last, already linked to each other
+static inline void slab_push(Slab *s, SlabHeader *first, SlabHeader *last) {
+    uint64_t old = atomic_load(&s->free);
+    uint64_t new;
+    do {
+        atomic_store_explicit(&last->next, (uint32_t)old, memory_order_relaxed);
+        new = (old & 0xffffffff00000000ULL) | (first->index + 1);
+    } while (!atomic_compare_exchange_weak(&s->free, &old, new));
+}
+
+// Add a chunk of free slots. Returns -1 if the slab is full or out of memory.
+static inline int slab_grow(Slab *s) {
+    pthread_mutex_lock(&s->grow_mtx);
+    if ((uint32_t)atomic_load(&s->free) != 0) {
+        // another thread grew it meanwhile
+        pthread_mutex_unlock(&s->grow_mtx);
+        return 0;
+    }
+    uint32_t n = atomic_load(&s->nchunks);
+    char *chunk = n < SLAB_MAX_CHUNKS ? malloc(SLAB_CHUNK * s->slot_size) : NULL;
+    if (chunk == NULL) {
+        pthread_mutex_unlock(&s->grow_mtx);
+        return -1;
+    }
+    s->chunks[n] = chunk;
+    atomic_store(&s->nchunks, n + 1);
+    for (uint32_t i = 0; i < SLAB_CHUNK; i++) {
+        SlabHeader *h = slab_slot(s, n * SLAB_CHUNK + i);
+        h->index = n * SLAB_CHUNK + i;
+        atomic_init(&h->next, i + 1 < SLAB_CHUNK ? h->index + 2 : 0);
+    }
+    slab_push(s, slab_slot(s, n * SLAB_CHUNK), slab_slot(s, n * SLAB_CHUNK + SLAB_CHUNK - 1));
+    pthread_mutex_unlock(&s->grow_mtx);
+    return 0;
+}
+
+// Returns NULL if out of memory
+static inline void *slab_alloc(Slab *s) {
+    uint64_t old = atomic_load(&s->free);
+    for (;;) {
+        uint32_t top = (uint32_t)old;
+        if (top == 0) {
+            if (slab_grow(s) < 0) {
+                return NULL;
+            }
+            old = atomic_load(&s->free);
+            continue;
+        }
+        // the slot may be taken and freed again before the CAS; its next
+        // is then stale, but the counter makes the CAS fail
+        SlabHeader *h = slab_slot(s, top - 1);
+        uint32_t next = atomic_load_explicit(&h->next, memory_order_relaxed);
+        uint64_t new = ((old >> 32) + 1) << 32 | next;
+        if (atomic_compare_exchange_weak(&s->free, &old, new)) {
+            return (char *)h + SLAB_HEADER;
+        }
+    }
+}
+
+static inline void slab_free(Slab *s, void *object) {
+    SlabHeader *h = (SlabHeader *)((char *)object - SLAB_HEADER);
+    slab_push(s, h, h);
+}
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * Benchmark of the chatroom server's per-message work as the number of
+ * connected clients grows: the parts that have to find a client or a
+ * name, timed from the probe client's side as a round trip.
+ *
+ *   login  connect, then time sending a username until "Let's start
+ *          chatting" comes back; the server checks that the name is free
+ *   who    time "/who" until the "Active users:" reply
+ *   unicast  time "/bogus" until "Invalid command"; the worker has to
+ *          find the sender's Client to answer it
+ *
+ * Connects <clients> clients first. The first <named> of them (-n, 100 by
+ * default) log in as u0, u1, ...; the rest stay at the username prompt,
+ * so logging in every one of tens of thousands of clients (and sending
+ * each join to all the others) does not dominate the run. After the login
+ * and after each round the bench reads whatever the server sent the other
+ * clients, until 20 ms pass with nothing to read, so the probe's own join
+ * and leave are not in the way of the next request.
+ *
+ * -b starts a talker thread that broadcasts <rate> lines per second while
+ * the probes run, so every probe competes with fan-outs to all clients.
+ *
+ * Prints the median and 99th percentile round trip of each probe, in
+ * microseconds, over <rounds> rounds (-k, 200 by default).
+ *
+ * Build: gcc -O2 -Wall -pthread -o lookup_bench lookup_bench.c
+ * Usage: ./lookup_bench [-n named] [-k rounds] [-b rate] <host> <port> <clients>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define LINE_MAX_LEN 4096
+
+static struct addrinfo *ai;
+static int *fds;                // The <clients> background connections
+static int nclients, nnamed = 100, rounds = 200;
+static double bcast_rate = 0;   // -b: talker broadcasts per second
+static volatile int stop_talker;
+static int epfd;
+
+static long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+static int connect_server(void) {
+    int fd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void send_line(int fd, const char *line) {
+    size_t len = strlen(line);
+    if (send(fd, line, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        perror("send");
+        exit(1);
+    }
+}
+
+// Block until a line starting with prefix arrives on fd; earlier lines
+// are skipped
+static void wait_line(int fd, const char *prefix) {
+    char buf[LINE_MAX_LEN];
+    int len = 0;
+    for (;;) {
+        ssize_t n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if (n <= 0) {
+            fprintf(stderr, "server closed the probe waiting for \"%s\"\n", prefix);
+            exit(1);
+        }
+        len += n;
+        buf[len] = '\0';
+        char *line = buf, *nl;
+        while ((nl = strchr(line, '\n')) != NULL) {
+            if (strncmp(line, prefix, strlen(prefix)) == 0) {
+                return;
+            }
+            line = nl + 1;
+        }
+        len -= line - buf;
+        memmove(buf, line, len);
+        if (len == (int)sizeof(buf) - 1) {
+            len = 0;            // a line too long to be the reply
+        }
+    }
+}
+
+// Read what the server sent the background clients until it goes quiet,
+// for at most a second, or 200 ms under -b, where it never does
+static void settle(void) {
+    char buf[65536];
+    struct epoll_event events[256];
+    long deadline = now_us() + (bcast_rate > 0 ? 200000L : 1000000L);
+    int n;
+    while ((n = epoll_wait(epfd, events, 256, 20)) > 0 && now_us() < deadline) {
+        for (int i = 0; i < n; i++) {
+            while (recv(events[i].data.fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+            }
+        }
+    }
+}
+
+// -b: broadcast at the given rate, discarding what comes back
+static void *talker(void *arg) {
+    (void)arg;
+    int fd = connect_server();
+    send_line(fd, "talker\n");
+    wait_line(fd, "Let's start chatting");
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    char buf[65536];
+    long period = (long)(1000000 / bcast_rate);
+    long next = now_us();
+    while (!stop_talker) {
+        send_line(fd, "talker line\n");
+        next += period;
+        while (recv(fd, buf, sizeof(buf), 0) > 0) {
+        }
+        long wait = next - now_us();
+        if (wait > 0) {
+            usleep(wait);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *name, long *samples) {
+    qsort(samples, rounds, sizeof(long), cmp_long);
+    printf(" %s_p50_us=%ld %s_p99_us=%ld", name, samples[rounds / 2], name, samples[(rounds - 1) * 99 / 100]);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n named] [-k rounds] [-b rate] <host> <port> <clients>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:k:b:")) != -1) {
+        switch (opt) {
+            case 'n':
+                nnamed = atoi(optarg);
+                break;
+            case 'k':
+                rounds = atoi(optarg);
+                break;
+            case 'b':
+                bcast_rate = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3 || nnamed < 0 || rounds <= 0 || bcast_rate < 0) {
+        usage(argv[0]);
+    }
+    nclients = atoi(argv[optind + 2]);
+    if (nclients <= 0) {
+        usage(argv[0]);
+    }
+    if (nnamed > nclients) {
+        nnamed = nclients;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int gai = getaddrinfo(argv[optind], argv[optind + 1], &hints, &ai);
+    if (gai != 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], gai_strerror(gai));
+        exit(1);
+    }
+
+    // Background clients: the named ones log in one at a time, so each
+    // join goes to the clients connected so far
+    char line[64];
+    fds = malloc(nclients * sizeof(int));
+    epfd = epoll_create1(0);
+    for (int i = 0; i < nclients; i++) {
+        fds[i] = connect_server();
+        if (i < nnamed) {
+            snprintf(line, sizeof(line), "u%d\n", i);
+            send_line(fds[i], line);
+            wait_line(fds[i], "Let's start chatting");
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = fds[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+    settle();
+
+    pthread_t talker_thread;
+    if (bcast_rate > 0) {
+        pthread_create(&talker_thread, NULL, talker, NULL);
+    }
+
+    long *login = malloc(rounds * sizeof(long));
+    long *who = malloc(rounds * sizeof(long));
+    long *unicast = malloc(rounds * sizeof(long));
+    for (int r = 0; r < rounds; r++) {
+        // a new name every round; its join and leave go to everyone
+        int probe = connect_server();
+        wait_line(probe, "Welcome");
+        snprintf(line, sizeof(line), "probe%d\n", r);
+        long t = now_us();
+        send_line(probe, line);
+        wait_line(probe, "Let's start chatting");
+        login[r] = now_us() - t;
+        settle();
+
+        t = now_us();
+        send_line(probe, "/who\n");
+        wait_line(probe, "Active users:");
+        who[r] = now_us() - t;
+
+        t = now_us();
+        send_line(probe, "/bogus\n");
+        wait_line(probe, "Invalid command");
+        unicast[r] = now_us() - t;
+
+        close(probe);
+        settle();
+    }
+
+    if (bcast_rate > 0) {
+        stop_talker = 1;
+        pthread_join(talker_thread, NULL);
+    }
+
+    printf("clients=%d named=%d", nclients, nnamed);
+    report("login", login);
+    report("who", who);
+    report("unicast", unicast);
+    printf("\n");
+
+    freeaddrinfo(ai);
+    return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * Microbenchmark of the chatroom server's job queues: the mutex and
+ * condition variable queue with malloc()'d Jobs that the server used
+ * before, against the lock-free rings and slab from lockfree.h.
+ *
+ * Mirrors the server's path for a broadcast: one "reactor" thread
+ * allocates Jobs and pushes them on the job queue, <workers> threads pop
+ * them and push them on to the broadcast queue, and the reactor pops
+ * those and frees them. At most <window> Jobs are in flight, so neither
+ * queue grows without bound. A line of text is copied into every Job as
+ * the reactor does, but nothing is sent or formatted.
+ *
+ * Prints jobs per second for each queue at 1, 2, 4, ... <max_workers>
+ * workers.
+ *
+ * Build: gcc -O2 -Wall -pthread -o queue_bench queue_bench.c
+ * Usage: ./queue_bench [-n jobs] [-w window] [max_workers]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "lockfree.h"
+
+#define MAX_NAME  32
+#define MAX_MSG   1024
+#define RING_SIZE 4096
+
+typedef struct Job {
+    int sender_fd;
+    char username[MAX_NAME];
+    char msg[MAX_MSG];
+    struct Job *next;
+} Job;
+
+static long njobs = 2000000;
+static int window = 1024;
+static int nworkers;
+static const char *line = "alice: the quick brown fox jumps over the lazy dog";
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(Job *j, long i) {
+    j->sender_fd = (int)i;
+    strncpy(j->msg, line, MAX_MSG - 1);
+    j->msg[MAX_MSG - 1] = '\0';
+}
+
+/* ---------------- Mutex queue, as the server had it ---------------- */
+
+typedef struct MQueue {
+    Job *head;
+    Job *tail;
+    pthread_mutex_t mtx;
+    pthread_cond_t cv;
+    int closed;
+} MQueue;
+
+static MQueue mjobs, mbcast;
+
+static void mq_init(MQueue *q) {
+    q->head = q->tail = NULL;
+    q->closed = 0;
+    pthread_mutex_init(&q->mtx, NULL);
+    pthread_cond_init(&q->cv, NULL);
+}
+
+static void mq_close(MQueue *q) {
+    pthread_mutex_lock(&q->mtx);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->cv);
+    pthread_mutex_unlock(&q->mtx);
+}
+
+static void mq_push(MQueue *q, Job *j) {
+    pthread_mutex_lock(&q->mtx);
+    j->next = NULL;
+    if (q->tail == NULL) {
+        q->head = q->tail = j;
+    } else {
+        q->tail->next = j;
+        q->tail = j;
+    }
+    pthread_cond_signal(&q->cv);
+    pthread_mutex_unlock(&q->mtx);
+}
+
+static Job *mq_pop(MQueue *q, int wait) {
+    pthread_mutex_lock(&q->mtx);
+    while (wait && q->head == NULL && !q->closed) {
+        pthread_cond_wait(&q->cv, &q->mtx);
+    }
+    Job *j = q->head;
+    if (j != NULL) {
+        q->head = j->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&q->mtx);
+    return j;
+}
+
+static void *mutex_worker(void *arg) {
+    (void)arg;
+    Job *j;
+    while ((j = mq_pop(&mjobs, 1)) != NULL) {
+        // the server passes the same Job on with its formatted line
+        mq_push(&mbcast, j);
+    }
+    return NULL;
+}
+
+/* ---------------- Lock-free rings and slab, as the server has them ---------------- */
+
+static Ring rjobs, rbcast;
+static sem_t ritems;
+static atomic_int rclosed;
+static Slab slab;
+
+static Job *rq_pop(void) {
+    while (sem_wait(&ritems) < 0) {
+        if (errno != EINTR) {
+            return NULL;
+        }
+    }
+    for (;;) {
+        Job *j = ring_try_pop(&rjobs);
+        if (j != NULL || atomic_load(&rclosed)) {
+            return j;
+        }
+        sched_yield();
+    }
+}
+
+static void *ring_worker(void *arg) {
+    (void)arg;
+    Job *j;
+    while ((j = rq_pop()) != NULL) {
+        // the server passes the same Job on with its formatted line
+        while (!ring_try_push(&rbcast, j)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/* ---------------- Driver ---------------- */
+
+// The reactor's side of one run; returns jobs per second
+static double run(int lockfree) {
+    pthread_t *threads = malloc(nworkers * sizeof(pthread_t));
+    if (lockfree) {
+        ring_init(&rjobs, RING_SIZE);
+        ring_init(&rbcast, RING_SIZE);
+        sem_init(&ritems, 0, 0);
+        atomic_store(&rclosed, 0);
+    } else {
+        mq_init(&mjobs);
+        mq_init(&mbcast);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        pthread_create(&threads[i], NULL, lockfree ? ring_worker : mutex_worker, NULL);
+    }
+
+    double start = now_s();
+    long pushed = 0, done = 0;
+    while (done < njobs) {
+        int progress = 0;
+        while (pushed < njobs && pushed - done < window) {
+            Job *j = lockfree ? slab_alloc(&slab) : malloc(sizeof(Job));
+            fill(j, pushed);
+            if (lockfree) {
+                if (!ring_try_push(&rjobs, j)) {
+                    slab_free(&slab, j);
+                    break;
+                }
+                sem_post(&ritems);
+            } else {
+                mq_push(&mjobs, j);
+            }
+            pushed++;
+            progress = 1;
+        }
+        Job *b;
+        while ((b = lockfree ? ring_try_pop(&rbcast) : mq_pop(&mbcast, 0)) != NULL) {
+            if (lockfree) {
+                slab_free(&slab, b);
+            } else {
+                free(b);
+            }
+            done++;
+            progress = 1;
+        }
+        if (!progress) {
+            sched_yield();
+        }
+    }
+    double elapsed = now_s() - start;
+
+    if (lockfree) {
+        atomic_store(&rclosed, 1);
+        for (int i = 0; i < nworkers; i++) {
+            sem_post(&ritems);
+        }
+    } else {
+        mq_close(&mjobs);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (lockfree) {
+        ring_destroy(&rjobs);
+        ring_destroy(&rbcast);
+        sem_destroy(&ritems);
+    }
+    free(threads);
+    return njobs / elapsed;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n jobs] [-w window] [max_workers]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+        switch (opt) {
+            case 'n':
+                njobs = atol(optarg);
+                break;
+            case 'w':
+                window = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    int max_workers = argc - optind == 1 ? atoi(argv[optind]) : 8;
+    if (argc - optind > 1 || njobs <= 0 || window <= 0 || window > RING_SIZE || max_workers <= 0) {
+        usage(argv[0]);
+    }
+    slab_init(&slab, sizeof(Job));
+
+    printf("%8s %16s %16s %8s\n", "workers", "mutex jobs/s", "lock-free jobs/s", "speedup");
+    for (nworkers = 1; nworkers <= max_workers; nworkers *= 2) {
+        double m = run(0);
+        double r = run(1);
+        printf("%8d %16.0f %16.0f %7.2fx\n", nworkers, m, r, r / m);
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+#!/bin/bash
+
+# Slow consumers: 10 talkers send 500 lines/s of 900 bytes in all while
+# one client that never reads (4 KB receive buffer) stays connected. Its
+# kernel buffers fill after a few seconds and the server has to queue for
+# it. Under -s drop and -s disconnect the talkers must get every line,
+# with a p99 latency close to the run without the slow client; drop keeps
+# the slow client connected and disconnect closes it. Under -s block the
+# server waits for the slow client, as the old blocking send() did, and
+# the talkers stop getting lines until the wait times out after 2 s and
+# the slow client is closed.
+#
+# Run from hw2: ./test_slow_consumer.sh
+
+PORT=${PORT:-12000}
+SECONDS_PER_CASE=${SECONDS_PER_CASE:-10}
+
+cd "$(dirname "$0")" || exit 1
+
+echo "Compiling..."
+make -s chatroom_server.out || exit 1
+gcc -O2 -Wall -o chat_bench chat_bench.c || exit 1
+
+FAILED=0
+
+check() {
+    if eval "$2"; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1"
+        FAILED=1
+    fi
+}
+
+field() {
+    echo "$1" | sed -n "s|.* $2=\([0-9.]*\).*|\1|p"
+}
+
+# run <policy> <slow clients>
+run() {
+    ./chatroom_server.out -s $1 $PORT 3 100 > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+    OUT=$(./chat_bench -s $2 -t 10 -r 50 -l 900 -d $SECONDS_PER_CASE 127.0.0.1 $PORT)
+    kill -INT $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null
+    printf "%-11s %5s %14s %12s %8s %8s %8s\n" $1 $2 "$(echo "$OUT" | sed -n 's|.*delivered_talkers=\([0-9/]*\).*|\1|p')" \
+        "$(echo "$OUT" | sed -n 's|.*delivered_slow=\([0-9/]*\).*|\1|p')" \
+        "$(field "$OUT" slow_closed)" "$(field "$OUT" p50_ms)" "$(field "$OUT" p99_ms)"
+}
+
+# talker lines delivered == expected
+all_delivered() {
+    echo "$OUT" | grep -Eq 'delivered_talkers=([0-9]+)/\1 '
+}
+
+printf "%-11s %5s %14s %12s %8s %8s %8s\n" policy slow talkers slow closed p50_ms p99_ms
+run disconnect 0
+BASE_P99=$(field "$OUT" p99_ms)
+check "no slow client: every line delivered" all_delivered
+
+for POLICY in drop disconnect; do
+    run $POLICY 1
+    P99=$(field "$OUT" p99_ms)
+    check "$POLICY: every line delivered to the talkers" all_delivered
+    check "$POLICY: p99 within 2x of no slow client" \
+        "awk -v p=${P99:-999} -v b=${BASE_P99:-0} 'BEGIN { exit !(p <= 2 * b + 5) }'"
+    if [ $POLICY = drop ]; then
+        check "drop: slow client still connected, missed lines" \
+            "[ '$(field "$OUT" slow_closed)' = 0 ] && ! echo \"\$OUT\" | grep -Eq 'delivered_slow=([0-9]+)/\1 '"
+    else
+        check "disconnect: slow client disconnected" "[ '$(field "$OUT" slow_closed)' = 1 ]"
+    fi
+done
+
+run block 1
+P99=$(field "$OUT" p99_ms)
+check "block: the slow client stalls the talkers" \
+    "awk -v p=${P99:-0} 'BEGIN { exit !(p >= 1000) }'"
+check "block: slow client disconnected when the wait times out" \
+    "[ '$(field "$OUT" slow_closed)' = 1 ] && all_delivered"
+
+exit $FAILED